@@ -0,0 +1,238 @@
+#include <algorithm>
+#include <chrono>
+#include "serving/processor/serving/batch_scheduler.h"
+#include "tensorflow/core/framework/tensor.h"
+#include "tensorflow/core/framework/tensor_util.h"
+#include "tensorflow/core/lib/strings/strcat.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/logging.h"
+
+namespace tensorflow {
+namespace processor {
+
+namespace {
+// Returns false if the request can't be merged with others, otherwise
+// sets its number of rows and the signature of mergeable requests.
+bool GetBatchSignature(const Request& req, int64* size,
+                       std::string* signature) {
+  if (req.inputs.empty()) {
+    return false;
+  }
+  *size = -1;
+  for (auto& input : req.inputs) {
+    const Tensor& t = input.second;
+    if (t.dims() < 1) {
+      return false;
+    }
+    if (*size < 0) {
+      *size = t.dim_size(0);
+    } else if (t.dim_size(0) != *size) {
+      return false;
+    }
+    strings::StrAppend(signature, input.first, ":",
+                       static_cast<int>(t.dtype()));
+    for (int i = 1; i < t.dims(); ++i) {
+      strings::StrAppend(signature, ",", t.dim_size(i));
+    }
+    strings::StrAppend(signature, ";");
+  }
+  for (auto& name : req.output_tensor_names) {
+    strings::StrAppend(signature, "|", name);
+  }
+  return *size > 0;
+}
+} // namespace
+
+BatchScheduler::BatchScheduler(const BatchOptions& options,
+                               ProcessFn process_fn)
+    : options_(options), process_fn_(std::move(process_fn)) {
+  for (int i = 0; i < options_.num_batch_threads; ++i) {
+    batch_threads_.emplace_back(&BatchScheduler::BatchLoop, this);
+  }
+}
+
+BatchScheduler::~BatchScheduler() {
+  {
+    mutex_lock l(mu_);
+    is_stop_ = true;
+  }
+  batch_cv_.notify_all();
+  for (auto& t : batch_threads_) {
+    t.join();
+  }
+}
+
+Status BatchScheduler::Schedule(Request& req, Response& resp) {
+  int64 size = 0;
+  std::string signature;
+  if (!GetBatchSignature(req, &size, &signature) ||
+      size >= options_.max_batch_size) {
+    return process_fn_(req, resp);
+  }
+
+  Task task;
+  task.request = &req;
+  task.response = &resp;
+  task.size = size;
+  bool scheduled = false;
+  // Each ready batch and each new open batch needs a thread to wake up.
+  int num_events = 0;
+  {
+    mutex_lock l(mu_);
+    if (!is_stop_ && unmergeable_signatures_.count(signature) == 0) {
+      auto it = open_batches_.find(signature);
+      if (it != open_batches_.end() &&
+          it->second->size + size > options_.max_batch_size) {
+        ready_batches_.push_back(it->second);
+        open_batches_.erase(it);
+        it = open_batches_.end();
+        ++num_events;
+      }
+      Batch* batch = nullptr;
+      if (it == open_batches_.end()) {
+        batch = new Batch;
+        batch->signature = signature;
+        batch->deadline_micros =
+            Env::Default()->NowMicros() + options_.batch_timeout_micros;
+        open_batches_.emplace(signature, batch);
+        ++num_events;
+      } else {
+        batch = it->second;
+      }
+      batch->tasks.push_back(&task);
+      batch->size += size;
+      if (batch->size >= options_.max_batch_size) {
+        ready_batches_.push_back(batch);
+        open_batches_.erase(signature);
+        ++num_events;
+      }
+      scheduled = true;
+    }
+  }
+  if (!scheduled) {
+    return process_fn_(req, resp);
+  }
+  for (int i = 0; i < num_events; ++i) {
+    batch_cv_.notify_one();
+  }
+
+  task.done.WaitForNotification();
+  return task.status;
+}
+
+void BatchScheduler::BatchLoop() {
+  while (Batch* batch = NextBatch()) {
+    ProcessBatch(batch);
+  }
+}
+
+BatchScheduler::Batch* BatchScheduler::NextBatch() {
+  mutex_lock l(mu_);
+  while (true) {
+    if (!ready_batches_.empty()) {
+      Batch* batch = ready_batches_.front();
+      ready_batches_.pop_front();
+      return batch;
+    }
+
+    uint64 now = Env::Default()->NowMicros();
+    uint64 next_deadline = kuint64max;
+    for (auto it = open_batches_.begin(); it != open_batches_.end();) {
+      if (is_stop_ || it->second->deadline_micros <= now) {
+        ready_batches_.push_back(it->second);
+        it = open_batches_.erase(it);
+      } else {
+        next_deadline = std::min(next_deadline, it->second->deadline_micros);
+        ++it;
+      }
+    }
+    if (!ready_batches_.empty()) {
+      continue;
+    }
+    if (is_stop_) {
+      return nullptr;
+    }
+
+    if (open_batches_.empty()) {
+      batch_cv_.wait(l);
+    } else {
+      batch_cv_.wait_for(l, std::chrono::microseconds(next_deadline - now));
+    }
+  }
+}
+
+void BatchScheduler::ProcessBatch(Batch* batch) {
+  bool mergeable = batch->tasks.size() > 1;
+  if (mergeable) {
+    // Batches closed before the signature was found unmergeable.
+    mutex_lock l(mu_);
+    mergeable = unmergeable_signatures_.count(batch->signature) == 0;
+  }
+  if (!mergeable || !ProcessMergedBatch(batch)) {
+    for (auto task : batch->tasks) {
+      task->status = process_fn_(*task->request, *task->response);
+    }
+  }
+  for (auto task : batch->tasks) {
+    task->done.Notify();
+  }
+  delete batch;
+}
+
+// Returns false if the merged request can't be built or its outputs can't
+// be split, the requests are left unprocessed then.
+bool BatchScheduler::ProcessMergedBatch(Batch* batch) {
+  const Request& first = *batch->tasks[0]->request;
+  Request merged_req;
+  merged_req.output_tensor_names = first.output_tensor_names;
+  std::vector<Tensor> inputs(batch->tasks.size());
+  for (size_t i = 0; i < first.inputs.size(); ++i) {
+    for (size_t j = 0; j < batch->tasks.size(); ++j) {
+      inputs[j] = batch->tasks[j]->request->inputs[i].second;
+    }
+    Tensor merged;
+    if (!tensor::Concat(inputs, &merged).ok()) {
+      return false;
+    }
+    merged_req.inputs.emplace_back(first.inputs[i].first, merged);
+  }
+
+  Response merged_resp;
+  Status s = process_fn_(merged_req, merged_resp);
+  if (!s.ok()) {
+    for (auto task : batch->tasks) {
+      task->status = s;
+    }
+    return true;
+  }
+
+  std::vector<int64> sizes;
+  for (auto task : batch->tasks) {
+    sizes.push_back(task->size);
+  }
+  std::vector<std::vector<Tensor>> outputs(merged_resp.outputs.size());
+  for (size_t i = 0; i < merged_resp.outputs.size(); ++i) {
+    const Tensor& t = merged_resp.outputs[i];
+    if (t.dims() < 1 || t.dim_size(0) != batch->size ||
+        !tensor::Split(t, sizes, &outputs[i]).ok()) {
+      LOG(WARNING) << "[BatchScheduler] Output " << i << " of "
+                   << batch->signature << " is not batch-major, "
+                   << "these requests will be processed alone.";
+      mutex_lock l(mu_);
+      unmergeable_signatures_.insert(batch->signature);
+      return false;
+    }
+  }
+  for (size_t j = 0; j < batch->tasks.size(); ++j) {
+    Task* task = batch->tasks[j];
+    task->response->outputs.clear();
+    for (size_t i = 0; i < outputs.size(); ++i) {
+      task->response->outputs.emplace_back(outputs[i][j]);
+    }
+    task->status = Status::OK();
+  }
+  return true;
+}
+
+} // processor
+} // tensorflow
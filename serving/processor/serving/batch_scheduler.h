@@ -0,0 +1,83 @@
+#ifndef SERVING_PROCESSOR_SERVING_BATCH_SCHEDULER_H
+#define SERVING_PROCESSOR_SERVING_BATCH_SCHEDULER_H
+
+#include <deque>
+#include <functional>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "serving/processor/serving/model_message.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/platform/mutex.h"
+#include "tensorflow/core/platform/notification.h"
+
+namespace tensorflow {
+namespace processor {
+
+struct BatchOptions {
+  // Max number of rows (dim 0 of the inputs) of a merged request.
+  int max_batch_size = 256;
+  // Max time the first request of a batch waits for others, in microseconds.
+  int batch_timeout_micros = 1000;
+  // Number of threads running merged requests.
+  int num_batch_threads = 1;
+};
+
+// Merges concurrent requests along the batch dimension, runs them once
+// and splits the outputs back to every request.
+//
+// Requests are merged when all their inputs have the same number of rows,
+// and they agree on input names, dtypes, inner dims and output names.
+// Other requests run alone, so do the requests whose outputs of the merged
+// run turn out not to be batch-major.
+class BatchScheduler {
+ public:
+  typedef std::function<Status(Request&, Response&)> ProcessFn;
+
+  BatchScheduler(const BatchOptions& options, ProcessFn process_fn);
+  virtual ~BatchScheduler();
+
+  // Blocks until the request is processed.
+  Status Schedule(Request& req, Response& resp);
+
+ private:
+  struct Task {
+    Request* request;
+    Response* response;
+    int64 size;
+    Status status;
+    Notification done;
+  };
+
+  struct Batch {
+    std::string signature;
+    std::vector<Task*> tasks;
+    int64 size = 0;
+    uint64 deadline_micros = 0;
+  };
+
+  void BatchLoop();
+  // Waits for a full or expired batch, returns nullptr when stopped.
+  Batch* NextBatch();
+  void ProcessBatch(Batch* batch);
+  bool ProcessMergedBatch(Batch* batch);
+
+  BatchOptions options_;
+  ProcessFn process_fn_;
+
+  mutex mu_;
+  condition_variable batch_cv_;
+  // Batches still waiting for requests, by request signature.
+  std::unordered_map<std::string, Batch*> open_batches_;
+  std::deque<Batch*> ready_batches_;
+  // Signatures of requests whose outputs are not batch-major.
+  std::unordered_set<std::string> unmergeable_signatures_;
+  bool is_stop_ = false;
+  std::vector<std::thread> batch_threads_;
+};
+
+} // processor
+} // tensorflow
+
+#endif // SERVING_PROCESSOR_SERVING_BATCH_SCHEDULER_H
@@ -0,0 +1,164 @@
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include "gtest/gtest.h"
+#include "serving/processor/serving/batch_scheduler.h"
+#include "serving/processor/serving/model_message.h"
+#include "tensorflow/core/framework/tensor.h"
+#include "tensorflow/core/framework/tensor_testutil.h"
+
+namespace tensorflow {
+namespace processor {
+namespace {
+Request CreateRequest(float value, int64 rows) {
+  Request req;
+  Tensor t(DT_FLOAT, TensorShape({rows, 2}));
+  t.flat<float>().setConstant(value);
+  req.inputs.emplace_back("x:0", t);
+  req.output_tensor_names.emplace_back("y:0");
+  return req;
+}
+
+// Returns x * 2, and counts the runs and the rows of every run.
+class FakeProcessor {
+ public:
+  explicit FakeProcessor(bool batch_major = true)
+      : batch_major_(batch_major) {}
+
+  Status Process(Request& req, Response& resp) {
+    ++run_count_;
+    const Tensor& x = req.inputs[0].second;
+    if (x.dims() > 0) {
+      max_rows_ = std::max(max_rows_.load(), x.dim_size(0));
+    }
+    if (!batch_major_) {
+      Tensor y(DT_FLOAT, TensorShape({}));
+      y.scalar<float>()() = 1.0;
+      resp.outputs.emplace_back(y);
+      return Status::OK();
+    }
+    Tensor y(DT_FLOAT, x.shape());
+    y.flat<float>() = x.flat<float>() * 2.0f;
+    resp.outputs.emplace_back(y);
+    return Status::OK();
+  }
+
+  int run_count() { return run_count_; }
+  int64 max_rows() { return max_rows_; }
+
+ private:
+  bool batch_major_;
+  std::atomic<int> run_count_{0};
+  std::atomic<int64> max_rows_{0};
+};
+
+BatchScheduler::ProcessFn Bind(FakeProcessor* processor) {
+  return [processor](Request& req, Response& resp) {
+    return processor->Process(req, resp);
+  };
+}
+} // namespace
+
+class BatchSchedulerTest : public ::testing::Test {
+ protected:
+  void RunConcurrently(BatchScheduler* scheduler, int num) {
+    std::vector<Request> reqs;
+    for (int i = 0; i < num; ++i) {
+      reqs.emplace_back(CreateRequest(i, i % 3 + 1));
+    }
+    std::vector<Response> resps(num);
+    std::vector<Status> status(num);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num; ++i) {
+      threads.emplace_back([&, i]() {
+        status[i] = scheduler->Schedule(reqs[i], resps[i]);
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    for (int i = 0; i < num; ++i) {
+      EXPECT_TRUE(status[i].ok());
+      ASSERT_EQ(1, resps[i].outputs.size());
+      Tensor expected(DT_FLOAT, TensorShape({i % 3 + 1, 2}));
+      expected.flat<float>().setConstant(i * 2.0f);
+      test::ExpectTensorEqual<float>(expected, resps[i].outputs[0]);
+    }
+  }
+};
+
+TEST_F(BatchSchedulerTest, ShouldMergeConcurrentRequests) {
+  FakeProcessor processor;
+  BatchOptions options;
+  options.max_batch_size = 64;
+  options.batch_timeout_micros = 100 * 1000;
+  options.num_batch_threads = 1;
+  BatchScheduler scheduler(options, Bind(&processor));
+
+  RunConcurrently(&scheduler, 16);
+  EXPECT_LT(processor.run_count(), 16);
+  EXPECT_LE(processor.max_rows(), 64);
+}
+
+TEST_F(BatchSchedulerTest, ShouldNotExceedMaxBatchSize) {
+  FakeProcessor processor;
+  BatchOptions options;
+  options.max_batch_size = 4;
+  options.batch_timeout_micros = 100 * 1000;
+  options.num_batch_threads = 2;
+  BatchScheduler scheduler(options, Bind(&processor));
+
+  RunConcurrently(&scheduler, 16);
+  EXPECT_LE(processor.max_rows(), 4);
+}
+
+TEST_F(BatchSchedulerTest, ShouldProcessAloneWhenOutputsNotBatchMajor) {
+  FakeProcessor processor(/*batch_major*/false);
+  BatchOptions options;
+  options.max_batch_size = 64;
+  options.batch_timeout_micros = 10 * 1000;
+  options.num_batch_threads = 1;
+  BatchScheduler scheduler(options, Bind(&processor));
+
+  const int num = 8;
+  std::vector<Request> reqs;
+  for (int i = 0; i < num; ++i) {
+    reqs.emplace_back(CreateRequest(i, 1));
+  }
+  std::vector<Response> resps(num);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num; ++i) {
+    threads.emplace_back([&, i]() {
+      EXPECT_TRUE(scheduler.Schedule(reqs[i], resps[i]).ok());
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  for (int i = 0; i < num; ++i) {
+    ASSERT_EQ(1, resps[i].outputs.size());
+    EXPECT_EQ(0, resps[i].outputs[0].dims());
+  }
+  // Every request runs alone once, after at most one merged run that found
+  // the outputs are not batch-major.
+  EXPECT_GE(processor.run_count(), num);
+  EXPECT_LE(processor.run_count(), num + 1);
+}
+
+TEST_F(BatchSchedulerTest, ShouldProcessAloneWhenRequestNotBatchable) {
+  FakeProcessor processor;
+  BatchOptions options;
+  BatchScheduler scheduler(options, Bind(&processor));
+
+  Request req;
+  Tensor x(DT_FLOAT, TensorShape({}));
+  x.scalar<float>()() = 3.0;
+  req.inputs.emplace_back("x:0", x);
+  Response resp;
+  EXPECT_TRUE(scheduler.Schedule(req, resp).ok());
+  EXPECT_EQ(1, processor.run_count());
+  EXPECT_EQ(6.0, resp.outputs[0].scalar<float>()());
+}
+
+} // processor
+} // tensorflow
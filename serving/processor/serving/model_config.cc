@@ -67,9 +67,11 @@ Status ModelConfigFactory::Create(const char* model_config, ModelConfig** config
       json_config["select_session_policy"].asString();
   }
   if ((*config)->select_session_policy != "MOD" &&
-      (*config)->select_session_policy != "RR") {
+      (*config)->select_session_policy != "RR" &&
+      (*config)->select_session_policy != "LOR" &&
+      (*config)->select_session_policy != "P2C") {
     return Status(error::Code::INVALID_ARGUMENT,
-        "[TensorFlow] select_session_policy must be 'RR' or 'MOD'");
+        "[TensorFlow] select_session_policy must be 'RR', 'MOD', 'LOR' or 'P2C'");
   }
 
   bool enable_inline_execute = false;
@@ -301,6 +303,80 @@ Status ModelConfigFactory::Create(const char* model_config, ModelConfig** config
         json_config["use_per_session_threads"].asBool();
   }
 
+  (*config)->session_group_numa_affinity = false;
+  if (!json_config["session_group_numa_affinity"].isNull()) {
+    (*config)->session_group_numa_affinity =
+        json_config["session_group_numa_affinity"].asBool();
+  }
+
+  (*config)->enable_batching = false;
+  if (!json_config["enable_batching"].isNull()) {
+    (*config)->enable_batching = json_config["enable_batching"].asBool();
+  }
+  (*config)->max_batch_size = 256;
+  if (!json_config["max_batch_size"].isNull()) {
+    (*config)->max_batch_size = json_config["max_batch_size"].asInt();
+  }
+  (*config)->batch_timeout_micros = 1000;
+  if (!json_config["batch_timeout_micros"].isNull()) {
+    (*config)->batch_timeout_micros =
+        json_config["batch_timeout_micros"].asInt();
+  }
+  (*config)->num_batch_threads = (*config)->session_num;
+  if (!json_config["num_batch_threads"].isNull()) {
+    (*config)->num_batch_threads = json_config["num_batch_threads"].asInt();
+  }
+  if ((*config)->enable_batching) {
+    if ((*config)->max_batch_size <= 0) {
+      return Status(error::Code::INVALID_ARGUMENT,
+          "[TensorFlow] max_batch_size must be positive.");
+    }
+    if ((*config)->batch_timeout_micros < 0) {
+      return Status(error::Code::INVALID_ARGUMENT,
+          "[TensorFlow] batch_timeout_micros must be non-negative.");
+    }
+    if ((*config)->num_batch_threads <= 0) {
+      return Status(error::Code::INVALID_ARGUMENT,
+          "[TensorFlow] num_batch_threads must be positive.");
+    }
+  }
+
+  (*config)->model_update_interval_seconds = 60;
+  if (!json_config["model_update_interval_seconds"].isNull()) {
+    (*config)->model_update_interval_seconds =
+        json_config["model_update_interval_seconds"].asInt();
+  }
+  if ((*config)->model_update_interval_seconds <= 0) {
+    return Status(error::Code::INVALID_ARGUMENT,
+        "[TensorFlow] model_update_interval_seconds must be positive.");
+  }
+
+  // Delta models are upserted into the serving embedding variables
+  // by the KvResourceIncrImport kernels, which read the slice options
+  // from the environment.
+  if (!json_config["delta_update_slice_size"].isNull()) {
+    (*config)->delta_update_slice_size =
+        json_config["delta_update_slice_size"].asInt();
+    if (setenv("TF_EV_INCR_RESTORE_SLICE_SIZE",
+               std::to_string((*config)->delta_update_slice_size).c_str(),
+               1) != 0) {
+      LOG(WARNING) << "Set TF_EV_INCR_RESTORE_SLICE_SIZE env error: "
+                   << json_config["delta_update_slice_size"];
+    }
+  }
+
+  if (!json_config["delta_update_slice_interval_micros"].isNull()) {
+    (*config)->delta_update_slice_interval_micros =
+        json_config["delta_update_slice_interval_micros"].asInt();
+    if (setenv("TF_EV_INCR_RESTORE_SLICE_INTERVAL_MICROS",
+               std::to_string(
+                   (*config)->delta_update_slice_interval_micros).c_str(),
+               1) != 0) {
+      LOG(WARNING) << "Set TF_EV_INCR_RESTORE_SLICE_INTERVAL_MICROS env error: "
+                   << json_config["delta_update_slice_interval_micros"];
+    }
+  }
+
   (*config)->shard_embedding = false;
   bool shard_embedding = false;
   if (!json_config["shard_embedding"].isNull()) {
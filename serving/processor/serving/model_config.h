@@ -46,14 +46,41 @@ struct ModelConfig {
   // session num of session group,
   // default num is 1
   int session_num = 1;
-  // In multi-session mode, we have two policy for
+  // In multi-session mode, we have several policies for
   // select session for each thread.
   // "RR": Round-Robin policy, threads will use all sessions in Round-Robin way
   // "MOD": Thread select session according unique id, uid % session_num
+  // "LOR": Least-Outstanding-Requests policy, select the session with the
+  //        fewest requests in flight
+  // "P2C": Power-of-Two-Choices policy, select the less loaded one of two
+  //        random sessions, load is in-flight requests weighted by latency
   std::string select_session_policy = "MOD";
 
   // session use self-owned thread pool
   bool use_per_session_threads = false;
+
+  // Bind sessions of session group to NUMA nodes in turn,
+  // each session uses inter-op and intra-op threads on its node.
+  bool session_group_numa_affinity = false;
+
+  // Merge concurrent requests along the batch dimension (dim 0)
+  // before running them on the serving session.
+  bool enable_batching = false;
+  // Max number of rows of a merged request.
+  int max_batch_size = 256;
+  // Max time a request waits for others to merge with, in microseconds.
+  int batch_timeout_micros = 1000;
+  // Number of threads running merged requests, default is session_num.
+  int num_batch_threads = 1;
+
+  // Interval of checking new full or delta models, in seconds.
+  int model_update_interval_seconds = 60;
+  // When applying a delta model, keys upserted into the serving
+  // embedding variables at a time, 0 means no limit.
+  int delta_update_slice_size = 0;
+  // Pause after every slice of a delta model, in microseconds,
+  // bounds the latency impact on the concurrent predictions.
+  int delta_update_slice_interval_micros = 0;
 };
 
 class ModelConfigFactory {
@@ -1,3 +1,5 @@
+#include <stdlib.h>
+
 #include "gtest/gtest.h"
 #include "serving/processor/serving/model_config.h"
 
@@ -216,6 +218,109 @@ const std::string oss_and_redis_config = " \
   EXPECT_EQ("test_key", config->oss_access_key);
 }
 
+TEST_F(ModelConfigTest, ShouldSuccessWhenDeltaUpdateOptions) {
+const std::string local_config = " \
+  { \
+    \"serialize_protocol\": \"protobuf\", \
+    \"signature_name\": \"tensorflow_serving\", \
+    \"checkpoint_dir\" : \"/test_ckpt/1\", \
+    \"savedmodel_dir\" : \"/test_savedmodel/1\", \
+    \"feature_store_type\" : \"memory\", \
+    \"model_store_type\": \"local\", \
+    \"model_update_interval_seconds\": 10, \
+    \"delta_update_slice_size\": 4096, \
+    \"delta_update_slice_interval_micros\": 500 \
+  }";
+
+  ModelConfig* config = nullptr;
+  EXPECT_TRUE(
+      ModelConfigFactory::Create(local_config.c_str(), &config).ok());
+  EXPECT_EQ(10, config->model_update_interval_seconds);
+  EXPECT_EQ(4096, config->delta_update_slice_size);
+  EXPECT_EQ(500, config->delta_update_slice_interval_micros);
+  EXPECT_EQ(std::string("4096"), getenv("TF_EV_INCR_RESTORE_SLICE_SIZE"));
+  EXPECT_EQ(std::string("500"),
+            getenv("TF_EV_INCR_RESTORE_SLICE_INTERVAL_MICROS"));
+}
+
+TEST_F(ModelConfigTest, ShouldSuccessWhenLoadAwareSelectSessionPolicy) {
+const std::string config_template = " \
+  { \
+    \"session_num\": 4, \
+    \"select_session_policy\": \"%s\", \
+    \"serialize_protocol\": \"protobuf\", \
+    \"signature_name\": \"tensorflow_serving\", \
+    \"checkpoint_dir\" : \"/test_ckpt/1\", \
+    \"savedmodel_dir\" : \"/test_savedmodel/1\", \
+    \"feature_store_type\" : \"memory\", \
+    \"model_store_type\": \"local\" \
+  }";
+
+  for (auto policy : {"LOR", "P2C"}) {
+    char local_config[1024];
+    snprintf(local_config, sizeof(local_config),
+             config_template.c_str(), policy);
+    ModelConfig* config = nullptr;
+    EXPECT_TRUE(ModelConfigFactory::Create(local_config, &config).ok());
+    EXPECT_EQ(4, config->session_num);
+    EXPECT_EQ(std::string(policy), config->select_session_policy);
+  }
+
+  char local_config[1024];
+  snprintf(local_config, sizeof(local_config),
+           config_template.c_str(), "LRU");
+  ModelConfig* config = nullptr;
+  EXPECT_FALSE(ModelConfigFactory::Create(local_config, &config).ok());
+}
+
+TEST_F(ModelConfigTest, ShouldSuccessWhenSessionGroupNumaAffinity) {
+const std::string local_config = " \
+  { \
+    \"session_num\": 4, \
+    \"session_group_numa_affinity\": true, \
+    \"serialize_protocol\": \"protobuf\", \
+    \"signature_name\": \"tensorflow_serving\", \
+    \"checkpoint_dir\" : \"/test_ckpt/1\", \
+    \"savedmodel_dir\" : \"/test_savedmodel/1\", \
+    \"feature_store_type\" : \"memory\", \
+    \"model_store_type\": \"local\" \
+  }";
+
+  ModelConfig* config = nullptr;
+  EXPECT_TRUE(
+      ModelConfigFactory::Create(local_config.c_str(), &config).ok());
+  EXPECT_EQ(4, config->session_num);
+  EXPECT_TRUE(config->session_group_numa_affinity);
+}
+
+TEST_F(ModelConfigTest, ShouldSuccessWhenBatchingOptions) {
+const std::string config_template = " \
+  { \
+    \"session_num\": 2, \
+    \"enable_batching\": true, \
+    \"max_batch_size\": %d, \
+    \"batch_timeout_micros\": 500, \
+    \"serialize_protocol\": \"protobuf\", \
+    \"signature_name\": \"tensorflow_serving\", \
+    \"checkpoint_dir\" : \"/test_ckpt/1\", \
+    \"savedmodel_dir\" : \"/test_savedmodel/1\", \
+    \"feature_store_type\" : \"memory\", \
+    \"model_store_type\": \"local\" \
+  }";
+
+  char local_config[1024];
+  snprintf(local_config, sizeof(local_config), config_template.c_str(), 64);
+  ModelConfig* config = nullptr;
+  EXPECT_TRUE(ModelConfigFactory::Create(local_config, &config).ok());
+  EXPECT_TRUE(config->enable_batching);
+  EXPECT_EQ(64, config->max_batch_size);
+  EXPECT_EQ(500, config->batch_timeout_micros);
+  EXPECT_EQ(2, config->num_batch_threads);
+
+  snprintf(local_config, sizeof(local_config), config_template.c_str(), 0);
+  EXPECT_FALSE(ModelConfigFactory::Create(local_config, &config).ok());
+}
+
 } // processor
 } // tensorflow
 
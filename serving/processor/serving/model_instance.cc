@@ -1,5 +1,6 @@
 #include <fstream>
 #include "serving/processor/serving/model_instance.h"
+#include "serving/processor/serving/batch_scheduler.h"
 #include "serving/processor/serving/model_partition.h"
 #include "serving/processor/serving/model_session.h"
 #include "serving/processor/serving/predict.pb.h"
@@ -14,13 +15,12 @@
 #include "tensorflow/cc/saved_model/constants.h"
 #include "tensorflow/core/platform/protobuf_internal.h"
 #include "tensorflow/core/lib/io/path.h"
+#include "tensorflow/core/platform/env.h"
 #include "tensorflow/core/util/tensor_bundle/naming.h"
 
 namespace tensorflow {
 namespace processor {
 namespace {
-constexpr int _60_Seconds = 60;
-
 Tensor CreateTensor(const TensorInfo& tensor_info) {
   auto real_ts = tensor_info.tensor_shape();
   // set batch_size to 1 when the default value is -1
@@ -114,6 +114,17 @@ bool ShouldWarmup(SignatureDef& sig_def) {
   return true;
 }
 
+void MaybeEnableBatching(ModelConfig* config, ModelSessionMgr* session_mgr) {
+  if (!config->enable_batching) {
+    return;
+  }
+  BatchOptions options;
+  options.max_batch_size = config->max_batch_size;
+  options.batch_timeout_micros = config->batch_timeout_micros;
+  options.num_batch_threads = config->num_batch_threads;
+  session_mgr->EnableBatching(options);
+}
+
 } // namespace
 
 LocalSessionInstance::LocalSessionInstance(
@@ -163,6 +174,7 @@ Status LocalSessionInstance::Init(ModelConfig* config,
 
   session_mgr_ = new ModelSessionMgr(meta_graph_def_,
       session_options_, run_options_);
+  MaybeEnableBatching(config, session_mgr_);
 
   // Load full model
   TF_RETURN_IF_ERROR(session_mgr_->CreateModelSession(version_,
@@ -251,6 +263,9 @@ Status LocalSessionInstance::FullModelUpdate(
 
 Status LocalSessionInstance::DeltaModelUpdate(
     const Version& version, ModelConfig* model_config) {
+  uint64 start_micros = Env::Default()->NowMicros();
+  // The delta is upserted into the embedding variables of the serving
+  // session in slices while it keeps predicting.
   TF_RETURN_IF_ERROR(
       session_mgr_->CreateModelSession(version,
           version.full_ckpt_name.c_str(),
@@ -261,6 +276,9 @@ Status LocalSessionInstance::DeltaModelUpdate(
   // reset serving session, we don't create a new session.
 
   UpdateVersion(version);
+  LOG(INFO) << "[Model Instance] Delta model " << version.delta_ckpt_name
+            << " applied in "
+            << (Env::Default()->NowMicros() - start_micros) / 1000 << " ms.";
 
   return Status::OK();
 }
@@ -346,6 +364,7 @@ Status RemoteSessionInstance::Init(ModelConfig* model_config,
 
   session_mgr_ = new ModelSessionMgr(meta_graph_def_,
       session_options_, run_options_);
+  MaybeEnableBatching(model_config, session_mgr_);
 
   TF_RETURN_IF_ERROR(ReadModelSignature(model_config));
 
@@ -446,6 +465,8 @@ LocalSessionInstanceMgr::LocalSessionInstanceMgr(ModelConfig* config)
   session_options_->config.set_inter_op_parallelism_threads(config->inter_threads);
   session_options_->config.set_intra_op_parallelism_threads(config->intra_threads);
   session_options_->config.set_use_per_session_threads(config->use_per_session_threads);
+  session_options_->config.set_session_group_numa_affinity(
+      config->session_group_numa_affinity);
   //session_options_->config.mutable_gpu_options()->set_allocator_type("CPU");
   run_options_ = new RunOptions();
 }
@@ -508,6 +529,8 @@ RemoteSessionInstanceMgr::RemoteSessionInstanceMgr(ModelConfig* config)
   //session_options_->target = target;
   session_options_->config.set_inter_op_parallelism_threads(config->inter_threads);
   session_options_->config.set_intra_op_parallelism_threads(config->intra_threads);
+  session_options_->config.set_session_group_numa_affinity(
+      config->session_group_numa_affinity);
   //session_options_->config.mutable_gpu_options()->set_allocator_type("CPU");
   run_options_ = new RunOptions();
 
@@ -656,7 +679,9 @@ void ModelUpdater::WorkLoop() {
     if (!status.ok()) {
       LOG(WARNING) << "[Processor] Not found full model or incremental model directory. "
                    << "Please ignore this warning if you confirm it. "
-                   << "And we will try 60 seconds later. Warning message: "
+                   << "And we will try "
+                   << model_config_->model_update_interval_seconds
+                   << " seconds later. Warning message: "
                    << status.error_message() << std::endl;
     }
 
@@ -672,7 +697,7 @@ void ModelUpdater::WorkLoop() {
       }
     }
 
-    sleep(_60_Seconds);
+    sleep(model_config_->model_update_interval_seconds);
   }
 }
 
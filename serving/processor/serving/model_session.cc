@@ -1,5 +1,6 @@
 #include <random>
 #include "serving/processor/serving/model_session.h"
+#include "serving/processor/serving/batch_scheduler.h"
 #include "serving/processor/serving/model_message.h"
 #include "serving/processor/serving/tracer.h"
 #include "serving/processor/serving/util.h"
@@ -129,6 +130,7 @@ void ModelSessionMgr::ClearLoop() {
 }
 
 ModelSessionMgr::~ModelSessionMgr() {
+  delete batch_scheduler_;
   is_stop_ = true;
   clear_session_thread_->join();
   delete clear_session_thread_;
@@ -198,14 +200,7 @@ ModelSession::ModelSession(SessionGroup* s,
     const Version& version, IFeatureStoreMgr* sparse_storage)
     : session_group_(s), counter_(0), is_local_(false),
       version_(version) {
-  if (select_session_policy == "MOD") {
-    select_session_policy_ = SelectSessionPolicy::MOD;
-  } else if (select_session_policy == "RR") {
-    select_session_policy_ = SelectSessionPolicy::RR;
-  } else {
-    LOG(FATAL) << "[ModelSession] select_session_policy must be RR or MOD, current get "
-               << select_session_policy;
-  }
+  InitSelectSessionPolicy(select_session_policy);
 
   Tensor t(DT_UINT64, TensorShape({}));
   t.scalar<uint64>()() = reinterpret_cast<uint64>(sparse_storage);
@@ -222,19 +217,31 @@ ModelSession::ModelSession(SessionGroup* s,
     const std::string& select_session_policy, const Version& version)
     : session_group_(s), counter_(0), is_local_(true),
       version_(version) {
+  InitSelectSessionPolicy(select_session_policy);
+
+  Tensor t_version(DT_UINT64, TensorShape({}));
+  t_version.scalar<uint64>()() = version.full_ckpt_version;
+  model_version_tensor_ = t_version;
+  model_version_name_ = GetModelVersionNodeName();
+}
+
+void ModelSession::InitSelectSessionPolicy(
+    const std::string& select_session_policy) {
   if (select_session_policy == "MOD") {
     select_session_policy_ = SelectSessionPolicy::MOD;
   } else if (select_session_policy == "RR") {
     select_session_policy_ = SelectSessionPolicy::RR;
+    session_group_->SetSelectPolicy(SessionGroupPolicy::kRoundRobin);
+  } else if (select_session_policy == "LOR") {
+    select_session_policy_ = SelectSessionPolicy::LOR;
+    session_group_->SetSelectPolicy(SessionGroupPolicy::kLeastOutstanding);
+  } else if (select_session_policy == "P2C") {
+    select_session_policy_ = SelectSessionPolicy::P2C;
+    session_group_->SetSelectPolicy(SessionGroupPolicy::kPowerOfTwoChoices);
   } else {
-    LOG(FATAL) << "[ModelSession] select_session_policy must be RR or MOD, current get "
-               << select_session_policy;
+    LOG(FATAL) << "[ModelSession] select_session_policy must be RR, MOD, "
+               << "LOR or P2C, current get " << select_session_policy;
   }
-
-  Tensor t_version(DT_UINT64, TensorShape({}));
-  t_version.scalar<uint64>()() = version.full_ckpt_version;
-  model_version_tensor_ = t_version;
-  model_version_name_ = GetModelVersionNodeName();
 }
 
 ModelSession::~ModelSession() {
@@ -249,8 +256,9 @@ Session* ModelSession::GetSession() {
 }
 
 int ModelSession::GetServingSessionId() {
-  if (select_session_policy_ ==
-      SelectSessionPolicy::RR) {
+  // Let SessionGroup pick the session by its policy.
+  if (select_session_policy_ !=
+      SelectSessionPolicy::MOD) {
     return -1;
   }
   static std::atomic<int> counter{0};
@@ -313,13 +321,30 @@ Status ModelSession::LocalPredict(Request& req, Response& resp) {
 }
 
 Status ModelSessionMgr::Predict(Request& req, Response& resp) {
+  if (batch_scheduler_ && !serving_session_->is_local_) {
+    return batch_scheduler_->Schedule(req, resp);
+  }
   return serving_session_->Predict(req, resp);
 }
 
 Status ModelSessionMgr::LocalPredict(Request& req, Response& resp) {
+  if (batch_scheduler_ && serving_session_->is_local_) {
+    return batch_scheduler_->Schedule(req, resp);
+  }
   return serving_session_->LocalPredict(req, resp);
 }
 
+void ModelSessionMgr::EnableBatching(const BatchOptions& options) {
+  delete batch_scheduler_;
+  // Merged requests run on the serving session at the time they run.
+  batch_scheduler_ = new BatchScheduler(options,
+      [this](Request& req, Response& resp) {
+        ModelSession* session = serving_session_;
+        return session->is_local_ ? session->LocalPredict(req, resp)
+                                  : session->Predict(req, resp);
+      });
+}
+
 Status ModelSessionMgr::CreateModelSession(
     const Version& version, const char* ckpt_name,
     IFeatureStoreMgr* sparse_storage, bool is_incr_ckpt,
@@ -21,9 +21,13 @@ namespace processor {
 class IFeatureStoreMgr;
 class Request;
 class Response;
+class BatchScheduler;
+struct BatchOptions;
 enum SelectSessionPolicy {
   MOD = 1,
-  RR = 2
+  RR = 2,
+  LOR = 3,
+  P2C = 4
 };
 struct ModelSession {
   ModelSession(SessionGroup* s, const std::string& select_session_policy,
@@ -53,6 +57,7 @@ struct ModelSession {
   Version version_;
 
  private:
+  void InitSelectSessionPolicy(const std::string& select_session_policy);
   int GetServingSessionId();
 };
 
@@ -65,6 +70,9 @@ class ModelSessionMgr {
   Status Predict(Request& req, Response& resp);
   Status LocalPredict(Request& req, Response& resp);
 
+  // Merges concurrent requests before running them on the serving session.
+  void EnableBatching(const BatchOptions& options);
+
   Status CreateModelSession(
       const Version& version, const char* ckpt_name,
       IFeatureStoreMgr* sparse_storage,
@@ -111,6 +119,7 @@ class ModelSessionMgr {
 
  protected:
   ModelSession* serving_session_ = nullptr;
+  BatchScheduler* batch_scheduler_ = nullptr;
 
   MetaGraphDef meta_graph_def_;
   SessionOptions* session_options_;
@@ -3,6 +3,7 @@
 #include "serving/processor/serving/model_session.h"
 #include "serving/processor/serving/model_config.h"
 #include "serving/processor/serving/model_message.h"
+#include "tensorflow/core/platform/notification.h"
 #include "tensorflow/core/public/session.h"
 
 namespace tensorflow {
@@ -112,6 +113,33 @@ class FakeSession : public Session {
   }
 };
 
+// Counts runs, the first run blocks until Unblock when `block` is set.
+class BlockingSession : public FakeSession {
+ public:
+  explicit BlockingSession(bool block) : block_(block) {}
+
+  Status Run(const std::vector<std::pair<string, Tensor> >& inputs,
+             const std::vector<string>& output_tensor_names,
+             const std::vector<string>& target_node_names,
+             std::vector<Tensor>* outputs) override {
+    if (run_num_.fetch_add(1) == 0 && block_) {
+      started_.Notify();
+      unblock_.WaitForNotification();
+    }
+    return Status::OK();
+  }
+
+  void WaitForStart() { started_.WaitForNotification(); }
+  void Unblock() { unblock_.Notify(); }
+  int RunNum() const { return run_num_.load(); }
+
+ private:
+  bool block_;
+  std::atomic<int> run_num_{0};
+  Notification started_;
+  Notification unblock_;
+};
+
 class FakeFeatureStoreMgr : public IFeatureStoreMgr {
  public:
   FakeFeatureStoreMgr(ModelConfig* config) {
@@ -290,5 +318,37 @@ TEST_F(ModelSessionMgrTest, CleanupModelSessionWhenNoRequest) {
   EXPECT_EQ(1, mgr.GetModelSessionSize());
 }
 
+TEST_F(ModelSessionMgrTest, LoadAwarePolicyAvoidsBusySession) {
+  for (auto policy : {"LOR", "P2C"}) {
+    auto busy_session = new BlockingSession(true);
+    auto idle_session = new BlockingSession(false);
+    SessionGroup* sess_group = new SessionGroup();
+    sess_group->CreateLeaderSession(busy_session);
+    sess_group->CreateFollowerSession(idle_session);
+    ModelSession model_session(sess_group, policy, Version());
+
+    Request busy_req;
+    Response busy_resp;
+    std::thread busy_thread([&model_session, &busy_req, &busy_resp]() {
+      EXPECT_TRUE(model_session.LocalPredict(busy_req, busy_resp).ok());
+    });
+    busy_session->WaitForStart();
+    EXPECT_EQ(1, sess_group->GetOutstandingNum(0));
+
+    for (int i = 0; i < 4; ++i) {
+      Request req;
+      Response resp;
+      EXPECT_TRUE(model_session.LocalPredict(req, resp).ok());
+    }
+    EXPECT_EQ(1, busy_session->RunNum());
+    EXPECT_EQ(4, idle_session->RunNum());
+    EXPECT_EQ(0, sess_group->GetOutstandingNum(1));
+
+    busy_session->Unblock();
+    busy_thread.join();
+    EXPECT_EQ(0, sess_group->GetOutstandingNum(0));
+  }
+}
+
 } // processor
 } // tensorflow
@@ -0,0 +1,213 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "serving/processor/serving/processor.h"
+#include "serving/processor/serving/predict.pb.h"
+
+// Closed-loop serving benchmark, every client thread sends a request after
+// the previous one returned. Reports QPS and latency percentiles.
+//
+// Usage:
+//   benchmark --session_num=4 --select_session_policy=LOR \
+//       --session_group_numa_affinity=true --threads=32 --duration=30
+//   benchmark --enable_batching=true --max_batch_size=256 \
+//       --batch_timeout_micros=1000 --threads=64 --batch_size=16
+
+namespace {
+
+struct BenchmarkOptions {
+  std::string checkpoint_dir = "/tmp/checkpoint/";
+  std::string savedmodel_dir = "/tmp/saved_model/";
+  int session_num = 1;
+  std::string select_session_policy = "MOD";
+  std::string session_group_numa_affinity = "false";
+  int inter_threads = 10;
+  int intra_threads = 10;
+  int threads = 8;
+  int duration = 10;
+  int batch_size = 1;
+  std::string enable_batching = "false";
+  int max_batch_size = 256;
+  int batch_timeout_micros = 1000;
+};
+
+bool ParseFlag(const char* arg, const char* name, std::string* value) {
+  size_t len = strlen(name);
+  if (strncmp(arg, "--", 2) != 0 || strncmp(arg + 2, name, len) != 0 ||
+      arg[len + 2] != '=') {
+    return false;
+  }
+  *value = arg + len + 3;
+  return true;
+}
+
+bool ParseFlag(const char* arg, const char* name, int* value) {
+  std::string str;
+  if (!ParseFlag(arg, name, &str)) return false;
+  *value = atoi(str.c_str());
+  return true;
+}
+
+bool ParseOptions(int argc, char** argv, BenchmarkOptions* opts) {
+  for (int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    if (!ParseFlag(arg, "checkpoint_dir", &opts->checkpoint_dir) &&
+        !ParseFlag(arg, "savedmodel_dir", &opts->savedmodel_dir) &&
+        !ParseFlag(arg, "session_num", &opts->session_num) &&
+        !ParseFlag(arg, "select_session_policy",
+                   &opts->select_session_policy) &&
+        !ParseFlag(arg, "session_group_numa_affinity",
+                   &opts->session_group_numa_affinity) &&
+        !ParseFlag(arg, "inter_threads", &opts->inter_threads) &&
+        !ParseFlag(arg, "intra_threads", &opts->intra_threads) &&
+        !ParseFlag(arg, "threads", &opts->threads) &&
+        !ParseFlag(arg, "duration", &opts->duration) &&
+        !ParseFlag(arg, "batch_size", &opts->batch_size) &&
+        !ParseFlag(arg, "enable_batching", &opts->enable_batching) &&
+        !ParseFlag(arg, "max_batch_size", &opts->max_batch_size) &&
+        !ParseFlag(arg, "batch_timeout_micros",
+                   &opts->batch_timeout_micros)) {
+      std::cerr << "Unknown flag: " << arg << "\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+std::string ModelConfig(const BenchmarkOptions& opts) {
+  char buf[2048];
+  snprintf(buf, sizeof(buf), "{ \
+      \"omp_num_threads\": 4, \
+      \"kmp_blocktime\": 0, \
+      \"feature_store_type\": \"memory\", \
+      \"serialize_protocol\": \"protobuf\", \
+      \"inter_op_parallelism_threads\": %d, \
+      \"intra_op_parallelism_threads\": %d, \
+      \"init_timeout_minutes\": 1, \
+      \"signature_name\": \"serving_default\", \
+      \"read_thread_num\": 3, \
+      \"update_thread_num\": 2, \
+      \"model_store_type\": \"local\", \
+      \"session_num\": %d, \
+      \"select_session_policy\": \"%s\", \
+      \"session_group_numa_affinity\": %s, \
+      \"enable_batching\": %s, \
+      \"max_batch_size\": %d, \
+      \"batch_timeout_micros\": %d, \
+      \"checkpoint_dir\": \"%s\", \
+      \"savedmodel_dir\": \"%s\" \
+    }", opts.inter_threads, opts.intra_threads, opts.session_num,
+      opts.select_session_policy.c_str(),
+      opts.session_group_numa_affinity.c_str(),
+      opts.enable_batching.c_str(), opts.max_batch_size,
+      opts.batch_timeout_micros, opts.checkpoint_dir.c_str(),
+      opts.savedmodel_dir.c_str());
+  return buf;
+}
+
+std::string BuildRequest(int batch_size) {
+  ::tensorflow::eas::ArrayShape array_shape;
+  array_shape.add_dim(batch_size);
+  array_shape.add_dim(1);
+  ::tensorflow::eas::ArrayProto input;
+  for (int i = 0; i < batch_size; ++i) {
+    input.add_float_val(1.0);
+  }
+  input.set_dtype(::tensorflow::eas::ArrayDataType::DT_FLOAT);
+  *(input.mutable_array_shape()) = array_shape;
+
+  ::tensorflow::eas::PredictRequest req;
+  req.set_signature_name("serving_default");
+  req.add_output_filter("y:0");
+  (*req.mutable_inputs())["x:0"] = input;
+  return req.SerializeAsString();
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  BenchmarkOptions opts;
+  if (!ParseOptions(argc, argv, &opts)) {
+    return 1;
+  }
+
+  int state;
+  std::string model_config = ModelConfig(opts);
+  void* model = initialize("", model_config.c_str(), &state);
+  if (state == -1) {
+    std::cerr << "initialize error\n";
+    return 1;
+  }
+
+  const std::string request = BuildRequest(opts.batch_size);
+  std::atomic<bool> stop(false);
+  std::atomic<int64_t> error_num(0);
+  std::vector<std::vector<int64_t>> latencies(opts.threads);
+  std::vector<std::thread> clients;
+  auto start = std::chrono::steady_clock::now();
+  for (int t = 0; t < opts.threads; ++t) {
+    clients.emplace_back([&, t]() {
+      while (!stop.load(std::memory_order_relaxed)) {
+        void* output = nullptr;
+        int output_size = 0;
+        auto begin = std::chrono::steady_clock::now();
+        int ret = process(model, request.data(), request.size(),
+                          &output, &output_size);
+        auto end = std::chrono::steady_clock::now();
+        if (ret != 200) {
+          ++error_num;
+        }
+        free(output);
+        latencies[t].push_back(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                end - begin).count());
+      }
+    });
+  }
+  std::this_thread::sleep_for(std::chrono::seconds(opts.duration));
+  stop = true;
+  for (auto& client : clients) {
+    client.join();
+  }
+  double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+  std::vector<int64_t> all;
+  for (auto& l : latencies) {
+    all.insert(all.end(), l.begin(), l.end());
+  }
+  if (all.empty()) {
+    std::cerr << "no request finished\n";
+    return 1;
+  }
+  std::sort(all.begin(), all.end());
+  auto percentile = [&all](double p) {
+    size_t i = std::min(all.size() - 1, static_cast<size_t>(p * all.size()));
+    return all[i] / 1000.0;
+  };
+  double sum = 0;
+  for (auto l : all) sum += l;
+
+  printf("session_num: %d, select_session_policy: %s, "
+         "session_group_numa_affinity: %s, threads: %d, batch_size: %d\n",
+         opts.session_num, opts.select_session_policy.c_str(),
+         opts.session_group_numa_affinity.c_str(), opts.threads,
+         opts.batch_size);
+  printf("enable_batching: %s, max_batch_size: %d, "
+         "batch_timeout_micros: %d\n", opts.enable_batching.c_str(),
+         opts.max_batch_size, opts.batch_timeout_micros);
+  printf("requests: %zu, errors: %lld, QPS: %.1f\n", all.size(),
+         static_cast<long long>(error_num.load()), all.size() / seconds);
+  printf("latency(ms) avg: %.3f, p50: %.3f, p90: %.3f, p99: %.3f, "
+         "p999: %.3f\n", sum / all.size() / 1000.0, percentile(0.5),
+         percentile(0.9), percentile(0.99), percentile(0.999));
+
+  return 0;
+}
@@ -74,6 +74,7 @@ limitations under the License.
 #include "tensorflow/core/platform/cpu_info.h"
 #include "tensorflow/core/platform/logging.h"
 #include "tensorflow/core/platform/mutex.h"
+#include "tensorflow/core/platform/numa.h"
 #include "tensorflow/core/platform/tracing.h"
 #include "tensorflow/core/platform/types.h"
 #include "tensorflow/core/profiler/lib/profiler_session.h"
@@ -93,35 +94,41 @@ auto* direct_session_runs = monitoring::Counter<0>::New(
 Status NewThreadPoolFromThreadPoolOptions(
     const SessionOptions& options,
     const ThreadPoolOptionProto& thread_pool_options, int pool_number,
-    thread::ThreadPool** pool, bool* owned) {
+    int numa_node, thread::ThreadPool** pool, bool* owned) {
   int32 num_threads = thread_pool_options.num_threads();
   if (num_threads == 0) {
     num_threads = NumInterOpThreadsFromSessionOptions(options);
   }
+  ThreadOptions thread_opts;
+  thread_opts.numa_node = numa_node;
   const string& name = thread_pool_options.global_name();
   if (name.empty()) {
     // Session-local threadpool.
     VLOG(1) << "Direct session inter op parallelism threads for pool "
             << pool_number << ": " << num_threads;
     *pool = new thread::ThreadPool(
-        options.env, ThreadOptions(), strings::StrCat("Compute", pool_number),
+        options.env, thread_opts, strings::StrCat("Compute", pool_number),
         num_threads, !options.config.experimental().disable_thread_spinning(),
         /*allocator=*/nullptr);
     *owned = true;
     return Status::OK();
   }
 
-  // Global, named threadpool.
+  // Global, named threadpool. Sessions bound to different NUMA nodes
+  // don't share it.
   typedef std::pair<int32, thread::ThreadPool*> MapValue;
   static std::map<string, MapValue>* global_pool_map =
       new std::map<string, MapValue>;
   static mutex* mu = new mutex();
   mutex_lock l(*mu);
-  MapValue* mvalue = &(*global_pool_map)[name];
+  const string key = numa_node == port::kNUMANoAffinity
+                         ? name
+                         : strings::StrCat(name, "_numa_", numa_node);
+  MapValue* mvalue = &(*global_pool_map)[key];
   if (mvalue->second == nullptr) {
     mvalue->first = thread_pool_options.num_threads();
     mvalue->second = new thread::ThreadPool(
-        options.env, ThreadOptions(), strings::StrCat("Compute", pool_number),
+        options.env, thread_opts, strings::StrCat("Compute", pool_number),
         num_threads, !options.config.experimental().disable_thread_spinning(),
         /*allocator=*/nullptr);
   } else {
@@ -144,6 +151,29 @@ thread::ThreadPool* GlobalThreadPool(const SessionOptions& options) {
   return thread_pool;
 }
 
+// Intra-op thread pool shared by the sessions bound to `numa_node`.
+thread::ThreadPool* NumaIntraOpThreadPool(const SessionOptions& options,
+                                          int numa_node) {
+  static std::map<int, thread::ThreadPool*>* numa_pool_map =
+      new std::map<int, thread::ThreadPool*>;
+  static mutex* mu = new mutex();
+  mutex_lock l(*mu);
+  thread::ThreadPool*& pool = (*numa_pool_map)[numa_node];
+  if (pool == nullptr) {
+    int32 num_threads = options.config.intra_op_parallelism_threads();
+    if (num_threads <= 0) {
+      num_threads = port::MaxParallelism(numa_node);
+    }
+    ThreadOptions thread_opts;
+    thread_opts.numa_node = numa_node;
+    pool = new thread::ThreadPool(
+        options.env, thread_opts, strings::StrCat("numa_", numa_node, "_Intra"),
+        num_threads, !options.config.experimental().disable_thread_spinning(),
+        /*allocator=*/nullptr);
+  }
+  return pool;
+}
+
 // TODO(vrv): Figure out how to unify the many different functions
 // that generate RendezvousKey, since many of them have to be
 // consistent with each other.
@@ -238,13 +268,27 @@ class DirectSessionFactory : public SessionFactory {
 
     DeviceMgr* device_mgr = new DeviceMgr(std::move(devices));
 
+    // Sessions are bound to NUMA nodes in turn, the leader to node 0.
+    int num_numa_nodes = 0;
+    if (options.config.session_group_numa_affinity()) {
+      if (port::NUMAEnabled()) {
+        num_numa_nodes = port::NUMANumNodes();
+      } else {
+        LOG(WARNING) << "NUMA is not available, sessions of SessionGroup "
+                     << "are not bound to NUMA nodes.";
+      }
+    }
+    auto session_numa_node = [num_numa_nodes](int i) {
+      return num_numa_nodes > 0 ? i % num_numa_nodes : port::kNUMANoAffinity;
+    };
+
     SessionGroup* session_group = new SessionGroup();
-    DirectSession* leader_session =
-        new DirectSession(options, device_mgr, true, this);
+    DirectSession* leader_session = new DirectSession(
+        options, device_mgr, true, this, session_numa_node(0));
     session_group->CreateLeaderSession(leader_session);
     for (int i = 1; i < session_num; ++i) {
-      DirectSession* follower_session =
-          new DirectSession(options, device_mgr, false, this);
+      DirectSession* follower_session = new DirectSession(
+          options, device_mgr, false, this, session_numa_node(i));
       session_group->CreateFollowerSession(follower_session);
       {
         mutex_lock l(sessions_lock_);
@@ -369,13 +413,15 @@ bool DirectSession::ShouldUseRunHandlerPool(
 DirectSession::DirectSession(const SessionOptions& options,
                              const DeviceMgr* device_mgr,
                              bool owd_device_mgr,
-                             DirectSessionFactory* const factory)
+                             DirectSessionFactory* const factory,
+                             int numa_node)
     : options_(options),
       own_device_mgr_(owd_device_mgr),
       device_mgr_(device_mgr),
       factory_(factory),
       cancellation_manager_(new CancellationManager()),
-      operation_timeout_in_ms_(options_.config.operation_timeout_in_ms()) {
+      operation_timeout_in_ms_(options_.config.operation_timeout_in_ms()),
+      numa_node_(numa_node) {
   const int thread_pool_size =
       options_.config.session_inter_op_thread_pool_size();
   if (thread_pool_size > 0) {
@@ -383,10 +429,23 @@ DirectSession::DirectSession(const SessionOptions& options,
       thread::ThreadPool* pool = nullptr;
       bool owned = false;
       init_error_.Update(NewThreadPoolFromThreadPoolOptions(
-          options_, options_.config.session_inter_op_thread_pool(i), i, &pool,
-          &owned));
+          options_, options_.config.session_inter_op_thread_pool(i), i,
+          numa_node_, &pool, &owned));
       thread_pools_.emplace_back(pool, owned);
     }
+  } else if (numa_node_ != port::kNUMANoAffinity) {
+    // The global thread pool spans all NUMA nodes, use a session owned one
+    // on the bound node instead.
+    ThreadOptions thread_opts;
+    thread_opts.numa_node = numa_node_;
+    thread_pools_.emplace_back(
+        new thread::ThreadPool(
+            options_.env, thread_opts,
+            strings::StrCat("numa_", numa_node_, "_Compute"),
+            NumInterOpThreadsFromSessionOptions(options_),
+            !options_.config.experimental().disable_thread_spinning(),
+            /*allocator=*/nullptr),
+        true /* owned */);
   } else if (options_.config.use_per_session_threads()) {
     thread_pools_.emplace_back(NewThreadPoolFromSessionOptions(options_),
                                true /* owned */);
@@ -403,6 +462,11 @@ DirectSession::DirectSession(const SessionOptions& options,
     MemoryPlannerFactory::GetMemoryPlanner()->SetThreadPool(GlobalThreadPool(options));
   }
 
+  if (numa_node_ != port::kNUMANoAffinity) {
+    intra_op_thread_pool_ = NumaIntraOpThreadPool(options_, numa_node_);
+    LOG(INFO) << "DirectSession is bound to NUMA node " << numa_node_;
+  }
+
   // Select which executor to use
   if (options_.config.executor_policy() ==
       ExecutorPolicy::USE_COST_MODEL_EXECUTOR) {
@@ -657,6 +721,10 @@ Status DirectSession::RunInternal(
   args.step_container = &run_state.step_container;
   args.sync_on_finish = sync_on_finish_;
   args.user_intra_op_threadpool = threadpool_options.intra_op_threadpool;
+  if (args.user_intra_op_threadpool == nullptr &&
+      intra_op_thread_pool_ != nullptr) {
+    args.user_intra_op_threadpool = intra_op_thread_pool_->AsEigenThreadPool();
+  }
   if (run_in_caller_thread_) {
     args.executor_policy = ExecutorPolicy::USE_INLINE_EXECUTOR;
   } else if (run_cost_model_executor_) {
@@ -41,6 +41,7 @@ limitations under the License.
 #include "tensorflow/core/lib/core/status.h"
 #include "tensorflow/core/platform/macros.h"
 #include "tensorflow/core/platform/mutex.h"
+#include "tensorflow/core/platform/numa.h"
 #include "tensorflow/core/platform/thread_annotations.h"
 #include "tensorflow/core/platform/types.h"
 #include "tensorflow/core/public/session.h"
@@ -60,8 +61,11 @@ class DirectSession : public Session {
   // 'factory' is used to unregister the DirectSession with 'factory' when its
   // closed. This ensures that Reset requests from the 'factory' don't get sent
   // to sessions that are already closed.
+  // Threads of the session are bound to 'numa_node' unless it is
+  // port::kNUMANoAffinity.
   DirectSession(const SessionOptions& options, const DeviceMgr* device_mgr,
-                bool own_device_mgr, DirectSessionFactory* factory);
+                bool own_device_mgr, DirectSessionFactory* factory,
+                int numa_node = port::kNUMANoAffinity);
   ~DirectSession() override;
 
   typedef std::vector<std::pair<string, Tensor>> NamedTensorList;
@@ -426,6 +430,11 @@ class DirectSession : public Session {
   // If true, will use cost_model_executor to run the graph.
   bool run_cost_model_executor_ = false;
 
+  // NUMA node the session is bound to, and the intra-op thread pool on it
+  // shared with other sessions bound to the same node (not owned).
+  const int numa_node_;
+  thread::ThreadPool* intra_op_thread_pool_ = nullptr;
+
   TF_DISALLOW_COPY_AND_ASSIGN(DirectSession);
 
   // EXPERIMENTAL: debugger (tfdbg) related
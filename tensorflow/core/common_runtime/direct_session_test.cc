@@ -150,6 +150,25 @@ TEST_F(DirectSessionMinusAXTest, RunSimpleNetwork) {
   EXPECT_FLOAT_EQ(5.0, mat(0, 0));
 }
 
+TEST_F(DirectSessionMinusAXTest, RunSimpleNetworkWithNumaSessionGroup) {
+  Initialize({3, 2, -1, 0});
+  SessionOptions options = DefaultSessionOptions();
+  options.config.set_session_group_numa_affinity(true);
+  SessionGroup* session_group = nullptr;
+  TF_ASSERT_OK(NewSessionGroup(options, &session_group, 4));
+  std::unique_ptr<SessionGroup> session_group_owner(session_group);
+  TF_ASSERT_OK(session_group->Create(def_));
+
+  // Bound or not, every session computes the same result.
+  for (int i = 0; i < 4; ++i) {
+    std::vector<Tensor> outputs;
+    TF_ASSERT_OK(
+        session_group->Run({}, {y_ + ":0"}, {y_neg_}, &outputs, i));
+    ASSERT_EQ(1, outputs.size());
+    EXPECT_FLOAT_EQ(5.0, outputs[0].matrix<float>()(0, 0));
+  }
+}
+
 TEST_F(DirectSessionMinusAXTest, RunSimpleNetwork_Callable) {
   Initialize({3, 2, -1, 0});
   auto session = CreateSession();
@@ -662,6 +662,10 @@ Status GraphExecutionState::SmartStageGraph(std::unique_ptr<Graph>* g,
         unstage_node_map[name] = n;
       }
     }
+    if (stage_node_map.empty()) {
+      LOG(WARNING) << "SmartStage requires at least one stage in the graph, "
+                   << "use tf.staged or tf.auto_staged to add stages.";
+    }
     std::map<std::string, Node*>::iterator it;
     for (it = stage_node_map.begin(); it != stage_node_map.end(); ++it) {
       if (unstage_node_map.find(it->first) != unstage_node_map.end()) {
@@ -5,6 +5,9 @@
 #include <unordered_map>
 #include <set>
 #include <list>
+#include <atomic>
+#include <memory>
+#include <vector>
 #include "tensorflow/core/platform/types.h"
 #include "tensorflow/core/platform/mutex.h"
 #include "tensorflow/core/lib/core/status.h"
@@ -19,6 +22,8 @@ public:
   BatchCache():visit_count(0), hit_count(0) {}
   virtual size_t get_evic_ids(K* evic_ids, size_t k_size) = 0;
   virtual void add_to_rank(const K* batch_ids, size_t batch_size) = 0;
+  // Drops ids that left the storage level without being evicted.
+  virtual void remove_ids(const K* batch_ids, size_t batch_size) = 0;
   virtual size_t size() = 0;
 
   void Hit() {
@@ -110,6 +115,21 @@ public:
       }
     }
   }
+
+  void remove_ids(const K* batch_ids, size_t batch_size) {
+    mutex_lock l(mu_);
+    for (size_t i = 0; i < batch_size; ++i) {
+      auto it = mp.find(batch_ids[i]);
+      if (it == mp.end()) {
+        continue;
+      }
+      LRUNode *node = it->second;
+      node->pre->next = node->next;
+      node->next->pre = node->pre;
+      mp.erase(it);
+      delete node;
+    }
+  }
 };
 
 template <class K>
@@ -189,8 +209,296 @@ public:
       }
     }
   }
+
+  void remove_ids(const K *batch_ids, size_t batch_size) {
+    mutex_lock l(mu_);
+    for (size_t i = 0; i < batch_size; ++i) {
+      auto it = key_table.find(batch_ids[i]);
+      if (it == key_table.end()) {
+        continue;
+      }
+      size_t freq = it->second->freq;
+      freq_table[freq].erase(it->second);
+      key_table.erase(it);
+      if (freq_table[freq].size() == 0) {
+        freq_table.erase(freq);
+        if (min_freq == freq) {
+          ++min_freq;
+          while (min_freq <= max_freq) {
+            auto next = freq_table.find(min_freq);
+            if (next == freq_table.end() || next->second.size() == 0) {
+              ++min_freq;
+            } else {
+              break;
+            }
+          }
+        }
+      }
+    }
+  }
+};
+
+// CLOCK cache split into hash-sharded segments. Every shard keeps its ids in a
+// slot array swept by a clock hand and an open-addressed index mapping id to
+// slot, so both touching and evicting an id are O(1). add_to_rank groups a
+// batch by shard and takes every shard lock at most once per batch.
+template <class K>
+class ShardedClockCache : public BatchCache<K> {
+ private:
+  struct ClockEntry {
+    K id;
+    bool referenced;
+    bool valid;
+  };
+
+  class Shard {
+   public:
+    Shard() : size(0), used_buckets(0), hand(0) {
+      index.assign(kInitBucketNum, kEmptyBucket);
+      index_mask = kInitBucketNum - 1;
+    }
+
+    // Returns true if id is newly inserted. Caller must hold mu.
+    bool Touch(K id, uint64 hash) {
+      size_t pos = hash & index_mask;
+      int64 tombstone = -1;
+      while (index[pos] != kEmptyBucket) {
+        int64 slot = index[pos];
+        if (slot == kDeletedBucket) {
+          if (tombstone == -1) tombstone = pos;
+        } else if (slots[slot].id == id) {
+          slots[slot].referenced = true;
+          return false;
+        }
+        pos = (pos + 1) & index_mask;
+      }
+      int64 slot;
+      if (!free_slots.empty()) {
+        slot = free_slots.back();
+        free_slots.pop_back();
+      } else {
+        slot = slots.size();
+        slots.emplace_back();
+      }
+      slots[slot].id = id;
+      slots[slot].referenced = false;
+      slots[slot].valid = true;
+      if (tombstone != -1) {
+        index[tombstone] = slot;
+      } else {
+        index[pos] = slot;
+        ++used_buckets;
+      }
+      ++size;
+      if (used_buckets * 2 > index.size()) {
+        Rehash();
+      }
+      return true;
+    }
+
+    // Evicts up to k ids into evic_ids. Caller must hold mu.
+    size_t Evict(K* evic_ids, size_t k) {
+      size_t true_size = 0;
+      while (true_size < k && size > 0) {
+        if (hand >= slots.size()) {
+          hand = 0;
+        }
+        ClockEntry& entry = slots[hand];
+        if (entry.valid) {
+          if (entry.referenced) {
+            entry.referenced = false;
+          } else {
+            evic_ids[true_size++] = entry.id;
+            EraseIndex(entry.id, Hash(entry.id));
+            entry.valid = false;
+            free_slots.push_back(hand);
+            --size;
+          }
+        }
+        ++hand;
+      }
+      return true_size;
+    }
+
+    // Returns true if id was in the shard. Caller must hold mu.
+    bool Erase(K id, uint64 hash) {
+      size_t pos = hash & index_mask;
+      while (index[pos] != kEmptyBucket) {
+        int64 slot = index[pos];
+        if (slot != kDeletedBucket && slots[slot].id == id) {
+          index[pos] = kDeletedBucket;
+          slots[slot].valid = false;
+          free_slots.push_back(slot);
+          --size;
+          return true;
+        }
+        pos = (pos + 1) & index_mask;
+      }
+      return false;
+    }
+
+    mutex mu;
+    size_t size;
+
+   private:
+    void EraseIndex(K id, uint64 hash) {
+      size_t pos = hash & index_mask;
+      while (index[pos] != kEmptyBucket) {
+        int64 slot = index[pos];
+        if (slot != kDeletedBucket && slots[slot].id == id) {
+          index[pos] = kDeletedBucket;
+          return;
+        }
+        pos = (pos + 1) & index_mask;
+      }
+    }
+
+    void Rehash() {
+      size_t bucket_num = index.size();
+      while (size * 4 > bucket_num) {
+        bucket_num <<= 1;
+      }
+      index.assign(bucket_num, kEmptyBucket);
+      index_mask = bucket_num - 1;
+      used_buckets = 0;
+      for (size_t slot = 0; slot < slots.size(); ++slot) {
+        if (!slots[slot].valid) continue;
+        size_t pos = Hash(slots[slot].id) & index_mask;
+        while (index[pos] != kEmptyBucket) {
+          pos = (pos + 1) & index_mask;
+        }
+        index[pos] = slot;
+        ++used_buckets;
+      }
+    }
+
+    std::vector<ClockEntry> slots;
+    std::vector<int64> free_slots;
+    std::vector<int64> index;
+    size_t index_mask;
+    size_t used_buckets;
+    size_t hand;
+  };
+
+ public:
+  explicit ShardedClockCache(size_t num_shards = kDefaultShardNum)
+      : num_shards_(1), total_size_(0), evict_shard_(0) {
+    while (num_shards_ < num_shards) {
+      num_shards_ <<= 1;
+    }
+    shards_.reset(new Shard[num_shards_]);
+  }
+
+  size_t size() {
+    return total_size_.load(std::memory_order_relaxed);
+  }
+
+  size_t get_evic_ids(K* evic_ids, size_t k_size) {
+    size_t true_size = 0;
+    size_t start = evict_shard_.fetch_add(1, std::memory_order_relaxed);
+    while (true_size < k_size) {
+      size_t last_size = true_size;
+      // Spread the victims over all shards so that no single shard is drained.
+      size_t quota = std::max<size_t>(1, (k_size - true_size) / num_shards_);
+      for (size_t i = 0; i < num_shards_ && true_size < k_size; ++i) {
+        Shard& shard = shards_[(start + i) & (num_shards_ - 1)];
+        mutex_lock l(shard.mu);
+        size_t evicted = shard.Evict(evic_ids + true_size,
+                                     std::min(quota, k_size - true_size));
+        true_size += evicted;
+        total_size_.fetch_sub(evicted, std::memory_order_relaxed);
+      }
+      if (true_size == last_size) {
+        break;
+      }
+    }
+    return true_size;
+  }
+
+  void add_to_rank(const K* batch_ids, size_t batch_size) {
+    std::vector<uint64> hashes(batch_size);
+    std::vector<size_t> offsets(num_shards_ + 1, 0);
+    for (size_t i = 0; i < batch_size; ++i) {
+      hashes[i] = Hash(batch_ids[i]);
+      ++offsets[ShardIndex(hashes[i]) + 1];
+    }
+    for (size_t s = 0; s < num_shards_; ++s) {
+      offsets[s + 1] += offsets[s];
+    }
+    // Bucket the batch by shard so that each shard lock is taken only once.
+    std::vector<size_t> order(batch_size);
+    std::vector<size_t> cursor(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < batch_size; ++i) {
+      order[cursor[ShardIndex(hashes[i])]++] = i;
+    }
+    for (size_t s = 0; s < num_shards_; ++s) {
+      if (offsets[s] == offsets[s + 1]) continue;
+      Shard& shard = shards_[s];
+      size_t inserted = 0;
+      {
+        mutex_lock l(shard.mu);
+        for (size_t j = offsets[s]; j < offsets[s + 1]; ++j) {
+          size_t i = order[j];
+          if (shard.Touch(batch_ids[i], hashes[i])) {
+            ++inserted;
+          }
+        }
+      }
+      total_size_.fetch_add(inserted, std::memory_order_relaxed);
+    }
+  }
+
+  void remove_ids(const K* batch_ids, size_t batch_size) {
+    for (size_t i = 0; i < batch_size; ++i) {
+      uint64 hash = Hash(batch_ids[i]);
+      Shard& shard = shards_[ShardIndex(hash)];
+      bool erased = false;
+      {
+        mutex_lock l(shard.mu);
+        erased = shard.Erase(batch_ids[i], hash);
+      }
+      if (erased) {
+        total_size_.fetch_sub(1, std::memory_order_relaxed);
+      }
+    }
+  }
+
+ private:
+  static uint64 Hash(K id) {
+    uint64 h = static_cast<uint64>(id);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+  }
+
+  // Use the high bits for shard selection, the low bits index the shard.
+  size_t ShardIndex(uint64 hash) const {
+    return (hash >> 40) & (num_shards_ - 1);
+  }
+
+  static const size_t kDefaultShardNum = 64;
+  static const size_t kInitBucketNum = 1024;
+  static const int64 kEmptyBucket = -1;
+  static const int64 kDeletedBucket = -2;
+
+  size_t num_shards_;
+  std::unique_ptr<Shard[]> shards_;
+  std::atomic<size_t> total_size_;
+  std::atomic<size_t> evict_shard_;
 };
 
+template <class K>
+const size_t ShardedClockCache<K>::kDefaultShardNum;
+template <class K>
+const size_t ShardedClockCache<K>::kInitBucketNum;
+template <class K>
+const int64 ShardedClockCache<K>::kEmptyBucket;
+template <class K>
+const int64 ShardedClockCache<K>::kDeletedBucket;
+
 } // embedding
 } // tensorflow
 
@@ -1,8 +1,12 @@
 #ifndef TENSORFLOW_CORE_FRAMEWORK_EMBEDDING_EMBEDDING_FILTER_H_
 #define TENSORFLOW_CORE_FRAMEWORK_EMBEDDING_EMBEDDING_FILTER_H_
 
+#include <limits>
+
 //#include "tensorflow/core/framework/embedding/embedding_var.h"
 #include "tensorflow/core/framework/embedding/embedding_config.h"
+#include "tensorflow/core/platform/mem.h"
+#include "tensorflow/core/util/env_var.h"
 
 namespace tensorflow {
 namespace embedding{
@@ -30,6 +34,8 @@ struct RestoreBuffer;
 template<typename K, typename V, typename EV>
 class EmbeddingFilter {
  public:
+  virtual ~EmbeddingFilter() {}
+
   virtual void LookupOrCreate(K key, V* val, const V* default_value_ptr,
                                ValuePtr<V>** value_ptr, int count) = 0;
   virtual Status LookupOrCreateKey(K key, ValuePtr<V>** val, bool* is_filter,
@@ -165,10 +171,19 @@ class BloomFilter : public EmbeddingFilter<K, V, EV> {
     return min_freq;
   }
 
+  // Raises the counters to `freq`. Shards are imported in parallel and the
+  // counters are shared with other keys, so none is lowered.
   template<typename VBloom>
   void SetMinFreq(std::vector<int64> hash_val, int64 freq) {
+    const VBloom target = (VBloom)std::min((uint64)std::max(freq, (int64)0),
+        (uint64)std::numeric_limits<VBloom>::max());
     for (auto it : hash_val) {
-      *((VBloom*)bloom_counter_ + it) = freq;
+      VBloom* counter = (VBloom*)bloom_counter_ + it;
+      VBloom old_freq = __atomic_load_n(counter, __ATOMIC_RELAXED);
+      while (old_freq < target &&
+             !__atomic_compare_exchange_n(counter, &old_freq, target, true,
+                 __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      }
     }
   }
 
@@ -230,7 +245,11 @@ class BloomFilter : public EmbeddingFilter<K, V, EV> {
           value_ptr->SetStep(version_buff[i]);
         }
         if (!is_filter){
-          V* v = ev_->LookupOrCreateEmb(value_ptr, value_buff + i * ev_->ValueLen());
+          if (restore_buff.upsert) {
+            ev_->UpsertEmb(key_buff[i], &value_ptr, value_buff + i * ev_->ValueLen());
+          } else {
+            ev_->LookupOrCreateEmb(value_ptr, value_buff + i * ev_->ValueLen());
+          }
         } else {
           V* v = ev_->LookupOrCreateEmb(value_ptr, ev_->GetDefaultValue(key_buff[i]));
         }
@@ -340,6 +359,253 @@ class BloomFilter : public EmbeddingFilter<K, V, EV> {
   embedding::StorageManager<K, V>* storage_manager_;
 };
 
+// Counting Bloom filter that keeps all the counters of a key in one 64 byte
+// block: a key is hashed once and its lookups and updates touch a single
+// cache line. Within the block the counters are picked by double hashing,
+// the frequency of a key is the smallest of them.
+template<typename K, typename V, typename EV>
+class BlockedBloomFilter : public EmbeddingFilter<K, V, EV> {
+ public:
+  BlockedBloomFilter(const EmbeddingConfig& config, EV* ev,
+                     embedding::StorageManager<K, V>* storage_manager)
+      : config_(config), ev_(ev), storage_manager_(storage_manager) {
+    switch (config_.counter_type) {
+      case DT_UINT32:
+        lane_num_ = kBlockBytes / sizeof(uint32);
+        break;
+      case DT_UINT16:
+        lane_num_ = kBlockBytes / sizeof(uint16);
+        break;
+      case DT_UINT8:
+        lane_num_ = kBlockBytes / sizeof(uint8);
+        break;
+      default:
+        lane_num_ = kBlockBytes / sizeof(uint64);
+    }
+    lane_bits_ = __builtin_ctzll(lane_num_);
+    hash_num_ = std::min(std::max(config_.kHashFunc, (int64)1), lane_num_);
+    block_num_ = std::max((config_.num_counter + lane_num_ - 1) / lane_num_,
+                          (int64)1);
+    blocks_ = port::AlignedMalloc(block_num_ * kBlockBytes, kBlockBytes);
+    memset(blocks_, 0, block_num_ * kBlockBytes);
+    VLOG(2) << "Blocked bloom filter, blocks: " << block_num_
+            << ", counters per key: " << hash_num_ << "/" << lane_num_;
+  }
+
+  ~BlockedBloomFilter() override {
+    port::AlignedFree(blocks_);
+  }
+
+  void LookupOrCreate(K key, V* val, const V* default_value_ptr,
+                       ValuePtr<V>** value_ptr, int count) override {
+    if (GetBloomFreq(key) >= config_.filter_freq) {
+      TF_CHECK_OK(ev_->LookupOrCreateKey(key, value_ptr));
+      V* mem_val = ev_->LookupOrCreateEmb(*value_ptr, default_value_ptr);
+      memcpy(val, mem_val, sizeof(V) * ev_->ValueLen());
+    } else {
+      AddFreq(key, count);
+      memcpy(val, default_value_ptr, sizeof(V) * ev_->ValueLen());
+    }
+  }
+
+  Status LookupOrCreateKey(K key, ValuePtr<V>** val, bool* is_filter,
+        int update_version = -1) override {
+    if (GetBloomFreq(key) >= config_.filter_freq) {
+      *is_filter = true;
+      return ev_->LookupOrCreateKey(key, val, update_version);
+    }
+    *is_filter = false;
+    return Status::OK();
+  }
+
+  int64 GetFreq(K key, ValuePtr<V>*) override {
+    return GetBloomFreq(key);
+  }
+
+  int64 GetFreq(K key) override {
+    return GetBloomFreq(key);
+  }
+
+  Status Import(RestoreBuffer& restore_buff,
+                int64 key_num,
+                int bucket_num,
+                int64 partition_id,
+                int64 partition_num,
+                bool is_filter) override {
+    K* key_buff = (K*)restore_buff.key_buffer;
+    V* value_buff = (V*)restore_buff.value_buffer;
+    int64* version_buff = (int64*)restore_buff.version_buffer;
+    int64* freq_buff = (int64*)restore_buff.freq_buffer;
+    for (auto i = 0; i < key_num; ++i) {
+      if (*(key_buff + i) % bucket_num % partition_num != partition_id) {
+        LOG(INFO) << "skip EV key:" << *(key_buff + i);
+        continue;
+      }
+      ValuePtr<V>* value_ptr = nullptr;
+      int64 new_freq = freq_buff[i];
+      if (!is_filter && freq_buff[i] < config_.filter_freq) {
+        new_freq = config_.filter_freq;
+      }
+      SetBloomFreq(key_buff[i], new_freq);
+      if (new_freq >= config_.filter_freq){
+        TF_CHECK_OK(ev_->LookupOrCreateKey(key_buff[i], &value_ptr));
+        if (config_.is_primary() && config_.steps_to_live != 0) {
+          value_ptr->SetStep(version_buff[i]);
+        }
+        if (!is_filter){
+          if (restore_buff.upsert) {
+            ev_->UpsertEmb(key_buff[i], &value_ptr, value_buff + i * ev_->ValueLen());
+          } else {
+            ev_->LookupOrCreateEmb(value_ptr, value_buff + i * ev_->ValueLen());
+          }
+        } else {
+          ev_->LookupOrCreateEmb(value_ptr, ev_->GetDefaultValue(key_buff[i]));
+        }
+        TF_CHECK_OK(ev_->storage_manager()->Commit(key_buff[i], value_ptr));
+      }
+    }
+    UpdateCache(key_buff, key_num, ev_);
+    return Status::OK();
+  }
+
+ private:
+  int64 GetBloomFreq(K key) {
+    switch (config_.counter_type) {
+      case DT_UINT32:
+        return GetMinFreq<uint32>(key);
+      case DT_UINT16:
+        return GetMinFreq<uint16>(key);
+      case DT_UINT8:
+        return GetMinFreq<uint8>(key);
+      default:
+        return GetMinFreq<uint64>(key);
+    }
+  }
+
+  void AddFreq(K key, int64 count) {
+    switch (config_.counter_type) {
+      case DT_UINT32:
+        AddMinFreq<uint32>(key, count);
+        break;
+      case DT_UINT16:
+        AddMinFreq<uint16>(key, count);
+        break;
+      case DT_UINT8:
+        AddMinFreq<uint8>(key, count);
+        break;
+      default:
+        AddMinFreq<uint64>(key, count);
+    }
+  }
+
+  void SetBloomFreq(K key, int64 freq) {
+    switch (config_.counter_type) {
+      case DT_UINT32:
+        SetMinFreq<uint32>(key, freq);
+        break;
+      case DT_UINT16:
+        SetMinFreq<uint16>(key, freq);
+        break;
+      case DT_UINT8:
+        SetMinFreq<uint8>(key, freq);
+        break;
+      default:
+        SetMinFreq<uint64>(key, freq);
+    }
+  }
+
+  // Returns the block of the key and sets the bits of its counters in
+  // `lanes`, each lane is the top bits of a multiplicative rehash of the
+  // key's hash.
+  template<typename VBloom>
+  VBloom* Locate(K key, uint64* lanes) {
+    uint64 h = (uint64)key ^ kSeed;
+    h = mix(h);
+    VBloom* block = (VBloom*)((char*)blocks_ + (h % block_num_) * kBlockBytes);
+    *lanes = 0;
+    for (int64 i = 0; i < hash_num_; ++i) {
+      h = h * 0x9e3779b97f4a7c15ULL + 2 * i + 1;
+      *lanes |= 1ULL << (h >> (64 - lane_bits_));
+    }
+    return block;
+  }
+
+  // Branch free over all lanes of the block, the loop is vectorized.
+  template<typename VBloom>
+  static VBloom MaskedMin(const VBloom* block, uint64 lanes) {
+    const int kLaneNum = kBlockBytes / sizeof(VBloom);
+    VBloom min_freq = std::numeric_limits<VBloom>::max();
+    for (int i = 0; i < kLaneNum; ++i) {
+      VBloom c = ((lanes >> i) & 1) ? block[i] :
+          std::numeric_limits<VBloom>::max();
+      min_freq = std::min(min_freq, c);
+    }
+    return min_freq;
+  }
+
+  template<typename VBloom>
+  int64 GetMinFreq(K key) {
+    uint64 lanes;
+    const VBloom* block = Locate<VBloom>(key, &lanes);
+    return MaskedMin(block, lanes);
+  }
+
+  // Saturating increments of the key's counters, each one retried until it
+  // is applied or the counter reached filter_freq.
+  template<typename VBloom>
+  void AddMinFreq(K key, int64 count) {
+    uint64 lanes;
+    VBloom* block = Locate<VBloom>(key, &lanes);
+    const uint64 cap = std::min((uint64)config_.filter_freq,
+        (uint64)std::numeric_limits<VBloom>::max());
+    if (MaskedMin(block, lanes) >= cap) {
+      return;
+    }
+    while (lanes != 0) {
+      VBloom* counter = block + __builtin_ctzll(lanes);
+      lanes &= lanes - 1;
+      VBloom old_freq = __atomic_load_n(counter, __ATOMIC_RELAXED);
+      while (old_freq < cap) {
+        VBloom new_freq = (VBloom)std::min(cap, (uint64)old_freq + count);
+        if (__atomic_compare_exchange_n(counter, &old_freq, new_freq, true,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+          break;
+        }
+      }
+    }
+  }
+
+  // Raises the key's counters to `freq`, the counters are shared with other
+  // keys so none is lowered.
+  template<typename VBloom>
+  void SetMinFreq(K key, int64 freq) {
+    uint64 lanes;
+    VBloom* block = Locate<VBloom>(key, &lanes);
+    const VBloom target = (VBloom)std::min((uint64)std::max(freq, (int64)0),
+        (uint64)std::numeric_limits<VBloom>::max());
+    while (lanes != 0) {
+      VBloom* counter = block + __builtin_ctzll(lanes);
+      lanes &= lanes - 1;
+      VBloom old_freq = __atomic_load_n(counter, __ATOMIC_RELAXED);
+      while (old_freq < target &&
+             !__atomic_compare_exchange_n(counter, &old_freq, target, true,
+                 __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      }
+    }
+  }
+
+  static const int64 kBlockBytes = 64;
+  static const uint64 kSeed = 0x880355f21e6d1965ULL;
+  void* blocks_;
+  int64 block_num_;
+  int64 lane_num_;
+  int lane_bits_;
+  int64 hash_num_;
+  EmbeddingConfig config_;
+  EV* ev_;
+  embedding::StorageManager<K, V>* storage_manager_;
+};
+
 template<typename K, typename V, typename EV>
 class CounterFilter : public EmbeddingFilter<K, V, EV> {
  public:
@@ -410,7 +676,11 @@ class CounterFilter : public EmbeddingFilter<K, V, EV> {
       }
       if (value_ptr->GetFreq() >= config_.filter_freq){
         if(!is_filter){
-           V* v = ev_->LookupOrCreateEmb(value_ptr, value_buff + i * ev_->ValueLen());
+           if (restore_buff.upsert) {
+             ev_->UpsertEmb(key_buff[i], &value_ptr, value_buff + i * ev_->ValueLen());
+           } else {
+             ev_->LookupOrCreateEmb(value_ptr, value_buff + i * ev_->ValueLen());
+           }
         } else {
            V* v = ev_->LookupOrCreateEmb(value_ptr, ev_->GetDefaultValue(key_buff[i]));
         }
@@ -491,7 +761,11 @@ class NullableFilter : public EmbeddingFilter<K, V, EV> {
         value_ptr->SetStep(version_buff[i]);
       }
       if (!is_filter) {
-        V* v = ev_->LookupOrCreateEmb(value_ptr, value_buff + i * ev_->ValueLen());
+        if (restore_buff.upsert) {
+          ev_->UpsertEmb(key_buff[i], &value_ptr, value_buff + i * ev_->ValueLen());
+        } else {
+          ev_->LookupOrCreateEmb(value_ptr, value_buff + i * ev_->ValueLen());
+        }
         TF_CHECK_OK(ev_->storage_manager()->Commit(key_buff[i], value_ptr));
       }else {
         V* v = ev_->LookupOrCreateEmb(value_ptr, ev_->GetDefaultValue(key_buff[i]));
@@ -515,6 +789,14 @@ class FilterFactory {
       EV* ev, embedding::StorageManager<K, V>* storage_manager) {
     if (config.filter_freq > 0) {
       if (config.kHashFunc != 0) {
+        // TF_EV_BLOCKED_BLOOM_FILTER=1 keeps the counters of a key in one
+        // cache line, see BlockedBloomFilter.
+        bool blocked = false;
+        TF_CHECK_OK(ReadBoolFromEnvVar("TF_EV_BLOCKED_BLOOM_FILTER", false,
+                                       &blocked));
+        if (blocked) {
+          return new BlockedBloomFilter<K, V, EV>(config, ev, storage_manager);
+        }
         return new BloomFilter<K, V, EV>(config, ev, storage_manager);
       } else {
         return new CounterFilter<K, V, EV>(config, ev, storage_manager);
@@ -17,14 +17,18 @@ limitations under the License.
 #ifndef TENSORFLOW_CORE_FRAMEWORK_EMBEDDING_EMBEDDING_VAR_H_
 #define TENSORFLOW_CORE_FRAMEWORK_EMBEDDING_EMBEDDING_VAR_H_
 
+#include <atomic>
+
 #include "tensorflow/core/framework/allocator.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/register_types.h"
 #include "tensorflow/core/framework/resource_mgr.h"
 #include "tensorflow/core/lib/core/errors.h"
 #include "tensorflow/core/lib/io/path.h"
+#include "tensorflow/core/lib/strings/strcat.h"
 #include "tensorflow/core/platform/macros.h"
 #include "tensorflow/core/platform/mutex.h"
+#include "tensorflow/core/platform/prefetch.h"
 #include "tensorflow/core/platform/types.h"
 
 #include "tensorflow/core/framework/embedding/cache.h"
@@ -36,11 +40,34 @@ limitations under the License.
 
 namespace tensorflow {
 
+namespace embedding {
+struct RestoreMetrics {
+  RestoreMetrics() : restored_num(0), read_micros(0), import_micros(0),
+      total_micros(0) {}
+  // Keys imported so far, updated as every chunk of the checkpoint lands.
+  int64 restored_num;
+  // Time spent reading chunks from the bundle and importing their rows. The
+  // two overlap when the restore runs on a thread pool.
+  int64 read_micros;
+  int64 import_micros;
+  int64 total_micros;
+
+  std::string DebugString() const {
+    return strings::StrCat("restored_num: ", restored_num,
+                           " read_micros: ", read_micros,
+                           " import_micros: ", import_micros,
+                           " total_micros: ", total_micros);
+  }
+};
+}  // namespace embedding
+
 struct RestoreBuffer {
   char* key_buffer;
   char* value_buffer;
   char* version_buffer;
   char* freq_buffer;
+  // Overwrite the rows of existing keys instead of keeping them.
+  bool upsert = false;
 
   ~RestoreBuffer() {
     delete key_buffer;
@@ -120,6 +147,44 @@ class EmbeddingVar : public ResourceBase {
     return s;
   }
 
+  // Resolves the ValuePtr of an existing key, NotFound once it was removed.
+  Status LookupKey(K key, ValuePtr<V>** value_ptr) {
+    return storage_manager_->Get(key, value_ptr,
+        emb_config_.total_num(storage_manager_->GetAllocLen()));
+  }
+
+  // Batched LookupOrCreateKey, is_filter[i] reports the filter result of
+  // keys[i] as LookupOrCreateKey does.
+  Status BatchLookupOrCreateKey(const K* keys, int64 num,
+                                ValuePtr<V>** value_ptrs, bool* is_filter,
+                                int64 update_version = -1) {
+    if (emb_config_.filter_freq != 0) {
+      for (int64 i = 0; i < num; ++i) {
+        value_ptrs[i] = nullptr;
+        TF_RETURN_IF_ERROR(filter_->LookupOrCreateKey(
+            keys[i], &value_ptrs[i], &is_filter[i], update_version));
+      }
+      return Status::OK();
+    }
+    TF_RETURN_IF_ERROR(storage_manager_->BatchGetOrCreate(keys, num, value_ptrs,
+        emb_config_.total_num(storage_manager_->GetAllocLen())));
+    bool set_step = emb_config_.is_primary() &&
+        emb_config_.steps_to_live != 0 && update_version != -1;
+    for (int64 i = 0; i < num; ++i) {
+      is_filter[i] = true;
+      if (set_step) {
+        value_ptrs[i]->SetStep(update_version);
+      }
+    }
+    return Status::OK();
+  }
+
+  // ValuePtrs returned by the LookupOrCreateKey family stay valid while a
+  // guard of it is held.
+  embedding::EpochManager* epoch_manager() {
+    return storage_manager_->epoch_manager();
+  }
+
   void BatchCommit(std::vector<K> keys, std::vector<ValuePtr<V>*> value_ptrs) {
     TF_CHECK_OK(storage_manager_->BatchCommit(keys, value_ptrs));
   }
@@ -134,18 +199,99 @@ class EmbeddingVar : public ResourceBase {
     return filter_->GetFreq(key);
   }
 
-  void LookupOrCreate(K key, V* val, V* default_v, int count = 1)  {
+  void LookupOrCreate(K key, V* val, const V* default_v, int count = 1)  {
     const V* default_value_ptr = (default_v == nullptr) ? default_value_ : default_v;
     ValuePtr<V>* value_ptr = nullptr;
+    embedding::EpochGuard guard(epoch_manager());
     filter_->LookupOrCreate(key, val, default_value_ptr, &value_ptr, count);
     add_freq_fn_(value_ptr, count, emb_config_.filter_freq);
   }
 
+  // Batched LookupOrCreate, default_values[i] is the default value of keys[i]
+  // and counts may be nullptr.
+  void BatchLookupOrCreate(const K* keys, V* output,
+                           const V* const* default_values,
+                           const int32* counts, int64 num) {
+    embedding::EpochGuard guard(epoch_manager());
+    if (emb_config_.filter_freq != 0) {
+      for (int64 i = 0; i < num; ++i) {
+        LookupOrCreate(keys[i], output + i * value_len_, default_values[i],
+                       counts == nullptr ? 1 : counts[i]);
+      }
+      return;
+    }
+    std::vector<ValuePtr<V>*> value_ptrs(num);
+    TF_CHECK_OK(storage_manager_->BatchGetOrCreate(keys, num, value_ptrs.data(),
+        emb_config_.total_num(storage_manager_->GetAllocLen())));
+    for (int64 i = 0; i < num; ++i) {
+      if (i + kPrefetchDistance < num) {
+        port::prefetch<port::PREFETCH_HINT_T0>(
+            value_ptrs[i + kPrefetchDistance]->GetPtr());
+      }
+      const V* default_v = (default_values[i] == nullptr) ?
+          default_value_ : default_values[i];
+      V* mem_val = LookupOrCreateEmb(value_ptrs[i], default_v);
+      memcpy(output + i * value_len_, mem_val, sizeof(V) * value_len_);
+      add_freq_fn_(value_ptrs[i], counts == nullptr ? 1 : counts[i],
+                   emb_config_.filter_freq);
+    }
+  }
+
+  // BatchLookupOrCreate handing each embedding to `fn(i, emb)` in place
+  // instead of copying it to an output, so that callers reducing the
+  // embeddings do not materialize them. `emb` is only valid inside `fn`.
+  template <typename Fn>
+  void BatchLookupOrCreate(const K* keys, const V* const* default_values,
+                           const int32* counts, int64 num, Fn fn) {
+    embedding::EpochGuard guard(epoch_manager());
+    if (emb_config_.filter_freq != 0) {
+      std::vector<V> val(value_len_);
+      for (int64 i = 0; i < num; ++i) {
+        LookupOrCreate(keys[i], val.data(), default_values[i],
+                       counts == nullptr ? 1 : counts[i]);
+        fn(i, val.data());
+      }
+      return;
+    }
+    std::vector<ValuePtr<V>*> value_ptrs(num);
+    TF_CHECK_OK(storage_manager_->BatchGetOrCreate(keys, num, value_ptrs.data(),
+        emb_config_.total_num(storage_manager_->GetAllocLen())));
+    for (int64 i = 0; i < num; ++i) {
+      if (i + kPrefetchDistance < num) {
+        port::prefetch<port::PREFETCH_HINT_T0>(
+            value_ptrs[i + kPrefetchDistance]->GetPtr());
+      }
+      const V* default_v = (default_values[i] == nullptr) ?
+          default_value_ : default_values[i];
+      fn(i, LookupOrCreateEmb(value_ptrs[i], default_v));
+      add_freq_fn_(value_ptrs[i], counts == nullptr ? 1 : counts[i],
+                   emb_config_.filter_freq);
+    }
+  }
+
   V* LookupOrCreateEmb(ValuePtr<V>* value_ptr, const V* default_v) {
     return value_ptr->GetOrAllocate(alloc_, value_len_, default_v,
         emb_config_.emb_index, storage_manager_->GetOffset(emb_config_.emb_index));
   }
 
+  // Sets the emb of key to `v`, also for keys that already have one, so an
+  // incremental restore into a live EV upserts the rows of existing keys.
+  // Lookups racing with it see either the old or the new row, see
+  // StorageManager::UpsertValue. *value_ptr may be replaced by a copy, the
+  // caller must commit the returned one.
+  V* UpsertEmb(K key, ValuePtr<V>** value_ptr, const V* v) {
+    if ((*value_ptr)->GetValue(emb_config_.emb_index,
+            storage_manager_->GetOffset(emb_config_.emb_index)) == nullptr) {
+      V* val = LookupOrCreateEmb(*value_ptr, v);
+      // Unless a lookup allocated the row with the default value first.
+      if (memcmp(val, v, sizeof(V) * value_len_) == 0) {
+        return val;
+      }
+    }
+    return storage_manager_->UpsertValue(key, value_ptr, alloc_, value_len_,
+                                         v, emb_config_.emb_index);
+  }
+
   V* LookupPrimaryEmb(ValuePtr<V>* value_ptr) {
     V* primary_val = value_ptr->GetValue(emb_config_.primary_emb_index,
                                  storage_manager_->GetOffset(emb_config_.primary_emb_index));
@@ -256,11 +402,45 @@ class EmbeddingVar : public ResourceBase {
     return storage_manager_->Cache();
   }
 
+  void Prefetch(const K* keys, int64 num) {
+    storage_manager_->Prefetch(keys, num);
+  }
+
+  embedding::PrefetchMetrics GetPrefetchMetrics() {
+    return storage_manager_->GetPrefetchMetrics();
+  }
+
   int64 GetEmbeddingIndex() {
     return emb_config_.emb_index;
   }
 
+  void RecordRestoreRead(int64 micros) {
+    restore_read_micros_.fetch_add(micros, std::memory_order_relaxed);
+  }
+
+  void RecordRestoreImport(int64 key_num, int64 micros) {
+    restored_num_.fetch_add(key_num, std::memory_order_relaxed);
+    restore_import_micros_.fetch_add(micros, std::memory_order_relaxed);
+  }
+
+  void RecordRestoreTotal(int64 micros) {
+    restore_total_micros_.fetch_add(micros, std::memory_order_relaxed);
+  }
+
+  embedding::RestoreMetrics GetRestoreMetrics() {
+    embedding::RestoreMetrics metrics;
+    metrics.restored_num = restored_num_.load(std::memory_order_relaxed);
+    metrics.read_micros = restore_read_micros_.load(std::memory_order_relaxed);
+    metrics.import_micros =
+        restore_import_micros_.load(std::memory_order_relaxed);
+    metrics.total_micros = restore_total_micros_.load(std::memory_order_relaxed);
+    return metrics;
+  }
+
  private:
+  // Number of keys the batched lookups run ahead when prefetching values.
+  static const int64 kPrefetchDistance = 8;
+
   std::string name_;
   bool is_initialized_ = false;
 
@@ -273,6 +453,10 @@ class EmbeddingVar : public ResourceBase {
   EmbeddingConfig emb_config_;
   EmbeddingFilter<K, V, EmbeddingVar<K, V>>* filter_;
   std::function<void(ValuePtr<V>*, int, int64)> add_freq_fn_;
+  std::atomic<int64> restored_num_{0};
+  std::atomic<int64> restore_read_micros_{0};
+  std::atomic<int64> restore_import_micros_{0};
+  std::atomic<int64> restore_total_micros_{0};
 
   ~EmbeddingVar() override {
     // When dynamic dimension embedding is used, there will be more than one primary slot
@@ -0,0 +1,116 @@
+#ifndef TENSORFLOW_CORE_FRAMEWORK_EMBEDDING_EPOCH_MANAGER_H_
+#define TENSORFLOW_CORE_FRAMEWORK_EMBEDDING_EPOCH_MANAGER_H_
+
+#include <atomic>
+#include <functional>
+#include <thread>
+
+#include "tensorflow/core/platform/types.h"
+
+namespace tensorflow {
+namespace embedding {
+
+// Epoch based reclamation for objects that lock-free readers may still hold
+// after they were removed from a hash table.
+//
+// Readers bracket every use of such pointers with an EpochGuard. An object
+// retired in epoch e can be reused once the global epoch reached e + 2: the
+// epoch only moves forward when no reader is left in the previous epoch, so
+// every reader that could have seen the object has exited by then.
+//
+// Readers are counted per epoch in cache line sized stripes picked by thread
+// id, entering and exiting touch the thread's own stripe only.
+class EpochManager {
+ public:
+  EpochManager() : epoch_(0) {
+    for (int i = 0; i < kStripeNum; ++i) {
+      for (int j = 0; j < kEpochNum; ++j) {
+        stripes_[i].reader_num[j] = 0;
+      }
+    }
+  }
+
+  // Returns the stripe the reader is counted in, pass it to Exit.
+  int Enter(uint64* epoch) {
+    int stripe = StripeIndex();
+    auto& reader_num = stripes_[stripe].reader_num;
+    while (true) {
+      uint64 e = epoch_.load();
+      reader_num[e % kEpochNum].fetch_add(1);
+      // The epoch may have moved on before the reader was counted.
+      if (epoch_.load() == e) {
+        *epoch = e;
+        return stripe;
+      }
+      reader_num[e % kEpochNum].fetch_sub(1);
+    }
+  }
+
+  void Exit(int stripe, uint64 epoch) {
+    stripes_[stripe].reader_num[epoch % kEpochNum].fetch_sub(
+        1, std::memory_order_release);
+  }
+
+  uint64 CurrentEpoch() const {
+    return epoch_.load();
+  }
+
+  // Moves the global epoch forward when every reader has entered the current
+  // one, returns the epoch after the attempt.
+  uint64 TryAdvance() {
+    uint64 e = epoch_.load();
+    for (int i = 0; i < kStripeNum; ++i) {
+      if (stripes_[i].reader_num[(e + kEpochNum - 1) % kEpochNum].load() != 0) {
+        return e;
+      }
+    }
+    epoch_.compare_exchange_strong(e, e + 1);
+    return epoch_.load();
+  }
+
+  // Whether an object retired in `retire_epoch` is no longer reachable by
+  // any reader at `epoch`.
+  static bool IsSafe(uint64 retire_epoch, uint64 epoch) {
+    return epoch >= retire_epoch + 2;
+  }
+
+ private:
+  static int StripeIndex() {
+    static thread_local int index =
+        std::hash<std::thread::id>()(std::this_thread::get_id()) % kStripeNum;
+    return index;
+  }
+
+  static const int kStripeNum = 64;
+  static const int kEpochNum = 3;
+
+  struct alignas(64) Stripe {
+    std::atomic<int64> reader_num[kEpochNum];
+  };
+
+  std::atomic<uint64> epoch_;
+  Stripe stripes_[kStripeNum];
+};
+
+// Keeps the ValuePtrs looked up in its scope from being reused.
+class EpochGuard {
+ public:
+  explicit EpochGuard(EpochManager* epoch_manager)
+      : epoch_manager_(epoch_manager) {
+    stripe_ = epoch_manager_->Enter(&epoch_);
+  }
+
+  ~EpochGuard() {
+    epoch_manager_->Exit(stripe_, epoch_);
+  }
+
+ private:
+  EpochManager* epoch_manager_;
+  int stripe_;
+  uint64 epoch_;
+};
+
+}  // namespace embedding
+}  // namespace tensorflow
+
+#endif  // TENSORFLOW_CORE_FRAMEWORK_EMBEDDING_EPOCH_MANAGER_H_
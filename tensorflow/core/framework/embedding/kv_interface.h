@@ -17,6 +17,7 @@ limitations under the License.
 #define TENSORFLOW_CORE_FRAMEWORK_EMBEDDING_KV_INTERFACE_H_
 
 #include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/lib/gtl/array_slice.h"
 
 namespace tensorflow {
 
@@ -46,15 +47,24 @@ class KVInterface {
   // KV Remove
   virtual Status Remove(K key) = 0;
 
-  // KV Batch Lookup
-  virtual Status BatchLookup(std::vector<K> keys, std::vector<ValuePtr<V>**> value_ptrs) {
-    return Status(error::Code::UNIMPLEMENTED,
-                      "Unimplemented for BatchLookup in KVInterface.");
+  // KV Batch Lookup, value_ptrs[i] is set to nullptr if keys[i] is absent
+  virtual Status BatchLookup(gtl::ArraySlice<K> keys,
+                             gtl::MutableArraySlice<ValuePtr<V>*> value_ptrs) {
+    for (size_t i = 0; i < keys.size(); ++i) {
+      if (!Lookup(keys[i], &value_ptrs[i]).ok()) {
+        value_ptrs[i] = nullptr;
+      }
+    }
+    return Status::OK();
   }
-  // KV Batch Insert
-  virtual Status BatchInsert(std::vector<K> keys, std::vector<const ValuePtr<V>*> value_ptrs) {
-    return Status(error::Code::UNIMPLEMENTED,
-                      "Unimplemented for BatchInsert in KVInterface.");
+  // KV Batch Insert, returns the first failure
+  virtual Status BatchInsert(gtl::ArraySlice<K> keys,
+                             gtl::ArraySlice<const ValuePtr<V>*> value_ptrs) {
+    Status status;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      status.Update(Insert(keys[i], value_ptrs[i]));
+    }
+    return status;
   }
   // KV Batch Remove
   virtual Status BatchRemove(std::vector<K> keys) {
@@ -62,6 +72,15 @@ class KVInterface {
                       "Unimplemented for BatchRemove in KVInterface.");
   }
 
+  // KV Replace, swaps the ValuePtr of key from old_value_ptr to value_ptr,
+  // fails if key holds another ValuePtr
+  virtual Status Replace(K key, const ValuePtr<V>* old_value_ptr,
+                         const ValuePtr<V>* value_ptr) {
+    return Status(error::Code::UNIMPLEMENTED,
+                      "Unimplemented for Replace in KVInterface.");
+  }
+
+  // KV Batch Commit, value_ptrs stay owned by the caller
   virtual Status BatchCommit(std::vector<K> keys, std::vector<ValuePtr<V>*> value_ptrs) {return Status::OK();}
 
   // KV Size
@@ -94,7 +94,7 @@ class LevelDBKV : public KVInterface<K, V> {
     leveldb::Status s = leveldb::DB::Open(options_, path_, &db_);
     CHECK(s.ok());
     counter_ =  new SizeCounter<K>(8);
-    new_value_ptr_fn_ = [] (size_t size) { return new NormalContiguousValuePtr<V>(cpu_allocator(), size); };
+    new_value_ptr_fn_ = [] (size_t size) { return new (cpu_allocator(), size) NormalContiguousValuePtr<V>(size); };
     total_dims_ = 0;
   }
 
@@ -127,9 +127,15 @@ class LevelDBKV : public KVInterface<K, V> {
     return Status::OK();
   }
 
-  Status BatchInsert(std::vector<K> keys, std::vector<ValuePtr<V>*> value_ptrs) {
-    return BatchCommit(keys, value_ptrs);
-  } 
+  Status BatchInsert(gtl::ArraySlice<K> keys,
+                     gtl::ArraySlice<const ValuePtr<V>*> value_ptrs) {
+    std::vector<ValuePtr<V>*> value_ptr_list;
+    for (auto value_ptr : value_ptrs) {
+      value_ptr_list.emplace_back(const_cast<ValuePtr<V>*>(value_ptr));
+    }
+    return BatchCommit(std::vector<K>(keys.begin(), keys.end()),
+                       value_ptr_list);
+  }
 
   Status BatchCommit(std::vector<K> keys, std::vector<ValuePtr<V>*> value_ptrs) {
     WriteBatch batch;
@@ -137,7 +143,8 @@ class LevelDBKV : public KVInterface<K, V> {
       std::string value_res((char*)value_ptrs[i]->GetPtr(), sizeof(FixedLengthHeader) + total_dims_ * sizeof(V));
       leveldb::Slice db_key((char*)(&keys[i]), sizeof(void*));
       batch.Put(db_key, value_res);
-      delete value_ptrs[i];
+      // Demoted keys are removed from the upper level, so they are new here.
+      counter_->add(keys[i], 1);
     }
     db_->Write(WriteOptions(),&batch);
     return Status::OK();
@@ -156,10 +163,16 @@ class LevelDBKV : public KVInterface<K, V> {
   }
 
   Status Remove(K key) {
-    counter_->sub(key, 1);
     leveldb::Slice db_key((char*)(&key), sizeof(void*));
+    // Delete succeeds for a missing key, which must not be counted.
+    std::string val_str;
+    if (!db_->Get(ReadOptions(), db_key, &val_str).ok()) {
+      return errors::NotFound(
+          "Unable to find Key: ", key, " in LevelDB.");
+    }
     leveldb::Status s = db_->Delete(WriteOptions(), db_key);
     if (s.ok()) {
+      counter_->sub(key, 1);
       return Status::OK();
     } else {
       return errors::NotFound(
@@ -16,9 +16,12 @@ limitations under the License.
 #ifndef TENSORFLOW_CORE_FRAMEWORK_EMBEDDING_LOCKLESS_HASH_MAP_H_
 #define TENSORFLOW_CORE_FRAMEWORK_EMBEDDING_LOCKLESS_HASH_MAP_H_
 
+#include <algorithm>
+
 #include "sparsehash/dense_hash_map_lockless"
 #include "tensorflow/core/framework/embedding/kv_interface.h"
 #include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/platform/prefetch.h"
 
 namespace tensorflow {
 template <class V>
@@ -50,6 +53,40 @@ class LocklessHashMap : public KVInterface<K, V> {
     }
   }
 
+  // Prefetches the bucket of the key kPrefetchDistance ahead before probing
+  // the current one, so the bucket misses of a batch overlap instead of
+  // stalling one by one. Each hit prefetches its ValuePtr, which the caller
+  // dereferences right after to reach the embedding.
+  Status BatchLookup(gtl::ArraySlice<K> keys,
+                     gtl::MutableArraySlice<ValuePtr<V>*> value_ptrs) {
+    const size_t warmup = std::min(keys.size(), kPrefetchDistance);
+    for (size_t i = 0; i < warmup; ++i) {
+      hash_map_.prefetch_bucket(keys[i]);
+    }
+    for (size_t i = 0; i < keys.size(); ++i) {
+      if (i + kPrefetchDistance < keys.size()) {
+        hash_map_.prefetch_bucket(keys[i + kPrefetchDistance]);
+      }
+      auto iter = hash_map_.find_wait_free(keys[i]);
+      if (iter.first == LocklessHashMap<K, V>::EMPTY_KEY_) {
+        value_ptrs[i] = nullptr;
+      } else {
+        value_ptrs[i] = iter.second;
+        port::prefetch<port::PREFETCH_HINT_T0>(iter.second);
+      }
+    }
+    return Status::OK();
+  }
+
+  Status BatchInsert(gtl::ArraySlice<K> keys,
+                     gtl::ArraySlice<const ValuePtr<V>*> value_ptrs) {
+    Status status;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      status.Update(Insert(keys[i], value_ptrs[i]));
+    }
+    return status;
+  }
+
   Status Insert(K key, const ValuePtr<V>* value_ptr) {
     auto iter = hash_map_.insert_lockless(
         std::move(std::pair<K, ValuePtr<V>*>(key, const_cast<ValuePtr<V>*>(value_ptr))));
@@ -62,6 +99,21 @@ class LocklessHashMap : public KVInterface<K, V> {
     }
   } 
 
+  // Lookups racing with the swap see either the old or the new ValuePtr.
+  // A key removed concurrently is inserted again with value_ptr.
+  Status Replace(K key, const ValuePtr<V>* old_value_ptr,
+                 const ValuePtr<V>* value_ptr) {
+    auto it = hash_map_.insert_lockless(std::move(
+        std::pair<K, ValuePtr<V>*>(key, const_cast<ValuePtr<V>*>(old_value_ptr))));
+    if (!__sync_bool_compare_and_swap(&((*(it.first)).second),
+            const_cast<ValuePtr<V>*>(old_value_ptr),
+            const_cast<ValuePtr<V>*>(value_ptr))) {
+      return errors::Aborted(
+          "Key: ", key, " was changed concurrently in LocklessHashMap.");
+    }
+    return Status::OK();
+  }
+
   // Other Method
   int64 Size() const {
     return hash_map_.size_lockless();
@@ -107,12 +159,16 @@ class LocklessHashMap : public KVInterface<K, V> {
   typedef google::dense_hash_map_lockless<K, ValuePtr<V>* > LockLessHashMap;
   static const int EMPTY_KEY_;
   static const int DELETED_KEY_;
+  // Far enough to cover a DRAM miss with the probes in between.
+  static constexpr size_t kPrefetchDistance = 8;
   LockLessHashMap hash_map_;
 };
 template <class K, class V>
 const int LocklessHashMap<K, V>::EMPTY_KEY_ = -1;
 template <class K, class V>
 const int LocklessHashMap<K, V>::DELETED_KEY_ = -2;
+template <class K, class V>
+constexpr size_t LocklessHashMap<K, V>::kPrefetchDistance;
 
 }  // namespace embedding
 }  // namespace tensorflow
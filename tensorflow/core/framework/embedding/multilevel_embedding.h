@@ -1,15 +1,20 @@
 #ifndef TENSORFLOW_CORE_FRAMEWORK_EMBEDDING_MULTILEVEL_EMBEDDING_H_
 #define TENSORFLOW_CORE_FRAMEWORK_EMBEDDING_MULTILEVEL_EMBEDDING_H_
 
+#include <deque>
+
 #include "tensorflow/core/framework/embedding/cache.h"
 #include "tensorflow/core/framework/embedding/config.pb.h"
 #include "tensorflow/core/framework/embedding/dense_hash_map.h"
+#include "tensorflow/core/framework/embedding/epoch_manager.h"
 #include "tensorflow/core/framework/embedding/leveldb_kv.h"
 #include "tensorflow/core/framework/embedding/ssd_hashkv.h"
 #include "tensorflow/core/framework/embedding/lockless_hash_map.h"
 #include "tensorflow/core/framework/embedding/kv_interface.h"
 #include "tensorflow/core/lib/core/threadpool.h"
 #include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/lib/strings/str_util.h"
+#include "tensorflow/core/util/env_var.h"
 
 namespace tensorflow {
 template <class V>
@@ -23,11 +28,21 @@ namespace embedding {
 struct StorageConfig {
   StorageConfig() : type(StorageType::INVALID), path(""), layout_type(LayoutType::NORMAL) {
     size = {1<<30,1<<30,1<<30,1<<30};
+    cache_strategy = {CacheStrategy::LRU};
   }
   StorageConfig(StorageType t,
                 const std::string& p,
                 const std::vector<int64>& s,
-                const std::string& layout) : type(t), path(p) {
+                const std::string& layout,
+                CacheStrategy cache = CacheStrategy::LRU)
+      : StorageConfig(t, p, s, layout, std::vector<int64>({cache})) {}
+  // cache[i] is the cache strategy of level i, the last one is used for
+  // the remaining levels.
+  StorageConfig(StorageType t,
+                const std::string& p,
+                const std::vector<int64>& s,
+                const std::string& layout,
+                const std::vector<int64>& cache) : type(t), path(p) {
     if ("normal" == layout) {
       layout_type = LayoutType::NORMAL;
     } else if ("light" == layout) {
@@ -39,11 +54,141 @@ struct StorageConfig {
       layout_type = LayoutType::NORMAL;
     }
     size = s;
+    for (auto c : cache) {
+      cache_strategy.emplace_back(static_cast<CacheStrategy>(c));
+    }
+    if (cache_strategy.empty()) {
+      cache_strategy.emplace_back(CacheStrategy::LRU);
+    }
+  }
+
+  CacheStrategy GetCacheStrategy(int level) const {
+    return cache_strategy[std::min(level, (int)cache_strategy.size() - 1)];
   }
+
+  int64 GetSize(int level) const {
+    return level < size.size() ? size[level] : (1L << 30);
+  }
+
   StorageType type;
   LayoutType layout_type;
   std::string path;
   std::vector<int64> size;
+  std::vector<CacheStrategy> cache_strategy;
+};
+
+// Chains the iterators of the disk based levels so that a checkpoint dumps
+// all of them in one pass.
+class ChainedIterator : public Iterator {
+ public:
+  explicit ChainedIterator(const std::vector<Iterator*>& iters)
+      : iters_(iters), curr_(0) {}
+  virtual ~ChainedIterator() {
+    for (auto it : iters_) {
+      delete it;
+    }
+  }
+  virtual bool Valid() {
+    return curr_ < iters_.size() && iters_[curr_]->Valid();
+  }
+  virtual void SeekToFirst() {
+    curr_ = 0;
+    SeekToValidIterator();
+  }
+  virtual void Next() {
+    iters_[curr_]->Next();
+    if (!iters_[curr_]->Valid()) {
+      ++curr_;
+      SeekToValidIterator();
+    }
+  }
+  virtual void Key(char* val, int64 dim) {
+    iters_[curr_]->Key(val, dim);
+  }
+  virtual void Value(char* val, int64 dim, int64 value_offset) {
+    iters_[curr_]->Value(val, dim, value_offset);
+  }
+
+ private:
+  void SeekToValidIterator() {
+    for (; curr_ < iters_.size(); ++curr_) {
+      iters_[curr_]->SeekToFirst();
+      if (iters_[curr_]->Valid()) {
+        break;
+      }
+    }
+  }
+
+  std::vector<Iterator*> iters_;
+  size_t curr_;
+};
+
+struct EvictionMetrics {
+  EvictionMetrics() : evicted_num(0), flushed_batch_num(0),
+      total_lag_micros(0), max_lag_micros(0),
+      overshoot(0), max_overshoot(0) {}
+  // Number of ids demoted from the DRAM tier.
+  int64 evicted_num;
+  int64 flushed_batch_num;
+  // Time between selecting a batch of victims and finishing its flush.
+  int64 total_lag_micros;
+  int64 max_lag_micros;
+  // Number of ids the DRAM tier holds beyond cache_capacity_.
+  int64 overshoot;
+  int64 max_overshoot;
+
+  std::string DebugString() const {
+    int64 avg_lag_micros = 0;
+    if (flushed_batch_num > 0) {
+      avg_lag_micros = total_lag_micros / flushed_batch_num;
+    }
+    return strings::StrCat("evicted_num: ", evicted_num,
+                           " flushed_batch_num: ", flushed_batch_num,
+                           " avg_lag_micros: ", avg_lag_micros,
+                           " max_lag_micros: ", max_lag_micros,
+                           " overshoot: ", overshoot,
+                           " max_overshoot: ", max_overshoot);
+  }
+};
+
+struct RecycleMetrics {
+  RecycleMetrics() : retired_num(0), pooled_num(0), reused_num(0),
+      freed_num(0) {}
+  // Removed ValuePtrs that readers may still hold.
+  int64 retired_num;
+  // ValuePtrs past their grace period, waiting to be reused for new keys.
+  int64 pooled_num;
+  int64 reused_num;
+  int64 freed_num;
+
+  std::string DebugString() const {
+    return strings::StrCat("retired_num: ", retired_num,
+                           " pooled_num: ", pooled_num,
+                           " reused_num: ", reused_num,
+                           " freed_num: ", freed_num);
+  }
+};
+
+struct PrefetchMetrics {
+  PrefetchMetrics() : prefetch_num(0), promoted_num(0), dropped_num(0),
+      hit_num(0), miss_num(0) {}
+  // Number of ids handed to Prefetch, promoted into DRAM by it, and dropped
+  // because too many prefetch batches were pending.
+  int64 prefetch_num;
+  int64 promoted_num;
+  int64 dropped_num;
+  // Lookups served by the DRAM tier vs. lookups that read a lower tier
+  // synchronously.
+  int64 hit_num;
+  int64 miss_num;
+
+  std::string DebugString() const {
+    return strings::StrCat("prefetch_num: ", prefetch_num,
+                           " promoted_num: ", promoted_num,
+                           " dropped_num: ", dropped_num,
+                           " hit_num: ", hit_num,
+                           " miss_num: ", miss_num);
+  }
 };
 
 template <class K, class V>
@@ -58,6 +203,26 @@ class StorageManager {
   cache_(nullptr),
   cache_capacity_(cap),
   eviction_thread_(nullptr),
+  eviction_thread_num_(1),
+  pending_eviction_batch_num_(0),
+  evicted_num_(0),
+  flushed_batch_num_(0),
+  total_lag_micros_(0),
+  max_lag_micros_(0),
+  overshoot_(0),
+  max_overshoot_(0),
+  pending_prefetch_batch_num_(0),
+  prefetch_num_(0),
+  promoted_num_(0),
+  prefetch_dropped_num_(0),
+  hit_num_(0),
+  miss_num_(0),
+  retired_num_(0),
+  pool_size_(0),
+  reused_num_(0),
+  freed_num_(0),
+  new_value_ptr_num_(0),
+  upsert_num_(0),
   total_dims_(0),
   alloc_len_(0),
   is_multi_level_(false) {}
@@ -66,7 +231,9 @@ class StorageManager {
     for (auto kv: kvs_) {
       delete kv.first;
     }
-    delete cache_;
+    for (auto cache : caches_) {
+      delete cache;
+    }
   }
 
   Status Init() {
@@ -78,12 +245,14 @@ class StorageManager {
         new_value_ptr_fn_ = [] (Allocator* alloc, size_t size) { return new LightValuePtr<V>(alloc, size); };
         break;
       case LayoutType::NORMAL_CONTIGUOUS:
-        new_value_ptr_fn_ = [] (Allocator* alloc, size_t size) { return new NormalContiguousValuePtr<V>(alloc, size); };
+        new_value_ptr_fn_ = [] (Allocator* alloc, size_t size) { return new (alloc, size) NormalContiguousValuePtr<V>(size); };
         break;
       default:
         new_value_ptr_fn_ = [] (Allocator* alloc, size_t size) { return new NormalValuePtr<V>(alloc, size); };
         break;
     }
+    TF_CHECK_OK(ReadInt64FromEnvVar("TF_EV_VALUE_PTR_POOL_SIZE", 1 << 20,
+                                    &pool_capacity_));
     
     switch (sc_.type) {
       Allocator* alloc_ssd;
@@ -126,6 +295,21 @@ class StorageManager {
         kvs_.emplace_back(std::make_pair(new LocklessHashMap<K, V>(), alloc_ssd));
         kvs_.emplace_back(std::make_pair(new SSDHashKV<K, V>(sc_.path, alloc_ssd), alloc_ssd));
         break;
+      case StorageType::DRAM_PMEM_SSDHASH:
+        VLOG(1) << "StorageManager::DRAM_PMEM_SSDHASH: " << name_;
+        alloc_ssd = cpu_allocator();
+        kvs_.emplace_back(std::make_pair(new LocklessHashMap<K, V>(), alloc_ssd));
+        kvs_.emplace_back(std::make_pair(new LocklessHashMap<K, V>(),
+                                         experimental_pmem_allocator(sc_.path, sc_.GetSize(1))));
+        kvs_.emplace_back(std::make_pair(new SSDHashKV<K, V>(sc_.path, alloc_ssd), alloc_ssd));
+        break;
+      case StorageType::DRAM_SSDHASH_LEVELDB:
+        VLOG(1) << "StorageManager::DRAM_SSDHASH_LEVELDB: " << name_;
+        alloc_ssd = cpu_allocator();
+        kvs_.emplace_back(std::make_pair(new LocklessHashMap<K, V>(), alloc_ssd));
+        kvs_.emplace_back(std::make_pair(new SSDHashKV<K, V>(sc_.path, alloc_ssd), alloc_ssd));
+        kvs_.emplace_back(std::make_pair(new LevelDBKV<K, V>(sc_.path), alloc_ssd));
+        break;
       default:
         VLOG(1) << "StorageManager::default" << name_;
         kvs_.push_back(std::make_pair(new LocklessHashMap<K, V>(), ev_allocator()));
@@ -134,21 +318,48 @@ class StorageManager {
 
     if (sc_.type == embedding::PMEM_MEMKIND || sc_.type == embedding::PMEM_LIBPMEM ||
         sc_.type == embedding::DRAM_PMEM || sc_.type == embedding::DRAM_SSDHASH ||
-        sc_.type == embedding::HBM_DRAM || sc_.type == embedding::DRAM_LEVELDB) {
+        sc_.type == embedding::HBM_DRAM || sc_.type == embedding::DRAM_LEVELDB ||
+        sc_.type == embedding::DRAM_PMEM_SSDHASH ||
+        sc_.type == embedding::DRAM_SSDHASH_LEVELDB) {
       is_multi_level_ = true;
     }
 
     hash_table_count_ = kvs_.size();
+    for (auto kv : kvs_) {
+      // In-memory levels own their ValuePtrs, disk levels return copies.
+      level_in_memory_.emplace_back(
+          dynamic_cast<LocklessHashMap<K, V>*>(kv.first) != nullptr);
+    }
     if (hash_table_count_ > 1) {
-      cache_ = new LRUCache<K>();
+      // Every level except the last one is bounded and ranked by its own cache.
+      for (int level = 0; level < hash_table_count_ - 1; ++level) {
+        caches_.emplace_back(CreateCache(sc_.GetCacheStrategy(level)));
+        level_capacity_.emplace_back(-1);
+      }
+      cache_ = caches_[0];
+      TF_CHECK_OK(ReadInt64FromEnvVar("TF_EV_COLD_FREQ_THRESHOLD", 0,
+                                      &cold_freq_threshold_));
+      TF_CHECK_OK(ReadInt64FromEnvVar("TF_EV_EVICTION_THREAD_NUM", 1,
+                                      &eviction_thread_num_));
+      eviction_thread_num_ = std::max(eviction_thread_num_, (int64)1);
+      eviction_pool_.reset(new thread::ThreadPool(Env::Default(), ThreadOptions(),
+                                                  "EV_Eviction_Flush",
+                                                  eviction_thread_num_,
+                                                  /*low_latency_hint=*/false));
       eviction_thread_ = Env::Default()->StartThread(ThreadOptions(), "EV_Eviction",
                                                      [this]() { BatchEviction(); });
+      int64 prefetch_thread_num = 1;
+      TF_CHECK_OK(ReadInt64FromEnvVar("TF_EV_PREFETCH_THREAD_NUM", 1,
+                                      &prefetch_thread_num));
+      prefetch_pool_.reset(new thread::ThreadPool(Env::Default(), ThreadOptions(),
+                                                  "EV_Prefetch",
+                                                  std::max(prefetch_thread_num, (int64)1),
+                                                  /*low_latency_hint=*/false));
       thread_pool_.reset(new thread::ThreadPool(Env::Default(), ThreadOptions(),
                                                "MultiLevel_Embedding_Cache", 2,
                                                /*low_latency_hint=*/false));
     }
     // DebugString();
-    CHECK(2 >= hash_table_count_) << "Not support multi-level(>2) embedding.";
 
     return Status::OK();
   }
@@ -160,15 +371,16 @@ class StorageManager {
     int64 temp = alloc_len_ * slot_num;
     if (temp > total_dims_) {
       total_dims_ = temp;
-      if (sc_.type == StorageType::LEVELDB || sc_.type == StorageType::SSDHASH) {
-        kvs_[0].first->SetTotalDims(total_dims_);
-      } else if (sc_.type == StorageType::DRAM_LEVELDB || sc_.type == StorageType::DRAM_SSDHASH) {
-        kvs_[1].first->SetTotalDims(total_dims_);
+      for (auto kv : kvs_) {
+        kv.first->SetTotalDims(total_dims_);
       }
       if (hash_table_count_ > 1) {
-        cache_capacity_ = sc_.size[0] / (total_dims_ * sizeof(V));
+        for (int level = 0; level < hash_table_count_ - 1; ++level) {
+          level_capacity_[level] = sc_.GetSize(level) / (total_dims_ * sizeof(V));
+          LOG(INFO) << "Level " << level << " cache_capacity: " << level_capacity_[level];
+        }
+        cache_capacity_ = level_capacity_[0];
         done_ = true;
-        LOG(INFO) << "Cache cache_capacity: " << cache_capacity_;
       }
     }
     flag_.clear(std::memory_order_release);
@@ -206,6 +418,109 @@ class StorageManager {
     return is_multi_level_;
   }
 
+  // The SSDHASH level if it is the only disk level. The checkpoint iterator
+  // then visits exactly its records, which its index snapshot can replace.
+  SSDHashKV<K, V>* SSDIndexLevel() {
+    SSDHashKV<K, V>* ssd = nullptr;
+    for (int level = 1; level < hash_table_count_; ++level) {
+      if (level_in_memory_[level]) {
+        continue;
+      }
+      if (ssd != nullptr) {
+        return nullptr;
+      }
+      ssd = dynamic_cast<SSDHashKV<K, V>*>(kvs_[level].first);
+      if (ssd == nullptr) {
+        return nullptr;
+      }
+    }
+    return ssd;
+  }
+
+  // Saves an index snapshot of the SSDHASH level under `index_dir`, the
+  // snapshot directory of a checkpoint bundle. Variables sharing this storage
+  // reuse the snapshot of the same checkpoint as long as the level is not
+  // modified.
+  Status SaveSSDIndex(const std::string& index_dir, int64* mutation_num) {
+    SSDHashKV<K, V>* ssd = SSDIndexLevel();
+    if (ssd == nullptr) {
+      return errors::Unimplemented("EV ", name_, " has no SSDHASH index.");
+    }
+    mutex_lock l(ssd_index_mu_);
+    const std::string dir = SSDIndexDir(index_dir);
+    *mutation_num = ssd->MutationNum();
+    if (ssd_snapshot_dir_ == dir &&
+        ssd_snapshot_mutation_num_ == *mutation_num) {
+      return Status::OK();
+    }
+    ssd_snapshot_dir_.clear();
+    TF_RETURN_IF_ERROR(ssd->Save(dir));
+    ssd_snapshot_dir_ = dir;
+    // Commits racing with Save may be part of the snapshot or not, such a
+    // snapshot is not reused.
+    ssd_snapshot_mutation_num_ =
+        ssd->MutationNum() == *mutation_num ? *mutation_num : -1;
+    return Status::OK();
+  }
+
+  // Restores the SSDHASH level from the snapshot SaveSSDIndex wrote under
+  // `index_dir`. Only the first restore loads it, later calls succeed for the
+  // same snapshot.
+  Status RestoreSSDIndex(const std::string& index_dir) {
+    SSDHashKV<K, V>* ssd = SSDIndexLevel();
+    if (ssd == nullptr) {
+      return errors::Unimplemented("EV ", name_, " has no SSDHASH index.");
+    }
+    mutex_lock l(ssd_index_mu_);
+    const std::string dir = SSDIndexDir(index_dir);
+    if (restored_ssd_index_dir_ == dir) {
+      return Status::OK();
+    }
+    if (!restored_ssd_index_dir_.empty()) {
+      return errors::FailedPrecondition(
+          "EV ", name_, " already restored SSDHASH index snapshot ",
+          restored_ssd_index_dir_);
+    }
+    TF_RETURN_IF_ERROR(ssd->Restore(dir));
+    restored_ssd_index_dir_ = dir;
+    return Status::OK();
+  }
+
+  PrefetchMetrics GetPrefetchMetrics() {
+    PrefetchMetrics metrics;
+    metrics.prefetch_num = prefetch_num_.load(std::memory_order_relaxed);
+    metrics.promoted_num = promoted_num_.load(std::memory_order_relaxed);
+    metrics.dropped_num = prefetch_dropped_num_.load(std::memory_order_relaxed);
+    metrics.hit_num = hit_num_.load(std::memory_order_relaxed);
+    metrics.miss_num = miss_num_.load(std::memory_order_relaxed);
+    return metrics;
+  }
+
+  RecycleMetrics GetRecycleMetrics() {
+    RecycleMetrics metrics;
+    metrics.retired_num = retired_num_.load(std::memory_order_relaxed);
+    metrics.pooled_num = pool_size_.load(std::memory_order_relaxed);
+    metrics.reused_num = reused_num_.load(std::memory_order_relaxed);
+    metrics.freed_num = freed_num_.load(std::memory_order_relaxed);
+    return metrics;
+  }
+
+  // Readers of the ValuePtrs hold a guard of it, see EpochGuard.
+  EpochManager* epoch_manager() {
+    return &epoch_manager_;
+  }
+
+  EvictionMetrics GetEvictionMetrics() {
+    EvictionMetrics metrics;
+    metrics.evicted_num = evicted_num_.load(std::memory_order_relaxed);
+    metrics.flushed_batch_num = flushed_batch_num_.load(std::memory_order_relaxed);
+    metrics.total_lag_micros = total_lag_micros_.load(std::memory_order_relaxed);
+    metrics.max_lag_micros = max_lag_micros_.load(std::memory_order_relaxed);
+    metrics.overshoot = overshoot_.load(std::memory_order_relaxed);
+    metrics.max_overshoot = max_overshoot_.load(std::memory_order_relaxed);
+    return metrics;
+  }
+
   std::string DebugString() const{
     return strings::StrCat("Level Number: ", hash_table_count_,
                           " alloc_len: ", alloc_len_,
@@ -233,18 +548,29 @@ class StorageManager {
         break;
       }
     }
+    if (hash_table_count_ > 1 && found) {
+      if (level == 0) {
+        hit_num_.fetch_add(1, std::memory_order_relaxed);
+      } else {
+        miss_num_.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
     if (!found) {
-      *value_ptr = new_value_ptr_fn_(kvs_[0].second, size);
+      *value_ptr = NewValuePtr(size);
+    } else if (level) {
+      *value_ptr = PromoteValuePtr(level, *value_ptr);
     }
     if (level || !found) {
       Status s = kvs_[0].first->Insert(key, *value_ptr);
       if (s.ok()) {
-        // Insert Success
+        // Insert Success, the key only lives in level 0 from now on
+        if (found) {
+          RemoveFromLowerLevels(key, level);
+        }
         return s;
       } else {
         // Insert Failed, key already exist
-        (*value_ptr)->Destroy(kvs_[0].second);
-        delete *value_ptr;
+        RecycleValuePtr(*value_ptr, kvs_[0].second);
         s = kvs_[0].first->Lookup(key, value_ptr);
         return s;
       }
@@ -252,9 +578,90 @@ class StorageManager {
     return Status::OK();
   }
 
+  // Like GetOrCreate, but a missing key is NotFound instead of created. A
+  // key found in a lower level is promoted from the ValuePtr found there, so
+  // a key removed meanwhile is never brought back with a default value.
+  Status Get(K key, ValuePtr<V>** value_ptr, size_t size) {
+    if (kvs_[0].first->Lookup(key, value_ptr).ok()) {
+      return Status::OK();
+    }
+    for (int level = 1; level < hash_table_count_; ++level) {
+      if (!kvs_[level].first->Lookup(key, value_ptr).ok()) {
+        continue;
+      }
+      miss_num_.fetch_add(1, std::memory_order_relaxed);
+      ValuePtr<V>* promoted = PromoteValuePtr(level, *value_ptr);
+      if (!kvs_[0].first->Insert(key, promoted).ok()) {
+        // Promoted by another lookup meanwhile.
+        RecycleValuePtr(promoted, kvs_[0].second);
+        return kvs_[0].first->Lookup(key, value_ptr);
+      }
+      ValuePtr<V>* lower = nullptr;
+      if (!kvs_[level].first->Lookup(key, &lower).ok()) {
+        // Removed after it was found, drop the promoted copy again.
+        kvs_[0].first->Remove(key);
+        ReleaseValuePtrs(0, {promoted});
+        return errors::NotFound("Key: ", key, " was removed.");
+      }
+      if (!level_in_memory_[level]) {
+        RecycleValuePtr(lower, kvs_[level].second);
+      }
+      RemoveFromLowerLevels(key, level);
+      *value_ptr = promoted;
+      return Status::OK();
+    }
+    return errors::NotFound("Unable to find Key: ", key, " in any level.");
+  }
+
+  // Looks the whole batch up in level 0 first, only the missing keys take
+  // the per-key GetOrCreate path through the lower levels.
+  Status BatchGetOrCreate(const K* keys, int64 num, ValuePtr<V>** value_ptrs,
+                          size_t size) {
+    TF_RETURN_IF_ERROR(kvs_[0].first->BatchLookup(
+        gtl::ArraySlice<K>(keys, num),
+        gtl::MutableArraySlice<ValuePtr<V>*>(value_ptrs, num)));
+    int64 hit = 0;
+    for (int64 i = 0; i < num; ++i) {
+      if (value_ptrs[i] != nullptr) {
+        ++hit;
+        continue;
+      }
+      TF_RETURN_IF_ERROR(GetOrCreate(keys[i], &value_ptrs[i], size));
+    }
+    if (hash_table_count_ > 1) {
+      hit_num_.fetch_add(hit, std::memory_order_relaxed);
+    }
+    return Status::OK();
+  }
+
+  // Promotes the ids living in lower levels into level 0 in the background,
+  // so that a following gather of the same ids never waits for the disk.
+  // Batches are dropped when the prefetch workers fall behind.
+  void Prefetch(const K* keys, int64 num) {
+    if (hash_table_count_ <= 1 || num <= 0 || !prefetch_pool_) {
+      return;
+    }
+    prefetch_num_.fetch_add(num, std::memory_order_relaxed);
+    {
+      mutex_lock l(prefetch_mu_);
+      if (pending_prefetch_batch_num_ >= kMaxPendingPrefetchBatch) {
+        prefetch_dropped_num_.fetch_add(num, std::memory_order_relaxed);
+        return;
+      }
+      ++pending_prefetch_batch_num_;
+    }
+    std::vector<K> ids(keys, keys + num);
+    prefetch_pool_->Schedule([this, ids]() {
+      PrefetchIds(ids);
+      mutex_lock l(prefetch_mu_);
+      --pending_prefetch_batch_num_;
+    });
+  }
+
   Status Remove(K key) {
-    for (auto kv : kvs_) {
-      kv.first->Remove(key);
+    for (int level = 0; level < hash_table_count_; ++level) {
+      kvs_[level].first->Remove(key);
+      RemoveFromCache(level, {key});
     }
     return Status::OK();
   }
@@ -275,16 +682,22 @@ class StorageManager {
     return Status::OK();
   }
 
+  // The values are handed out as pointers into the ValuePtrs, the caller
+  // holds an EpochGuard until it is done reading them.
   int64 GetSnapshot(std::vector<K>* key_list, std::vector<V* >* value_list,
                     std::vector<int64>* version_list, std::vector<int64>* freq_list,
                     const EmbeddingConfig& emb_config, EmbeddingFilter<K, V, EmbeddingVar<K, V>>* filter,
                     embedding::Iterator** it) {
+    std::vector<embedding::Iterator*> iters;
     for (auto kv : kvs_) {
       std::vector<ValuePtr<V>* > value_ptr_list;
       std::vector<K> key_list_tmp;
       TF_CHECK_OK(kv.first->GetSnapshot(&key_list_tmp, &value_ptr_list));
       if (key_list_tmp.empty()) {
-        *it = kv.first->GetIterator();
+        embedding::Iterator* kv_it = kv.first->GetIterator();
+        if (kv_it != nullptr) {
+          iters.emplace_back(kv_it);
+        }
         continue;
       }
       for (int64 i = 0; i < key_list_tmp.size(); ++i) {
@@ -311,14 +724,21 @@ class StorageManager {
         // storage_manager_->FreeValuePtr(value_ptr_list[i]);
       } 
     }
+    if (iters.size() == 1) {
+      *it = iters[0];
+    } else if (iters.size() > 1) {
+      *it = new ChainedIterator(iters);
+    }
     return key_list->size();
   }
 
   Status Shrink(const EmbeddingConfig& emb_config, int64 value_len) {
     mutex_lock l(mu_);
-    for (auto kv : kvs_) {
+    for (int level = 0; level < hash_table_count_; ++level) {
+      auto kv = kvs_[level];
       std::vector<K> key_list;
       std::vector<ValuePtr<V>* > value_ptr_list;
+      EpochGuard guard(&epoch_manager_);
       TF_CHECK_OK(kv.first->GetSnapshot(&key_list, &value_ptr_list));
       std::vector<std::pair<K, ValuePtr<V>* > > to_deleted;
       for (int64 i = 0; i < key_list.size(); ++i) {
@@ -334,21 +754,27 @@ class StorageManager {
           }
         }
       }
+      std::vector<K> removed_keys;
+      std::vector<ValuePtr<V>*> removed;
       for (const auto it : to_deleted) {
-        // TODO memory recycle
-        (it.second)->Destroy(kv.second);
-        delete it.second;
         kv.first->Remove(it.first);
+        removed_keys.emplace_back(it.first);
+        removed.emplace_back(it.second);
       }
+      RemoveFromCache(level, removed_keys);
+      ReleaseValuePtrs(level, removed);
     }
+    ReclaimRetiredValuePtrs();
     return Status::OK();
   }
 
   Status Shrink(int64 gs, int64 steps_to_live) {
     mutex_lock l(mu_);
-    for (auto kv : kvs_) {
+    for (int level = 0; level < hash_table_count_; ++level) {
+      auto kv = kvs_[level];
       std::vector<K> key_list;
       std::vector<ValuePtr<V>* > value_ptr_list;
+      EpochGuard guard(&epoch_manager_);
       TF_CHECK_OK(kv.first->GetSnapshot(&key_list, &value_ptr_list));
       std::vector<std::pair<K, ValuePtr<V>* > > to_deleted;
       for (int64 i = 0; i < key_list.size(); ++i) {
@@ -361,13 +787,17 @@ class StorageManager {
           }
         }
       }
+      std::vector<K> removed_keys;
+      std::vector<ValuePtr<V>*> removed;
       for (const auto it : to_deleted) {
-        // TODO memory recycle
-        (it.second)->Destroy(kv.second);
-        delete it.second;
         kv.first->Remove(it.first);
+        removed_keys.emplace_back(it.first);
+        removed.emplace_back(it.second);
       }
+      RemoveFromCache(level, removed_keys);
+      ReleaseValuePtrs(level, removed);
     }
+    ReclaimRetiredValuePtrs();
     return Status::OK();
   }
 
@@ -378,13 +808,23 @@ class StorageManager {
       shutdown_ = true;
     }
     delete eviction_thread_;
+    eviction_thread_ = nullptr;
+    prefetch_pool_.reset();
+    // Wait for the in-flight flushes before tearing down level 0.
+    eviction_pool_.reset();
+    FreeRecycledValuePtrs();
     mutex_lock l(mu_);
-    std::vector<K> key_list;
-    std::vector<ValuePtr<V>* > value_ptr_list;
-    kvs_[0].first->GetSnapshot(&key_list, &value_ptr_list);
-    for (auto value_ptr : value_ptr_list) {
-      value_ptr->Destroy(kvs_[0].second);
-      delete value_ptr;
+    for (int level = 0; level < hash_table_count_; ++level) {
+      if (level > 0 && !level_in_memory_[level]) {
+        continue;
+      }
+      std::vector<K> key_list;
+      std::vector<ValuePtr<V>* > value_ptr_list;
+      kvs_[level].first->GetSnapshot(&key_list, &value_ptr_list);
+      for (auto value_ptr : value_ptr_list) {
+        value_ptr->Destroy(kvs_[level].second);
+        delete value_ptr;
+      }
     }
     return Status::OK();
   }
@@ -405,6 +845,49 @@ class StorageManager {
     return Status::OK();
   }
 
+  // Sets the value of emb_index of key to `v`, the value must be allocated.
+  // Readers holding an epoch see either the old or the new value, never a
+  // mix of both, and the replaced one is released once their epochs end.
+  // Layouts keeping a pointer per value swap that pointer, NORMAL_CONTIGUOUS
+  // swaps a copy of the whole ValuePtr in level 0, so updates made to the
+  // replaced copy meanwhile, like the frequency counting of lookups, are
+  // lost. *value_ptr is set to the ValuePtr holding the new value.
+  V* UpsertValue(K key, ValuePtr<V>** value_ptr, Allocator* alloc,
+                 int64 value_len, const V* v, int emb_index) {
+    if (upsert_num_.fetch_add(1, std::memory_order_relaxed) %
+            kReclaimInterval == 0) {
+      ReclaimRetiredValuePtrs();
+    }
+    EpochGuard guard(&epoch_manager_);
+    if (sc_.layout_type != LayoutType::NORMAL_CONTIGUOUS) {
+      V* old_val = (*value_ptr)->ExchangeValue(alloc, value_len, v, emb_index);
+      RetireValue(old_val, alloc);
+      return (*value_ptr)->GetValue(emb_index, GetOffset(emb_index));
+    }
+    // The embedding and the slots of a key are upserted one by one, each
+    // must copy the ValuePtr the previous one published.
+    mutex_lock l(upsert_mu_[(uint64)key % kUpsertLockNum]);
+    while (true) {
+      ValuePtr<V>* old_value_ptr = nullptr;
+      if (!kvs_[0].first->Lookup(key, &old_value_ptr).ok()) {
+        // Removed meanwhile, no lookup reaches *value_ptr anymore.
+        V* val = (*value_ptr)->GetValue(emb_index, GetOffset(emb_index));
+        memcpy(val, v, sizeof(V) * value_len);
+        return val;
+      }
+      ValuePtr<V>* copy = CopyValuePtr(0, old_value_ptr);
+      V* val = copy->GetValue(emb_index, GetOffset(emb_index));
+      memcpy(val, v, sizeof(V) * value_len);
+      if (kvs_[0].first->Replace(key, old_value_ptr, copy).ok()) {
+        ReleaseValuePtrs(0, {old_value_ptr});
+        *value_ptr = copy;
+        return val;
+      }
+      // Eviction and promotion put another ValuePtr in level 0 meanwhile.
+      RecycleValuePtr(copy, kvs_[0].second);
+    }
+  }
+
   void FreeValuePtr(ValuePtr<V>* value_ptr) {
     for (auto kv : kvs_) {
       kv.first->FreeValuePtr(value_ptr);
@@ -414,6 +897,9 @@ class StorageManager {
   mutex* get_mutex() { return &mu_; }
 
  private:
+  // Selects victims from the cache without holding mu_ and hands them to the
+  // flush workers. At most 2 * eviction_thread_num_ batches are in flight, the
+  // selector blocks beyond that so the lower tier can catch up.
   void BatchEviction() {
     Env* env = Env::Default();
     const int EvictionSize = 10000;
@@ -425,46 +911,418 @@ class StorageManager {
         }
       }
     }
-    K evic_ids[EvictionSize];
     while (true) {
-      mutex_lock l(mu_);
-      if (shutdown_) {
-        break;
+      {
+        mutex_lock l(mu_);
+        if (shutdown_) {
+          break;
+        }
+        const int kTimeoutMilliseconds = 1;
+        WaitForMilliseconds(&l, &shutdown_cv_, kTimeoutMilliseconds);
+        if (shutdown_) {
+          break;
+        }
+      }
+      ReclaimRetiredValuePtrs();
+
+      int64 dram_overshoot =
+          std::max(kvs_[0].first->Size() - cache_capacity_, (int64)0);
+      overshoot_.store(dram_overshoot, std::memory_order_relaxed);
+      if (dram_overshoot > max_overshoot_.load(std::memory_order_relaxed)) {
+        max_overshoot_.store(dram_overshoot, std::memory_order_relaxed);
+      }
+      // Demotion cascades: every bounded level spills into the next one.
+      for (int level = 0; level < hash_table_count_ - 1; ++level) {
+        int64 cache_count = caches_[level]->size();
+        if (cache_count <= level_capacity_[level]) {
+          continue;
+        }
+        {
+          mutex_lock l(eviction_mu_);
+          while (pending_eviction_batch_num_ >= 2 * eviction_thread_num_) {
+            eviction_cv_.wait(l);
+          }
+          ++pending_eviction_batch_num_;
+        }
+        int64 k_size = std::min(cache_count - level_capacity_[level], (int64)EvictionSize);
+        std::vector<K> evic_ids(k_size);
+        size_t true_size = caches_[level]->get_evic_ids(evic_ids.data(), k_size);
+        evic_ids.resize(true_size);
+        uint64 select_micros = env->NowMicros();
+        eviction_pool_->Schedule([this, level, evic_ids, select_micros]() {
+          FlushEvictedIds(level, evic_ids, select_micros);
+        });
+      }
+    }
+  }
+
+  // Demotes a batch of victims from `level` to the next level with one
+  // BatchCommit. Runs under a shared lock of mu_ so that flushes run
+  // concurrently with each other but never with Save/Shrink.
+  void FlushEvictedIds(int level, const std::vector<K>& evic_ids,
+                       uint64 select_micros) {
+    std::vector<K> keys;
+    std::vector<ValuePtr<V>*> value_ptrs;
+    keys.reserve(evic_ids.size());
+    value_ptrs.reserve(evic_ids.size());
+    {
+      tf_shared_lock l(mu_);
+      EpochGuard guard(&epoch_manager_);
+      for (auto id : evic_ids) {
+        ValuePtr<V>* value_ptr = nullptr;
+        if (kvs_[level].first->Lookup(id, &value_ptr).ok()) {
+          keys.emplace_back(id);
+          value_ptrs.emplace_back(value_ptr);
+        } else {
+          // bypass
+        }
+      }
+      if (!keys.empty()) {
+        int last_level = hash_table_count_ - 1;
+        if (level == 0 && last_level > 1 && cold_freq_threshold_ > 0) {
+          // Rarely seen ids skip the warm levels and go to the coldest one.
+          std::vector<K> warm_keys, cold_keys;
+          std::vector<ValuePtr<V>*> warm_value_ptrs, cold_value_ptrs;
+          for (int64 i = 0; i < keys.size(); ++i) {
+            if (value_ptrs[i]->GetFreq() < cold_freq_threshold_) {
+              cold_keys.emplace_back(keys[i]);
+              cold_value_ptrs.emplace_back(value_ptrs[i]);
+            } else {
+              warm_keys.emplace_back(keys[i]);
+              warm_value_ptrs.emplace_back(value_ptrs[i]);
+            }
+          }
+          CommitToLevel(level + 1, warm_keys, warm_value_ptrs);
+          CommitToLevel(last_level, cold_keys, cold_value_ptrs);
+        } else {
+          CommitToLevel(level + 1, keys, value_ptrs);
+        }
+        for (auto key : keys) {
+          TF_CHECK_OK(kvs_[level].first->Remove(key));
+        }
       }
-      const int kTimeoutMilliseconds = 1;
-      WaitForMilliseconds(&l, &shutdown_cv_, kTimeoutMilliseconds);
-     
-      for (int i = 0; i < value_ptr_out_of_date_.size(); i++) {
-        value_ptr_out_of_date_[i]->Destroy(kvs_[0].second);
-        delete value_ptr_out_of_date_[i];
-      }
-      value_ptr_out_of_date_.clear();
-      
-      int cache_count = cache_->size();
-      if (cache_count > cache_capacity_) {
-        // eviction
-        int k_size = cache_count - cache_capacity_;
-        k_size = std::min(k_size, EvictionSize);
-        size_t true_size = cache_->get_evic_ids(evic_ids, k_size);
-        ValuePtr<V>* value_ptr;
-        for (int64 i = 0; i < true_size; ++i) {
-          if (kvs_[0].first->Lookup(evic_ids[i], &value_ptr).ok()) {
-            TF_CHECK_OK(kvs_[1].first->Commit(evic_ids[i], value_ptr));
-            TF_CHECK_OK(kvs_[0].first->Remove(evic_ids[i]));
-            value_ptr_out_of_date_.emplace_back(value_ptr);
+    }
+    uint64 lag_micros = Env::Default()->NowMicros() - select_micros;
+    evicted_num_.fetch_add(keys.size(), std::memory_order_relaxed);
+    flushed_batch_num_.fetch_add(1, std::memory_order_relaxed);
+    total_lag_micros_.fetch_add(lag_micros, std::memory_order_relaxed);
+    if (lag_micros > max_lag_micros_.load(std::memory_order_relaxed)) {
+      max_lag_micros_.store(lag_micros, std::memory_order_relaxed);
+    }
+    VLOG(2) << "EV " << name_ << " flushed " << keys.size()
+            << " ids from level " << level << ", lag(us): " << lag_micros;
+    ReleaseValuePtrs(level, value_ptrs);
+    {
+      mutex_lock l(eviction_mu_);
+      --pending_eviction_batch_num_;
+    }
+    eviction_cv_.notify_one();
+  }
+
+  void PrefetchIds(const std::vector<K>& ids) {
+    std::vector<K> promoted;
+    {
+      tf_shared_lock l(mu_);
+      EpochGuard guard(&epoch_manager_);
+      for (auto key : ids) {
+        ValuePtr<V>* value_ptr = nullptr;
+        if (kvs_[0].first->Lookup(key, &value_ptr).ok()) {
+          continue;
+        }
+        for (int level = 1; level < hash_table_count_; ++level) {
+          if (!kvs_[level].first->Lookup(key, &value_ptr).ok()) {
+            continue;
+          }
+          value_ptr = PromoteValuePtr(level, value_ptr);
+          if (kvs_[0].first->Insert(key, value_ptr).ok()) {
+            RemoveFromLowerLevels(key, level);
+            promoted.emplace_back(key);
           } else {
-            // bypass
+            // A concurrent lookup promoted it first.
+            RecycleValuePtr(value_ptr, kvs_[0].second);
           }
+          break;
         }
       }
     }
+    if (!promoted.empty()) {
+      // Rank the promoted ids so they are not the next victims.
+      caches_[0]->add_to_rank(promoted.data(), promoted.size());
+      promoted_num_.fetch_add(promoted.size(), std::memory_order_relaxed);
+    }
+    VLOG(2) << "EV " << name_ << " prefetched " << promoted.size() << " of "
+            << ids.size() << " ids";
+  }
+
+  // Writes a batch into `level`. In-memory levels get their own copies
+  // allocated from the level's allocator, disk levels copy in BatchCommit.
+  void CommitToLevel(int level, const std::vector<K>& keys,
+                     const std::vector<ValuePtr<V>*>& value_ptrs) {
+    if (keys.empty()) {
+      return;
+    }
+    if (level_in_memory_[level]) {
+      for (int64 i = 0; i < keys.size(); ++i) {
+        ValuePtr<V>* copy = CopyValuePtr(level, value_ptrs[i]);
+        if (!kvs_[level].first->Insert(keys[i], copy).ok()) {
+          ValuePtr<V>* exist = nullptr;
+          TF_CHECK_OK(kvs_[level].first->Lookup(keys[i], &exist));
+          memcpy(exist->GetPtr(), copy->GetPtr(), ValueBytes());
+          RecycleValuePtr(copy, kvs_[level].second);
+        }
+      }
+    } else {
+      // Disk levels own a single write buffer, commits are serialized.
+      mutex_lock cl(commit_mu_);
+      TF_CHECK_OK(kvs_[level].first->BatchCommit(keys, value_ptrs));
+    }
+    if (level < hash_table_count_ - 1) {
+      caches_[level]->add_to_rank(keys.data(), keys.size());
+    }
+  }
+
+  // Moves a ValuePtr found in a lower level into memory owned by level 0.
+  ValuePtr<V>* PromoteValuePtr(int level, ValuePtr<V>* value_ptr) {
+    if (!level_in_memory_[level] && kvs_[level].second == kvs_[0].second) {
+      // Disk levels hand out a fresh copy, level 0 can adopt it as is.
+      return value_ptr;
+    }
+    ValuePtr<V>* copy = CopyValuePtr(0, value_ptr);
+    if (!level_in_memory_[level]) {
+      RecycleValuePtr(value_ptr, kvs_[level].second);
+    }
+    return copy;
+  }
+
+  void RemoveFromLowerLevels(K key, int level) {
+    RemoveFromCache(level, {key});
+    ValuePtr<V>* value_ptr = nullptr;
+    if (level_in_memory_[level] &&
+        kvs_[level].first->Lookup(key, &value_ptr).ok()) {
+      kvs_[level].first->Remove(key);
+      ReleaseValuePtrs(level, {value_ptr});
+    } else {
+      kvs_[level].first->Remove(key);
+    }
+  }
+
+  // Keys leaving a bounded level other than by eviction must leave its
+  // cache too, or they would be counted and picked as victims again.
+  void RemoveFromCache(int level, const std::vector<K>& keys) {
+    if (level < hash_table_count_ - 1 && !keys.empty()) {
+      caches_[level]->remove_ids(keys.data(), keys.size());
+    }
+  }
+
+  ValuePtr<V>* CopyValuePtr(int level, ValuePtr<V>* value_ptr) {
+    ValuePtr<V>* copy = (level == 0) ?
+        NewValuePtr(total_dims_) :
+        new_value_ptr_fn_(kvs_[level].second, total_dims_);
+    memcpy(copy->GetPtr(), value_ptr->GetPtr(), ValueBytes());
+    return copy;
+  }
+
+  // Multi-level storage always uses the NORMAL_CONTIGUOUS layout.
+  size_t ValueBytes() const {
+    return sizeof(FixedLengthHeader) + total_dims_ * sizeof(V);
+  }
+
+  // Removed ValuePtrs of in-memory levels may still be held by a reader,
+  // they are retired and recycled once their grace period is over. Copies
+  // handed out by disk levels are private and are recycled right away.
+  void ReleaseValuePtrs(int level, const std::vector<ValuePtr<V>*>& value_ptrs) {
+    if (!level_in_memory_[level]) {
+      for (auto value_ptr : value_ptrs) {
+        RecycleValuePtr(value_ptr, kvs_[level].second);
+      }
+      return;
+    }
+    if (value_ptrs.empty()) {
+      return;
+    }
+    mutex_lock l(retire_mu_);
+    uint64 epoch = epoch_manager_.CurrentEpoch();
+    for (auto value_ptr : value_ptrs) {
+      retired_value_ptrs_.emplace_back(value_ptr, kvs_[level].second, epoch);
+    }
+    retired_num_.fetch_add(value_ptrs.size(), std::memory_order_relaxed);
+  }
+
+  // Recycles the retired ValuePtrs no reader can hold anymore. Retired
+  // entries are ordered by epoch, so only a prefix of them is ready.
+  void ReclaimRetiredValuePtrs() {
+    std::vector<RetiredValuePtr> ready;
+    std::vector<RetiredValue> ready_values;
+    {
+      mutex_lock l(retire_mu_);
+      if (retired_value_ptrs_.empty() && retired_values_.empty()) {
+        return;
+      }
+      uint64 epoch = epoch_manager_.TryAdvance();
+      while (!retired_value_ptrs_.empty() &&
+             EpochManager::IsSafe(retired_value_ptrs_.front().epoch, epoch)) {
+        ready.emplace_back(retired_value_ptrs_.front());
+        retired_value_ptrs_.pop_front();
+      }
+      while (!retired_values_.empty() &&
+             EpochManager::IsSafe(retired_values_.front().epoch, epoch)) {
+        ready_values.emplace_back(retired_values_.front());
+        retired_values_.pop_front();
+      }
+    }
+    retired_num_.fetch_sub(ready.size(), std::memory_order_relaxed);
+    for (auto& it : ready) {
+      RecycleValuePtr(it.value_ptr, it.alloc);
+    }
+    for (auto& it : ready_values) {
+      it.alloc->DeallocateRaw(it.value);
+    }
+  }
+
+  // A value UpsertValue replaced in a ValuePtr, see ReleaseValuePtrs.
+  void RetireValue(V* value, Allocator* alloc) {
+    mutex_lock l(retire_mu_);
+    retired_values_.emplace_back(value, alloc, epoch_manager_.CurrentEpoch());
+  }
+
+  // Puts a ValuePtr no reader holds into the pool of level 0, or frees it
+  // when it can't be reused there.
+  void RecycleValuePtr(ValuePtr<V>* value_ptr, Allocator* alloc) {
+    if (sc_.layout_type == LayoutType::NORMAL_CONTIGUOUS &&
+        alloc == kvs_[0].second &&
+        pool_size_.load(std::memory_order_relaxed) < pool_capacity_) {
+      mutex_lock l(pool_mu_);
+      value_ptr_pool_.emplace_back(value_ptr);
+      pool_size_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    value_ptr->Destroy(alloc);
+    delete value_ptr;
+    freed_num_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Creates a ValuePtr of level 0, reusing a recycled one if possible. When
+  // the pool runs dry the retired ValuePtrs are checked every
+  // kReclaimInterval creations, as single level EVs have no eviction thread
+  // doing it.
+  ValuePtr<V>* NewValuePtr(size_t size) {
+    if (sc_.layout_type == LayoutType::NORMAL_CONTIGUOUS && size == (size_t)total_dims_) {
+      if (pool_size_.load(std::memory_order_relaxed) == 0 &&
+          retired_num_.load(std::memory_order_relaxed) > 0 &&
+          new_value_ptr_num_.fetch_add(1, std::memory_order_relaxed) %
+              kReclaimInterval == 0) {
+        ReclaimRetiredValuePtrs();
+      }
+      if (pool_size_.load(std::memory_order_relaxed) > 0) {
+        ValuePtr<V>* value_ptr = nullptr;
+        {
+          mutex_lock l(pool_mu_);
+          if (!value_ptr_pool_.empty()) {
+            value_ptr = value_ptr_pool_.back();
+            value_ptr_pool_.pop_back();
+            pool_size_.fetch_sub(1, std::memory_order_relaxed);
+          }
+        }
+        if (value_ptr != nullptr) {
+          // A zeroed FixedLengthHeader and values, as the constructor leaves them.
+          memset(value_ptr->GetPtr(), 0, ValueBytes());
+          reused_num_.fetch_add(1, std::memory_order_relaxed);
+          return value_ptr;
+        }
+      }
+    }
+    return new_value_ptr_fn_(kvs_[0].second, size);
+  }
+
+  // Called once no reader is left, frees the retired and pooled ValuePtrs.
+  void FreeRecycledValuePtrs() {
+    std::deque<RetiredValuePtr> retired;
+    std::deque<RetiredValue> retired_values;
+    {
+      mutex_lock l(retire_mu_);
+      retired.swap(retired_value_ptrs_);
+      retired_values.swap(retired_values_);
+    }
+    for (auto& it : retired_values) {
+      it.alloc->DeallocateRaw(it.value);
+    }
+    retired_num_.fetch_sub(retired.size(), std::memory_order_relaxed);
+    std::vector<ValuePtr<V>*> pooled;
+    {
+      mutex_lock l(pool_mu_);
+      pooled.swap(value_ptr_pool_);
+      pool_size_.store(0, std::memory_order_relaxed);
+    }
+    for (auto& it : retired) {
+      it.value_ptr->Destroy(it.alloc);
+      delete it.value_ptr;
+    }
+    for (auto value_ptr : pooled) {
+      value_ptr->Destroy(kvs_[0].second);
+      delete value_ptr;
+    }
+    freed_num_.fetch_add(retired.size() + pooled.size(),
+                         std::memory_order_relaxed);
+  }
+
+  // One directory per storage, the name is escaped so that it is a single
+  // path component.
+  std::string SSDIndexDir(const std::string& index_dir) {
+    std::string name = str_util::StringReplace(name_, "%", "%25", true);
+    name = str_util::StringReplace(name, "/", "%2F", true);
+    return io::JoinPath(index_dir, name);
+  }
+
+  BatchCache<K>* CreateCache(CacheStrategy cache_strategy) {
+    switch (cache_strategy) {
+      case CacheStrategy::LFU:
+        VLOG(1) << "StorageManager::LFUCache: " << name_;
+        return new LFUCache<K>();
+      case CacheStrategy::SHARDED_CLOCK:
+        VLOG(1) << "StorageManager::ShardedClockCache: " << name_;
+        return new ShardedClockCache<K>();
+      default:
+        VLOG(1) << "StorageManager::LRUCache: " << name_;
+        return new LRUCache<K>();
+    }
   }
 
  private:
   int32 hash_table_count_;
   std::string name_;
   std::vector<std::pair<KVInterface<K, V>*, Allocator*>> kvs_;
-  std::vector<ValuePtr<V>*> value_ptr_out_of_date_;
+  std::vector<bool> level_in_memory_;
+
+  struct RetiredValuePtr {
+    RetiredValuePtr(ValuePtr<V>* v, Allocator* a, uint64 e)
+        : value_ptr(v), alloc(a), epoch(e) {}
+    ValuePtr<V>* value_ptr;
+    Allocator* alloc;
+    uint64 epoch;
+  };
+  struct RetiredValue {
+    RetiredValue(V* v, Allocator* a, uint64 e)
+        : value(v), alloc(a), epoch(e) {}
+    V* value;
+    Allocator* alloc;
+    uint64 epoch;
+  };
+  static const int64 kReclaimInterval = 1024;
+  static const int64 kUpsertLockNum = 64;
+  EpochManager epoch_manager_;
+  mutex retire_mu_;
+  std::deque<RetiredValuePtr> retired_value_ptrs_ GUARDED_BY(retire_mu_);
+  std::deque<RetiredValue> retired_values_ GUARDED_BY(retire_mu_);
+  mutex upsert_mu_[kUpsertLockNum];
+  mutex pool_mu_;
+  std::vector<ValuePtr<V>*> value_ptr_pool_ GUARDED_BY(pool_mu_);
+  int64 pool_capacity_ = 0;
+  std::atomic<int64> retired_num_;
+  std::atomic<int64> pool_size_;
+  std::atomic<int64> reused_num_;
+  std::atomic<int64> freed_num_;
+  std::atomic<int64> new_value_ptr_num_;
+  std::atomic<int64> upsert_num_;
   std::function<ValuePtr<V>*(Allocator*, size_t)> new_value_ptr_fn_;
   StorageConfig sc_;
   bool is_multi_level_;
@@ -474,8 +1332,40 @@ class StorageManager {
 
   std::unique_ptr<thread::ThreadPool> thread_pool_;
   Thread* eviction_thread_;
+  std::unique_ptr<thread::ThreadPool> eviction_pool_;
+  int64 eviction_thread_num_;
+  mutex eviction_mu_;
+  condition_variable eviction_cv_;
+  int64 pending_eviction_batch_num_ GUARDED_BY(eviction_mu_);
+  mutex commit_mu_;
+
+  std::atomic<int64> evicted_num_;
+  std::atomic<int64> flushed_batch_num_;
+  std::atomic<int64> total_lag_micros_;
+  std::atomic<int64> max_lag_micros_;
+  std::atomic<int64> overshoot_;
+  std::atomic<int64> max_overshoot_;
+
+  static const int64 kMaxPendingPrefetchBatch = 4;
+  std::unique_ptr<thread::ThreadPool> prefetch_pool_;
+  mutex prefetch_mu_;
+  int64 pending_prefetch_batch_num_ GUARDED_BY(prefetch_mu_);
+  std::atomic<int64> prefetch_num_;
+  std::atomic<int64> promoted_num_;
+  std::atomic<int64> prefetch_dropped_num_;
+  std::atomic<int64> hit_num_;
+  std::atomic<int64> miss_num_;
+
+  mutex ssd_index_mu_;
+  std::string ssd_snapshot_dir_ GUARDED_BY(ssd_index_mu_);
+  int64 ssd_snapshot_mutation_num_ GUARDED_BY(ssd_index_mu_) = -1;
+  std::string restored_ssd_index_dir_ GUARDED_BY(ssd_index_mu_);
+
   BatchCache<K>* cache_;
   int64 cache_capacity_;
+  std::vector<BatchCache<K>*> caches_;
+  std::vector<int64> level_capacity_;
+  int64 cold_freq_threshold_ = 0;
   mutex mu_;
   condition_variable shutdown_cv_;
   bool shutdown_ GUARDED_BY(mu_) = false;
@@ -4,7 +4,11 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <deque>
 #include <fstream>
 #include <iomanip>
 #include <map>
@@ -12,11 +16,17 @@
 #include <vector>
 
 #include "sparsehash/dense_hash_map_lockless"
+#include "tensorflow/core/framework/embedding/epoch_manager.h"
 #include "tensorflow/core/framework/embedding/kv_interface.h"
 #include "tensorflow/core/framework/embedding/value_ptr.h"
 #include "tensorflow/core/lib/core/status.h"
 #include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow/core/lib/io/inputbuffer.h"
 #include "tensorflow/core/lib/io/path.h"
+#include "tensorflow/core/lib/strings/strcat.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/mutex.h"
+#include "tensorflow/core/util/env_var.h"
 
 namespace tensorflow {
 
@@ -48,6 +58,9 @@ class EmbPosition {
   bool invalid;
 };
 
+// Each file is mapped once for its whole lifetime. Values are only read
+// after they were flushed, so the mapping may extend past the end of the
+// file while it is written.
 class EmbFile {
  public:
   EmbFile(const std::string& path_, size_t ver, int64 buffer_size)
@@ -56,18 +69,27 @@ class EmbFile {
     app_count(0),
     app_invalid_count(0),
     is_deleted(false) {
-    std::stringstream ss;
-    ss << std::setw(4) << std::setfill('0') << ver << ".emb";
-    filepath = path_ + ss.str();
+    filepath = FilePath(path_, ver);
     fs.open(filepath,
             std::ios::app | std::ios::in | std::ios::out | std::ios::binary);
     fd = open(filepath.data(), O_RDONLY);
     CHECK(fs.good());
+    file_addr = (char*)mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+    CHECK(file_addr != MAP_FAILED);
+    // Lookups are random, readahead would only pollute the page cache.
+    madvise(file_addr, file_size, MADV_RANDOM);
+  }
+
+  static std::string FilePath(const std::string& prefix, size_t ver) {
+    std::stringstream ss;
+    ss << std::setw(4) << std::setfill('0') << ver << ".emb";
+    return prefix + ss.str();
   }
 
   void DeleteFile() {
     is_deleted = true;
     if (fs.is_open()) fs.close();
+    munmap((void*)file_addr, file_size);
     close(fd);
     std::remove(filepath.c_str());
   }
@@ -78,12 +100,6 @@ class EmbFile {
     }
   }
 
-  void Map() {
-    file_addr = (char*)mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
-  }
-
-  void Unmap() { munmap((void*)file_addr, file_size); }
-
   void ReadWithoutMap(char* val, const size_t val_len, const size_t offset) {
     memcpy(val, file_addr + offset, val_len);
   }
@@ -100,10 +116,15 @@ class EmbFile {
   }
 
   void Read(char* val, const size_t val_len, const size_t offset) {
-    char* file_addr_tmp =
-        (char*)mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    memcpy(val, file_addr_tmp + offset, val_len);
-    munmap((void*)file_addr_tmp, file_size);
+    memcpy(val, file_addr + offset, val_len);
+  }
+
+  // Offsets in ascending order keep the page faults sequential.
+  void BatchRead(char* const* vals, const size_t* offsets, int64 num,
+                 const size_t val_len) {
+    for (int64 i = 0; i < num; ++i) {
+      memcpy(vals[i], file_addr + offsets[i], val_len);
+    }
   }
  public:
   size_t app_count;
@@ -120,10 +141,13 @@ class EmbFile {
 template <class K>
 class SSDIterator : public Iterator {
  public:
+  // Holds an epoch for its lifetime, so that the files and positions it
+  // collected are not reclaimed before it is deleted.
   SSDIterator(google::dense_hash_map_lockless<K, EmbPosition*>* hash_map,
               const std::vector<EmbFile*>& emb_files, int64 value_len,
-              char* write_buffer)
-      : emb_files_(emb_files),
+              char* write_buffer, EpochManager* epoch_manager)
+      : guard_(epoch_manager),
+        emb_files_(emb_files),
         curr_file_(0),
         curr_vec_(0),
         value_len_(value_len),
@@ -147,18 +171,13 @@ class SSDIterator : public Iterator {
   virtual void SeekToFirst() {
     curr_file_ = 0;
     curr_vec_ = 0;
-    int64 f_id = file_id_vec_[curr_file_];
-    emb_files_[f_id]->Map();
   }
   virtual void Next() {
     curr_vec_++;
     int64 f_id = file_id_vec_[curr_file_];
     if (curr_vec_ == file_map_[f_id].size()) {
-      emb_files_[f_id]->Unmap();
       curr_vec_ = 0;
       curr_file_++;
-      if (curr_file_ < file_id_vec_.size())
-        emb_files_[file_id_vec_[curr_file_]]->Map();
     }
   }
   virtual void Key(char* val, int64 dim) {
@@ -181,6 +200,7 @@ class SSDIterator : public Iterator {
   }
 
  private:
+  EpochGuard guard_;
   int64 value_len_;
   int64 curr_file_;
   int64 curr_vec_;
@@ -190,6 +210,43 @@ class SSDIterator : public Iterator {
   std::vector<EmbFile*> emb_files_;
 };
 
+struct CompactionMetrics {
+  CompactionMetrics() : compacted_file_num(0), compacted_record_num(0),
+      compacted_bytes(0), compaction_micros(0), disk_bytes(0), live_bytes(0),
+      commit_num(0), total_commit_micros(0), max_commit_micros(0) {}
+  // Work done by the background compaction, compacted_bytes over
+  // compaction_micros gives its throughput.
+  int64 compacted_file_num;
+  int64 compacted_record_num;
+  int64 compacted_bytes;
+  int64 compaction_micros;
+  // Bytes held by the emb files and the write buffer vs. bytes of the live
+  // records, their ratio is the space amplification.
+  int64 disk_bytes;
+  int64 live_bytes;
+  // Latency of Commit/BatchCommit calls.
+  int64 commit_num;
+  int64 total_commit_micros;
+  int64 max_commit_micros;
+
+  double SpaceAmplification() const {
+    return live_bytes == 0 ? 0.0 : (double)disk_bytes / live_bytes;
+  }
+
+  std::string DebugString() const {
+    return strings::StrCat("compacted_file_num: ", compacted_file_num,
+                           " compacted_record_num: ", compacted_record_num,
+                           " compacted_bytes: ", compacted_bytes,
+                           " compaction_micros: ", compaction_micros,
+                           " disk_bytes: ", disk_bytes,
+                           " live_bytes: ", live_bytes,
+                           " space_amplification: ", SpaceAmplification(),
+                           " commit_num: ", commit_num,
+                           " total_commit_micros: ", total_commit_micros,
+                           " max_commit_micros: ", max_commit_micros);
+  }
+};
+
 template <class K, class V>
 class SSDHashKV : public KVInterface<K, V> {
  public:
@@ -198,7 +255,16 @@ class SSDHashKV : public KVInterface<K, V> {
     current_offset(0),
     buffer_cur(0),
     alloc(alloc_),
-    total_app_count(0) {
+    file_table_(nullptr),
+    compaction_thread_(nullptr),
+    compacted_file_num_(0),
+    compacted_record_num_(0),
+    compacted_bytes_(0),
+    compaction_micros_(0),
+    commit_num_(0),
+    total_commit_micros_(0),
+    max_commit_micros_(0),
+    mutation_num_(0) {
     path_ = io::JoinPath(
         path, "ssd_kv_" + std::to_string(Env::Default()->NowMicros()) + "_");
     hash_map.max_load_factor(0.8);
@@ -207,9 +273,18 @@ class SSDHashKV : public KVInterface<K, V> {
     hash_map.set_deleted_key(-2);
     EmbFile* ef = new EmbFile(path_, current_version, buffer_size);
     emb_files.emplace_back(ef);
+    file_keys.emplace_back();
+    {
+      mutex_lock l(mu_);
+      PublishFileTable();
+    }
     new_value_ptr_fn_ = [this](size_t size) {
-      return new NormalContiguousValuePtr<V>(alloc, size);
+      return new (alloc, size) NormalContiguousValuePtr<V>(size);
     };
+    TF_CHECK_OK(ReadInt64FromEnvVar("TF_SSDHASH_COMPACTION_INVALID_PERCENT",
+                                    33, &compaction_invalid_percent_));
+    TF_CHECK_OK(ReadInt64FromEnvVar("TF_SSDHASH_COMPACTION_RATE_MB", 256,
+                                    &compaction_rate_mb_));
   }
 
   void SetTotalDims(int total_dims) {
@@ -219,13 +294,28 @@ class SSDHashKV : public KVInterface<K, V> {
     write_buffer = new char[buffer_size];
     unsigned int max_key_count = 1 + int(buffer_size / val_len);
     key_buffer = new K[max_key_count];
+    compaction_thread_ = Env::Default()->StartThread(
+        ThreadOptions(), "SSDHashKV_Compaction",
+        [this]() { CompactionLoop(); });
   }
 
   Iterator* GetIterator() {
-    return new SSDIterator<K>(&hash_map, emb_files, val_len, write_buffer);
+    // Keeps the file table alive until the iterator has copied it.
+    EpochGuard guard(&epoch_manager_);
+    return new SSDIterator<K>(&hash_map,
+                              *file_table_.load(std::memory_order_acquire),
+                              val_len, write_buffer, &epoch_manager_);
   }
 
   ~SSDHashKV() {
+    if (compaction_thread_) {
+      {
+        mutex_lock l(mu_);
+        shutdown_ = true;
+        compaction_cv_.notify_all();
+      }
+      delete compaction_thread_;
+    }
     if (buffer_cur > 0) {
       emb_files[current_version]->Write(write_buffer, buffer_cur * val_len);
       TF_CHECK_OK(UpdateFlushStatus());
@@ -237,6 +327,13 @@ class SSDHashKV : public KVInterface<K, V> {
       }
       delete it;
     }
+    for (auto& retired : pos_out_of_date) {
+      delete retired.posi;
+    }
+    for (auto& retired : tables_out_of_date) {
+      delete retired.table;
+    }
+    delete file_table_.load(std::memory_order_relaxed);
     delete[] write_buffer;
     delete[] key_buffer;
   }
@@ -244,10 +341,8 @@ class SSDHashKV : public KVInterface<K, V> {
   Status UpdateFlushStatus() {
     for (int i = 0; i < buffer_cur; ++i) {
       auto iter = hash_map.find_wait_free(key_buffer[i]);
-      if (iter.first == EMPTY_KEY_) {
-        return errors::NotFound("Unable to find Key: ", key_buffer[i],
-                                " in SSDHashKV.");
-      } else {
+      // The key may have been removed while it was buffered.
+      if (iter.first != EMPTY_KEY_) {
         iter.second->flushed = true;
       }
     }
@@ -255,6 +350,7 @@ class SSDHashKV : public KVInterface<K, V> {
   }
 
   Status Lookup(K key, ValuePtr<V>** value_ptr) {
+    EpochGuard guard(&epoch_manager_);
     auto iter = hash_map.find_wait_free(key);
     if (iter.first == EMPTY_KEY_) {
       return errors::NotFound("Unable to find Key: ", key, " in SSDHashKV.");
@@ -262,8 +358,11 @@ class SSDHashKV : public KVInterface<K, V> {
       ValuePtr<V>* val = new_value_ptr_fn_(total_dims_);
       EmbPosition* posi = iter.second;
       if (posi->flushed) {
-        emb_files[posi->version]->Read((char*)(val->GetPtr()), val_len,
-                                       posi->offset);
+        // Loaded after the position, so the table holds its file.
+        const std::vector<EmbFile*>& files =
+            *file_table_.load(std::memory_order_acquire);
+        files[posi->version]->Read((char*)(val->GetPtr()), val_len,
+                                   posi->offset);
       } else {
         memcpy((char*)val->GetPtr(), write_buffer + posi->buffer_offset,
                val_len);
@@ -274,35 +373,105 @@ class SSDHashKV : public KVInterface<K, V> {
     }
   }
 
+  // Flushed values are read file by file in offset order, so that page
+  // faults of a batch hit each file sequentially.
+  Status BatchLookup(gtl::ArraySlice<K> keys,
+                     gtl::MutableArraySlice<ValuePtr<V>*> value_ptrs) {
+    EpochGuard guard(&epoch_manager_);
+    std::vector<std::pair<EmbPosition*, ValuePtr<V>*>> flushed;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      auto iter = hash_map.find_wait_free(keys[i]);
+      if (iter.first == EMPTY_KEY_) {
+        value_ptrs[i] = nullptr;
+        continue;
+      }
+      ValuePtr<V>* val = new_value_ptr_fn_(total_dims_);
+      EmbPosition* posi = iter.second;
+      if (posi->flushed) {
+        flushed.emplace_back(posi, val);
+      } else {
+        memcpy((char*)val->GetPtr(), write_buffer + posi->buffer_offset,
+               val_len);
+      }
+      value_ptrs[i] = val;
+      posi->invalid = true;
+    }
+    std::sort(flushed.begin(), flushed.end(),
+              [](const std::pair<EmbPosition*, ValuePtr<V>*>& a,
+                 const std::pair<EmbPosition*, ValuePtr<V>*>& b) {
+                return a.first->version < b.first->version ||
+                       (a.first->version == b.first->version &&
+                        a.first->offset < b.first->offset);
+              });
+    // Loaded after the positions, so the table holds all their files.
+    const std::vector<EmbFile*>& files =
+        *file_table_.load(std::memory_order_acquire);
+    std::vector<char*> vals;
+    std::vector<size_t> offsets;
+    for (size_t begin = 0; begin < flushed.size();) {
+      size_t version = flushed[begin].first->version;
+      vals.clear();
+      offsets.clear();
+      size_t end = begin;
+      for (; end < flushed.size() && flushed[end].first->version == version;
+           ++end) {
+        vals.emplace_back((char*)flushed[end].second->GetPtr());
+        offsets.emplace_back(flushed[end].first->offset);
+      }
+      files[version]->BatchRead(vals.data(), offsets.data(), vals.size(),
+                                val_len);
+      begin = end;
+    }
+    return Status::OK();
+  }
+
   Status Insert(K key, const ValuePtr<V>* value_ptr) { return Status::OK(); }
 
-  Status BatchInsert(std::vector<K>& keys,
-                     std::vector<ValuePtr<V>*>& value_ptrs) {
-    return BatchCommit(keys, value_ptrs);
+  Status BatchInsert(gtl::ArraySlice<K> keys,
+                     gtl::ArraySlice<const ValuePtr<V>*> value_ptrs) {
+    std::vector<ValuePtr<V>*> value_ptr_list;
+    for (auto value_ptr : value_ptrs) {
+      value_ptr_list.emplace_back(const_cast<ValuePtr<V>*>(value_ptr));
+    }
+    return BatchCommit(std::vector<K>(keys.begin(), keys.end()),
+                       value_ptr_list);
   }
 
-  Status BatchCommit(std::vector<K>& keys,
-                     std::vector<ValuePtr<V>*>& value_ptrs) {
-    SingleThreadDynamicCompaction();
-    total_app_count += keys.size();
-    for (int i = 0; i < keys.size(); i++) {
-      CheckBuffer();
-      SaveKV(keys[i], value_ptrs[i]);
-      delete value_ptrs[i];
+  // value_ptrs stay owned by the caller.
+  Status BatchCommit(std::vector<K> keys,
+                     std::vector<ValuePtr<V>*> value_ptrs) {
+    uint64 start = Env::Default()->NowMicros();
+    {
+      mutex_lock l(mu_);
+      for (int i = 0; i < keys.size(); i++) {
+        CheckBuffer();
+        SaveKV(keys[i], (char*)value_ptrs[i]->GetPtr());
+      }
     }
+    RecordCommit(Env::Default()->NowMicros() - start);
     return Status::OK();
   }
 
   Status Commit(K key, const ValuePtr<V>* value_ptr) {
-    SingleThreadDynamicCompaction();
-    total_app_count++;
-    CheckBuffer();
-    SaveKV(key, value_ptr);
+    uint64 start = Env::Default()->NowMicros();
+    {
+      mutex_lock l(mu_);
+      CheckBuffer();
+      SaveKV(key, (char*)value_ptr->GetPtr());
+    }
+    RecordCommit(Env::Default()->NowMicros() - start);
     return Status::OK();
   }
 
   Status Remove(K key) {
-    if (hash_map.erase_lockless(key)) {
+    mutex_lock l(mu_);
+    auto iter = hash_map.find_wait_free(key);
+    if (iter.first != EMPTY_KEY_ && hash_map.erase_lockless(key)) {
+      mutation_num_.fetch_add(1, std::memory_order_relaxed);
+      // Count the removed record as garbage of its file, so that the file
+      // becomes a compaction victim.
+      emb_files[iter.second->version]->app_invalid_count++;
+      RetirePosition(iter.second);
       return Status::OK();
     } else {
       return errors::NotFound("Unable to find Key: ", key, " in SSDHashKV.");
@@ -318,103 +487,502 @@ class SSDHashKV : public KVInterface<K, V> {
 
   void FreeValuePtr(ValuePtr<V>* value_ptr) { delete value_ptr; }
 
+  // Compacts the sealed file with the highest invalid ratio above
+  // TF_SSDHASH_COMPACTION_INVALID_PERCENT, returns false if there is none.
+  // Live records are moved in chunks of kCompactionChunkSize, commits and
+  // lookups proceed between chunks.
+  bool CompactOnce() {
+    mutex_lock cl(compaction_mu_);
+    int64 version = -1;
+    std::vector<K> keys;
+    EmbFile* file = nullptr;
+    {
+      mutex_lock l(mu_);
+      ReclaimRetired();
+      version = PickVictimFile();
+      if (version == -1) {
+        return false;
+      }
+      file = emb_files[version];
+      keys = file_keys[version];
+    }
+
+    uint64 start = Env::Default()->NowMicros();
+    int64 moved_num = 0;
+    char* chunk_buffer = new char[kCompactionChunkSize * val_len];
+    std::vector<char*> vals;
+    std::vector<size_t> offsets;
+    std::vector<K> live_keys;
+    for (size_t begin = 0; begin < keys.size();
+         begin += kCompactionChunkSize) {
+      uint64 chunk_start = Env::Default()->NowMicros();
+      size_t end = std::min(begin + kCompactionChunkSize, keys.size());
+      // The file is sealed, so live records are read without holding mu_.
+      vals.clear();
+      offsets.clear();
+      live_keys.clear();
+      for (size_t i = begin; i < end; ++i) {
+        if (IsLive(keys[i], version, i * val_len)) {
+          vals.emplace_back(chunk_buffer + live_keys.size() * val_len);
+          offsets.emplace_back(i * val_len);
+          live_keys.emplace_back(keys[i]);
+        }
+      }
+      if (live_keys.empty()) {
+        continue;
+      }
+      file->BatchRead(vals.data(), offsets.data(), vals.size(), val_len);
+      {
+        mutex_lock l(mu_);
+        if (shutdown_) {
+          delete[] chunk_buffer;
+          return false;
+        }
+        for (size_t i = 0; i < live_keys.size(); ++i) {
+          // Skip records committed or removed since they were read.
+          if (IsLive(live_keys[i], version, offsets[i])) {
+            CheckBuffer();
+            SaveKV(live_keys[i], vals[i], true);
+            ++moved_num;
+          }
+        }
+      }
+      Throttle(live_keys.size() * val_len,
+               Env::Default()->NowMicros() - chunk_start);
+    }
+    delete[] chunk_buffer;
+
+    {
+      mutex_lock l(mu_);
+      // Every live record was moved, lookups that still read the file hold
+      // an epoch older than the one it is retired in.
+      files_out_of_date.push_back({file, (size_t)version,
+                                   epoch_manager_.CurrentEpoch()});
+    }
+    compacted_file_num_.fetch_add(1, std::memory_order_relaxed);
+    compacted_record_num_.fetch_add(moved_num, std::memory_order_relaxed);
+    compacted_bytes_.fetch_add(moved_num * val_len, std::memory_order_relaxed);
+    compaction_micros_.fetch_add(Env::Default()->NowMicros() - start,
+                                 std::memory_order_relaxed);
+    VLOG(1) << "SSDHashKV compacted file " << version << ", moved "
+            << moved_num << " of " << keys.size() << " records, "
+            << GetCompactionMetrics().DebugString();
+    return true;
+  }
+
+  // Saves the index and hard links of the files holding live records into
+  // `dir`, which then describes the whole table:
+  //   index: kIndexMagic, kIndexFormat, sizeof(K), val_len, file number,
+  //          per file its record number, invalid record number and the keys
+  //          of all its records in offset order, then the live record number
+  //          and per live record its key, file id and offset.
+  //   NNNN.emb: the files, renumbered from 0.
+  // The buffered records are flushed and the current file is sealed first.
+  // Only collecting the records holds mu_, commits and lookups proceed while
+  // the index is written. The sealed files are immutable and compaction,
+  // which would delete them, waits for Save.
+  Status Save(const std::string& dir) {
+    mutex_lock cl(compaction_mu_);
+    Env* env = Env::Default();
+    TF_RETURN_IF_ERROR(env->RecursivelyCreateDir(dir));
+    std::map<size_t, std::vector<std::pair<K, size_t>>> records;
+    std::vector<std::string> filepaths;
+    std::vector<std::vector<K>> keys_of_files;
+    int64 record_num = 0;
+    {
+      mutex_lock l(mu_);
+      if (buffer_cur > 0) {
+        FlushBuffer(true);
+      }
+      for (auto it : hash_map) {
+        EmbPosition* posi = it.second;
+        if (!posi->invalid) {
+          records[posi->version].emplace_back(it.first, posi->offset);
+          ++record_num;
+        }
+      }
+      for (auto& it : records) {
+        filepaths.emplace_back(emb_files[it.first]->filepath);
+        keys_of_files.emplace_back(file_keys[it.first]);
+      }
+    }
+
+    std::unique_ptr<WritableFile> index_file;
+    TF_RETURN_IF_ERROR(
+        env->NewWritableFile(io::JoinPath(dir, kIndexFileName), &index_file));
+    std::string buf;
+    AppendToIndex(&buf, kIndexMagic);
+    AppendToIndex(&buf, kIndexFormat);
+    AppendToIndex(&buf, (uint64)sizeof(K));
+    AppendToIndex(&buf, (uint64)val_len);
+    AppendToIndex(&buf, (uint64)records.size());
+    uint64 file_id = 0;
+    for (auto& it : records) {
+      TF_RETURN_IF_ERROR(LinkOrCopyFile(
+          filepaths[file_id],
+          EmbFile::FilePath(strings::StrCat(dir, "/"), file_id)));
+      const std::vector<K>& keys = keys_of_files[file_id];
+      AppendToIndex(&buf, (uint64)keys.size());
+      AppendToIndex(&buf, (uint64)(keys.size() - it.second.size()));
+      for (auto key : keys) {
+        AppendToIndex(&buf, key);
+        TF_RETURN_IF_ERROR(FlushIndex(index_file.get(), &buf, false));
+      }
+      ++file_id;
+    }
+    AppendToIndex(&buf, (uint64)record_num);
+    file_id = 0;
+    for (auto& it : records) {
+      for (auto& record : it.second) {
+        AppendToIndex(&buf, record.first);
+        AppendToIndex(&buf, file_id);
+        AppendToIndex(&buf, (uint64)record.second);
+        TF_RETURN_IF_ERROR(FlushIndex(index_file.get(), &buf, false));
+      }
+      ++file_id;
+    }
+    TF_RETURN_IF_ERROR(FlushIndex(index_file.get(), &buf, true));
+    TF_RETURN_IF_ERROR(index_file->Close());
+    VLOG(1) << "SSDHashKV saved " << record_num << " records of "
+            << records.size() << " files to " << dir;
+    return Status::OK();
+  }
+
+  // Reopens the files saved by Save and loads their index, without reading
+  // or rewriting any value. The SSDHashKV must be empty. The whole index is
+  // read before the files are linked and the records inserted, so a failed
+  // restore leaves the SSDHashKV empty.
+  Status Restore(const std::string& dir) {
+    mutex_lock cl(compaction_mu_);
+    mutex_lock l(mu_);
+    if (hash_map.size_lockless() != 0 || buffer_cur != 0 ||
+        current_version != 0 || emb_files[0]->app_count != 0) {
+      return errors::FailedPrecondition(
+          "SSDHashKV must be empty to be restored from ", dir);
+    }
+    Env* env = Env::Default();
+    std::unique_ptr<RandomAccessFile> index_file;
+    TF_RETURN_IF_ERROR(env->NewRandomAccessFile(
+        io::JoinPath(dir, kIndexFileName), &index_file));
+    io::InputBuffer in(index_file.get(), 8 << 20);
+    uint64 magic, format, key_size, value_len, file_num;
+    TF_RETURN_IF_ERROR(ReadFromIndex(&in, &magic));
+    TF_RETURN_IF_ERROR(ReadFromIndex(&in, &format));
+    TF_RETURN_IF_ERROR(ReadFromIndex(&in, &key_size));
+    TF_RETURN_IF_ERROR(ReadFromIndex(&in, &value_len));
+    if (magic != kIndexMagic || format != kIndexFormat) {
+      return errors::DataLoss("Not a SSDHashKV index: ", dir);
+    }
+    if (key_size != sizeof(K) || value_len != val_len) {
+      return errors::InvalidArgument(
+          "SSDHashKV index ", dir, " holds ", key_size, " bytes keys and ",
+          value_len, " bytes values, expected ", sizeof(K), " and ", val_len);
+    }
+    TF_RETURN_IF_ERROR(ReadFromIndex(&in, &file_num));
+    std::vector<std::pair<uint64, uint64>> file_counts(file_num);
+    std::vector<std::vector<K>> keys(file_num);
+    for (uint64 i = 0; i < file_num; ++i) {
+      TF_RETURN_IF_ERROR(ReadFromIndex(&in, &file_counts[i].first));
+      TF_RETURN_IF_ERROR(ReadFromIndex(&in, &file_counts[i].second));
+      keys[i].resize(file_counts[i].first);
+      for (uint64 j = 0; j < file_counts[i].first; ++j) {
+        TF_RETURN_IF_ERROR(ReadFromIndex(&in, &keys[i][j]));
+      }
+    }
+    uint64 record_num;
+    TF_RETURN_IF_ERROR(ReadFromIndex(&in, &record_num));
+    std::vector<K> record_keys(record_num);
+    std::vector<std::pair<uint64, uint64>> record_positions(record_num);
+    for (uint64 i = 0; i < record_num; ++i) {
+      TF_RETURN_IF_ERROR(ReadFromIndex(&in, &record_keys[i]));
+      TF_RETURN_IF_ERROR(ReadFromIndex(&in, &record_positions[i].first));
+      TF_RETURN_IF_ERROR(ReadFromIndex(&in, &record_positions[i].second));
+      if (record_positions[i].first >= file_num) {
+        return errors::DataLoss("SSDHashKV index ", dir, " refers to file ",
+                                record_positions[i].first, " of ", file_num);
+      }
+    }
+
+    // Replace the empty initial file by the saved ones.
+    emb_files[0]->DeleteFile();
+    delete emb_files[0];
+    emb_files.clear();
+    file_keys.clear();
+    Status st;
+    for (uint64 i = 0; i < file_num && st.ok(); ++i) {
+      st = LinkOrCopyFile(EmbFile::FilePath(strings::StrCat(dir, "/"), i),
+                          EmbFile::FilePath(path_, i));
+      if (st.ok()) {
+        EmbFile* file = new EmbFile(path_, i, buffer_size);
+        file->app_count = file_counts[i].first;
+        file->app_invalid_count = file_counts[i].second;
+        emb_files.emplace_back(file);
+        file_keys.emplace_back(std::move(keys[i]));
+      }
+    }
+    if (!st.ok()) {
+      for (auto file : emb_files) {
+        file->DeleteFile();
+        delete file;
+      }
+      emb_files.clear();
+      file_keys.clear();
+    }
+    current_version = emb_files.size();
+    current_offset = 0;
+    emb_files.emplace_back(new EmbFile(path_, current_version, buffer_size));
+    file_keys.emplace_back();
+    PublishFileTable();
+    TF_RETURN_IF_ERROR(st);
+
+    for (uint64 i = 0; i < record_num; ++i) {
+      EmbPosition* posi = new EmbPosition(record_positions[i].second,
+                                          record_positions[i].first, -1, true);
+      hash_map.insert_lockless(
+          std::move(std::pair<K, EmbPosition*>(record_keys[i], posi)));
+    }
+    VLOG(1) << "SSDHashKV restored " << record_num << " records of "
+            << file_num << " files from " << dir;
+    return Status::OK();
+  }
+
+  // Number of Commit/BatchCommit/Remove calls, a snapshot is up to date as
+  // long as it does not change.
+  int64 MutationNum() { return mutation_num_.load(std::memory_order_relaxed); }
+
+  CompactionMetrics GetCompactionMetrics() {
+    CompactionMetrics metrics;
+    metrics.compacted_file_num =
+        compacted_file_num_.load(std::memory_order_relaxed);
+    metrics.compacted_record_num =
+        compacted_record_num_.load(std::memory_order_relaxed);
+    metrics.compacted_bytes = compacted_bytes_.load(std::memory_order_relaxed);
+    metrics.compaction_micros =
+        compaction_micros_.load(std::memory_order_relaxed);
+    metrics.commit_num = commit_num_.load(std::memory_order_relaxed);
+    metrics.total_commit_micros =
+        total_commit_micros_.load(std::memory_order_relaxed);
+    metrics.max_commit_micros =
+        max_commit_micros_.load(std::memory_order_relaxed);
+    mutex_lock l(mu_);
+    int64 record_num = buffer_cur;
+    for (auto file : emb_files) {
+      if (!file->is_deleted) {
+        record_num += file->app_count;
+      }
+    }
+    metrics.disk_bytes = record_num * val_len;
+    metrics.live_bytes = hash_map.size_lockless() * val_len;
+    return metrics;
+  }
+
  private:
-  void CheckBuffer() {
+  void CompactionLoop() {
+    while (true) {
+      {
+        mutex_lock l(mu_);
+        if (shutdown_) {
+          break;
+        }
+        WaitForMilliseconds(&l, &compaction_cv_,
+                            kCompactionIntervalMilliseconds);
+        if (shutdown_) {
+          break;
+        }
+      }
+      while (CompactOnce()) {
+        mutex_lock l(mu_);
+        if (shutdown_) {
+          return;
+        }
+      }
+    }
+  }
+
+  int64 PickVictimFile() EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    int64 victim = -1;
+    double max_ratio = compaction_invalid_percent_ / 100.0;
+    for (size_t version = 0; version < emb_files.size(); ++version) {
+      EmbFile* file = emb_files[version];
+      if (version == current_version || file->is_deleted ||
+          file->app_count == 0 ||
+          std::find_if(files_out_of_date.begin(), files_out_of_date.end(),
+                       [file](const RetiredFile& retired) {
+                         return retired.file == file;
+                       }) != files_out_of_date.end()) {
+        continue;
+      }
+      double ratio = (double)file->app_invalid_count / file->app_count;
+      if (ratio > max_ratio) {
+        max_ratio = ratio;
+        victim = version;
+      }
+    }
+    return victim;
+  }
+
+  bool IsLive(K key, int64 version, size_t offset) {
+    EpochGuard guard(&epoch_manager_);
+    auto iter = hash_map.find_wait_free(key);
+    return iter.first != EMPTY_KEY_ && iter.second->flushed &&
+           iter.second->version == version && iter.second->offset == offset;
+  }
+
+  // Sleeps so that compaction writes at most TF_SSDHASH_COMPACTION_RATE_MB
+  // per second, 0 disables the limit.
+  void Throttle(int64 bytes, int64 elapsed_micros) {
+    if (compaction_rate_mb_ <= 0) {
+      return;
+    }
+    int64 expected_micros = bytes / compaction_rate_mb_;
+    if (expected_micros > elapsed_micros) {
+      Env::Default()->SleepForMicroseconds(expected_micros - elapsed_micros);
+    }
+  }
+
+  template <typename T>
+  static void AppendToIndex(std::string* buf, const T& val) {
+    buf->append((const char*)&val, sizeof(T));
+  }
+
+  static Status FlushIndex(WritableFile* file, std::string* buf, bool force) {
+    if (force || buf->size() >= (8 << 20)) {
+      TF_RETURN_IF_ERROR(file->Append(*buf));
+      buf->clear();
+    }
+    return Status::OK();
+  }
+
+  template <typename T>
+  static Status ReadFromIndex(io::InputBuffer* in, T* val) {
+    size_t bytes_read = 0;
+    TF_RETURN_IF_ERROR(in->ReadNBytes(sizeof(T), (char*)val, &bytes_read));
+    return Status::OK();
+  }
+
+  // Hard links keep a saved file alive after compaction deletes the live
+  // one, copies are only made across file systems.
+  static Status LinkOrCopyFile(const std::string& src,
+                               const std::string& dst) {
+    if (link(src.c_str(), dst.c_str()) == 0) {
+      return Status::OK();
+    }
+    return Env::Default()->CopyFile(src, dst);
+  }
+
+  void RecordCommit(int64 micros) {
+    mutation_num_.fetch_add(1, std::memory_order_relaxed);
+    commit_num_.fetch_add(1, std::memory_order_relaxed);
+    total_commit_micros_.fetch_add(micros, std::memory_order_relaxed);
+    int64 max_micros = max_commit_micros_.load(std::memory_order_relaxed);
+    while (micros > max_micros &&
+           !max_commit_micros_.compare_exchange_weak(
+               max_micros, micros, std::memory_order_relaxed)) {}
+  }
+
+  void CheckBuffer() EXCLUSIVE_LOCKS_REQUIRED(mu_) {
     size_t curr_buffer_offset = buffer_cur * val_len;
     if (curr_buffer_offset + val_len > buffer_size) {
-      emb_files[current_version]->Write(write_buffer, curr_buffer_offset);
-      emb_files[current_version]->app_count += buffer_cur;
-      emb_files[current_version]->Flush();
-      if (emb_files[current_version]->app_count >= max_app_count) {
-        ++current_version;
-        current_offset = 0;
-        emb_files.emplace_back(
-            new EmbFile(path_, current_version, buffer_size));
-      }
-      TF_CHECK_OK(UpdateFlushStatus());
-      buffer_cur = 0;
+      FlushBuffer(false);
     }
   }
 
-  void SaveKV(K key, const ValuePtr<V>* value_ptr, bool is_compaction = false) {
+  // Writes the buffer to the current file, which is sealed once it is full
+  // or when `seal` is set. Sealed files are never written again.
+  void FlushBuffer(bool seal) EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    emb_files[current_version]->Write(write_buffer, buffer_cur * val_len);
+    emb_files[current_version]->app_count += buffer_cur;
+    emb_files[current_version]->Flush();
+    file_keys[current_version].insert(file_keys[current_version].end(),
+                                      key_buffer, key_buffer + buffer_cur);
+    if (emb_files[current_version]->app_count >= max_app_count ||
+        (seal && emb_files[current_version]->app_count > 0)) {
+      ++current_version;
+      current_offset = 0;
+      emb_files.emplace_back(
+          new EmbFile(path_, current_version, buffer_size));
+      file_keys.emplace_back();
+      PublishFileTable();
+    }
+    TF_CHECK_OK(UpdateFlushStatus());
+    buffer_cur = 0;
+  }
+
+  void SaveKV(K key, const char* val, bool is_compaction = false)
+      EXCLUSIVE_LOCKS_REQUIRED(mu_) {
     size_t curr_buffer_offset = buffer_cur * val_len;
     EmbPosition* ep = new EmbPosition(current_offset, current_version,
                                       curr_buffer_offset, false);
 
     current_offset += val_len;
-    memcpy(write_buffer + curr_buffer_offset, (char*)value_ptr->GetPtr(),
-           val_len);
+    memcpy(write_buffer + curr_buffer_offset, val, val_len);
     key_buffer[buffer_cur] = key;
     ++buffer_cur;
 
     auto iter = hash_map.insert_lockless(std::move(
         std::pair<K, EmbPosition*>(key, const_cast<EmbPosition*>(ep))));
     if ((*(iter.first)).second != ep) {
-      int version = (*(iter.first)).second->version;
+      EmbPosition* old_posi = (*(iter.first)).second;
+      // Compaction discards the whole victim file, it needs no accounting.
       if (!is_compaction) {
-        emb_files[version]->app_invalid_count++;
-        //A parameter that can be adjusted in the future
-        if (version != current_version && emb_files[version]->app_count >=
-                emb_files[version]->app_invalid_count &&
-            emb_files[version]->app_count / 3 <
-                emb_files[version]->app_invalid_count)
-          evict_file_set.insert((*(iter.first)).second->version);
+        emb_files[old_posi->version]->app_invalid_count++;
       }
-      EmbPosition* old_posi = (*(iter.first)).second;
-      __sync_bool_compare_and_swap(&((*(iter.first)).second),
-                                   (*(iter.first)).second, ep);
-      //A parameter that can be adjusted in the future
-      if (pos_out_of_date.size() > cap_invalid_pos) {
-        EmbPosition* posi = pos_out_of_date.front();
-        delete posi;
+      // Lookups racing with the swap either see the old position, whose
+      // file and EmbPosition are reclaimed later, or the new one.
+      __sync_bool_compare_and_swap(&((*(iter.first)).second), old_posi, ep);
+      RetirePosition(old_posi);
+    }
+  }
+
+  // Publishes a copy of emb_files to the lock free lookups. Appending to
+  // emb_files may move its storage, so lookups never index it directly. The
+  // replaced copy is deleted once no lookup can hold it.
+  void PublishFileTable() EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    const std::vector<EmbFile*>* old_table = file_table_.exchange(
+        new std::vector<EmbFile*>(emb_files), std::memory_order_acq_rel);
+    if (old_table != nullptr) {
+      tables_out_of_date.push_back({old_table, epoch_manager_.CurrentEpoch()});
+    }
+  }
+
+  void RetirePosition(EmbPosition* posi) EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    //A parameter that can be adjusted in the future
+    if (pos_out_of_date.size() > cap_invalid_pos) {
+      uint64 epoch = epoch_manager_.TryAdvance();
+      // Keeps the position while a lookup may still read it.
+      if (EpochManager::IsSafe(pos_out_of_date.front().epoch, epoch)) {
+        delete pos_out_of_date.front().posi;
         pos_out_of_date.pop_front();
       }
-      pos_out_of_date.emplace_back(old_posi);
     }
+    pos_out_of_date.push_back({posi, epoch_manager_.CurrentEpoch()});
   }
 
-  void SingleThreadDynamicCompaction() {
-    uint64 start, end;
-    int64 hash_size = hash_map.size_lockless();
-    //These parameter that can be adjusted in the future
-    if (hash_size * 3 / 2 < total_app_count ||
-        total_app_count - hash_size > cap_invalid_id) {
-      // delete the evict_files
-      for (auto it : evict_file_map) {
-        emb_files[it.first]->DeleteFile();
-      }
-      // flush the data in buffer
-      evict_file_map.clear();
-      // Initialize evict_file_map
-      for (auto it : evict_file_set) {
-        std::vector<std::pair<K, EmbPosition*>> tmp;
-        evict_file_map[it] = tmp;
-      }
-      evict_file_set.clear();
-      for (auto it : hash_map) {
-        EmbPosition* posi = it.second;
-        auto iter = evict_file_map.find(posi->version);
-        if (iter != evict_file_map.end()) {
-          (*iter).second.emplace_back(it);
-        }
-      }
-      // read embeddings and write to new file
-      ValuePtr<V>* val = new_value_ptr_fn_(total_dims_);
-      for (auto it : evict_file_map) {
-        EmbFile* file = emb_files[it.first];
-        total_app_count -= file->app_invalid_count;
-        file->Map();
-        for (auto it_vec : it.second) {
-          EmbPosition* posi = it_vec.second;
-          file->ReadWithoutMap((char*)(val->GetPtr()), val_len, posi->offset);
-          CheckBuffer();
-          SaveKV(it_vec.first, val, true);
-        }
-        file->Unmap();
-      }
-      delete val;
+  // Deletes the compacted files and the retired positions no lookup can
+  // reach any more. The epoch moves at most two steps, one per epoch every
+  // lookup in flight has left.
+  void ReclaimRetired() EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    uint64 epoch = epoch_manager_.TryAdvance();
+    epoch = epoch_manager_.TryAdvance();
+    while (!files_out_of_date.empty() &&
+           EpochManager::IsSafe(files_out_of_date.front().epoch, epoch)) {
+      const RetiredFile& retired = files_out_of_date.front();
+      retired.file->DeleteFile();
+      std::vector<K>().swap(file_keys[retired.version]);
+      files_out_of_date.pop_front();
+    }
+    while (!pos_out_of_date.empty() &&
+           EpochManager::IsSafe(pos_out_of_date.front().epoch, epoch)) {
+      delete pos_out_of_date.front().posi;
+      pos_out_of_date.pop_front();
+    }
+    while (!tables_out_of_date.empty() &&
+           EpochManager::IsSafe(tables_out_of_date.front().epoch, epoch)) {
+      delete tables_out_of_date.front().table;
+      tables_out_of_date.pop_front();
     }
   }
+
   std::string DebugString() const {
     return strings::StrCat("map info size:", Size(),
                           ", map info bucket_count:",
@@ -432,7 +1000,6 @@ class SSDHashKV : public KVInterface<K, V> {
   size_t current_version;
   size_t current_offset;
   size_t buffer_cur;
-  size_t total_app_count;
   size_t max_app_count;
 
   char* write_buffer;
@@ -449,15 +1016,56 @@ class SSDHashKV : public KVInterface<K, V> {
   static const int EMPTY_KEY_;
   static const int DELETED_KEY_;
   static const int cap_invalid_pos;
-  static const int cap_invalid_id;
   static const size_t buffer_size;
+  static const size_t kCompactionChunkSize;
+  static const int64 kCompactionIntervalMilliseconds;
+  static const char* const kIndexFileName;
+  static const uint64 kIndexMagic;
+  static const uint64 kIndexFormat;
+
+  struct RetiredFile {
+    EmbFile* file;
+    size_t version;
+    uint64 epoch;
+  };
+  struct RetiredPosition {
+    EmbPosition* posi;
+    uint64 epoch;
+  };
+  struct RetiredFileTable {
+    const std::vector<EmbFile*>* table;
+    uint64 epoch;
+  };
 
+  // mu_ serializes writers of the write buffer: commits, removals and the
+  // compaction. Lookups stay lock free, they hold an epoch of epoch_manager_
+  // instead, which defers deleting the files, positions and file tables they
+  // may read. They index the immutable file_table_, never emb_files.
+  mutex mu_;
+  EpochManager epoch_manager_;
+  std::vector<EmbFile*> emb_files GUARDED_BY(mu_);
+  std::atomic<const std::vector<EmbFile*>*> file_table_;
+  std::deque<RetiredFileTable> tables_out_of_date GUARDED_BY(mu_);
+  // Keys of the flushed records of each file, in offset order.
+  std::vector<std::vector<K>> file_keys GUARDED_BY(mu_);
+  std::deque<RetiredFile> files_out_of_date GUARDED_BY(mu_);
+  std::deque<RetiredPosition> pos_out_of_date GUARDED_BY(mu_);
 
-  std::vector<EmbFile*> emb_files;
-  std::vector<EmbFile*> files_out_of_date;
-  std::deque<EmbPosition*> pos_out_of_date;
-  std::set<int64> evict_file_set;
-  std::map<int64, std::vector<std::pair<K, EmbPosition*>>> evict_file_map;
+  mutex compaction_mu_;
+  Thread* compaction_thread_;
+  condition_variable compaction_cv_;
+  bool shutdown_ GUARDED_BY(mu_) = false;
+  int64 compaction_invalid_percent_;
+  int64 compaction_rate_mb_;
+
+  std::atomic<int64> compacted_file_num_;
+  std::atomic<int64> compacted_record_num_;
+  std::atomic<int64> compacted_bytes_;
+  std::atomic<int64> compaction_micros_;
+  std::atomic<int64> commit_num_;
+  std::atomic<int64> total_commit_micros_;
+  std::atomic<int64> max_commit_micros_;
+  std::atomic<int64> mutation_num_;
 };
 template <class K, class V>
 const int SSDHashKV<K, V>::EMPTY_KEY_ = -1;
@@ -466,9 +1074,17 @@ const int SSDHashKV<K, V>::DELETED_KEY_ = -2;
 template <class K, class V>
 const int SSDHashKV<K, V>::cap_invalid_pos = 100000;
 template <class K, class V>
-const int SSDHashKV<K, V>::cap_invalid_id = 10000000;
-template <class K, class V>
 const size_t SSDHashKV<K, V>::buffer_size = 1<<27;
+template <class K, class V>
+const size_t SSDHashKV<K, V>::kCompactionChunkSize = 1024;
+template <class K, class V>
+const int64 SSDHashKV<K, V>::kCompactionIntervalMilliseconds = 100;
+template <class K, class V>
+const char* const SSDHashKV<K, V>::kIndexFileName = "index";
+template <class K, class V>
+const uint64 SSDHashKV<K, V>::kIndexMagic = 0x5353444841534858ULL;
+template <class K, class V>
+const uint64 SSDHashKV<K, V>::kIndexFormat = 1;
 
 }  // namespace embedding
 }  // namespace tensorflow
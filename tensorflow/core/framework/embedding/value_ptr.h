@@ -231,6 +231,17 @@ class ValuePtr {
     }
   }
 
+  // Publishes a copy of `v` as the allocated value of emb_index with one
+  // pointer swap and returns the replaced value, which lock-free readers may
+  // still hold. Only for layouts keeping a pointer per value.
+  virtual V* ExchangeValue(Allocator* allocator, int64 value_len, const V* v, int emb_index) {
+    MetaHeader* meta = (MetaHeader*)ptr_;
+    V* tensor_val = (V*)allocator->AllocateRaw(0/*alignemnt unused*/, sizeof(V) * value_len);
+    memcpy(tensor_val, v, sizeof(V) * value_len);
+    V** slot = (V**)((int64*)ptr_ + meta->GetHeaderSize()) + emb_index;
+    return __atomic_exchange_n(slot, tensor_val, __ATOMIC_RELEASE);
+  }
+
   virtual void Free(const V* v) {}
 
   virtual void Destroy(Allocator* allocator) {
@@ -346,13 +357,41 @@ class NormalValuePtr : public ValuePtr<V> {
 
 template <class V>
 class NormalContiguousValuePtr : public ValuePtr<V>{
+/*_____________________________________________________________________________
+  |             |               |                   |           |           |
+  | allocator   | ValuePtr      | FixedLengthHeader | embedding |   slot    |...
+  | (8 bytes)   | object        |    (16 bytes)     |     V     |     V     |
+  -----------------------------------------------------------------------------
+  The ValuePtr object, the header, the embedding and all the slots of a key
+  live in one slot of the allocator, e.g. a fixed-size bin of ev_allocator,
+  so a key costs one allocation and deleting the ValuePtr on Shrink or
+  eviction puts the whole slot back on the bin's free list.
+  Must be created by new (allocator, size) NormalContiguousValuePtr<V>(size).
+ */
   public:
-   NormalContiguousValuePtr(Allocator* allocator, size_t size) {
-    this->ptr_ = allocator->AllocateRaw(0/*alignemnt unused*/, sizeof(FixedLengthHeader) + sizeof(V) * size);
-    memset(this->ptr_ + sizeof(FixedLengthHeader), 0, sizeof(V) * size);
+   static void* operator new(size_t obj_size, Allocator* allocator,
+                             size_t size) {
+     char* block = (char*)allocator->AllocateRaw(0/*alignemnt unused*/,
+         PrefixBytes() + sizeof(FixedLengthHeader) + sizeof(V) * size);
+     *((Allocator**)block) = allocator;
+     return block + sizeof(Allocator*);
+   }
+
+   static void operator delete(void* ptr) {
+     char* block = (char*)ptr - sizeof(Allocator*);
+     (*((Allocator**)block))->DeallocateRaw(block);
+   }
+
+   static void operator delete(void* ptr, Allocator* allocator, size_t size) {
+     operator delete(ptr);
+   }
+
+   explicit NormalContiguousValuePtr(size_t size) {
+    this->ptr_ = (char*)this - sizeof(Allocator*) + PrefixBytes();
+    memset((char*)this->ptr_ + sizeof(FixedLengthHeader), 0, sizeof(V) * size);
     new ((char*)this->ptr_) FixedLengthHeader();
    }
-  
+
    ~NormalContiguousValuePtr(){
    }
 
@@ -361,7 +400,9 @@ class NormalContiguousValuePtr : public ValuePtr<V>{
     std::bitset<8> bs(meta);
     if (!bs.test(emb_index)) {
       while(this->flag_.test_and_set(std::memory_order_acquire));
+      bs = std::bitset<8>(*((int8*)((char*)this->ptr_ + 6)));
       if (bs.test(emb_index)) {
+        this->flag_.clear(std::memory_order_release);
         return ((V*)this->ptr_ + sizeof(FixedLengthHeader) / sizeof(V) + offset);
       }
       V* tensor_val = ((V*)this->ptr_ + sizeof(FixedLengthHeader) / sizeof(V) + offset);
@@ -385,10 +426,22 @@ class NormalContiguousValuePtr : public ValuePtr<V>{
     }
   }
 
+  // The values are inline, StorageManager::UpsertValue swaps the whole
+  // ValuePtr instead.
+  virtual V* ExchangeValue(Allocator* allocator, int64 value_len, const V* v, int emb_index) override {
+    LOG(FATAL) << "Unsupport ExchangeValue in NormalContiguousValuePtr";
+  }
+
+  // The values are released together with the ValuePtr object by delete.
   virtual void Destroy(Allocator* allocator) {
-    allocator->DeallocateRaw(this->ptr_);
   }
-  
+
+  // Bytes in front of the FixedLengthHeader, kept a multiple of 16 so the
+  // values stay as aligned as the allocation itself.
+  static size_t PrefixBytes() {
+    return (sizeof(Allocator*) + sizeof(NormalContiguousValuePtr<V>) + 15) & ~(size_t)15;
+  }
+
   int64 GetStep() {
     return ((FixedLengthHeader*)this->ptr_)->GetGlobalStep();
   }
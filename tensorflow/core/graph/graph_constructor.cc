@@ -1935,6 +1935,7 @@ void StageGraph(Graph* dest, Node* stage_node, Node* unstage_node,
     .Input(src_list)
     .Attr("container", stage_node->def().attr().at("container"))
     .Attr("shared_capacity", stage_node->def().attr().at("shared_capacity"))
+    .Attr("shared_max_capacity", stage_node->def().attr().at("shared_max_capacity"))
     .Attr("shared_name", stage_node->def().attr().at("shared_name"))
     .Attr("timeout_millis", stage_node->def().attr().at("timeout_millis"))
     .Finalize(&node_def_stage));
@@ -1950,6 +1951,7 @@ void StageGraph(Graph* dest, Node* stage_node, Node* unstage_node,
     .Attr("container", unstage_node->def().attr().at("container"))
     .Attr("dtypes", DataTypeSlice(type_vec))
     .Attr("shared_capacity", unstage_node->def().attr().at("shared_capacity"))
+    .Attr("shared_max_capacity", unstage_node->def().attr().at("shared_max_capacity"))
     .Attr("shared_name", unstage_node->def().attr().at("shared_name"))
     .Attr("shared_threads", unstage_node->def().attr().at("shared_threads"))
     .Finalize(&node_def_unstage));
@@ -1,3 +1,5 @@
+#include <atomic>
+#include <set>
 #include <thread>
 
 #include "tensorflow/core/framework/op.h"
@@ -24,6 +26,7 @@
 #include "tensorflow/core/kernels/ops_testutil.h"
 #include "tensorflow/core/kernels/ops_util.h"
 #include "tensorflow/core/lib/io/path.h"
+#include "tensorflow/core/lib/random/simple_philox.h"
 #include "tensorflow/core/lib/strings/strcat.h"
 #include "tensorflow/core/platform/test.h"
 #include "tensorflow/core/util/tensor_slice_reader_cache.h"
@@ -167,6 +170,57 @@ TEST(TensorBundleTest, TestEVShrinkLockless) {
 
 }
 
+TEST(EmbeddingVariableTest, TestValuePtrRecycle) {
+  int64 value_size = 8;
+  Tensor value(DT_FLOAT, TensorShape({value_size}));
+  test::FillValues<float>(&value, std::vector<float>(value_size, 9.0));
+  auto storage_manager = new embedding::StorageManager<int64, float>(
+      "name", embedding::StorageConfig(embedding::DRAM, "", {1<<30},
+                                       "normal_contiguous"));
+  TF_CHECK_OK(storage_manager->Init());
+  EmbeddingVar<int64, float>* emb_var
+    = new EmbeddingVar<int64, float>("name",
+        storage_manager, EmbeddingConfig(0, 0, 1, 0, "", 5, 0, 99999, -1.0,
+                                         "normal_contiguous"));
+  emb_var->Init(value, 1);
+
+  int64 insert_num = 100;
+  std::vector<float> val(value_size);
+  for (int64 i = 0; i < insert_num; ++i) {
+    ValuePtr<float>* value_ptr = nullptr;
+    TF_CHECK_OK(emb_var->LookupOrCreateKey(i, &value_ptr, 1));
+    emb_var->flat(value_ptr).setConstant(1.0);
+  }
+
+  {
+    // A reader that entered before the shrink keeps the ValuePtrs alive.
+    embedding::EpochGuard guard(emb_var->epoch_manager());
+    TF_CHECK_OK(emb_var->Shrink(10));
+    ASSERT_EQ(emb_var->Size(), 0);
+    TF_CHECK_OK(emb_var->Shrink(10));
+    embedding::RecycleMetrics metrics = storage_manager->GetRecycleMetrics();
+    ASSERT_EQ(metrics.retired_num, insert_num);
+    ASSERT_EQ(metrics.pooled_num, 0);
+  }
+  TF_CHECK_OK(emb_var->Shrink(10));
+  embedding::RecycleMetrics metrics = storage_manager->GetRecycleMetrics();
+  ASSERT_EQ(metrics.retired_num, 0);
+  ASSERT_EQ(metrics.pooled_num, insert_num);
+
+  // New keys reuse the recycled ValuePtrs and start from the default value.
+  for (int64 i = insert_num; i < 2 * insert_num; ++i) {
+    emb_var->LookupOrCreate(i, val.data(), nullptr);
+    for (int64 j = 0; j < value_size; ++j) {
+      ASSERT_EQ(val[j], 9.0);
+    }
+  }
+  metrics = storage_manager->GetRecycleMetrics();
+  ASSERT_EQ(metrics.pooled_num, 0);
+  ASSERT_EQ(metrics.reused_num, insert_num);
+  ASSERT_EQ(metrics.freed_num, 0);
+  ASSERT_EQ(emb_var->Size(), insert_num);
+}
+
 
 TEST(EmbeddingVariableTest, TestEmptyEV) {
   int64 value_size = 8;
@@ -392,6 +446,209 @@ TEST(EmbeddingVariableTest, TestEVExportLargeLockless) {
   }
 }
 
+TEST(EmbeddingVariableTest, TestEVExportWithThreadPool) {
+  // An odd value_size makes rows straddle the fixed dump buffer.
+  int64 value_size = 13;
+  int64 ev_size = 400000;
+  EmbeddingVar<int64, float>* variable = InitEV_Lockless(value_size);
+  for (int64 i = 0; i < ev_size; i++) {
+    ValuePtr<float>* value_ptr = nullptr;
+    variable->LookupOrCreateKey(i, &value_ptr);
+    typename TTypes<float>::Flat vflat = variable->flat(value_ptr);
+    for (int64 j = 0; j < value_size; j++) {
+      vflat(j) = i + j;
+    }
+  }
+
+  thread::ThreadPool pool(Env::Default(), "ev_save", 8);
+  Tensor part_offset_tensor(DT_INT32,  TensorShape({kSavedPartitionNum + 1}));
+  BundleWriter writer(Env::Default(), Prefix("ev_pool"));
+  TF_ASSERT_OK(DumpEmbeddingValues(variable, "var/part_0", &writer,
+                                   &part_offset_tensor, &pool));
+  TF_ASSERT_OK(writer.Finish());
+
+  BundleReader reader(Env::Default(), Prefix("ev_pool"));
+  TF_ASSERT_OK(reader.status());
+  Tensor keys(DT_INT64, TensorShape{ev_size});
+  TF_ASSERT_OK(reader.Lookup("var/part_0-keys", &keys));
+  Tensor values(DT_FLOAT, TensorShape{ev_size, value_size});
+  TF_ASSERT_OK(reader.Lookup("var/part_0-values", &values));
+  auto keys_flat = keys.flat<int64>();
+  auto values_matrix = values.matrix<float>();
+  for (int64 i = 0; i < ev_size; i++) {
+    for (int64 j = 0; j < value_size; j++) {
+      ASSERT_EQ(values_matrix(i, j), keys_flat(i) + j);
+    }
+  }
+}
+
+void SaveEVForRestore(const string& prefix, int64 ev_size, int64 value_size) {
+  EmbeddingVar<int64, float>* variable = InitEV_Lockless(value_size);
+  for (int64 i = 0; i < ev_size; i++) {
+    ValuePtr<float>* value_ptr = nullptr;
+    variable->LookupOrCreateKey(i, &value_ptr);
+    typename TTypes<float>::Flat vflat = variable->flat(value_ptr);
+    for (int64 j = 0; j < value_size; j++) {
+      vflat(j) = i + j;
+    }
+  }
+  Tensor part_offset_tensor(DT_INT32,  TensorShape({kSavedPartitionNum + 1}));
+  BundleWriter writer(Env::Default(), Prefix(prefix));
+  TF_CHECK_OK(DumpEmbeddingValues(variable, "var", &writer,
+                                  &part_offset_tensor));
+  TF_CHECK_OK(writer.Finish());
+}
+
+TEST(EmbeddingVariableTest, TestEVRestoreWithThreadPool) {
+  int64 value_size = 13;
+  int64 ev_size = 400000;
+  SaveEVForRestore("ev_restore", ev_size, value_size);
+
+  thread::ThreadPool pool(Env::Default(), "ev_restore", 8);
+  EmbeddingVar<int64, float>* variable = InitEV_Lockless(value_size);
+  BundleReader reader(Env::Default(), Prefix("ev_restore"));
+  TF_ASSERT_OK(reader.status());
+  TF_ASSERT_OK(EVRestoreDynamically(variable, "var", 0, 1, nullptr, &reader,
+      "-partition_offset", "-keys", "-values", "-versions", "-freqs", &pool));
+  ASSERT_EQ(variable->Size(), ev_size);
+  embedding::RestoreMetrics metrics = variable->GetRestoreMetrics();
+  ASSERT_EQ(metrics.restored_num, ev_size);
+
+  std::vector<float> val(value_size);
+  for (int64 i = 0; i < ev_size; i++) {
+    variable->LookupOrCreate(i, val.data(), nullptr);
+    for (int64 j = 0; j < value_size; j++) {
+      ASSERT_EQ(val[j], i + j);
+    }
+  }
+}
+
+// Gives the even keys of `variable` stale rows of -1.
+void SetStaleRows(EmbeddingVar<int64, float>* variable, int64 ev_size,
+                  int64 value_size) {
+  for (int64 i = 0; i < ev_size; i += 2) {
+    ValuePtr<float>* value_ptr = nullptr;
+    variable->LookupOrCreateKey(i, &value_ptr);
+    typename TTypes<float>::Flat vflat = variable->flat(value_ptr);
+    for (int64 j = 0; j < value_size; j++) {
+      vflat(j) = -1;
+    }
+  }
+}
+
+void IncrRestoreWhileLookup(EmbeddingVar<int64, float>* variable,
+                            const string& prefix, int64 ev_size,
+                            int64 value_size) {
+  // The live EV already holds half of the keys with stale rows.
+  SetStaleRows(variable, ev_size, value_size);
+
+  std::atomic<bool> done(false);
+  std::atomic<int64> lookup_num(0);
+  std::atomic<int64> bad_row_num(0);
+  auto lookup = [&](int64 seed) {
+    std::vector<float> val(value_size);
+    int64 key = seed;
+    while (!done) {
+      key = (key + 7919) % ev_size;
+      if (key % 2 != 0) continue;
+      variable->LookupOrCreate(key, val.data(), nullptr);
+      // A row is either all stale or all restored, never a mix of both.
+      bool stale = (val[0] == -1);
+      for (int64 j = 0; j < value_size; j++) {
+        if (val[j] != (stale ? -1 : key + j)) {
+          ++bad_row_num;
+          break;
+        }
+      }
+      ++lookup_num;
+    }
+  };
+  std::vector<std::thread> lookup_threads;
+  for (int i = 0; i < 4; i++) {
+    lookup_threads.emplace_back(lookup, i * 1000);
+  }
+
+  thread::ThreadPool pool(Env::Default(), "ev_incr_restore", 4);
+  EVRestoreThrottle throttle;
+  throttle.slice_key_num = 4096;
+  throttle.slice_interval_micros = 1000;
+  throttle.upsert = true;
+  BundleReader reader(Env::Default(), Prefix(prefix));
+  TF_ASSERT_OK(reader.status());
+  int64 lookup_num_before = lookup_num;
+  TF_ASSERT_OK(EVRestoreDynamically(variable, "var", 0, 1, nullptr, &reader,
+      "-partition_offset", "-keys", "-values", "-versions", "-freqs", &pool,
+      throttle));
+  int64 lookup_num_during = lookup_num - lookup_num_before;
+  done = true;
+  for (auto& t : lookup_threads) {
+    t.join();
+  }
+
+  LOG(INFO) << "lookups during the restore: " << lookup_num_during;
+  ASSERT_GT(lookup_num_during, 0);
+  ASSERT_EQ(bad_row_num, 0);
+  ASSERT_EQ(variable->Size(), ev_size);
+  // Existing keys are upserted as well as new ones inserted.
+  std::vector<float> val(value_size);
+  for (int64 i = 0; i < ev_size; i++) {
+    variable->LookupOrCreate(i, val.data(), nullptr);
+    for (int64 j = 0; j < value_size; j++) {
+      ASSERT_EQ(val[j], i + j);
+    }
+  }
+}
+
+TEST(EmbeddingVariableTest, TestEVIncrRestoreWhileLookup) {
+  int64 value_size = 13;
+  int64 ev_size = 200000;
+  SaveEVForRestore("ev_incr_restore", ev_size, value_size);
+  IncrRestoreWhileLookup(InitEV_Lockless(value_size), "ev_incr_restore",
+                         ev_size, value_size);
+}
+
+TEST(EmbeddingVariableTest, TestEVIncrRestoreWhileLookupContiguous) {
+  int64 value_size = 13;
+  int64 ev_size = 200000;
+  SaveEVForRestore("ev_incr_restore_contiguous", ev_size, value_size);
+  Tensor value(DT_FLOAT, TensorShape({value_size}));
+  test::FillValues<float>(&value, std::vector<float>(value_size, 10.0));
+  auto storage_manager = new embedding::StorageManager<int64, float>(
+      "EmbeddingVar", embedding::StorageConfig(embedding::DRAM, "", {1<<30},
+                                               "normal_contiguous"));
+  TF_CHECK_OK(storage_manager->Init());
+  EmbeddingVar<int64, float>* variable
+    = new EmbeddingVar<int64, float>("EmbeddingVar",
+        storage_manager, EmbeddingConfig(0, 0, 1, 0, "", 0, 0, 99999, -1.0,
+                                         "normal_contiguous"));
+  variable->Init(value, 1);
+  IncrRestoreWhileLookup(variable, "ev_incr_restore_contiguous", ev_size,
+                         value_size);
+}
+
+TEST(EmbeddingVariableTest, TestEVFullRestoreKeepsExistingRows) {
+  int64 value_size = 13;
+  int64 ev_size = 10000;
+  SaveEVForRestore("ev_full_restore", ev_size, value_size);
+  EmbeddingVar<int64, float>* variable = InitEV_Lockless(value_size);
+  SetStaleRows(variable, ev_size, value_size);
+
+  thread::ThreadPool pool(Env::Default(), "ev_full_restore", 4);
+  BundleReader reader(Env::Default(), Prefix("ev_full_restore"));
+  TF_ASSERT_OK(reader.status());
+  TF_ASSERT_OK(EVRestoreDynamically(variable, "var", 0, 1, nullptr, &reader,
+      "-partition_offset", "-keys", "-values", "-versions", "-freqs", &pool));
+
+  ASSERT_EQ(variable->Size(), ev_size);
+  std::vector<float> val(value_size);
+  for (int64 i = 0; i < ev_size; i++) {
+    variable->LookupOrCreate(i, val.data(), nullptr);
+    for (int64 j = 0; j < value_size; j++) {
+      ASSERT_EQ(val[j], (i % 2 == 0) ? -1 : i + j);
+    }
+  }
+}
+
 void multi_insertion(EmbeddingVar<int64, float>* variable, int64 value_size){
   for (long j = 0; j < 5; j++) {
     ValuePtr<float>* value_ptr = nullptr;
@@ -770,6 +1027,83 @@ TEST(EmbeddingVariableTest, TestBloomCounterInt8) {
   }
 }
 
+// Creates an EV whose bloom filter admits keys seen filter_freq times, the
+// blocked filter when `blocked` is set.
+EmbeddingVar<int64, float>* InitEV_Bloom(int64 value_size, int64 filter_freq,
+                                         int64 max_element_size,
+                                         DataType counter_type, bool blocked) {
+  Tensor value(DT_FLOAT, TensorShape({value_size}));
+  test::FillValues<float>(&value, std::vector<float>(value_size, 10.0));
+  auto storage_manager = new embedding::StorageManager<int64, float>(
+                 "EmbeddingVar", embedding::StorageConfig());
+  TF_CHECK_OK(storage_manager->Init());
+  EmbeddingVar<int64, float>* var
+    = new EmbeddingVar<int64, float>("EmbeddingVar",
+        storage_manager,
+          EmbeddingConfig(0, 0, 1, 1, "", 0, filter_freq, 999999, -1.0,
+                          "normal", max_element_size, 0.01, counter_type));
+  setenv("TF_EV_BLOCKED_BLOOM_FILTER", blocked ? "1" : "0", 1);
+  var->Init(value, 1);
+  unsetenv("TF_EV_BLOCKED_BLOOM_FILTER");
+  return var;
+}
+
+TEST(EmbeddingVariableTest, TestBlockedBloomFilterConcurrentAdd) {
+  int64 value_size = 8;
+  EmbeddingVar<int64, float>* var =
+      InitEV_Bloom(value_size, 100000, 1000, DT_UINT32, true);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; i++) {
+    threads.emplace_back([var, value_size]() {
+      std::vector<float> val(value_size);
+      for (int j = 0; j < 1000; j++) {
+        var->LookupOrCreate(42, val.data(), nullptr);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  // No increment is lost to a concurrent one.
+  ASSERT_EQ(var->GetFreq(42), 8000);
+  ASSERT_EQ(var->Size(), 0);
+
+  // Counters saturate at filter_freq.
+  EmbeddingVar<int64, float>* admit_var =
+      InitEV_Bloom(value_size, 3, 1000, DT_UINT8, true);
+  std::vector<float> val(value_size);
+  for (int j = 0; j < 10; j++) {
+    admit_var->LookupOrCreate(7, val.data(), nullptr);
+  }
+  ASSERT_EQ(admit_var->GetFreq(7), 3);
+  ASSERT_EQ(admit_var->Size(), 1);
+}
+
+TEST(EmbeddingVariableTest, TestBloomFilterAccuracy) {
+  int64 value_size = 8;
+  int64 key_num = 100000;
+  std::vector<float> val(value_size);
+  double false_positive_rate[2];
+  for (int blocked = 0; blocked < 2; blocked++) {
+    EmbeddingVar<int64, float>* var =
+        InitEV_Bloom(value_size, 2, key_num, DT_UINT8, blocked);
+    for (int64 i = 0; i < key_num; i++) {
+      var->LookupOrCreate(i, val.data(), nullptr);
+    }
+    int64 false_positive = 0;
+    for (int64 i = key_num; i < 2 * key_num; i++) {
+      if (var->GetFreq(i) > 0) {
+        false_positive++;
+      }
+    }
+    false_positive_rate[blocked] = (double)false_positive / key_num;
+  }
+  LOG(INFO) << "false positive rate, bloom filter: " << false_positive_rate[0]
+            << ", blocked bloom filter: " << false_positive_rate[1];
+  // Blocked filters trade some accuracy for locality.
+  ASSERT_LT(false_positive_rate[1], 0.05);
+}
+
 TEST(EmbeddingVariableTest, TestInsertAndLookup) {
   int64 value_size = 128;
   Tensor value(DT_INT64, TensorShape({value_size}));
@@ -938,6 +1272,66 @@ void BM_HYBRID_LOCKLESS(int iters, int thread_num) {
   }
 }
 
+void gather_process(EmbeddingVar<int64, float>* variable, int64* keys,
+                    int64 InsertLoop, int thread_num, int64 i,
+                    int64 value_size, bool batch) {
+  const int64 batch_size = 1024;
+  float* val = (float*)malloc(sizeof(float) * value_size * batch_size);
+  std::vector<const float*> default_values(batch_size, nullptr);
+  for (int64 j = i * InsertLoop/thread_num; j < (i+1) * InsertLoop/thread_num;
+       j += batch_size) {
+    int64 num = std::min(batch_size, (i+1) * InsertLoop/thread_num - j);
+    if (batch) {
+      variable->BatchLookupOrCreate(keys + j, val, default_values.data(),
+                                    nullptr, num);
+    } else {
+      for (int64 k = 0; k < num; k++) {
+        variable->LookupOrCreate(keys[j + k], val + k * value_size, nullptr);
+      }
+    }
+  }
+  free(val);
+}
+
+void BM_GATHER_LOCKLESS(int iters, int thread_num, bool batch) {
+  testing::StopTiming();
+  testing::UseRealTime();
+
+  int64 value_size = 128;
+  EmbeddingVar<int64, float>* variable = InitEV_Lockless(value_size);
+  int64 InsertLoop =  1000000;
+
+  srand((unsigned)time(NULL));
+  int64 *keys = (int64 *)malloc(sizeof(int64)*InsertLoop);
+  for (int64 i = 0; i < InsertLoop; i++) {
+    keys[i] = rand() % InsertLoop;
+  }
+  gather_process(variable, keys, InsertLoop, 1, 0, value_size, false);
+
+  testing::StartTiming();
+  while (iters--) {
+    std::vector<std::thread> gather_threads(thread_num);
+    for (size_t i = 0 ; i < thread_num; i++) {
+      gather_threads[i] = std::thread(gather_process, variable, keys,
+                                      InsertLoop, thread_num, i, value_size,
+                                      batch);
+    }
+    for (auto &t : gather_threads) {
+      t.join();
+    }
+  }
+  testing::StopTiming();
+  free(keys);
+}
+
+void BM_SINGLE_GATHER_LOCKLESS(int iters, int thread_num) {
+  BM_GATHER_LOCKLESS(iters, thread_num, false);
+}
+
+void BM_BATCH_GATHER_LOCKLESS(int iters, int thread_num) {
+  BM_GATHER_LOCKLESS(iters, thread_num, true);
+}
+
 BENCHMARK(BM_MULTIREAD_LOCKLESS)
     ->Arg(1)
     ->Arg(2)
@@ -952,6 +1346,187 @@ BENCHMARK(BM_HYBRID_LOCKLESS)
     ->Arg(8)
     ->Arg(16);
 
+BENCHMARK(BM_SINGLE_GATHER_LOCKLESS)
+    ->Arg(1)
+    ->Arg(4)
+    ->Arg(16);
+
+BENCHMARK(BM_BATCH_GATHER_LOCKLESS)
+    ->Arg(1)
+    ->Arg(4)
+    ->Arg(16);
+
+// blocked 0 benchmarks BloomFilter, 1 BlockedBloomFilter.
+void BM_BLOOM_FILTER_LOOKUP(int iters, int blocked) {
+  testing::StopTiming();
+  int64 value_size = 8;
+  int64 key_num = 1 << 20;
+  EmbeddingVar<int64, float>* var =
+      InitEV_Bloom(value_size, 1 << 30, key_num, DT_UINT16, blocked);
+  std::vector<int64> keys(key_num);
+  random::PhiloxRandom philox(123, 17);
+  random::SimplePhilox rnd(&philox);
+  for (int64 i = 0; i < key_num; i++) {
+    keys[i] = rnd.Uniform64(1LL << 40);
+  }
+  std::vector<float> val(value_size);
+
+  testing::StartTiming();
+  for (int i = 0; i < iters; i++) {
+    // Keys stay below filter_freq, every lookup updates the counters.
+    var->LookupOrCreate(keys[i & (key_num - 1)], val.data(), nullptr);
+  }
+  testing::StopTiming();
+  testing::ItemsProcessed(iters);
+}
+
+BENCHMARK(BM_BLOOM_FILTER_LOOKUP)
+    ->Arg(0)
+    ->Arg(1);
+
+TEST(EmbeddingVariableTest, TestBatchLookupOrCreateInPlace) {
+  int64 value_size = 8;
+  EmbeddingVar<int64, float>* variable = InitEV_Lockless(value_size);
+  std::vector<int64> keys = {3, 1, 3, 7, 5};
+  std::vector<const float*> default_values(keys.size(), nullptr);
+  std::vector<float> expected(keys.size() * value_size);
+  variable->BatchLookupOrCreate(keys.data(), expected.data(),
+                                default_values.data(), nullptr, keys.size());
+  std::vector<float> sum(value_size, 0.0);
+  int64 num = 0;
+  variable->BatchLookupOrCreate(keys.data(), default_values.data(), nullptr,
+      keys.size(), [&](int64 i, const float* emb) {
+    ASSERT_EQ(i, num++);
+    for (int64 j = 0; j < value_size; ++j) {
+      ASSERT_EQ(emb[j], expected[i * value_size + j]);
+      sum[j] += emb[j];
+    }
+  });
+  ASSERT_EQ(num, static_cast<int64>(keys.size()));
+  for (int64 j = 0; j < value_size; ++j) {
+    ASSERT_EQ(sum[j], 10.0 * keys.size());
+  }
+}
+
+// Mean of 16 embeddings per row, gathered into a [N, dim] buffer and then
+// reduced when fused is 0, accumulated where they are stored when fused is 1.
+void BM_SPARSE_COMBINE_LOCKLESS(int iters, int fused) {
+  testing::StopTiming();
+  const int64 value_size = 64;
+  const int64 num_rows = 1024;
+  const int64 num_per_row = 16;
+  const int64 N = num_rows * num_per_row;
+  EmbeddingVar<int64, float>* variable = InitEV_Lockless(value_size);
+  std::vector<int64> keys(N);
+  random::PhiloxRandom philox(123, 17);
+  random::SimplePhilox rnd(&philox);
+  for (int64 i = 0; i < N; i++) {
+    keys[i] = rnd.Uniform64(1 << 20);
+  }
+  std::vector<const float*> default_values(N, nullptr);
+  std::vector<float> gathered(N * value_size);
+  std::vector<float> out(num_rows * value_size);
+  variable->BatchLookupOrCreate(keys.data(), gathered.data(),
+                                default_values.data(), nullptr, N);
+
+  testing::StartTiming();
+  for (int it = 0; it < iters; ++it) {
+    std::fill(out.begin(), out.end(), 0.0);
+    if (fused) {
+      variable->BatchLookupOrCreate(keys.data(), default_values.data(),
+          nullptr, N, [&](int64 i, const float* emb) {
+        float* out_row = out.data() + (i / num_per_row) * value_size;
+        for (int64 j = 0; j < value_size; ++j) {
+          out_row[j] += emb[j];
+        }
+      });
+    } else {
+      variable->BatchLookupOrCreate(keys.data(), gathered.data(),
+                                    default_values.data(), nullptr, N);
+      for (int64 i = 0; i < N; ++i) {
+        float* out_row = out.data() + (i / num_per_row) * value_size;
+        for (int64 j = 0; j < value_size; ++j) {
+          out_row[j] += gathered[i * value_size + j];
+        }
+      }
+    }
+    for (int64 j = 0; j < num_rows * value_size; ++j) {
+      out[j] /= num_per_row;
+    }
+  }
+  testing::StopTiming();
+  testing::ItemsProcessed(static_cast<int64>(iters) * N);
+}
+
+BENCHMARK(BM_SPARSE_COMBINE_LOCKLESS)
+    ->Arg(0)
+    ->Arg(1);
+
+// thread_num 0 saves without a thread pool.
+void BM_EV_SAVE(int iters, int thread_num) {
+  testing::StopTiming();
+  testing::UseRealTime();
+
+  int64 value_size = 128;
+  int64 ev_size = 1000000;
+  EmbeddingVar<int64, float>* variable = InitEV_Lockless(value_size);
+  for (int64 i = 0; i < ev_size; i++) {
+    ValuePtr<float>* value_ptr = nullptr;
+    variable->LookupOrCreateKey(i, &value_ptr);
+  }
+  std::unique_ptr<thread::ThreadPool> pool;
+  if (thread_num > 0) {
+    pool.reset(new thread::ThreadPool(Env::Default(), "ev_save", thread_num));
+  }
+  Tensor part_offset_tensor(DT_INT32,  TensorShape({kSavedPartitionNum + 1}));
+
+  testing::StartTiming();
+  for (int i = 0; i < iters; i++) {
+    BundleWriter writer(Env::Default(), Prefix("ev_save"));
+    TF_CHECK_OK(DumpEmbeddingValues(variable, "var/part_0", &writer,
+                                    &part_offset_tensor, pool.get()));
+    TF_CHECK_OK(writer.Finish());
+  }
+  testing::StopTiming();
+  testing::BytesProcessed(static_cast<int64>(iters) * ev_size *
+                          (value_size * sizeof(float) + sizeof(int64)));
+}
+
+BENCHMARK(BM_EV_SAVE)
+    ->Arg(0)
+    ->Arg(4)
+    ->Arg(16);
+
+// thread_num 0 restores without a thread pool.
+void BM_EV_RESTORE(int iters, int thread_num) {
+  testing::StopTiming();
+  testing::UseRealTime();
+
+  int64 value_size = 128;
+  int64 ev_size = 1000000;
+  SaveEVForRestore("ev_restore_bm", ev_size, value_size);
+  std::unique_ptr<thread::ThreadPool> pool;
+  if (thread_num > 0) {
+    pool.reset(new thread::ThreadPool(Env::Default(), "ev_restore", thread_num));
+  }
+
+  for (int i = 0; i < iters; i++) {
+    EmbeddingVar<int64, float>* variable = InitEV_Lockless(value_size);
+    BundleReader reader(Env::Default(), Prefix("ev_restore_bm"));
+    testing::StartTiming();
+    TF_CHECK_OK(EVRestoreDynamically(variable, "var", 0, 1, nullptr, &reader,
+        "-partition_offset", "-keys", "-values", "-versions", "-freqs",
+        pool.get()));
+    testing::StopTiming();
+  }
+  testing::ItemsProcessed(static_cast<int64>(iters) * ev_size);
+}
+
+BENCHMARK(BM_EV_RESTORE)
+    ->Arg(0)
+    ->Arg(4)
+    ->Arg(16);
+
 
 TEST(EmbeddingVariableTest, TestAllocate) {
   int value_len = 8;
@@ -997,6 +1572,31 @@ TEST(EmbeddingVariableTest, TestEVStorageType_DRAM) {
   LOG(INFO) << "size:" << variable->Size();
 }
 
+TEST(EmbeddingVariableTest, TestLookupKeySkipsRemoved) {
+  int64 value_size = 8;
+  Tensor value(DT_FLOAT, TensorShape({value_size}));
+  test::FillValues<float>(&value, std::vector<float>(value_size, 9.0));
+  auto storage_manager = new embedding::StorageManager<int64, float>(
+                 "EmbeddingVar", embedding::StorageConfig());
+  TF_CHECK_OK(storage_manager->Init());
+  EmbeddingVar<int64, float>* variable
+    = new EmbeddingVar<int64, float>("EmbeddingVar",
+        storage_manager, EmbeddingConfig(0, 0, 1, 1, "", 0, 0, 999999, -1.0,
+                                         "normal", 0, -1.0, DT_UINT64));
+  variable->Init(value, 1);
+
+  ValuePtr<float>* value_ptr = nullptr;
+  for (int64 i = 0; i < 10; i++) {
+    TF_CHECK_OK(variable->LookupOrCreateKey(i, &value_ptr));
+  }
+  TF_CHECK_OK(storage_manager->Remove(3));
+  ASSERT_TRUE(variable->LookupKey(2, &value_ptr).ok());
+  ASSERT_TRUE(errors::IsNotFound(variable->LookupKey(3, &value_ptr)));
+  ASSERT_TRUE(errors::IsNotFound(variable->LookupKey(42, &value_ptr)));
+  // A failed lookup must not create the key.
+  ASSERT_EQ(variable->Size(), 9);
+}
+
 void t1(KVInterface<int64, float>* hashmap) {
   for (int i = 0; i< 100; ++i) {
     hashmap->Insert(i, new NormalValuePtr<float>(ev_allocator(), 100));
@@ -1016,6 +1616,9 @@ TEST(EmbeddingVariableTest, TestRemoveLockless) {
   TF_CHECK_OK(hashmap->Remove(2));
   ASSERT_EQ(hashmap->Size(), 98);
   LOG(INFO) << "2 size:" << hashmap->Size();
+  // Removing a missing key leaves the size alone.
+  ASSERT_FALSE(hashmap->Remove(1).ok());
+  ASSERT_EQ(hashmap->Size(), 98);
 }
 
 TEST(EmbeddingVariableTest, TestBatchCommitofDBKV) {
@@ -1044,7 +1647,7 @@ TEST(EmbeddingVariableTest, TestBatchCommitofDBKV) {
 
   for(int64 i = 0; i < 6; i++) {
     key_list.emplace_back(i);
-    ValuePtr<float>* tmp = new NormalContiguousValuePtr<float>(ev_allocator(), 4);
+    ValuePtr<float>* tmp = new (ev_allocator(), 4) NormalContiguousValuePtr<float>(4);
     value_ptr_list.emplace_back(tmp);
   }
 
@@ -1058,7 +1661,7 @@ TEST(EmbeddingVariableTest, TestBatchCommitofDBKV) {
 
 void InsertAndCommit(KVInterface<int64, float>* hashmap) {
   for (int64 i = 0; i< 100; ++i) {
-    const ValuePtr<float>* tmp= new NormalContiguousValuePtr<float>(ev_allocator(), 100);
+    const ValuePtr<float>* tmp= new (ev_allocator(), 100) NormalContiguousValuePtr<float>(100);
     hashmap->Insert(i, tmp);
     hashmap->Commit(i, tmp);
   }
@@ -1077,6 +1680,9 @@ TEST(EmbeddingVariableTest, TestSizeDBKV) {
   TF_CHECK_OK(hashmap->Remove(2));
   ASSERT_EQ(hashmap->Size(), 98);
   LOG(INFO) << "2 size:" << hashmap->Size();
+  // Removing a missing key leaves the size alone.
+  ASSERT_FALSE(hashmap->Remove(1).ok());
+  ASSERT_EQ(hashmap->Size(), 98);
 }
 
 TEST(EmbeddingVariableTest, TestSSDIterator) {
@@ -1087,7 +1693,7 @@ TEST(EmbeddingVariableTest, TestSSDIterator) {
   ASSERT_EQ(hashmap->Size(), 0);
   std::vector<ValuePtr<float>*> value_ptrs;
   for (int64 i = 0; i < 10; ++i) {
-    ValuePtr<float>* tmp= new NormalContiguousValuePtr<float>(alloc, 126);
+    ValuePtr<float>* tmp= new (alloc, 126) NormalContiguousValuePtr<float>(126);
     tmp->SetValue((float)i, 126);
     value_ptrs.emplace_back(tmp);
   }
@@ -1114,7 +1720,7 @@ TEST(EmbeddingVariableTest, TestLevelDBIterator) {
   ASSERT_EQ(hashmap->Size(), 0);
   std::vector<ValuePtr<float>*> value_ptrs;
   for (int64 i = 0; i < 10; ++i) {
-    ValuePtr<float>* tmp= new NormalContiguousValuePtr<float>(ev_allocator(), 126);
+    ValuePtr<float>* tmp= new (ev_allocator(), 126) NormalContiguousValuePtr<float>(126);
     tmp->SetValue((float)i, 126);
     value_ptrs.emplace_back(tmp);
   }
@@ -1134,6 +1740,715 @@ TEST(EmbeddingVariableTest, TestLevelDBIterator) {
     index++;
   }
 }
+
+TEST(EmbeddingVariableTest, TestBatchLookupLockless) {
+  KVInterface<int64, float>* hashmap = new LocklessHashMap<int64, float>();
+  std::vector<int64> keys;
+  std::vector<const ValuePtr<float>*> value_ptrs;
+  for (int64 i = 0; i < 100; ++i) {
+    keys.emplace_back(i * 2);
+    value_ptrs.emplace_back(new (ev_allocator(), 4) NormalContiguousValuePtr<float>(4));
+  }
+  TF_CHECK_OK(hashmap->BatchInsert(keys, value_ptrs));
+  ASSERT_EQ(hashmap->Size(), 100);
+  ASSERT_EQ(hashmap->BatchInsert(keys, value_ptrs).code(),
+            error::ALREADY_EXISTS);
+
+  std::vector<int64> lookup_keys;
+  for (int64 i = 0; i < 200; ++i) {
+    lookup_keys.emplace_back(i);
+  }
+  std::vector<ValuePtr<float>*> results(lookup_keys.size());
+  TF_CHECK_OK(hashmap->BatchLookup(lookup_keys, absl::MakeSpan(results)));
+  for (int64 i = 0; i < 200; ++i) {
+    if (i % 2 == 0) {
+      ASSERT_EQ(results[i], value_ptrs[i / 2]);
+    } else {
+      ASSERT_EQ(results[i], nullptr);
+    }
+  }
+}
+
+TEST(EmbeddingVariableTest, TestBatchLookupSSD) {
+  Allocator* alloc = ev_allocator();
+  KVInterface<int64, float>* hashmap =
+      new SSDHashKV<int64, float>(testing::TmpDir(), alloc);
+  // 2MB values, so the write buffer is flushed to file once in between.
+  const int64 dims = 1 << 19;
+  const int64 num_ids = 100;
+  hashmap->SetTotalDims(dims);
+  std::vector<int64> keys;
+  std::vector<ValuePtr<float>*> value_ptrs;
+  for (int64 i = 0; i < num_ids; ++i) {
+    ValuePtr<float>* tmp = new (alloc, dims) NormalContiguousValuePtr<float>(dims);
+    tmp->SetValue((float)i, dims);
+    keys.emplace_back(i);
+    value_ptrs.emplace_back(tmp);
+  }
+  TF_CHECK_OK(hashmap->BatchCommit(keys, value_ptrs));
+  for (auto value_ptr : value_ptrs) {
+    value_ptr->Destroy(alloc);
+    delete value_ptr;
+  }
+
+  // Reversed keys with a missing one.
+  std::vector<int64> lookup_keys;
+  for (int64 i = num_ids; i >= 0; --i) {
+    lookup_keys.emplace_back(i);
+  }
+  std::vector<ValuePtr<float>*> results(lookup_keys.size());
+  TF_CHECK_OK(hashmap->BatchLookup(lookup_keys, absl::MakeSpan(results)));
+  ASSERT_EQ(results[0], nullptr);
+  for (int64 i = 1; i < lookup_keys.size(); ++i) {
+    float* val = (float*)((char*)results[i]->GetPtr() + sizeof(FixedLengthHeader));
+    for (int64 j = 0; j < dims; ++j) {
+      ASSERT_EQ(val[j], lookup_keys[i]);
+    }
+    results[i]->Destroy(alloc);
+    delete results[i];
+  }
+  delete hashmap;
+}
+
+TEST(EmbeddingVariableTest, TestSSDHashCompaction) {
+  Allocator* alloc = ev_allocator();
+  SSDHashKV<int64, float>* hashmap =
+      new SSDHashKV<int64, float>(testing::TmpDir(), alloc);
+  // 2MB values, a file holds 63 records.
+  const int64 dims = 1 << 19;
+  hashmap->SetTotalDims(dims);
+  ValuePtr<float>* tmp = new (alloc, dims) NormalContiguousValuePtr<float>(dims);
+  for (int64 i = 0; i < 100; ++i) {
+    tmp->SetValue((float)i, dims);
+    TF_CHECK_OK(hashmap->Commit(i, tmp));
+  }
+  // Overwrite most records of the first file.
+  std::vector<int64> keys;
+  std::vector<ValuePtr<float>*> value_ptrs;
+  for (int64 i = 0; i < 50; ++i) {
+    ValuePtr<float>* value_ptr = new (alloc, dims) NormalContiguousValuePtr<float>(dims);
+    value_ptr->SetValue((float)(i + 1000), dims);
+    keys.emplace_back(i);
+    value_ptrs.emplace_back(value_ptr);
+  }
+  TF_CHECK_OK(hashmap->BatchCommit(keys, value_ptrs));
+  for (auto value_ptr : value_ptrs) {
+    value_ptr->Destroy(alloc);
+    delete value_ptr;
+  }
+
+  // The background worker may have compacted the file already, the second
+  // round deletes it.
+  hashmap->CompactOnce();
+  ASSERT_FALSE(hashmap->CompactOnce());
+  CompactionMetrics metrics = hashmap->GetCompactionMetrics();
+  LOG(INFO) << metrics.DebugString();
+  ASSERT_EQ(metrics.compacted_file_num, 1);
+  ASSERT_EQ(metrics.compacted_record_num, 13);
+  ASSERT_EQ(metrics.disk_bytes, metrics.live_bytes);
+  ASSERT_EQ(metrics.commit_num, 101);
+
+  for (int64 i = 0; i < 100; ++i) {
+    ValuePtr<float>* value_ptr = nullptr;
+    TF_CHECK_OK(hashmap->Lookup(i, &value_ptr));
+    float* val =
+        (float*)((char*)value_ptr->GetPtr() + sizeof(FixedLengthHeader));
+    float expected = i < 50 ? i + 1000 : i;
+    ASSERT_EQ(val[0], expected);
+    ASSERT_EQ(val[dims - 1], expected);
+    value_ptr->Destroy(alloc);
+    delete value_ptr;
+  }
+  tmp->Destroy(alloc);
+  delete tmp;
+  delete hashmap;
+}
+
+TEST(EmbeddingVariableTest, TestSSDHashCompactionWhileLookup) {
+  Allocator* alloc = ev_allocator();
+  SSDHashKV<int64, float>* hashmap =
+      new SSDHashKV<int64, float>(testing::TmpDir(), alloc);
+  // 2MB values, a file holds 63 records.
+  const int64 dims = 1 << 19;
+  const int64 num_ids = 100;
+  hashmap->SetTotalDims(dims);
+  ValuePtr<float>* tmp = new (alloc, dims) NormalContiguousValuePtr<float>(dims);
+  for (int64 i = 0; i < num_ids; ++i) {
+    tmp->SetValue((float)i, dims);
+    TF_CHECK_OK(hashmap->Commit(i, tmp));
+  }
+
+  // Overwrites half of the records per round, which keeps compaction busy
+  // moving the other half while the lookups read them.
+  std::atomic<bool> done(false);
+  std::thread writer([&]() {
+    for (int64 round = 1; round <= 2; ++round) {
+      for (int64 i = 0; i < num_ids / 2; ++i) {
+        tmp->SetValue((float)(round * 1000 + i), dims);
+        TF_CHECK_OK(hashmap->Commit(i, tmp));
+      }
+    }
+    done = true;
+  });
+  std::thread compactor([&]() {
+    while (!done) {
+      hashmap->CompactOnce();
+    }
+  });
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; ++t) {
+    readers.emplace_back([&, t]() {
+      std::vector<int64> keys;
+      for (int64 i = t; i < num_ids; i += 4) {
+        keys.emplace_back(i);
+      }
+      std::vector<ValuePtr<float>*> results(keys.size());
+      while (!done) {
+        TF_CHECK_OK(hashmap->BatchLookup(keys, absl::MakeSpan(results)));
+        for (size_t i = 0; i < keys.size(); ++i) {
+          float* val =
+              (float*)((char*)results[i]->GetPtr() + sizeof(FixedLengthHeader));
+          // Every element of a row comes from the same commit.
+          ASSERT_EQ((int64)val[0] % 1000, keys[i]);
+          ASSERT_EQ(val[0], val[dims - 1]);
+          ASSERT_EQ(val[0], val[dims / 2]);
+          results[i]->Destroy(alloc);
+          delete results[i];
+        }
+      }
+    });
+  }
+  writer.join();
+  compactor.join();
+  for (auto& t : readers) {
+    t.join();
+  }
+
+  while (hashmap->CompactOnce()) {}
+  for (int64 i = 0; i < num_ids; ++i) {
+    ValuePtr<float>* value_ptr = nullptr;
+    TF_CHECK_OK(hashmap->Lookup(i, &value_ptr));
+    float* val =
+        (float*)((char*)value_ptr->GetPtr() + sizeof(FixedLengthHeader));
+    float expected = i < num_ids / 2 ? 2000 + i : i;
+    ASSERT_EQ(val[0], expected);
+    ASSERT_EQ(val[dims - 1], expected);
+    value_ptr->Destroy(alloc);
+    delete value_ptr;
+  }
+  LOG(INFO) << hashmap->GetCompactionMetrics().DebugString();
+  tmp->Destroy(alloc);
+  delete tmp;
+  delete hashmap;
+}
+
+TEST(EmbeddingVariableTest, TestSSDHashSaveRestore) {
+  Allocator* alloc = ev_allocator();
+  std::string index_dir = io::JoinPath(testing::TmpDir(), "ssd_index");
+  SSDHashKV<int64, float>* hashmap =
+      new SSDHashKV<int64, float>(testing::TmpDir(), alloc);
+  hashmap->SetTotalDims(126);
+  ValuePtr<float>* tmp = new (alloc, 126) NormalContiguousValuePtr<float>(126);
+  for (int64 i = 0; i < 10; ++i) {
+    tmp->SetValue((float)i, 126);
+    TF_CHECK_OK(hashmap->Commit(i, tmp));
+  }
+  TF_CHECK_OK(hashmap->Remove(9));
+  TF_CHECK_OK(hashmap->Save(index_dir));
+  // Saved files outlive the ones of the saved SSDHashKV.
+  delete hashmap;
+
+  SSDHashKV<int64, float>* restored =
+      new SSDHashKV<int64, float>(testing::TmpDir(), alloc);
+  restored->SetTotalDims(126);
+  // A truncated index fails without loading any record.
+  std::string truncated_dir = io::JoinPath(testing::TmpDir(), "ssd_index_cut");
+  std::string index;
+  TF_CHECK_OK(ReadFileToString(Env::Default(),
+                               io::JoinPath(index_dir, "index"), &index));
+  TF_CHECK_OK(Env::Default()->RecursivelyCreateDir(truncated_dir));
+  TF_CHECK_OK(WriteStringToFile(Env::Default(),
+                                io::JoinPath(truncated_dir, "index"),
+                                index.substr(0, index.size() - 8)));
+  ASSERT_FALSE(restored->Restore(truncated_dir).ok());
+  ASSERT_EQ(restored->Size(), 0);
+  TF_CHECK_OK(restored->Restore(index_dir));
+  ASSERT_EQ(restored->Size(), 9);
+  ASSERT_EQ(restored->Restore(index_dir).code(), error::FAILED_PRECONDITION);
+  tmp->SetValue((float)10, 126);
+  TF_CHECK_OK(restored->Commit(10, tmp));
+  for (int64 i = 0; i <= 10; ++i) {
+    ValuePtr<float>* value_ptr = nullptr;
+    Status st = restored->Lookup(i, &value_ptr);
+    if (i == 9) {
+      ASSERT_EQ(st.code(), error::NOT_FOUND);
+      continue;
+    }
+    TF_CHECK_OK(st);
+    float* val =
+        (float*)((char*)value_ptr->GetPtr() + sizeof(FixedLengthHeader));
+    for (int64 j = 0; j < 126; ++j) {
+      ASSERT_EQ(val[j], i);
+    }
+    value_ptr->Destroy(alloc);
+    delete value_ptr;
+  }
+  tmp->Destroy(alloc);
+  delete tmp;
+  delete restored;
+}
+
+TEST(EmbeddingVariableTest, TestShardedClockCache) {
+  BatchCache<int64>* cache = new ShardedClockCache<int64>(8);
+  const int64 num_ids = 30;
+  std::vector<int64> ids(num_ids);
+  for (int64 i = 0; i < num_ids; i++) {
+    ids[i] = i;
+  }
+  cache->add_to_rank(ids.data(), num_ids);
+  ASSERT_EQ(cache->size(), num_ids);
+  // Touch the first half again, the other half should be evicted first.
+  cache->add_to_rank(ids.data(), num_ids / 2);
+  ASSERT_EQ(cache->size(), num_ids);
+  int64 evic_ids[num_ids];
+  size_t true_size = cache->get_evic_ids(evic_ids, num_ids / 2);
+  ASSERT_EQ(true_size, num_ids / 2);
+  for (int64 i = 0; i < true_size; i++) {
+    ASSERT_GE(evic_ids[i], num_ids / 2);
+  }
+  ASSERT_EQ(cache->size(), num_ids / 2);
+  true_size = cache->get_evic_ids(evic_ids, num_ids);
+  ASSERT_EQ(true_size, num_ids / 2);
+  ASSERT_EQ(cache->size(), 0);
+  delete cache;
+}
+
+TEST(EmbeddingVariableTest, TestCacheRemoveIds) {
+  std::vector<BatchCache<int64>*> caches = {
+      new LRUCache<int64>(), new LFUCache<int64>(),
+      new ShardedClockCache<int64>(8)};
+  const int64 num_ids = 30;
+  std::vector<int64> ids(num_ids);
+  for (int64 i = 0; i < num_ids; i++) {
+    ids[i] = i;
+  }
+  for (auto cache : caches) {
+    cache->add_to_rank(ids.data(), num_ids);
+    // Touch the odd ids again so that the LFU cache has two frequencies.
+    for (int64 i = 1; i < num_ids; i += 2) {
+      cache->add_to_rank(&ids[i], 1);
+    }
+    // Removes the even ids, and a missing one.
+    for (int64 i = 0; i <= num_ids; i += 2) {
+      cache->remove_ids(&i, 1);
+    }
+    ASSERT_EQ(cache->size(), num_ids / 2);
+    int64 evic_ids[num_ids];
+    size_t true_size = cache->get_evic_ids(evic_ids, num_ids / 2);
+    ASSERT_EQ(true_size, num_ids / 2);
+    for (int64 i = 0; i < true_size; i++) {
+      ASSERT_EQ(evic_ids[i] % 2, 1);
+    }
+    ASSERT_EQ(cache->size(), 0);
+    delete cache;
+  }
+}
+
+TEST(EmbeddingVariableTest, TestThreeLevelSkewedWorkload) {
+  int64 value_size = 4;
+  Tensor value(DT_FLOAT, TensorShape({value_size}));
+  test::FillValues<float>(&value, std::vector<float>(value_size, -1.0));
+  // 64 ids fit in DRAM, 512 ids on SSD, the rest goes to LevelDB.
+  std::vector<int64> size = {64 * value_size * sizeof(float),
+                             512 * value_size * sizeof(float)};
+  auto storage_manager = new embedding::StorageManager<int64, float>(
+      "EmbeddingVar", embedding::StorageConfig(
+          embedding::DRAM_SSDHASH_LEVELDB, testing::TmpDir(), size,
+          "normal_contiguous", {CacheStrategy::LRU, CacheStrategy::LFU}));
+  TF_CHECK_OK(storage_manager->Init());
+  EmbeddingVar<int64, float>* variable
+    = new EmbeddingVar<int64, float>("EmbeddingVar",
+        storage_manager,
+          EmbeddingConfig(/*emb_index = */0, /*primary_emb_index = */0,
+                          /*block_num = */1, /*slot_num = */0,
+                          /*name = */"", /*steps_to_live = */0,
+                          /*filter_freq = */0, /*max_freq = */999999,
+                          /*l2_weight_threshold = */-1.0, /*layout = */"normal_contiguous",
+                          /*max_element_size = */0, /*false_positive_probability = */-1.0,
+                          /*counter_type = */DT_UINT64));
+  variable->Init(value, 1);
+
+  // 80% of the lookups hit 32 hot ids, the others spread over 4096 ids.
+  const int64 num_ids = 4096;
+  const int64 batch_size = 64;
+  std::set<int64> seen;
+  srand(1);
+  for (int64 step = 0; step < 200; ++step) {
+    std::vector<int64> batch(batch_size);
+    for (int64 i = 0; i < batch_size; ++i) {
+      batch[i] = (rand() % 10 < 8) ? rand() % 32 : rand() % num_ids;
+      ValuePtr<float>* value_ptr = nullptr;
+      TF_CHECK_OK(variable->LookupOrCreateKey(batch[i], &value_ptr));
+      float* val = variable->LookupOrCreateEmb(value_ptr,
+                                               variable->GetDefaultValue(0));
+      for (int64 j = 0; j < value_size; ++j) {
+        val[j] = batch[i];
+      }
+      seen.insert(batch[i]);
+    }
+    variable->Cache()->add_to_rank(batch.data(), batch_size);
+  }
+  Env::Default()->SleepForMicroseconds(500 * 1000);
+
+  ASSERT_GT(storage_manager->GetEvictionMetrics().evicted_num, 512);
+  ASSERT_EQ(storage_manager->Size(), seen.size());
+  for (auto id : seen) {
+    ValuePtr<float>* value_ptr = nullptr;
+    TF_CHECK_OK(variable->LookupOrCreateKey(id, &value_ptr));
+    float* val = variable->LookupOrCreateEmb(value_ptr,
+                                             variable->GetDefaultValue(0));
+    for (int64 j = 0; j < value_size; ++j) {
+      ASSERT_EQ(val[j], id);
+    }
+  }
+}
+
+TEST(EmbeddingVariableTest, TestPrefetchLowerLevels) {
+  int64 value_size = 4;
+  Tensor value(DT_FLOAT, TensorShape({value_size}));
+  test::FillValues<float>(&value, std::vector<float>(value_size, -1.0));
+  std::vector<int64> size = {64 * value_size * sizeof(float)};
+  auto storage_manager = new embedding::StorageManager<int64, float>(
+      "EmbeddingVar", embedding::StorageConfig(
+          embedding::DRAM_SSDHASH, testing::TmpDir(), size,
+          "normal_contiguous"));
+  TF_CHECK_OK(storage_manager->Init());
+  EmbeddingVar<int64, float>* variable
+    = new EmbeddingVar<int64, float>("EmbeddingVar",
+        storage_manager,
+          EmbeddingConfig(/*emb_index = */0, /*primary_emb_index = */0,
+                          /*block_num = */1, /*slot_num = */0,
+                          /*name = */"", /*steps_to_live = */0,
+                          /*filter_freq = */0, /*max_freq = */999999,
+                          /*l2_weight_threshold = */-1.0, /*layout = */"normal_contiguous",
+                          /*max_element_size = */0, /*false_positive_probability = */-1.0,
+                          /*counter_type = */DT_UINT64));
+  variable->Init(value, 1);
+
+  const int64 num_ids = 256;
+  std::vector<int64> ids(num_ids);
+  for (int64 i = 0; i < num_ids; ++i) {
+    ids[i] = i;
+    ValuePtr<float>* value_ptr = nullptr;
+    TF_CHECK_OK(variable->LookupOrCreateKey(i, &value_ptr));
+    float* val = variable->LookupOrCreateEmb(value_ptr,
+                                             variable->GetDefaultValue(0));
+    for (int64 j = 0; j < value_size; ++j) {
+      val[j] = i;
+    }
+  }
+  variable->Cache()->add_to_rank(ids.data(), num_ids);
+  Env::Default()->SleepForMicroseconds(200 * 1000);
+
+  // The oldest ids were demoted to SSD, prefetch brings them back.
+  const int64 prefetch_num = 32;
+  variable->Prefetch(ids.data(), prefetch_num);
+  Env::Default()->SleepForMicroseconds(200 * 1000);
+  PrefetchMetrics before = storage_manager->GetPrefetchMetrics();
+  ASSERT_EQ(before.prefetch_num, prefetch_num);
+  ASSERT_EQ(before.promoted_num, prefetch_num);
+
+  for (int64 i = 0; i < prefetch_num; ++i) {
+    ValuePtr<float>* value_ptr = nullptr;
+    TF_CHECK_OK(variable->LookupOrCreateKey(i, &value_ptr));
+    float* val = variable->LookupOrCreateEmb(value_ptr,
+                                             variable->GetDefaultValue(0));
+    for (int64 j = 0; j < value_size; ++j) {
+      ASSERT_EQ(val[j], i);
+    }
+  }
+  PrefetchMetrics after = storage_manager->GetPrefetchMetrics();
+  ASSERT_EQ(after.miss_num, before.miss_num);
+  ASSERT_EQ(after.hit_num, before.hit_num + prefetch_num);
+}
+
+void CacheAddToRank(BatchCache<int64>* cache, int64* keys,
+                    int64 key_num, int64 batch_size) {
+  for (int64 j = 0; j + batch_size <= key_num; j += batch_size) {
+    cache->add_to_rank(keys + j, batch_size);
+  }
+}
+
+void BM_CACHE_ADD_TO_RANK(int iters, int thread_num,
+                          std::function<BatchCache<int64>*()> create_cache) {
+  testing::StopTiming();
+  testing::UseRealTime();
+
+  int64 key_num = 1000000;
+  const int64 batch_size = 4096;
+  std::vector<int64*> keys(thread_num);
+  srand((unsigned)time(NULL));
+  for (int i = 0; i < thread_num; i++) {
+    keys[i] = (int64*)malloc(sizeof(int64) * key_num);
+    for (int64 j = 0; j < key_num; j++) {
+      keys[i][j] = rand() % 10000000;
+    }
+  }
+  BatchCache<int64>* cache = create_cache();
+  int64 evic_ids[batch_size];
+
+  testing::StartTiming();
+  while (iters--) {
+    std::vector<std::thread> insert_threads(thread_num);
+    for (size_t i = 0 ; i < thread_num; i++) {
+      insert_threads[i] = std::thread(CacheAddToRank, cache, keys[i],
+                                      key_num, batch_size);
+    }
+    while (cache->get_evic_ids(evic_ids, batch_size) > 0) {}
+    for (auto &t : insert_threads) {
+      t.join();
+    }
+  }
+  testing::StopTiming();
+  delete cache;
+  for (int i = 0; i < thread_num; i++) {
+    free(keys[i]);
+  }
+}
+
+void BM_LRU_CACHE(int iters, int thread_num) {
+  BM_CACHE_ADD_TO_RANK(iters, thread_num,
+                       []() { return new LRUCache<int64>(); });
+}
+
+void BM_LFU_CACHE(int iters, int thread_num) {
+  BM_CACHE_ADD_TO_RANK(iters, thread_num,
+                       []() { return new LFUCache<int64>(); });
+}
+
+void BM_SHARDED_CLOCK_CACHE(int iters, int thread_num) {
+  BM_CACHE_ADD_TO_RANK(iters, thread_num,
+                       []() { return new ShardedClockCache<int64>(); });
+}
+
+BENCHMARK(BM_LRU_CACHE)
+    ->Arg(1)
+    ->Arg(4)
+    ->Arg(16);
+
+BENCHMARK(BM_LFU_CACHE)
+    ->Arg(1)
+    ->Arg(4)
+    ->Arg(16);
+
+BENCHMARK(BM_SHARDED_CLOCK_CACHE)
+    ->Arg(1)
+    ->Arg(4)
+    ->Arg(16);
+
+void SSDLookup(SSDHashKV<int64, float>* hashmap, int64* keys, int64 key_num) {
+  for (int64 j = 0; j < key_num; j++) {
+    ValuePtr<float>* value_ptr = nullptr;
+    TF_CHECK_OK(hashmap->Lookup(keys[j], &value_ptr));
+    value_ptr->Destroy(ev_allocator());
+    delete value_ptr;
+  }
+}
+
+// Lookups of flushed records, i.e. SSD-tier misses of a multi-level EV.
+void BM_SSD_LOOKUP(int iters, int thread_num) {
+  testing::StopTiming();
+  testing::UseRealTime();
+
+  Allocator* alloc = ev_allocator();
+  const int64 dims = 128;
+  const int64 flushed_num = 250000;
+  SSDHashKV<int64, float>* hashmap =
+      new SSDHashKV<int64, float>(testing::TmpDir(), alloc);
+  hashmap->SetTotalDims(dims);
+  ValuePtr<float>* tmp = new (alloc, dims) NormalContiguousValuePtr<float>(dims);
+  // 520B values, the first buffer is flushed after about 258k records.
+  for (int64 i = 0; i < 300000; i++) {
+    tmp->SetValue((float)i, dims);
+    TF_CHECK_OK(hashmap->Commit(i, tmp));
+  }
+
+  int64 key_num = 100000;
+  std::vector<int64*> keys(thread_num);
+  srand((unsigned)time(NULL));
+  for (int i = 0; i < thread_num; i++) {
+    keys[i] = (int64*)malloc(sizeof(int64) * key_num);
+    for (int64 j = 0; j < key_num; j++) {
+      keys[i][j] = rand() % flushed_num;
+    }
+  }
+
+  testing::ItemsProcessed((int64)iters * key_num * thread_num);
+  testing::StartTiming();
+  while (iters--) {
+    std::vector<std::thread> lookup_threads(thread_num);
+    for (size_t i = 0 ; i < thread_num; i++) {
+      lookup_threads[i] = std::thread(SSDLookup, hashmap, keys[i], key_num);
+    }
+    for (auto &t : lookup_threads) {
+      t.join();
+    }
+  }
+  testing::StopTiming();
+  tmp->Destroy(alloc);
+  delete tmp;
+  delete hashmap;
+  for (int i = 0; i < thread_num; i++) {
+    free(keys[i]);
+  }
+}
+
+BENCHMARK(BM_SSD_LOOKUP)
+    ->Arg(1)
+    ->Arg(4)
+    ->Arg(16);
+
+class CountingAllocator : public Allocator {
+ public:
+  string Name() override { return "counting_allocator"; }
+
+  void* AllocateRaw(size_t alignment, size_t num_bytes) override {
+    ++alloc_num;
+    return ev_allocator()->AllocateRaw(alignment, num_bytes);
+  }
+
+  void DeallocateRaw(void* ptr) override {
+    ++dealloc_num;
+    ev_allocator()->DeallocateRaw(ptr);
+  }
+
+  int64 alloc_num = 0;
+  int64 dealloc_num = 0;
+};
+
+TEST(EmbeddingVariableTest, TestContiguousValuePtrSingleAllocation) {
+  CountingAllocator alloc;
+  const int64 value_len = 16;
+  std::vector<float> default_v(value_len, 1.0);
+  // An embedding and two Adam slots.
+  ValuePtr<float>* value_ptr = new (&alloc, 3 * value_len)
+      NormalContiguousValuePtr<float>(3 * value_len);
+  ASSERT_EQ(alloc.alloc_num, 1);
+  ASSERT_EQ((uintptr_t)value_ptr->GetPtr() % 16, 0);
+  ASSERT_LE((char*)value_ptr->GetPtr() - (char*)value_ptr, 64);
+  for (int i = 0; i < 3; i++) {
+    float* val = value_ptr->GetOrAllocate(&alloc, value_len, default_v.data(),
+                                          i, i * value_len);
+    ASSERT_EQ(val, value_ptr->GetValue(i, i * value_len));
+    ASSERT_EQ(val[value_len - 1], 1.0);
+  }
+  ASSERT_EQ(alloc.alloc_num, 1);
+  value_ptr->Destroy(&alloc);
+  delete value_ptr;
+  ASSERT_EQ(alloc.dealloc_num, 1);
+
+  ValuePtr<float>* normal_value_ptr = new NormalValuePtr<float>(&alloc, 3);
+  for (int i = 0; i < 3; i++) {
+    normal_value_ptr->GetOrAllocate(&alloc, value_len, default_v.data(), i, 0);
+  }
+  ASSERT_EQ(alloc.alloc_num, 4);
+  normal_value_ptr->Destroy(&alloc);
+  delete normal_value_ptr;
+  ASSERT_EQ(alloc.dealloc_num, 4);
+}
+
+std::vector<EmbeddingVar<int64, float>*> InitAdamEV(int64 value_size,
+                                                    const std::string& layout) {
+  Tensor value(DT_FLOAT, TensorShape({value_size}));
+  test::FillValues<float>(&value, std::vector<float>(value_size, 1.0));
+  auto storage_manager = new embedding::StorageManager<int64, float>(
+      "EmbeddingVar", embedding::StorageConfig(embedding::DRAM, "",
+                                               {1<<30}, layout));
+  TF_CHECK_OK(storage_manager->Init());
+  // The variable and its m, v slots share the storage.
+  std::vector<EmbeddingVar<int64, float>*> vars;
+  for (int64 i = 0; i < 3; i++) {
+    EmbeddingVar<int64, float>* var = new EmbeddingVar<int64, float>(
+        "EmbeddingVar", storage_manager,
+        EmbeddingConfig(i, 0, 1, 2, "EmbeddingVar", 0, 0, 99999, -1.0,
+                        layout));
+    var->Init(value, 1);
+    vars.emplace_back(var);
+  }
+  return vars;
+}
+
+void AdamApply(std::vector<EmbeddingVar<int64, float>*> vars, int64* keys,
+               int64 key_num, int thread_num, int i, int64 value_size) {
+  const float lr = 0.001, beta1 = 0.9, beta2 = 0.999, epsilon = 1e-8;
+  for (int64 j = i * key_num / thread_num;
+       j < (i + 1) * key_num / thread_num; j++) {
+    ValuePtr<float>* value_ptr = nullptr;
+    TF_CHECK_OK(vars[0]->LookupOrCreateKey(keys[j], &value_ptr));
+    auto var = vars[0]->flat(value_ptr);
+    auto m = vars[1]->flat(value_ptr);
+    auto v = vars[2]->flat(value_ptr);
+    for (int64 k = 0; k < value_size; k++) {
+      const float grad = 0.01;
+      m(k) = beta1 * m(k) + (1 - beta1) * grad;
+      v(k) = beta2 * v(k) + (1 - beta2) * grad * grad;
+      var(k) -= lr * m(k) / (std::sqrt(v(k)) + epsilon);
+    }
+  }
+}
+
+// Sparse Adam updates of new and existing keys, every iteration creates
+// as many keys as it updates.
+void BM_ADAM_APPLY(int iters, int thread_num, const std::string& layout) {
+  testing::StopTiming();
+  testing::UseRealTime();
+
+  int64 value_size = 64;
+  std::vector<EmbeddingVar<int64, float>*> vars =
+      InitAdamEV(value_size, layout);
+  int64 key_num = 200000;
+  int64* keys = (int64*)malloc(sizeof(int64) * key_num);
+
+  srand((unsigned)time(NULL));
+  testing::ItemsProcessed((int64)iters * key_num);
+  int64 offset = 0;
+  while (iters--) {
+    for (int64 i = 0; i < key_num; i++) {
+      keys[i] = (i % 2 == 0) ? offset + i : rand() % (offset + 1);
+    }
+    offset += key_num;
+    testing::StartTiming();
+    std::vector<std::thread> apply_threads(thread_num);
+    for (size_t i = 0 ; i < thread_num; i++) {
+      apply_threads[i] = std::thread(AdamApply, vars, keys, key_num,
+                                     thread_num, i, value_size);
+    }
+    for (auto &t : apply_threads) {
+      t.join();
+    }
+    testing::StopTiming();
+  }
+  free(keys);
+}
+
+void BM_ADAM_APPLY_NORMAL(int iters, int thread_num) {
+  BM_ADAM_APPLY(iters, thread_num, "normal");
+}
+
+void BM_ADAM_APPLY_CONTIGUOUS(int iters, int thread_num) {
+  BM_ADAM_APPLY(iters, thread_num, "normal_contiguous");
+}
+
+BENCHMARK(BM_ADAM_APPLY_NORMAL)
+    ->Arg(1)
+    ->Arg(4)
+    ->Arg(16);
+
+BENCHMARK(BM_ADAM_APPLY_CONTIGUOUS)
+    ->Arg(1)
+    ->Arg(4)
+    ->Arg(16);
+
 } // namespace
 } // namespace embedding
 } // namespace tensorflow
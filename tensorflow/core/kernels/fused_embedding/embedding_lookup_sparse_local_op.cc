@@ -6,258 +6,188 @@
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/resource_var.h"
 #include "tensorflow/core/framework/bounds_check.h"
+#include "tensorflow/core/platform/cpu_info.h"
+#include "tensorflow/core/platform/prefetch.h"
+#include "tensorflow/core/util/work_sharder.h"
+
+#include <cmath>
+#include <unordered_map>
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#endif
 
 namespace tensorflow {
 
 typedef Eigen::ThreadPoolDevice CPUDevice;
 
 namespace {
-    // input: input tensor value (it sores the id)
-    // cols: How many elements to do SparseSegmentSum
-    // output: rows * embedding_size
-    template<typename T>
-    static void sparse_gather_v1(T *input, int rows, int cols, 
-                                float *embedding_table, float *output,
-                                int embedding_size, bool is_mean) {
-    T *pidx = input;
-    for (int i = 0; i < rows; ++i) {
-        for (int j = 0; j < embedding_size; ++j) {
-        float value = 0;
-        int dense_num = 0;
-        for (int k = 0; k < cols; ++k) {
-            int embedding_row = (int)pidx[k];
-            if (embedding_row >= 0) {
-            value += embedding_table[embedding_row * embedding_size + j];
-            dense_num += 1;
-            }
-        }
-
-        if (is_mean && dense_num > 0) {
-            *output++ = value / dense_num;
-        } else {
-            *output++ = value;
-        }
-        }
-        pidx += cols;
-    }
+    // dst[0:n) += alpha * src[0:n). The vectorized versions round the
+    // product before the add as the scalar loop does, without FMA.
+    static void axpy_scalar(float *dst, float alpha, const float *src,
+                            int64 n) {
+      for (int64 i = 0; i < n; ++i) {
+        dst[i] += alpha * src[i];
+      }
     }
 
-    // embedding_size = 1
-    template<typename T>
-    static void sparse_gather_embeddingsize1(T *input, int rows, int cols,
-                                            float *embedding_table, float *output,
-                                            bool is_mean) {
-    T *pidx = input;
-    for (int i = 0; i < rows; ++i) {
-        float value = 0;
-        int dense_num = 0;
-        for (int k = 0; k < cols; ++k) {
-        int embedding_row = pidx[k];
-        if (embedding_row >= 0) {
-            value += embedding_table[embedding_row];
-            dense_num += 1;
-        }
-        }
-        if (is_mean && dense_num > 0) {
-        *output++ = value / dense_num;
-        } else {
-        *output++ = value;
-        }
-        pidx += cols;
-    }
+    static void scale_scalar(float *dst, float alpha, int64 n) {
+      for (int64 i = 0; i < n; ++i) {
+        dst[i] *= alpha;
+      }
     }
 
-    // input cols = 1
-    template<typename T>
-    static void sparse_gather_column1(T *input, int rows, float *embedding_table, 
-                            float *output, int embedding_size) {
-    T *pidx = input;
-    for (int i = 0; i < rows; ++i) {
-        int embedding_row = *pidx++;
-        if (embedding_row >= 0) {
-        float *pembedding = &embedding_table[embedding_row * embedding_size];
-        for (int j = 0; j < embedding_size; ++j) {
-            output[j] = pembedding[j];
-        }
-        } else {
-        for (int j = 0; j < embedding_size; ++j) {
-            output[j] = 0;
-        }
-        }
-        output += embedding_size;
-    }
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define FUSED_EMBEDDING_X86_DISPATCH
+    // Built for AVX2 without FMA so that the product is never contracted.
+    __attribute__((target("avx2")))
+    static void axpy_avx2(float *dst, float alpha, const float *src, int64 n) {
+      const __m256 a = _mm256_set1_ps(alpha);
+      int64 i = 0;
+      for (; i + 8 <= n; i += 8) {
+        __m256 d = _mm256_loadu_ps(dst + i);
+        d = _mm256_add_ps(d, _mm256_mul_ps(a, _mm256_loadu_ps(src + i)));
+        _mm256_storeu_ps(dst + i, d);
+      }
+      for (; i < n; ++i) {
+        dst[i] += alpha * src[i];
+      }
     }
 
-    template<typename T>
-    static void sparse_gather(T *input, int rows, int cols, float *embedding_table,
-                            float *output, int embedding_size, bool is_mean) {
-    if (embedding_size == 1) {
-        sparse_gather_embeddingsize1(input, rows, cols, embedding_table, output,
-                                    is_mean);
-    } else if (cols == 1) {
-        sparse_gather_column1(input, rows, embedding_table, output, embedding_size);
-    } else {
-        //printf("General sparse gather!\n");
-        sparse_gather_v1(input, rows, cols, embedding_table, output, embedding_size, 
-                        is_mean);
-    }
+    __attribute__((target("avx2")))
+    static void scale_avx2(float *dst, float alpha, int64 n) {
+      const __m256 a = _mm256_set1_ps(alpha);
+      int64 i = 0;
+      for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(a, _mm256_loadu_ps(dst + i)));
+      }
+      for (; i < n; ++i) {
+        dst[i] *= alpha;
+      }
     }
 
-    // Use memcpy or manually assign?
-    static void mycopy(float *dst, float *src, int float_num) {
-      memcpy(dst, src, float_num * sizeof(float));
+    // AVX-512F implies FMA, the rounding variant of mul keeps the product
+    // from being contracted. The tail is handled with a masked load/store.
+    __attribute__((target("avx512f")))
+    static void axpy_avx512(float *dst, float alpha, const float *src,
+                            int64 n) {
+      const __m512 a = _mm512_set1_ps(alpha);
+      int64 i = 0;
+      for (; i + 16 <= n; i += 16) {
+        __m512 p = _mm512_mul_round_ps(a, _mm512_loadu_ps(src + i),
+            _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        _mm512_storeu_ps(dst + i, _mm512_add_ps(_mm512_loadu_ps(dst + i), p));
+      }
+      if (i < n) {
+        const __mmask16 mask = (1u << (n - i)) - 1;
+        __m512 p = _mm512_mul_round_ps(a, _mm512_maskz_loadu_ps(mask, src + i),
+            _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        __m512 d = _mm512_maskz_loadu_ps(mask, dst + i);
+        _mm512_mask_storeu_ps(dst + i, mask, _mm512_add_ps(d, p));
+      }
     }
 
-    static void myadd(float *dst, float *src, int float_num) {
-      for (int i = 0; i < float_num; ++i) {
-        dst[i] += src[i];
+    __attribute__((target("avx512f")))
+    static void scale_avx512(float *dst, float alpha, int64 n) {
+      const __m512 a = _mm512_set1_ps(alpha);
+      int64 i = 0;
+      for (; i + 16 <= n; i += 16) {
+        _mm512_storeu_ps(dst + i, _mm512_mul_ps(a, _mm512_loadu_ps(dst + i)));
+      }
+      if (i < n) {
+        const __mmask16 mask = (1u << (n - i)) - 1;
+        __m512 d = _mm512_maskz_loadu_ps(mask, dst + i);
+        _mm512_mask_storeu_ps(dst + i, mask, _mm512_mul_ps(a, d));
       }
     }
-
-
-    template<typename T>
-    static void row_add(std::map<T *, std::vector<T *>> &mapSet, int64 row_nums) {
-
-      for (auto it = mapSet.begin(); it != mapSet.end(); ++it){
-        T * dst = it->first;
-        std::vector<T *> srcs(std::move(it->second));
-        int64 src_size = srcs.size();
-
-        for (int row = 0; row < row_nums; ++row){
-          dst[row] = 0.0;
-          for (int index = 0; index < src_size; ++index) {
-            dst[row] += srcs[index][row];
-          }
+#endif  // __x86_64__
+
+    // Row kernels of the widest instruction set the CPU supports, picked
+    // once at runtime so the library itself needs no -mavx flags.
+    struct RowKernels {
+      void (*axpy)(float *dst, float alpha, const float *src, int64 n);
+      void (*scale)(float *dst, float alpha, int64 n);
+    };
+
+    static const RowKernels& row_kernels() {
+      static const RowKernels kernels = [] {
+        RowKernels k = {axpy_scalar, scale_scalar};
+#ifdef FUSED_EMBEDDING_X86_DISPATCH
+        if (port::TestCPUFeature(port::CPUFeature::AVX512F)) {
+          k = {axpy_avx512, scale_avx512};
+        } else if (port::TestCPUFeature(port::CPUFeature::AVX2)) {
+          k = {axpy_avx2, scale_avx2};
         }
-      }
+#endif
+        return k;
+      }();
+      return kernels;
     }
 
-    template<typename T>
-    static void row_add_mean(std::map<T *, std::vector<T *>> &mapSet, int64 row_nums, bool is_mean) {
-
-#define L(n) srcs[index + n][row]
-
-      for (auto it = mapSet.begin(); it != mapSet.end(); ++it){
-        T * dst = it->first;
-        std::vector<T *> srcs(std::move(it->second));
-        int64 src_size = srcs.size();
+    enum class Combiner { kSum, kMean, kSqrtN };
 
-        if (src_size==1){
-          for (int row = 0; row < row_nums; ++row){
-            dst[row] = srcs[0][row];
-          }
-          continue;
-        }
-
-        float sum_tmp = 0.0;
-        int64 index = 0;
-        int64 r = (src_size) % 8;
-        int64 m = 1;
-        if (src_size < 10 && is_mean) m = src_size;
-
-        for (int row = 0; row < row_nums; ++row){
-          sum_tmp = 0.0;
-          index = 0;
-          dst[row] = 0.0;
-          switch (r) {
-            case 2: {
-              sum_tmp = (L(0) + L(1)) / m;
-              dst[row] = sum_tmp;
-              break;
-            }
-            case 3: {
-              sum_tmp = (L(0) + L(1) + L(2)) / m;
-              dst[row] = sum_tmp;
-              break;
-            }
-            case 4: {
-              sum_tmp = (L(0) + L(1) + L(2) + L(3)) / m;
-              dst[row] = sum_tmp;
-              break;
-            }
-            case 5: {
-              sum_tmp = (L(0) + L(1) + L(2) + L(3) + L(4)) / m;
-              dst[row] = sum_tmp;
-              break;
-            }
-            case 6: {
-              sum_tmp = (L(0) + L(1) + L(2) + L(3) + L(4) + L(5)) / m;
-              dst[row] = sum_tmp;
-              break;
-            }
-            case 7: {
-              sum_tmp = (L(0) + L(1) + L(2) + L(3) + L(4) + L(5) + L(6)) / m;
-              dst[row] = sum_tmp;
-              break;
-            }
-            case 0: {
-              dst[row] = (L(0) + L(1) + L(2) + L(3) + L(4) + L(5) + L(6) + L(7)) / m;
-              index += 8;
-              break;
-            }
-            case 1: {
-              dst[row] = (L(0) + L(1) + L(2) + L(3) + L(4) + L(5) + L(6) + L(7) + L(8)) / m;
-              index += 8;
-              break;
+    static float combiner_scale(Combiner combiner, int64 num) {
+      if (combiner == Combiner::kMean) {
+        return static_cast<float>(1.0 / num);
+      } else if (combiner == Combiner::kSqrtN) {
+        return static_cast<float>(1.0 / std::sqrt(static_cast<double>(num)));
+      }
+      return 1.0f;
+    }
+
+    // Combines the embeddings of output rows [start, limit). The ids of row
+    // r are input[order[offsets[r]]] to input[order[offsets[r + 1] - 1]],
+    // order == nullptr means they are contiguous. Invalid ids (< 0) are
+    // skipped and rows without valid ids are zero.
+    template<typename Tid>
+    static void combine_rows(const Tid *input, const int64 *offsets,
+                             const int64 *order, int64 start, int64 limit,
+                             const float *embedding_table, float *output,
+                             int64 embedding_size, Combiner combiner) {
+      const RowKernels& kernels = row_kernels();
+      for (int64 r = start; r < limit; ++r) {
+        float *dst = output + r * embedding_size;
+        memset(dst, 0, embedding_size * sizeof(float));
+        int64 valid_num = 0;
+        for (int64 k = offsets[r]; k < offsets[r + 1]; ++k) {
+          if (k + 1 < offsets[r + 1]) {
+            const Tid next = input[order == nullptr ? k + 1 : order[k + 1]];
+            if (next >= 0) {
+              port::prefetch<port::PREFETCH_HINT_T0>(
+                  embedding_table + next * embedding_size);
             }
           }
-          for (index += r; index < src_size; index += 8) {
-            sum_tmp = L(0) + L(1) + L(2) + L(3) + L(4) + L(5) + L(6) + L(7);
-            dst[row] += sum_tmp;
+          const Tid id = input[order == nullptr ? k : order[k]];
+          if (id < 0) { // Skip invalid id
+            continue;
           }
-          if (src_size >= 10 && is_mean) dst[row] /= src_size;
+          kernels.axpy(dst, 1.0f, embedding_table + id * embedding_size,
+                       embedding_size);
+          ++valid_num;
+        }
+        if (valid_num > 1 && combiner != Combiner::kSum) {
+          kernels.scale(dst, combiner_scale(combiner, valid_num),
+                        embedding_size);
         }
       }
     }
 
-    static void myscale(float *dst, float factor, int float_num) {
-      for (int i = 0; i < float_num; ++i) {
-          dst[i] *= factor;
+    // Groups the N entries by key with a stable counting sort: entries of
+    // key k are order[offsets[k]] to order[offsets[k + 1] - 1], ascending.
+    static void group_by_key(const std::vector<int64>& keys, int64 num_keys,
+                             std::vector<int64> *offsets,
+                             std::vector<int64> *order) {
+      offsets->assign(num_keys + 1, 0);
+      for (int64 key : keys) {
+        ++(*offsets)[key + 1];
       }
-    }
-
-    template<typename Tid, typename Tshape>
-    static void sparse_gather(Tid *input, int64 input_size, Tshape *indice,
-                            int indice_dim, Tshape *shape, int rows, int cols,
-                            float *embedding_table, float *output,
-                            int embedding_size, bool is_mean) {
-      // Record how many values in each row
-      int *row_values = new int[rows];
-      memset(row_values, 0, rows * sizeof(int));
-
-      std::map<float *, std::vector<float *>> mapSet;
-
-      for (int64 i = 0; i < input_size; ++i) {
-        Tid id = input[i];
-        if (i < input_size && input[i] < 0) { // Skip invalid id
-          continue;
-        }
-        auto row = indice[i * indice_dim];
-        // for (int k = 1; k < indice_dim - 1; ++k) {
-        //   row = row * shape[k] + indice[i * indice_dim + k];
-        // }
-        row_values[row] += 1;
-
-        auto index = row * embedding_size;
-        if (!mapSet.count(&output[index])){
-          std::vector<float *> srcs;
-          mapSet[&output[index]] = srcs;
-        }
-        mapSet[&output[index]].push_back(&embedding_table[id * embedding_size]);
+      for (int64 k = 0; k < num_keys; ++k) {
+        (*offsets)[k + 1] += (*offsets)[k];
       }
-
-      // row_add(mapSet, embedding_size);
-      row_add_mean(mapSet, embedding_size, is_mean);
-
-      for (int i = 0; i < rows; ++i) {
-        if (row_values[i] == 0) {
-          memset(&output[i * embedding_size], 0, embedding_size * sizeof(float));
-        // } else if (is_mean && row_values[i] > 1) {
-        //   float factor = 1.0f / row_values[i];
-        //   myscale(&output[i * embedding_size], factor, embedding_size);
-        }
+      order->resize(keys.size());
+      std::vector<int64> cursors(offsets->begin(), offsets->end() - 1);
+      for (size_t i = 0; i < keys.size(); ++i) {
+        (*order)[cursors[keys[i]]++] = i;
       }
-      delete[] row_values;
     }
 }
 
@@ -310,13 +240,31 @@ namespace {
                     cols, weight, output, embedding_size, is_mean);
 */
 
+static Status parse_combiner(const std::string& combiner_str,
+                             Combiner *combiner) {
+  if (combiner_str == "sum") {
+    *combiner = Combiner::kSum;
+  } else if (combiner_str == "mean") {
+    *combiner = Combiner::kMean;
+  } else if (combiner_str == "sqrtn") {
+    *combiner = Combiner::kSqrtN;
+  } else {
+    return errors::InvalidArgument(
+        "Currently, 'mean', 'sqrtn' and 'sum' are only supported");
+  }
+  return Status::OK();
+}
+
+// The output rows are sharded across the CPU worker threads. Ids laid out
+// densely in row-major order (input_size == batch_size * cols) are combined
+// in place, otherwise they are grouped by row first.
 template <typename Device, typename Tid, typename Tshape>
 class FusedSafeEmbeddingLookupSparseLocalOp : public OpKernel {
 public:
   explicit FusedSafeEmbeddingLookupSparseLocalOp(OpKernelConstruction* context)
            : OpKernel(context) {
-    OP_REQUIRES_OK(context, context->GetAttr("combiner", &combiner_));
-    //OP_REQUIRES_OK(context, context->GetAttr("Dims", &dims));
+    OP_REQUIRES_OK(context, context->GetAttr("combiner", &combiner_str_));
+    OP_REQUIRES_OK(context, parse_combiner(combiner_str_, &combiner_));
     node_name = context->def().name();
   }
 
@@ -361,15 +309,19 @@ public:
     }
     
     int input_dims = shape_tensor.dim_size(0);
-    int cols = shape[input_dims - 1];
-    int batch_size = 1;
+    int64 cols = shape[input_dims - 1];
+    int64 batch_size = 1;
     for (int i = 0; i < input_dims - 1; ++i) {
       batch_size *= shape[i];
     }
-    int embedding_size = weight_tensor->dim_size(1);
-    bool is_mean = (combiner_ == "mean");
+    const int64 vocab_size = weight_tensor->dim_size(0);
+    const int64 embedding_size = weight_tensor->dim_size(1);
 
     const Tensor& indice_tensor = context->input(3);
+    OP_REQUIRES(context, (indice_tensor.dims() == 2),
+                errors::InvalidArgument("Indice tensor is not as expected (dims != 2)"));
+    OP_REQUIRES(context, (indice_tensor.dim_size(0) == input_size),
+                errors::InvalidArgument("Indice tensor is not as expected (dim_size(0) != batch_size)"));
     Tshape *indice = (Tshape *)indice_tensor.tensor_data().data();
     int indice_dim = indice_tensor.dim_size(1);
 
@@ -379,22 +331,52 @@ public:
     OP_REQUIRES_OK(context, context->allocate_output(0, output_shape,
                                                      &output_tensor));
     float *output = (float *)output_tensor->tensor_data().data();
+    if (batch_size == 0) {
+      return;
+    }
 
-    if (false && input_size == batch_size * cols) { // input id is dense
-      //fixme(marvin): disable this branch just for test.
-      sparse_gather(input, batch_size, cols, weight, output, embedding_size, is_mean);
+    // Validates the ids and rows, and checks whether the ids are dense.
+    std::vector<int64> rows(input_size);
+    bool is_dense = (input_size == batch_size * cols);
+    for (int64 i = 0; i < input_size; ++i) {
+      OP_REQUIRES(context, input[i] < vocab_size,
+                  errors::InvalidArgument("Id ", input[i], " is out of range [0, ",
+                                          vocab_size, ") in ", node_name));
+      rows[i] = indice[i * indice_dim];
+      OP_REQUIRES(context, rows[i] >= 0 && rows[i] < batch_size,
+                  errors::InvalidArgument("Row ", rows[i], " is out of range [0, ",
+                                          batch_size, ") in ", node_name));
+      is_dense = is_dense && (rows[i] == i / cols);
+    }
+
+    std::vector<int64> offsets;
+    std::vector<int64> order;
+    if (is_dense) { // input id is dense
+      offsets.resize(batch_size + 1);
+      for (int64 r = 0; r <= batch_size; ++r) {
+        offsets[r] = r * cols;
+      }
     } else { // input id is sparse
-      OP_REQUIRES(context, (indice_tensor.dims() == 2),
-                  errors::InvalidArgument("Indice tensor is not as expected (dims != 2)"));
-      OP_REQUIRES(context, (indice_tensor.dim_size(0) == input_size),
-                  errors::InvalidArgument("Indice tensor is not as expected (dim_size(0) != batch_size)"));
-      sparse_gather(input, input_size, indice, indice_dim, shape, batch_size,
-                    cols, weight, output, embedding_size, is_mean);
-    }
+      group_by_key(rows, batch_size, &offsets, &order);
+    }
+    const int64 *order_ptr = is_dense ? nullptr : order.data();
+
+    const Combiner combiner = combiner_;
+    auto do_work = [input, &offsets, order_ptr, weight, output,
+                    embedding_size, combiner] (int64 start, int64 limit) {
+      combine_rows(input, offsets.data(), order_ptr, start, limit, weight,
+                   output, embedding_size, combiner);
+    };
+    auto worker_threads = context->device()->tensorflow_cpu_worker_threads();
+    const int64 cost_per_row =
+        (input_size / batch_size + 1) * embedding_size * sizeof(float);
+    Shard(worker_threads->num_threads, worker_threads->workers, batch_size,
+          cost_per_row, do_work);
   }
 
 private:
-  std::string combiner_;
+  std::string combiner_str_;
+  Combiner combiner_;
   std::string node_name;
 };
 
@@ -412,133 +394,17 @@ REGISTER_KERNEL_BUILDER(                                        \
     .TypeConstraint<int64>("T_shape"),                           \
     FusedSafeEmbeddingLookupSparseLocalOp<CPUDevice, int64, int64>);
 
-
-enum class SparseSegmentReductionOperation { kSum, kMean, kSqrtN };
-
-namespace functor {
-
-template <typename T, typename Index, typename SegmentId>
-struct SparseSegmentGradFunctor {
-  void operator()(OpKernelContext* context,
-                  SparseSegmentReductionOperation operation,
-                  typename TTypes<T>::ConstMatrix input_flat,
-                  typename TTypes<Index>::ConstVec indices_vec,
-                  typename TTypes<SegmentId>::ConstVec segment_vec,
-                  typename TTypes<T>::Matrix output_flat) {
-    const int64_t N = indices_vec.size();
-    const SegmentId M = output_flat.dimension(0);
-
-    // Note that similar to SparseSegmentMean, we assume that segment_vec is
-    // already sorted and has non-negative values.
-    const SegmentId num_segments = input_flat.dimension(0);
-    const SegmentId last_segment_id_plus_one =
-        internal::SubtleMustCopy(segment_vec(N - 1)) + 1;
-    OP_REQUIRES(context, last_segment_id_plus_one <= num_segments,
-                errors::InvalidArgument("Invalid number of segments"));
-
-    // Compute scaling factors for input.
-    std::vector<double> scaling(
-        (operation == SparseSegmentReductionOperation::kSum ? 0 : num_segments),
-        0.0);
-    if (operation != SparseSegmentReductionOperation::kSum) {
-      for (int64_t i = 0; i < N; ++i) {
-        const SegmentId idx = internal::SubtleMustCopy(segment_vec(i));
-        OP_REQUIRES(
-            context, FastBoundsCheck(idx, num_segments),
-            errors::InvalidArgument("Segment id ", idx, " out of range [0, ",
-                                    num_segments, ")."));
-        scaling[idx] += 1;
-      }
-      for (size_t i = 0; i < scaling.size(); ++i) {
-        switch (operation) {
-          case SparseSegmentReductionOperation::kSum: {
-            OP_REQUIRES(
-                context, false,
-                errors::Internal(
-                    "Should not happen: sum inside SparseSegmentReductionOp "
-                    "scaling generation."));
-          }
-          case SparseSegmentReductionOperation::kMean: {
-            scaling[i] = 1.0 / std::max(scaling[i], 1.0);
-            break;
-          }
-          case SparseSegmentReductionOperation::kSqrtN: {
-            scaling[i] = 1.0 / sqrt(std::max(scaling[i], 1.0));
-            break;
-          }
-            // No default to get compiler warnings for missing cases.
-        }
-      }
-    }
-
-    output_flat.setZero();
-    std::vector<bool> is_modified(M, false);
-
-    for (int64_t i = 0; i < N; ++i) {
-      const Index output_idx = internal::SubtleMustCopy(indices_vec(i));
-      OP_REQUIRES(context, FastBoundsCheck(output_idx, M),
-                  errors::InvalidArgument("Index ", output_idx,
-                                          " out of range [0, ", M, ")."));
-
-      const SegmentId idx = internal::SubtleMustCopy(segment_vec(i));
-      OP_REQUIRES(
-          context, FastBoundsCheck(idx, num_segments),
-          errors::InvalidArgument("Segment id ", idx, " out of range [0, ",
-                                  num_segments, ")."));
-
-      const T scale = (operation == SparseSegmentReductionOperation::kSum
-                           ? static_cast<T>(1)
-                           : static_cast<T>(scaling[idx]));
-      if (is_modified[output_idx]) {
-        if (scale == 1.0) {
-          output_flat.template chip<0>(output_idx) +=
-              input_flat.template chip<0>(idx);
-        } else {
-          output_flat.template chip<0>(output_idx) +=
-              input_flat.template chip<0>(idx) * scale;
-        }
-      } else {
-        if (scale == 1.0) {
-          output_flat.template chip<0>(output_idx) =
-              input_flat.template chip<0>(idx);
-        } else {
-          output_flat.template chip<0>(output_idx) =
-              input_flat.template chip<0>(idx) * scale;
-        }
-      }
-      is_modified[output_idx] = true;
-    }
-  }
-};
-
-}  // namespace functor
-
+// Gradient rows are the unique valid ids in order of first occurrence. They
+// are sharded across the CPU worker threads, each accumulates the scaled
+// gradients of its id's occurrences in input order.
 template <typename Device, typename T, typename Tinput, typename Tindices, typename Tdense_shape>
 class FusedSafeEmbeddingLookupSparseLocalGradOp : public OpKernel {
 public:
   explicit FusedSafeEmbeddingLookupSparseLocalGradOp(OpKernelConstruction* context)
            : OpKernel(context) {
-    OP_REQUIRES_OK(context, context->GetAttr("combiner", &combiner_));
-    //OP_REQUIRES_OK(context, context->GetAttr("Dims", &dims));
-
-    if (combiner_ == "sum") {
-      operation_ = SparseSegmentReductionOperation::kSum;
-    } else if (combiner_ == "mean") {
-      operation_ = SparseSegmentReductionOperation::kMean;
-    } else if (combiner_ == "sqrtn") {
-      operation_ = SparseSegmentReductionOperation::kSqrtN;
-    } else {
-      OP_REQUIRES(context, false,
-          errors::InvalidArgument("Currently, 'mean', 'sqrtn' and 'sum' are only supported"));
-    }
-
+    OP_REQUIRES_OK(context, context->GetAttr("combiner", &combiner_str_));
+    OP_REQUIRES_OK(context, parse_combiner(combiner_str_, &combiner_));
     node_name = context->def().name();
-
-    static bool printed = false;
-    if (!printed) {
-      printf("******** FusedSafeEmbeddingLookupSparseLocalGradOp ********\n");
-      printed = true;
-    }
   }
 
   ~FusedSafeEmbeddingLookupSparseLocalGradOp() {
@@ -563,17 +429,12 @@ public:
 
     // Grad indices value
     const Tensor& indices_tensor = context->input(2);
-    Tindices *indices_ptr = (Tindices *)indices_tensor.tensor_data().data();
-    int indices_row = indices_tensor.dim_size(0);
-    int indices_col = indices_tensor.dim_size(1);
     OP_REQUIRES(context, (indices_tensor.dims() == 2),
                 errors::InvalidArgument("Indice tensor is not as expected (dims != 2)"));
     OP_REQUIRES(context, (indices_tensor.dim_size(0) == input_size),
                 errors::InvalidArgument("Indice tensor is not as expected (dim_size(0) != batch_size)"));
-    std::vector<Tindices> input_indices; // collect first col
-    for (int64 i = 0; i < indices_row; ++i) {
-      input_indices.emplace_back(indices_ptr[i*indices_col]);
-    }
+    Tindices *indices_ptr = (Tindices *)indices_tensor.tensor_data().data();
+    int64 indices_col = indices_tensor.dim_size(1);
 
     // Grad input dense shape
     const Tensor& dense_shape_tensor = context->input(3);
@@ -583,137 +444,89 @@ public:
     OP_REQUIRES(context, (dense_shape_tensor.dim_size(0) >= 2),
                 errors::InvalidArgument("Shape tensor is not valid (dim_size(0) < 2)"));
     int input_dims = dense_shape_tensor.dim_size(0);
-    int input_cols = dense_shape[input_dims - 1];
-    int batch_size = 1;
+    int64 batch_size = 1;
     for (int i = 0; i < input_dims - 1; ++i) {
       batch_size *= dense_shape[i];
     }
     OP_REQUIRES(context, (gradients_row == batch_size),
                 errors::InvalidArgument("gradients row is not same as batch_size)"));
 
-    // Grad combiner
-    // bool is_mean = (combiner == 1);
-
-    // compute unique value and indices of input hash value
+    // Rows of the valid ids, and their number per row for the scaling.
+    std::vector<int64> rows;
+    std::vector<int64> valid_num(batch_size, 0);
+    rows.reserve(input_size);
+    std::vector<int64> unique_slots;
+    unique_slots.reserve(input_size);
     std::vector<Tinput> unique_value;
-    std::vector<Tinput> unique_indices;
-    unique_value.reserve(input_size);
-    unique_indices.reserve(input_size);
+    std::unordered_map<Tinput, int64> unique_map;
+    unique_map.reserve(input_size);
     for (int64 i = 0; i < input_size; ++i) {
-        Tinput id = input[i];
-        if (id < 0) { // Skip invalid id
-          continue;
-        }
-        auto it = std::find(unique_value.begin(), unique_value.end(), id);
-        if (it == unique_value.end()) { // no find
-          unique_indices.push_back(unique_value.size());
-          unique_value.push_back(id);
-        }
-        else {
-          unique_indices.push_back(it - unique_value.begin());
-        }
+      const Tinput id = input[i];
+      if (id < 0) { // Skip invalid id
+        continue;
+      }
+      const int64 row = indices_ptr[i * indices_col];
+      OP_REQUIRES(context, row >= 0 && row < batch_size,
+                  errors::InvalidArgument("Row ", row, " is out of range [0, ",
+                                          batch_size, ") in ", node_name));
+      rows.push_back(row);
+      ++valid_num[row];
+      auto it = unique_map.emplace(id, unique_value.size());
+      if (it.second) {
+        unique_value.push_back(id);
+      }
+      unique_slots.push_back(it.first->second);
     }
-
-    // printf("unique_indices: ");
-    // for (int i = 0; i < unique_indices.size(); ++i)
-    //   printf("%d ", unique_indices[i]);
-    // printf("\n");
-
-    // printf("input_indices: ");
-    // for (int i = 0; i < input_indices.size(); ++i)
-    //   printf("%d ", input_indices[i]);
-    // printf("\n");
+    const int64 unique_num = unique_value.size();
 
     // Create an output tensor
     Tensor* output_tensor = NULL;
-    TensorShape output_shape({unique_value.size(), embedding_col});
+    TensorShape output_shape({unique_num, embedding_col});
     OP_REQUIRES_OK(context, context->allocate_output(0, output_shape, &output_tensor));
-    output_tensor->flat<T>().setZero();
     T *output = (T *)output_tensor->tensor_data().data();
-    
-    memset(output, 0, embedding_col * sizeof(float) * unique_value.size());
 
     Tensor* unique_tensor = NULL;
-    TensorShape unique_shape({unique_value.size()});
+    TensorShape unique_shape({unique_num});
     OP_REQUIRES_OK(context, context->allocate_output(1, unique_shape, &unique_tensor));
     Tinput *unique = (Tinput *)unique_tensor->tensor_data().data();
-
-    int64 unique_num = unique_value.size();
-    for (int64 i = 0; i < unique_num; ++i) {
-      unique[i] = unique_value[i];
-    }
-
-    // if (input_size == batch_size * input_cols) { // input id is dense
-    // } else { // input id is sparse
-    // }
-
-    if (operation_ == SparseSegmentReductionOperation::kMean) {
-      auto input_flat = gradients_tensor.flat_outer_dims<T>();
-      typename TTypes<Tinput>::ConstVec indices_vec(unique_indices.data(), unique_indices.size());
-      typename TTypes<Tindices>::ConstVec segment_vec(input_indices.data(), input_indices.size());
-      auto output_flat = output_tensor->flat_outer_dims<T>();
-      functor::SparseSegmentGradFunctor<T, Tinput, Tindices>()(
-          context, operation_, input_flat, indices_vec, segment_vec, output_flat);
-    }
-    else if (operation_ == SparseSegmentReductionOperation::kSum) {
-      uint64 rows = unique_indices.size();
-      // std::vector<int64> row_values(unique_value.size(), 0);
-      std::map<float *, std::vector<float *>> mapSet;
-
-      for (int64 i = 0; i < rows; ++i) {
-        // row_values[unique_indices[i]] += 1;
-
-        auto index = unique_indices[i] * embedding_col;
-        // memset(&output[index * embedding_col], 0, embedding_col * sizeof(float));
-        if (!mapSet.count(&output[index])){
-          std::vector<float *> srcs;
-          mapSet[&output[index]] = srcs;
+    std::copy(unique_value.begin(), unique_value.end(), unique);
+    if (unique_num == 0) {
+      return;
+    }
+
+    std::vector<float> scales(batch_size);
+    for (int64 r = 0; r < batch_size; ++r) {
+      scales[r] = valid_num[r] == 0 ? 0.0f : combiner_scale(combiner_, valid_num[r]);
+    }
+
+    std::vector<int64> offsets;
+    std::vector<int64> order;
+    group_by_key(unique_slots, unique_num, &offsets, &order);
+
+    auto do_work = [&offsets, &order, &rows, &scales, gradients, output,
+                    embedding_col] (int64 start, int64 limit) {
+      const RowKernels& kernels = row_kernels();
+      for (int64 u = start; u < limit; ++u) {
+        T *dst = output + u * embedding_col;
+        memset(dst, 0, embedding_col * sizeof(T));
+        for (int64 k = offsets[u]; k < offsets[u + 1]; ++k) {
+          const int64 row = rows[order[k]];
+          kernels.axpy(dst, scales[row], gradients + row * embedding_col,
+                       embedding_col);
         }
-        mapSet[&output[index]].push_back(&gradients[input_indices[i] * embedding_col]);
-
       }
-
-      row_add(mapSet, embedding_col);
-      // printf("******Goto row_add_mean func.******\n");
-      // row_add_mean(mapSet, embedding_col, false);
-      
-      // for (int i = 0; i < unique_value.size(); ++i) {
-      //   if (row_values[i] == 0) {
-      //     memset(&output[i * embedding_col], 0, embedding_col * sizeof(float));
-      //   }
-      // }
-      // delete[] row_values;
-
-    }
-    else if (operation_ == SparseSegmentReductionOperation::kSqrtN) {
-
-    }
-  }
-
-private:
-  template <typename Tdata>
-  void copy(Tdata* dst, const Tdata* src, const int64 num) {
-    memcpy(dst, src, num * sizeof(T));
-  }
-
-  template <typename Tdata>
-  void add(Tdata* dst, const Tdata* src, const int64 num) {
-    for (int64 i = 0; i < num; ++i) {
-      dst[i] += src[i];
-    }
-  }
-
-  template <typename Tdata>
-  void scale(Tdata* dst, const Tdata factor, const int64 num) {
-    for (int64 i = 0; i < num; ++i) {
-      dst[i] *= factor;
-    }
+    };
+    auto worker_threads = context->device()->tensorflow_cpu_worker_threads();
+    const int64 cost_per_row =
+        (rows.size() / unique_num + 1) * embedding_col * sizeof(T);
+    Shard(worker_threads->num_threads, worker_threads->workers, unique_num,
+          cost_per_row, do_work);
   }
 
 private:
-  std::string combiner_;
+  std::string combiner_str_;
+  Combiner combiner_;
   std::string node_name;
-  SparseSegmentReductionOperation operation_;
 };
 
 REGISTER_KERNEL_BUILDER(                            \
@@ -22,6 +22,8 @@ limitations under the License.
 #include "tensorflow/core/framework/node_def_builder.h"
 #include "tensorflow/core/framework/tensor.h"
 #include "tensorflow/core/framework/types.h"
+#include "tensorflow/core/graph/node_builder.h"
+#include "tensorflow/core/graph/testlib.h"
 #include "tensorflow/core/kernels/conv_ops_gpu.h"
 #include "tensorflow/core/kernels/ops_testutil.h"
 #include "tensorflow/core/kernels/ops_util.h"
@@ -881,5 +883,227 @@ TEST_F(FusedEmbeddingLocalSparseLookUpOpTest, GradFloatMeanCpu) {
   test::ExpectTensorEqual<int64>(output2_tensor_expected, output2_tensor);
 }
 
+TEST_F(FusedEmbeddingLocalSparseLookUpOpTest, LocalFloatMeanDenseIdsCpu) {
+  TF_EXPECT_OK(NodeDefBuilder("FusedSafeEmbeddingLookupSparseLocal",
+                              "FusedSafeEmbeddingLookupSparseLocal")
+                    .Input(FakeInput(DT_FLOAT))
+                    .Input(FakeInput(DT_INT64))
+                    .Input(FakeInput(DT_INT64))
+                    .Input(FakeInput(DT_INT64))
+                    .Input(FakeInput(DT_INT64))
+                    .Attr("T", DT_FLOAT)
+                    .Attr("combiner", "mean")
+                    .Finalize(node_def()));
+  TF_EXPECT_OK(InitOp());
+
+  const int batch_size = 3;
+  const int emb_vector_dim = 2;
+  const int entries = 2;
+  const int nnz = batch_size * entries;
+
+  // Every entry is present in row-major order, so the ids are dense.
+  Tensor sp_values(DT_INT64, {nnz});
+  Tensor sp_indices(DT_INT64, {nnz, 2});
+  Tensor sp_dense_shape(DT_INT64, {2});
+  Tensor emb_variable(DT_FLOAT, {4, emb_vector_dim});
+  test::FillValues<int64>(&sp_values, {1, 3, 2, -1, -1, -1});
+  test::FillValues<int64>(&sp_indices, {0, 0, 0, 1, 1, 0, 1, 1, 2, 0, 2, 1});
+  test::FillValues<int64>(&sp_dense_shape, {batch_size, entries});
+  test::FillValues<float>(&emb_variable, {0.0, 1.0, 2.0, 3.0,
+                                          4.0, 5.0, 6.0, 7.0});
+
+  AddInputFromArray<float>(emb_variable.shape(), emb_variable.flat<float>());
+  AddInputFromArray<int64>(sp_values.shape(), sp_values.flat<int64>());
+  AddInputFromArray<int64>(sp_dense_shape.shape(),
+                           sp_dense_shape.flat<int64>());
+  AddInputFromArray<int64>(sp_indices.shape(), sp_indices.flat<int64>());
+  AddInputFromArray<int64>(sp_values.shape(), sp_values.flat<int64>());
+
+  TF_ASSERT_OK(RunOpKernel());
+
+  // Invalid ids are skipped, a row without valid ids is zero.
+  Tensor emb_vector_expected(DT_FLOAT, {batch_size, emb_vector_dim});
+  test::FillValues<float>(&emb_vector_expected, {4.0, 5.0, 4.0, 5.0,
+                                                 0.0, 0.0});
+  test::ExpectTensorNear<float>(emb_vector_expected, *GetOutput(0), 1e-6);
+}
+
+TEST_F(FusedEmbeddingLocalSparseLookUpOpTest, LocalFloatSqrtnCpu) {
+  TF_EXPECT_OK(NodeDefBuilder("FusedSafeEmbeddingLookupSparseLocal",
+                              "FusedSafeEmbeddingLookupSparseLocal")
+                    .Input(FakeInput(DT_FLOAT))
+                    .Input(FakeInput(DT_INT64))
+                    .Input(FakeInput(DT_INT64))
+                    .Input(FakeInput(DT_INT64))
+                    .Input(FakeInput(DT_INT64))
+                    .Attr("T", DT_FLOAT)
+                    .Attr("combiner", "sqrtn")
+                    .Finalize(node_def()));
+  TF_EXPECT_OK(InitOp());
+
+  const int nnz = 4;
+  const int batch_size = 3;
+  const int emb_vector_dim = 2;
+  const int entries = 4;
+
+  // Indices out of row order take the sparse path.
+  Tensor sp_values(DT_INT64, {nnz});
+  Tensor sp_indices(DT_INT64, {nnz, 2});
+  Tensor sp_dense_shape(DT_INT64, {2});
+  Tensor emb_variable(DT_FLOAT, {4, emb_vector_dim});
+  test::FillValues<int64>(&sp_values, {0, 1, 2, 3});
+  test::FillValues<int64>(&sp_indices, {2, 0, 0, 1, 0, 0, 2, 3});
+  test::FillValues<int64>(&sp_dense_shape, {batch_size, entries});
+  test::FillValues<float>(&emb_variable, {0.0, 1.0, 2.0, 3.0,
+                                          4.0, 5.0, 6.0, 7.0});
+
+  AddInputFromArray<float>(emb_variable.shape(), emb_variable.flat<float>());
+  AddInputFromArray<int64>(sp_values.shape(), sp_values.flat<int64>());
+  AddInputFromArray<int64>(sp_dense_shape.shape(),
+                           sp_dense_shape.flat<int64>());
+  AddInputFromArray<int64>(sp_indices.shape(), sp_indices.flat<int64>());
+  AddInputFromArray<int64>(sp_values.shape(), sp_values.flat<int64>());
+
+  TF_ASSERT_OK(RunOpKernel());
+
+  Tensor emb_vector_expected(DT_FLOAT, {batch_size, emb_vector_dim});
+  test::FillValues<float>(&emb_vector_expected,
+      {4.24264069, 5.65685425, 0.0, 0.0, 4.24264069, 5.65685425});
+  test::ExpectTensorNear<float>(emb_vector_expected, *GetOutput(0), 1e-5);
+}
+
+TEST_F(FusedEmbeddingLocalSparseLookUpOpTest, LocalGradFloatSqrtnCpu) {
+  TF_EXPECT_OK(NodeDefBuilder("FusedSafeEmbeddingLookupSparseLocalGrad",
+                              "FusedSafeEmbeddingLookupSparseLocalGrad")
+                    .Input(FakeInput(DT_FLOAT)) // gradients
+                    .Input(FakeInput(DT_INT64)) // input hash value
+                    .Input(FakeInput(DT_INT64)) // indices
+                    .Input(FakeInput(DT_INT64)) // dense_shape
+                    .Attr("T", DT_FLOAT)
+                    .Attr("Tinput", DT_INT64)
+                    .Attr("Tindices", DT_INT64)
+                    .Attr("Tdense_shape", DT_INT64)
+                    .Attr("combiner", "sqrtn")
+                    .Finalize(node_def()));
+  TF_EXPECT_OK(InitOp());
+
+  const int nnz = 5;
+  const int batch_size = 3;
+  const int emb_vector_dim = 2;
+  const int entries = 4;
+
+  Tensor sp_values(DT_INT64, {nnz});
+  Tensor sp_indices(DT_INT64, {nnz, 2});
+  Tensor sp_dense_shape(DT_INT64, {2});
+  Tensor grad_variable(DT_FLOAT, {batch_size, emb_vector_dim});
+  test::FillValues<float>(&grad_variable, {1.0, 2.0, 5.0, 5.0, 3.0, 4.0});
+  // The invalid id of row 1 gets no gradient and does not count.
+  test::FillValues<int64>(&sp_values, {0, 1, -1, 2, 3});
+  test::FillValues<int64>(&sp_indices, {2, 0, 0, 1, 1, 0, 0, 0, 2, 3});
+  test::FillValues<int64>(&sp_dense_shape, {batch_size, entries});
+
+  AddInputFromArray<float>(grad_variable.shape(), grad_variable.flat<float>());
+  AddInputFromArray<int64>(sp_values.shape(), sp_values.flat<int64>());
+  AddInputFromArray<int64>(sp_indices.shape(), sp_indices.flat<int64>());
+  AddInputFromArray<int64>(sp_dense_shape.shape(), sp_dense_shape.flat<int64>());
+
+  TF_ASSERT_OK(RunOpKernel());
+
+  Tensor output1_tensor_expected(DT_FLOAT, {4, emb_vector_dim});
+  Tensor output2_tensor_expected(DT_INT64, {4});
+  test::FillValues<float>(&output1_tensor_expected,
+      {2.12132034, 2.82842712, 0.70710678, 1.41421356,
+       0.70710678, 1.41421356, 2.12132034, 2.82842712});
+  test::FillValues<int64>(&output2_tensor_expected, {0, 1, 2, 3});
+
+  test::ExpectTensorNear<float>(output1_tensor_expected, *GetOutput(0), 1e-6);
+  test::ExpectTensorEqual<int64>(output2_tensor_expected, *GetOutput(1));
+}
+
+// Ids of `batch_size` rows with `num_per_row` ids each. Dense ids are laid
+// out in row-major order, otherwise the rows are listed backwards so that
+// they have to be grouped.
+static void FillBenchmarkIds(int batch_size, int num_per_row, int vocab_size,
+                             bool dense, Tensor* ids, Tensor* indices) {
+  const int64 nnz = static_cast<int64>(batch_size) * num_per_row;
+  *ids = Tensor(DT_INT64, TensorShape({nnz}));
+  *indices = Tensor(DT_INT64, TensorShape({nnz, 2}));
+  auto ids_flat = ids->flat<int64>();
+  auto indices_matrix = indices->matrix<int64>();
+  for (int64 i = 0; i < nnz; ++i) {
+    const int64 row = i / num_per_row;
+    ids_flat(i) = (i * 7919) % vocab_size;
+    indices_matrix(i, 0) = dense ? row : batch_size - 1 - row;
+    indices_matrix(i, 1) = i % num_per_row;
+  }
+}
+
+static Graph* FusedLocalLookup(int batch_size, int num_per_row, int dim,
+                               bool dense) {
+  Graph* g = new Graph(OpRegistry::Global());
+  const int vocab_size = 100000;
+  Tensor weight(DT_FLOAT, TensorShape({vocab_size, dim}));
+  weight.flat<float>().setRandom();
+  Tensor ids;
+  Tensor indices;
+  FillBenchmarkIds(batch_size, num_per_row, vocab_size, dense, &ids, &indices);
+  Tensor dense_shape(DT_INT64, TensorShape({2}));
+  test::FillValues<int64>(&dense_shape, {batch_size, num_per_row});
+
+  Node* ids_node = test::graph::Constant(g, ids);
+  Node* node;
+  TF_CHECK_OK(NodeBuilder(g->NewName("n"), "FusedSafeEmbeddingLookupSparseLocal")
+                  .Input(test::graph::Constant(g, weight))
+                  .Input(ids_node)
+                  .Input(test::graph::Constant(g, dense_shape))
+                  .Input(test::graph::Constant(g, indices))
+                  .Input(ids_node)
+                  .Attr("combiner", "mean")
+                  .Finalize(g, &node));
+  return g;
+}
+
+static Graph* FusedLocalLookupGrad(int batch_size, int num_per_row, int dim,
+                                   bool dense) {
+  Graph* g = new Graph(OpRegistry::Global());
+  Tensor gradients(DT_FLOAT, TensorShape({batch_size, dim}));
+  gradients.flat<float>().setRandom();
+  Tensor ids;
+  Tensor indices;
+  FillBenchmarkIds(batch_size, num_per_row, 100000, dense, &ids, &indices);
+  Tensor dense_shape(DT_INT64, TensorShape({2}));
+  test::FillValues<int64>(&dense_shape, {batch_size, num_per_row});
+
+  Node* node;
+  TF_CHECK_OK(NodeBuilder(g->NewName("n"),
+                          "FusedSafeEmbeddingLookupSparseLocalGrad")
+                  .Input(test::graph::Constant(g, gradients))
+                  .Input(test::graph::Constant(g, ids))
+                  .Input(test::graph::Constant(g, indices))
+                  .Input(test::graph::Constant(g, dense_shape))
+                  .Attr("combiner", "mean")
+                  .Finalize(g, &node));
+  return g;
+}
+
+#define BM_FUSED_LOCAL_LOOKUP(B, N, D)                                       \
+  static void BM_FusedLocalLookup_##B##_##N##_##D(int iters, int dense) {    \
+    testing::UseRealTime();                                                  \
+    testing::ItemsProcessed(static_cast<int64>(iters) * B * N);              \
+    test::Benchmark("cpu", FusedLocalLookup(B, N, D, dense)).Run(iters);     \
+  }                                                                          \
+  BENCHMARK(BM_FusedLocalLookup_##B##_##N##_##D)->Arg(0)->Arg(1);            \
+  static void BM_FusedLocalLookupGrad_##B##_##N##_##D(int iters,             \
+                                                      int dense) {           \
+    testing::UseRealTime();                                                  \
+    testing::ItemsProcessed(static_cast<int64>(iters) * B * N);              \
+    test::Benchmark("cpu", FusedLocalLookupGrad(B, N, D, dense)).Run(iters); \
+  }                                                                          \
+  BENCHMARK(BM_FusedLocalLookupGrad_##B##_##N##_##D)->Arg(0)->Arg(1);
+
+BM_FUSED_LOCAL_LOOKUP(512, 20, 16);
+BM_FUSED_LOCAL_LOOKUP(4096, 200, 16);
+BM_FUSED_LOCAL_LOOKUP(4096, 200, 64);
+
 }  // namespace
-}  // namespace tensorflow
\ No newline at end of file
+}  // namespace tensorflow
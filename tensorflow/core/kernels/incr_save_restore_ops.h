@@ -15,7 +15,13 @@ limitations under the License.
 #ifndef TENSORFLOW_CORE_KERNELS_INCR_SAVE_RESTORE_OPS_H_
 #define TENSORFLOW_CORE_KERNELS_INCR_SAVE_RESTORE_OPS_H_
 
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "tensorflow/core/framework/bounds_check.h"
@@ -39,57 +45,206 @@ limitations under the License.
 #include "tensorflow/core/lib/strings/stringprintf.h"
 
 namespace tensorflow {
+// Counts how often every key was updated since the last Swap. Adding a key
+// is lock free: a CAS claims a slot of an open addressed table the first time
+// the key shows up, later updates only bump its counter.
+//
+// A full table is not rehashed, a table of twice the capacity takes the new
+// keys instead. A key may then live in several tables, the scans merge them.
+// Add and the scans run under a shared lock that Swap and Clear take
+// exclusively, before they drop the tables.
 template <typename T>
-class ThreadSafeHashMap {
+class IncrKeyTracker {
  public:
-  ThreadSafeHashMap() {}
-  ~ThreadSafeHashMap() {}
+  // initial_capacity is a power of 2.
+  explicit IncrKeyTracker(int64 initial_capacity = 1 << 14)
+      : initial_capacity_(initial_capacity), empty_key_count_(0) {
+    Reset();
+  }
 
- public:
-  void Update(const Tensor& indices, int64 start, int64 end) {
-    mutex_lock l(lock_);
-    auto indices_flat = indices.flat<T>();
-    for (int64 idx = start; idx < end; idx++) {
-      auto indice = indices_flat(idx);
-      auto it = hash_map_.find(indice);
-      if (it == hash_map_.end()) {
-        hash_map_[indice] = 1;
-      } else {
-        it->second = it->second + 1;
+  // Callers hold a shared lock of mu().
+  void Add(T key) {
+    if (key == kEmptyKey) {
+      empty_key_count_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    while (true) {
+      Table* table = current_.load(std::memory_order_acquire);
+      if (table->Add(key)) {
+        return;
       }
+      Grow(table);
     }
   }
 
+  mutex* mu() { return &mu_; }
+
+  // Moves the counts out and starts over with an empty table.
   void Swap(std::unordered_map<T, uint64>& out) {
-    mutex_lock l(lock_);
-    hash_map_.swap(out);
+    std::vector<std::unique_ptr<Table>> tables;
+    uint64 empty_key_count = 0;
+    {
+      mutex_lock l(mu_);
+      tables.swap(tables_);
+      empty_key_count = empty_key_count_.exchange(0);
+      Reset();
+    }
+    out.clear();
+    for (auto& table : tables) {
+      table->ForEach(0, table->capacity(), [&out](T key, uint64 count) {
+        out[key] += count;
+      });
+    }
+    if (empty_key_count > 0) {
+      out[kEmptyKey] += empty_key_count;
+    }
   }
 
-  void GetKeys(std::set<T>& key_set) {
-    mutex_lock l(lock_);
-    for (auto it : hash_map_) {
-      key_set.insert(it.first);
+  // Appends the distinct keys, scanning the tables on `thread_pool` when
+  // one is given. Training keeps adding keys meanwhile.
+  void GetKeys(std::vector<T>* keys, thread::ThreadPool* thread_pool) {
+    tf_shared_lock l(mu_);
+    std::vector<Table*> tables;
+    {
+      mutex_lock tables_lock(tables_mu_);
+      for (auto& table : tables_) {
+        tables.push_back(table.get());
+      }
+    }
+    size_t start = keys->size();
+    mutex keys_mu;
+    for (Table* table : tables) {
+      auto scan = [table, keys, &keys_mu](int64 begin, int64 end) {
+        std::vector<T> part;
+        table->ForEach(begin, end, [&part](T key, uint64 count) {
+          part.push_back(key);
+        });
+        mutex_lock keys_lock(keys_mu);
+        keys->insert(keys->end(), part.begin(), part.end());
+      };
+      if (thread_pool != nullptr) {
+        thread_pool->ParallelFor(table->capacity(), kScanCostPerSlot, scan);
+      } else {
+        scan(0, table->capacity());
+      }
+    }
+    if (empty_key_count_.load(std::memory_order_relaxed) > 0) {
+      keys->push_back(kEmptyKey);
+    }
+    if (tables.size() > 1) {
+      std::sort(keys->begin() + start, keys->end());
+      keys->erase(std::unique(keys->begin() + start, keys->end()),
+                  keys->end());
     }
   }
 
   void Clear() {
-    mutex_lock l(lock_);
-    hash_map_.clear();
+    mutex_lock l(mu_);
+    tables_.clear();
+    empty_key_count_ = 0;
+    Reset();
   }
 
  private:
-  std::unordered_map<T, uint64> hash_map_;
-  mutex lock_;
+  class Table {
+   public:
+    explicit Table(int64 capacity)
+        : capacity_(capacity), size_(0), slots_(new Slot[capacity]) {
+      for (int64 i = 0; i < capacity_; ++i) {
+        slots_[i].key.store(kEmptyKey, std::memory_order_relaxed);
+        slots_[i].count.store(0, std::memory_order_relaxed);
+      }
+    }
+
+    // Returns false when a new key would overfill the table.
+    bool Add(T key) {
+      int64 idx = Hash(key) & (capacity_ - 1);
+      while (true) {
+        T slot_key = slots_[idx].key.load(std::memory_order_acquire);
+        if (slot_key == key) {
+          slots_[idx].count.fetch_add(1, std::memory_order_relaxed);
+          return true;
+        }
+        if (slot_key == kEmptyKey) {
+          if (size_.load(std::memory_order_relaxed) >= capacity_ / 2) {
+            return false;
+          }
+          if (slots_[idx].key.compare_exchange_strong(slot_key, key)) {
+            size_.fetch_add(1, std::memory_order_relaxed);
+            slots_[idx].count.fetch_add(1, std::memory_order_relaxed);
+            return true;
+          }
+          // Another key took the slot, check it again.
+          continue;
+        }
+        idx = (idx + 1) & (capacity_ - 1);
+      }
+    }
+
+    template <typename Fn>
+    void ForEach(int64 begin, int64 end, Fn fn) const {
+      for (int64 i = begin; i < end; ++i) {
+        T key = slots_[i].key.load(std::memory_order_acquire);
+        if (key != kEmptyKey) {
+          fn(key, slots_[i].count.load(std::memory_order_relaxed));
+        }
+      }
+    }
+
+    int64 capacity() const { return capacity_; }
+
+   private:
+    static uint64 Hash(T key) {
+      uint64 h = static_cast<uint64>(key) * 0x9E3779B97F4A7C15ULL;
+      return h ^ (h >> 32);
+    }
+
+    struct Slot {
+      std::atomic<T> key;
+      std::atomic<uint64> count;
+    };
+
+    const int64 capacity_;
+    std::atomic<int64> size_;
+    std::unique_ptr<Slot[]> slots_;
+  };
+
+  void Reset() {
+    mutex_lock l(tables_mu_);
+    tables_.emplace_back(new Table(initial_capacity_));
+    current_.store(tables_.back().get(), std::memory_order_release);
+  }
+
+  void Grow(Table* full) {
+    mutex_lock l(tables_mu_);
+    if (current_.load(std::memory_order_acquire) != full) {
+      return;
+    }
+    tables_.emplace_back(new Table(full->capacity() * 2));
+    current_.store(tables_.back().get(), std::memory_order_release);
+  }
+
+  static constexpr T kEmptyKey = std::numeric_limits<T>::min();
+  static const int64 kScanCostPerSlot = 10;
+  const int64 initial_capacity_;
+  mutex mu_;
+  // Guards tables_, which only grows while training adds keys.
+  mutex tables_mu_;
+  std::vector<std::unique_ptr<Table>> tables_;
+  std::atomic<Table*> current_;
+  // kEmptyKey marks free slots, its count is kept aside.
+  std::atomic<uint64> empty_key_count_;
 };
 
+template <typename T>
+constexpr T IncrKeyTracker<T>::kEmptyKey;
+
 template <typename T>
 class ParallelHashMap {
  public:
   explicit ParallelHashMap(int min_part_size = 128, int part_count = 32)
       : part_count_(part_count),
-      min_part_size_(min_part_size) {
-    hash_maps_.resize(part_count_);
-  }
+      min_part_size_(min_part_size) {}
 
   void Update(const Tensor& indices, OpKernelContext *ctx) {
     const int64 N = indices.NumElements();
@@ -100,12 +255,16 @@ class ParallelHashMap {
         std::min(part_count_, thread_pool.workers->NumThreads()), parts);
 
     int part_count = parts.size();
+    if (part_count == 1) {
+      Update(indices, parts[0].first, parts[0].second);
+      return;
+    }
     BlockingCounter counter(part_count);
     for (int i = 0; i < part_count; i++) {
       int64 start = parts[i].first;
       int64 end = parts[i].second;
-      thread_pool.workers->Schedule([this, indices, i, start, end, &counter]() {
-          hash_maps_[i].Update(indices, start, end);
+      thread_pool.workers->Schedule([this, indices, start, end, &counter]() {
+          Update(indices, start, end);
           counter.DecrementCount();
         });
     }
@@ -113,35 +272,21 @@ class ParallelHashMap {
   }
 
   void Swap(std::unordered_map<T, uint64> &indices) {
-    std::vector<std::unordered_map<T, uint64>> tmp_maps;
-    tmp_maps.resize(part_count_);
-    for (int i = 0; i < part_count_; i++) {
-      hash_maps_[i].Swap(tmp_maps[i]);
-    }
-
-    indices.clear();
-    for (int i = 0; i < part_count_; i++) {
-      for (auto it : tmp_maps[i]) {
-        auto indiceIt = indices.find(it.first);
-        if (indiceIt == indices.end()) {
-          indices[it.first] = it.second;
-        } else {
-          indices[it.first] += it.second;
-        }
-      }
-    }
+    tracker_.Swap(indices);
   }
 
   void Clear() {
-    for (size_t i = 0; i < part_count_; i++) {
-      hash_maps_[i].Clear();
-    }
+    tracker_.Clear();
   }
 
   void GetKeys(std::set<T>& key_set) {
-    for (size_t i = 0; i < part_count_; i++) {
-      hash_maps_[i].GetKeys(key_set);
-    }
+    std::vector<T> keys;
+    tracker_.GetKeys(&keys, nullptr);
+    key_set.insert(keys.begin(), keys.end());
+  }
+
+  void GetKeys(std::vector<T>* keys, thread::ThreadPool* thread_pool) {
+    tracker_.GetKeys(keys, thread_pool);
   }
 
   void SplitParallelParts(int64 total_num, int64 part_count,
@@ -169,7 +314,15 @@ class ParallelHashMap {
   }
 
  private:
-  std::vector<ThreadSafeHashMap<T> > hash_maps_;
+  void Update(const Tensor& indices, int64 start, int64 end) {
+    tf_shared_lock l(*tracker_.mu());
+    auto indices_flat = indices.flat<T>();
+    for (int64 idx = start; idx < end; idx++) {
+      tracker_.Add(indices_flat(idx));
+    }
+  }
+
+  IncrKeyTracker<T> tracker_;
   int part_count_;
   int min_part_size_;
 };
@@ -195,108 +348,6 @@ class IncrKeyDumpIterator : public DumpIterator<K> {
   typename std::vector<K>::iterator keys_iter_;
 };
 
-template<class K, class T>
-class IncrEVValueDumpIterator : public  DumpIterator<T> {
- public:
-  IncrEVValueDumpIterator(std::vector<K>& incr_keys,
-      EmbeddingVar<K, T>*& emb_var)
-    : incr_keys_(incr_keys),
-    emb_var_(emb_var) {
-    keys_iter_ = incr_keys_.begin();
-    keys_idx_ = 1;
-    col_idx_ = 0;
-  }
-
-  bool HasNext() const {
-    if (keys_iter_ != incr_keys_.end()) {
-      if (keys_idx_ < incr_keys_.size()) {
-        return true;
-      } else {
-        return col_idx_ < emb_var_->ValueLen();
-      }
-    } else {
-      return false;
-    }
-  }
-
-  T Next() {
-    if (col_idx_ >= emb_var_->ValueLen()) {
-      keys_iter_++;
-      keys_idx_++;
-      col_idx_ = 0;
-    }
-    ValuePtr<T>* value_ptr = NULL;
-    TF_CHECK_OK(emb_var_->LookupOrCreateKey(*keys_iter_, &value_ptr));
-    return emb_var_->flat(value_ptr)(col_idx_++);
-  }
-
- private:
-  int64 keys_idx_;
-  int64 col_idx_;
-  typename std::vector<K>::iterator keys_iter_;
-  std::vector<K>& incr_keys_;
-  EmbeddingVar<K, T>* emb_var_;
-};
-
-template<class K, class V, class T>
-class IncrEVVersionDumpIterator : public  DumpIterator<T> {
- public:
-  IncrEVVersionDumpIterator(std::vector<K>& incr_keys,
-      EmbeddingVar<K, V>*& emb_var) :
-    incr_keys_(incr_keys),
-    emb_var_(emb_var) {
-    keys_iter_ = incr_keys_.begin();
-  }
-
-  bool HasNext() const {
-    return keys_iter_ != incr_keys_.end();
-  }
-
-  T Next() {
-    if (emb_var_->StepsToLive() == 0) {
-      keys_iter_++;
-      return 0;
-    } else {
-      K key = *keys_iter_;
-      int64 dump_version = emb_var_->GetVersion(key);
-      keys_iter_++;
-      return dump_version;
-    }
-  }
-
- private:
-  std::vector<K>& incr_keys_;
-  typename std::vector<K>::iterator keys_iter_;
-  EmbeddingVar<K, V>* emb_var_;
-};
-
-template<class K, class V, class T>
-class IncrEVFreqDumpIterator : public  DumpIterator<T> {
- public:
-  IncrEVFreqDumpIterator(std::vector<K>& incr_keys,
-      EmbeddingVar<K, V>*& emb_var)
-    : incr_keys_(incr_keys),
-    emb_var_(emb_var) {
-    keys_iter_ = incr_keys_.begin();
-  }
-
-  bool HasNext () const {
-    return keys_iter_ != incr_keys_.end();
-  }
-
-  T Next() {
-    K key = *keys_iter_;
-    int64 dump_version = emb_var_->GetFreq(key);
-    keys_iter_++;
-    return dump_version;
-  }
-
- private:
-  std::vector<K>& incr_keys_;
-  typename std::vector<K>::iterator keys_iter_;
-  EmbeddingVar<K, V>* emb_var_;
-};
-
 template<class K, class T>
 class IncrNormalValueDumpIterator : public  DumpIterator<T> {
  public:
@@ -403,87 +454,116 @@ class IndicesIncrRecorder: public ResourceBase {
     return Status::OK();
   }
 
+  // Resolves every updated key once and dumps its row, version and freq.
+  // Keys removed since their update are skipped rather than re-created.
   Status DumpSparseEmbeddingTensor(const string& tensor_name,
       EmbeddingVar<K, V>* emb_var, BundleWriter* writer,
       OpKernelContext* context) {
     mutex_lock l(mu_);
-    size_t bytes_limit = 8 << 20;
-    char* dump_buffer = (char*)malloc(sizeof(char) * bytes_limit);
-
-    std::set<K> incr_keys;
-    incr_indices_.GetKeys(incr_keys);
+    uint64 start_micros = Env::Default()->NowMicros();
+    thread::ThreadPool* thread_pool =
+        context->device()->tensorflow_cpu_worker_threads()->workers;
 
-    std::vector<std::vector<K> > incr_keys_parts;
-    incr_keys_parts.resize(kSavedPartitionNum);
-
-    for (auto& ik : incr_keys) {
-      for (int partid = 0; partid < kSavedPartitionNum; partid++) {
-        if (ik % kSavedPartitionNum == partid &&
-            emb_var->GetFreq(ik) >= emb_var->MinFreq()) {
-          incr_keys_parts[partid].push_back(ik);
-          break;
+    std::vector<K> incr_keys;
+    incr_indices_.GetKeys(&incr_keys, thread_pool);
+
+    // The ValuePtrs are not reused before the guard is released.
+    embedding::EpochGuard guard(emb_var->epoch_manager());
+    std::vector<ValuePtr<V>*> value_ptrs(incr_keys.size());
+    auto resolve = [&incr_keys, &value_ptrs, emb_var](int64 begin, int64 end) {
+      for (int64 i = begin; i < end; ++i) {
+        ValuePtr<V>* value_ptr = nullptr;
+        if (emb_var->LookupKey(incr_keys[i], &value_ptr).ok() &&
+            emb_var->GetFilter()->GetFreq(incr_keys[i], value_ptr) >=
+                emb_var->MinFreq()) {
+          value_ptrs[i] = value_ptr;
+        } else {
+          value_ptrs[i] = nullptr;
         }
       }
+    };
+    thread_pool->ParallelFor(incr_keys.size(), kResolveCostPerKey, resolve);
+
+    std::vector<std::vector<int64> > incr_idx_parts;
+    incr_idx_parts.resize(kSavedPartitionNum);
+    for (int64 i = 0; i < incr_keys.size(); ++i) {
+      // Keys with a negative remainder belong to no partition.
+      int partid = incr_keys[i] % kSavedPartitionNum;
+      if (partid >= 0 && value_ptrs[i] != nullptr) {
+        incr_idx_parts[partid].push_back(i);
+      }
     }
 
     std::vector<K> partitioned_incr_keys;
+    std::vector<V*> partitioned_incr_values;
+    std::vector<int64> partitioned_incr_versions;
+    std::vector<int64> partitioned_incr_freqs;
     Tensor part_offset_tensor;
     context->allocate_temp(DT_INT32,
         TensorShape({kSavedPartitionNum + 1}), &part_offset_tensor);
     auto part_offset_flat = part_offset_tensor.flat<int32>();
     part_offset_flat(0) = 0;
-    int ptsize = 0;
     for (int partid = 0; partid < kSavedPartitionNum; partid++) {
-      std::vector<K>& key_list = incr_keys_parts[partid];
-
-      ptsize += key_list.size();
-      for (int inpid = 0; inpid < key_list.size(); inpid++) {
-        partitioned_incr_keys.push_back(key_list[inpid]);
+      for (int64 i : incr_idx_parts[partid]) {
+        K key = incr_keys[i];
+        ValuePtr<V>* value_ptr = value_ptrs[i];
+        partitioned_incr_keys.push_back(key);
+        partitioned_incr_values.push_back(emb_var->flat(value_ptr).data());
+        partitioned_incr_versions.push_back(
+            emb_var->StepsToLive() == 0 ? 0 : value_ptr->GetStep());
+        partitioned_incr_freqs.push_back(
+            emb_var->GetFilter()->GetFreq(key, value_ptr));
       }
-
-      part_offset_flat(partid + 1) = part_offset_flat(partid) + key_list.size();
+      part_offset_flat(partid + 1) =
+          part_offset_flat(partid) + incr_idx_parts[partid].size();
     }
     writer->Add(tensor_name+ "-incr_partition_offset", part_offset_tensor);
 
-    IncrKeyDumpIterator<K> key_dump_iter(partitioned_incr_keys);
+    size_t bytes_limit = 8 << 20;
+    char* dump_buffer = (char*)malloc(sizeof(char) * bytes_limit);
+    uint64 key_num = partitioned_incr_keys.size();
+
+    EVKeyDumpIterator<K> key_dump_iter(partitioned_incr_keys);
     Status st = SaveTensorWithFixedBuffer(tensor_name + "-sparse_incr_keys",
         writer, dump_buffer, bytes_limit, &key_dump_iter,
-        TensorShape({partitioned_incr_keys.size()}));
+        TensorShape({key_num}));
     if (!st.ok()) {
       free(dump_buffer);
       return st;
     }
 
-    IncrEVValueDumpIterator<K, V> ev_value_dump_iter(
-        partitioned_incr_keys, emb_var);
+    EVValueDumpIterator<K, V> ev_value_dump_iter(
+        emb_var, partitioned_incr_values, thread_pool);
     st = SaveTensorWithFixedBuffer(tensor_name + "-sparse_incr_values",
         writer, dump_buffer, bytes_limit, &ev_value_dump_iter,
-        TensorShape({(uint64)partitioned_incr_keys.size(),
-          emb_var->ValueLen()}));
+        TensorShape({key_num, emb_var->ValueLen()}));
     if (!st.ok()) {
       free(dump_buffer);
       return st;
     }
 
-    IncrEVVersionDumpIterator<K, V, int64> ev_version_dump_iter(
-        partitioned_incr_keys, emb_var);
+    EVVersionDumpIterator<int64> ev_version_dump_iter(
+        partitioned_incr_versions);
     st = SaveTensorWithFixedBuffer(tensor_name + "-sparse_incr_versions",
         writer, dump_buffer, bytes_limit, &ev_version_dump_iter,
-        TensorShape({(uint64)partitioned_incr_keys.size()}));
+        TensorShape({key_num}));
     if (!st.ok()) {
       free(dump_buffer);
       return st;
     }
-    IncrEVFreqDumpIterator<K, V, int64> ev_freq_dump_iter(
-        partitioned_incr_keys, emb_var);
+    EVFreqDumpIterator<int64> ev_freq_dump_iter(partitioned_incr_freqs);
     st = SaveTensorWithFixedBuffer(tensor_name + "-sparse_incr_freqs",
         writer, dump_buffer, bytes_limit, &ev_freq_dump_iter,
-        TensorShape({(uint64)partitioned_incr_keys.size()}));
+        TensorShape({key_num}));
     if (!st.ok()) {
       free(dump_buffer);
       return st;
     }
     free(dump_buffer);
+    LogSaveThroughput("incremental", tensor_name, key_num,
+        key_num * (sizeof(K) + emb_var->ValueLen() * sizeof(V) +
+                   2 * sizeof(int64)),
+        start_micros);
     return Status::OK();
   }
 
@@ -496,6 +576,8 @@ class IndicesIncrRecorder: public ResourceBase {
   }
 
  private:
+  // Rough cycles of resolving a key and checking its freq.
+  static const int64 kResolveCostPerKey = 500;
   mutex mu_;
   string name_;
   ParallelHashMap<K> incr_indices_;
@@ -13,6 +13,8 @@ See the License for the specific language governing permissions and
 limitations under the License.
 ==============================================================================*/
 
+#include <thread>
+
 #include "tensorflow/core/framework/op.h"
 #include "tensorflow/core/graph/graph.h"
 #include "tensorflow/core/kernels/variable_ops.h"
@@ -115,6 +117,43 @@ TEST(ParallelHashMapTest, TestGetKeys) {
   EXPECT_TRUE(keys.find(3) != keys.end());
 }
 
+TEST(IncrKeyTrackerTest, TestConcurrentAddAndGrow) {
+  // A small table grows several times while the threads add keys.
+  IncrKeyTracker<int64> tracker(16);
+  const int thread_num = 8;
+  const int64 key_num = 5000;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < thread_num; i++) {
+    threads.emplace_back([&tracker, key_num]() {
+      tf_shared_lock l(*tracker.mu());
+      for (int64 k = 0; k < 4 * key_num; k++) {
+        tracker.Add(k % key_num);
+      }
+      tracker.Add(std::numeric_limits<int64>::min());
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  std::vector<int64> keys;
+  thread::ThreadPool pool(Env::Default(), "incr_scan", 4);
+  tracker.GetKeys(&keys, &pool);
+  EXPECT_EQ(key_num + 1, keys.size());
+
+  std::unordered_map<int64, uint64> out_indices;
+  tracker.Swap(out_indices);
+  EXPECT_EQ(key_num + 1, out_indices.size());
+  for (int64 k = 0; k < key_num; k++) {
+    EXPECT_EQ(4 * thread_num, out_indices[k]);
+  }
+  EXPECT_EQ(thread_num, out_indices[std::numeric_limits<int64>::min()]);
+
+  keys.clear();
+  tracker.GetKeys(&keys, nullptr);
+  EXPECT_TRUE(keys.empty());
+}
+
 TEST(IndicesIncrRecorderTest, TestUpdateAndSwap) {
   Tensor t(DT_INT32, TensorShape({5}));
   test::FillValues<int32>(&t, {1, 2, 3, 2, 3});
@@ -19,6 +19,9 @@ limitations under the License.
 #define EIGEN_USE_GPU
 #endif
 
+#include <cmath>
+#include <unordered_map>
+
 #include "tensorflow/core/framework/bounds_check.h"
 #include "tensorflow/core/framework/embedding/cache.h"
 #include "tensorflow/core/framework/embedding/config.pb.h"
@@ -36,6 +39,7 @@ limitations under the License.
 #include "tensorflow/core/platform/mem.h"
 #include "tensorflow/core/platform/mutex.h"
 #include "tensorflow/core/platform/types.h"
+#include "tensorflow/core/util/env_var.h"
 #include "tensorflow/core/util/util.h"
 #include "tensorflow/core/util/work_sharder.h"
 #if GOOGLE_CUDA
@@ -49,6 +53,19 @@ using GPUDevice = Eigen::GpuDevice;
 namespace {
 const int64 kEmbeddingVarUseDB = -214;
 const int64 kInitializableEmbeddingVarUseDB = -215;
+
+// With TF_EV_CONTIGUOUS_LAYOUT=1 the EVs that would use the LIGHT layout
+// keep the header, embedding and slots of a key in one allocation instead
+// of one allocation per column.
+Status MaybeUseContiguousLayout(int64 block_num, std::string* layout) {
+  bool contiguous_layout = false;
+  TF_RETURN_IF_ERROR(ReadBoolFromEnvVar("TF_EV_CONTIGUOUS_LAYOUT",
+                                        false, &contiguous_layout));
+  if (contiguous_layout && *layout == "light" && block_num == 1) {
+    *layout = "normal_contiguous";
+  }
+  return Status::OK();
+}
 }
 
 #define REGISTER_KV_VAR_HANDLE(ktype, vtype)                           \
@@ -145,6 +162,7 @@ class InitializeKvVariableOp : public OpKernel {
     OP_REQUIRES_OK(c, c->GetAttr("l2_weight_threshold", &l2_weight_threshold_));
 
     OP_REQUIRES_OK(c, c->GetAttr("layout", &layout_));
+    OP_REQUIRES_OK(c, MaybeUseContiguousLayout(block_num_, &layout_));
 
     OP_REQUIRES_OK(c, c->GetAttr("default_value_dim", &default_value_dim_));
 
@@ -156,6 +174,8 @@ class InitializeKvVariableOp : public OpKernel {
 
     OP_REQUIRES_OK(c, c->GetAttr("storage_path", &storage_path_));
     OP_REQUIRES_OK(c, c->GetAttr("storage_size", &storage_size_));
+    OP_REQUIRES_OK(c, c->GetAttr("storage_cache_strategy",
+                                 &storage_cache_strategy_));
 
     if (filter_freq_ < 0) {
       LOG(INFO) << "filter_freq < 0 is invalid, feature filter is disabled.";
@@ -209,7 +229,8 @@ class InitializeKvVariableOp : public OpKernel {
                   handle_self.name(), embedding::StorageConfig(storage_type_,
                                                                storage_path_,
                                                                storage_size_,
-                                                               layout_));
+                                                               layout_,
+                                                               storage_cache_strategy_));
               TF_CHECK_OK(storage_manager->Init());
               *ptr = new EmbeddingVar<TKey, TValue>(handle_self.name(),
                          storage_manager,
@@ -235,7 +256,8 @@ class InitializeKvVariableOp : public OpKernel {
                  handle_primary.name(), embedding::StorageConfig(storage_type_,
                                                                  storage_path_,
                                                                  storage_size_,
-                                                                 layout_));
+                                                                 layout_,
+                                                                 storage_cache_strategy_));
              TF_CHECK_OK(storage_manager->Init());
              *ptr = new EmbeddingVar<TKey, TValue>(handle_primary.name(),
                         storage_manager,
@@ -293,6 +315,7 @@ class InitializeKvVariableOp : public OpKernel {
   embedding::StorageType storage_type_;
   std::string storage_path_;
   std::vector<int64> storage_size_;
+  std::vector<int64> storage_cache_strategy_;
   int64 default_value_dim_;
 };
 
@@ -357,15 +380,6 @@ class KvResourceGatherOp : public OpKernel {
         return default_v + len * (id % total_dim) ;
       };
     }
-    if (c->num_inputs() == 4) {
-      get_count_fn_ = [](const int32* count, int64 index) {
-        return count[index];
-      };
-    } else {
-      get_count_fn_ = [](const int32* count, int64 index) {
-        return 1;
-      };
-    }
   }
 
   void Compute(OpKernelContext* c) override {
@@ -406,25 +420,30 @@ class KvResourceGatherOp : public OpKernel {
       const size_t slice_bytes = slice_elems * sizeof(TValue);
       auto do_work = [this, indices_flat,
            out_base, slice_elems, c, default_v, ev, counts] (int64 start, int64 limit) {
+        std::vector<const TValue*> default_values(limit - start);
         for (int64 i = start; i < limit; ++i) {
-          TValue* default_v_ptr = get_default_v_fn_(default_v, indices_flat(i),
-                                                    i, ev->GetDefaultValueDim(),
-                                                    ev->ValueLen());
-          int32 count = get_count_fn_(counts, i);
-          ev->LookupOrCreate(indices_flat(i),
-              out_base + i * slice_elems, default_v_ptr, count);
+          default_values[i - start] = get_default_v_fn_(default_v,
+              indices_flat(i), i, ev->GetDefaultValueDim(), ev->ValueLen());
         }
+        ev->BatchLookupOrCreate(&indices_flat(start),
+            out_base + start * slice_elems, default_values.data(),
+            counts == nullptr ? nullptr : counts + start, limit - start);
       };
       auto worker_threads = c->device()->tensorflow_cpu_worker_threads();
       Shard(worker_threads->num_threads, worker_threads->workers, indices_size,
           slice_bytes, do_work);
+
+      // Feed the multi-level cache so that eviction keeps the hot ids in DRAM.
+      embedding::BatchCache<TKey>* cache = ev->Cache();
+      if (cache) {
+        cache->add_to_rank(indices_flat.data(), indices_size);
+      }
     }
   }
 
   private:
     bool is_use_default_value_tensor_;
     std::function<TValue*(TValue*, TKey, int64, int64, int64)> get_default_v_fn_;
-    std::function<int32(int32*, int64)> get_count_fn_;
 };
 
 #define REGISTER_GATHER_FULL(dev, ktype, vtype)                   \
@@ -479,6 +498,343 @@ TF_CALL_double(REGISTER_GATHER_CPU);
 #undef REGISTER_GATHER_CPU
 #undef REGISTER_GATHER_ALL_INDICES
 #undef REGISTER_GATHER_FULL
+
+namespace {
+enum class SparseCombiner { kSum, kMean, kSqrtN };
+
+Status ParseSparseCombiner(const string& combiner, SparseCombiner* out) {
+  if (combiner == "sum") {
+    *out = SparseCombiner::kSum;
+  } else if (combiner == "mean") {
+    *out = SparseCombiner::kMean;
+  } else if (combiner == "sqrtn") {
+    *out = SparseCombiner::kSqrtN;
+  } else {
+    return errors::InvalidArgument("Unsupported combiner: ", combiner);
+  }
+  return Status::OK();
+}
+
+template <typename TValue>
+TValue SparseCombinerScale(SparseCombiner combiner, int64 num) {
+  if (combiner == SparseCombiner::kMean) {
+    return static_cast<TValue>(1) / static_cast<TValue>(num);
+  } else if (combiner == SparseCombiner::kSqrtN) {
+    return static_cast<TValue>(1) / std::sqrt(static_cast<TValue>(num));
+  }
+  return static_cast<TValue>(1);
+}
+
+// Groups the ids of a SparseTensor by output row with a counting sort, the
+// ids of row r are order[offsets[r]] to order[offsets[r + 1] - 1].
+Status GroupSparseIdsByRow(const Tensor& sp_indices, int64 num_rows,
+                           std::vector<int64>* offsets,
+                           std::vector<int64>* order) {
+  auto sp_indices_matrix = sp_indices.matrix<int64>();
+  const int64 N = sp_indices.dim_size(0);
+  offsets->assign(num_rows + 1, 0);
+  for (int64 i = 0; i < N; ++i) {
+    const int64 row = sp_indices_matrix(i, 0);
+    if (row < 0 || row >= num_rows) {
+      return errors::InvalidArgument("sp_indices[", i, ", 0] = ", row,
+                                     " is not in [0, ", num_rows, ")");
+    }
+    ++(*offsets)[row + 1];
+  }
+  for (int64 r = 0; r < num_rows; ++r) {
+    (*offsets)[r + 1] += (*offsets)[r];
+  }
+  order->resize(N);
+  std::vector<int64> cursors(offsets->begin(), offsets->end() - 1);
+  for (int64 i = 0; i < N; ++i) {
+    (*order)[cursors[sp_indices_matrix(i, 0)]++] = i;
+  }
+  return Status::OK();
+}
+}  // namespace
+
+// Fuses KvResourceGather and SparseSegmentSum/Mean/SqrtN: the output rows are
+// sharded across the worker threads and every embedding is added to its row
+// where the EV stores it, so no [N, dim] intermediate is written or re-read.
+template <typename TKey, typename TValue>
+class KvResourceSparseSegmentCombineOp : public OpKernel {
+ public:
+  explicit KvResourceSparseSegmentCombineOp(OpKernelConstruction* c)
+      : OpKernel(c) {
+    string combiner;
+    OP_REQUIRES_OK(c, c->GetAttr("combiner", &combiner));
+    OP_REQUIRES_OK(c, ParseSparseCombiner(combiner, &combiner_));
+    OP_REQUIRES_OK(c, c->GetAttr("is_use_default_value_tensor",
+                                 &is_use_default_value_tensor_));
+    if (is_use_default_value_tensor_) {
+      get_default_v_fn_ = [](TValue* default_v, TKey id, int64 index,
+                            int64 total_dim, int64 len) {
+        return default_v + len * index;
+      };
+    } else {
+      get_default_v_fn_ = [](TValue* default_v, TKey id, int64 index,
+                            int64 total_dim, int64 len) {
+        return default_v + len * (id % total_dim);
+      };
+    }
+  }
+
+  void Compute(OpKernelContext* c) override {
+    EmbeddingVar<TKey, TValue>* ev = nullptr;
+    OP_REQUIRES_OK(c, LookupResource(c, HandleFromInput(c, 0), &ev));
+    core::ScopedUnref unref_me(ev);
+    const Tensor& indices = c->input(1);
+    const Tensor& sp_indices = c->input(2);
+    const Tensor& dense_shape = c->input(3);
+    OP_REQUIRES(c, TensorShapeUtils::IsVector(indices.shape()),
+        errors::InvalidArgument("indices must be a vector, got ",
+                                indices.shape().DebugString()));
+    const int64 N = indices.NumElements();
+    OP_REQUIRES(c, TensorShapeUtils::IsMatrix(sp_indices.shape()) &&
+                   sp_indices.dim_size(0) == N,
+        errors::InvalidArgument("sp_indices must be a [", N,
+                                ", rank] matrix, got ",
+                                sp_indices.shape().DebugString()));
+    OP_REQUIRES(c, TensorShapeUtils::IsVector(dense_shape.shape()) &&
+                   dense_shape.NumElements() >= 1,
+        errors::InvalidArgument("dense_shape must be a non-empty vector"));
+    const int64 num_rows = dense_shape.flat<int64>()(0);
+    const int64 value_len = ev->ValueLen();
+
+    Tensor* out = nullptr;
+    OP_REQUIRES_OK(c, c->allocate_output(0,
+        TensorShape({num_rows, value_len}), &out));
+    if (num_rows == 0) {
+      return;
+    }
+    TValue* out_base = out->flat<TValue>().data();
+
+    std::vector<int64> offsets;
+    std::vector<int64> order;
+    OP_REQUIRES_OK(c, GroupSparseIdsByRow(sp_indices, num_rows,
+                                          &offsets, &order));
+
+    auto indices_flat = indices.flat<TKey>();
+    TValue* default_v = nullptr;
+    if (is_use_default_value_tensor_) {
+      default_v = (TValue*)c->input(4).data();
+    } else {
+      default_v = ev->GetDefaultValuePtr();
+    }
+    auto do_work = [this, ev, indices_flat, out_base, value_len, default_v,
+                    &offsets, &order] (int64 start, int64 limit) {
+      const int64 begin = offsets[start];
+      const int64 num = offsets[limit] - begin;
+      std::vector<TKey> keys(num);
+      std::vector<const TValue*> default_values(num);
+      for (int64 i = 0; i < num; ++i) {
+        const int64 index = order[begin + i];
+        keys[i] = indices_flat(index);
+        default_values[i] = get_default_v_fn_(default_v, keys[i], index,
+            ev->GetDefaultValueDim(), value_len);
+      }
+      memset(out_base + start * value_len, 0,
+             (limit - start) * value_len * sizeof(TValue));
+      int64 row = start;
+      ev->BatchLookupOrCreate(keys.data(), default_values.data(), nullptr,
+          num, [&offsets, out_base, value_len, begin, &row] (
+              int64 i, const TValue* emb) {
+        while (offsets[row + 1] <= begin + i) {
+          ++row;
+        }
+        TValue* out_row = out_base + row * value_len;
+        for (int64 j = 0; j < value_len; ++j) {
+          out_row[j] += emb[j];
+        }
+      });
+      if (combiner_ == SparseCombiner::kSum) {
+        return;
+      }
+      for (int64 r = start; r < limit; ++r) {
+        const int64 n = offsets[r + 1] - offsets[r];
+        if (n > 1) {
+          const TValue scale = SparseCombinerScale<TValue>(combiner_, n);
+          TValue* out_row = out_base + r * value_len;
+          for (int64 j = 0; j < value_len; ++j) {
+            out_row[j] *= scale;
+          }
+        }
+      }
+    };
+    auto worker_threads = c->device()->tensorflow_cpu_worker_threads();
+    const int64 cost_per_row =
+        (N / num_rows + 1) * value_len * sizeof(TValue);
+    Shard(worker_threads->num_threads, worker_threads->workers, num_rows,
+          cost_per_row, do_work);
+
+    embedding::BatchCache<TKey>* cache = ev->Cache();
+    if (cache && N > 0) {
+      cache->add_to_rank(indices_flat.data(), N);
+    }
+  }
+
+ private:
+  SparseCombiner combiner_;
+  bool is_use_default_value_tensor_;
+  std::function<TValue*(TValue*, TKey, int64, int64, int64)> get_default_v_fn_;
+};
+
+#define REGISTER_SPARSE_COMBINE_FULL(dev, ktype, vtype)            \
+  REGISTER_KERNEL_BUILDER(Name("KvResourceSparseSegmentCombine")   \
+                              .Device(DEVICE_##dev)                \
+                              .TypeConstraint<vtype>("dtype")      \
+                              .TypeConstraint<ktype>("Tkeys"),     \
+                          KvResourceSparseSegmentCombineOp<ktype, vtype>)
+
+#define REGISTER_SPARSE_COMBINE_CPU(type)            \
+  REGISTER_SPARSE_COMBINE_FULL(CPU, int32, type);    \
+  REGISTER_SPARSE_COMBINE_FULL(CPU, int64, type)
+
+TF_CALL_float(REGISTER_SPARSE_COMBINE_CPU);
+TF_CALL_double(REGISTER_SPARSE_COMBINE_CPU);
+
+#undef REGISTER_SPARSE_COMBINE_CPU
+#undef REGISTER_SPARSE_COMBINE_FULL
+
+// Scatters the row gradients of KvResourceSparseSegmentCombine to the unique
+// ids in one pass, in the IndexedSlices form KvSparseApply* consumes.
+template <typename TKey, typename TValue>
+class KvResourceSparseSegmentCombineGradOp : public OpKernel {
+ public:
+  explicit KvResourceSparseSegmentCombineGradOp(OpKernelConstruction* c)
+      : OpKernel(c) {
+    string combiner;
+    OP_REQUIRES_OK(c, c->GetAttr("combiner", &combiner));
+    OP_REQUIRES_OK(c, ParseSparseCombiner(combiner, &combiner_));
+  }
+
+  void Compute(OpKernelContext* c) override {
+    const Tensor& grad = c->input(0);
+    const Tensor& indices = c->input(1);
+    const Tensor& sp_indices = c->input(2);
+    OP_REQUIRES(c, TensorShapeUtils::IsMatrix(grad.shape()),
+        errors::InvalidArgument("grad must be a matrix, got ",
+                                grad.shape().DebugString()));
+    OP_REQUIRES(c, TensorShapeUtils::IsVector(indices.shape()),
+        errors::InvalidArgument("indices must be a vector, got ",
+                                indices.shape().DebugString()));
+    const int64 N = indices.NumElements();
+    OP_REQUIRES(c, TensorShapeUtils::IsMatrix(sp_indices.shape()) &&
+                   sp_indices.dim_size(0) == N,
+        errors::InvalidArgument("sp_indices must be a [", N,
+                                ", rank] matrix, got ",
+                                sp_indices.shape().DebugString()));
+    const int64 num_rows = grad.dim_size(0);
+    const int64 value_len = grad.dim_size(1);
+
+    std::vector<int64> offsets;
+    std::vector<int64> order;
+    OP_REQUIRES_OK(c, GroupSparseIdsByRow(sp_indices, num_rows,
+                                          &offsets, &order));
+
+    auto indices_flat = indices.flat<TKey>();
+    std::unordered_map<TKey, int64> unique_map;
+    unique_map.reserve(N);
+    std::vector<int64> slots(N);
+    for (int64 i = 0; i < N; ++i) {
+      slots[i] = unique_map.emplace(indices_flat(i), unique_map.size())
+                     .first->second;
+    }
+    const int64 num_unique = unique_map.size();
+
+    Tensor* values = nullptr;
+    OP_REQUIRES_OK(c, c->allocate_output(0,
+        TensorShape({num_unique, value_len}), &values));
+    Tensor* unique_indices = nullptr;
+    OP_REQUIRES_OK(c, c->allocate_output(1,
+        TensorShape({num_unique}), &unique_indices));
+    auto unique_flat = unique_indices->flat<TKey>();
+    for (const auto& it : unique_map) {
+      unique_flat(it.second) = it.first;
+    }
+
+    TValue* values_base = values->flat<TValue>().data();
+    const TValue* grad_base = grad.flat<TValue>().data();
+    memset(values_base, 0, num_unique * value_len * sizeof(TValue));
+    for (int64 r = 0; r < num_rows; ++r) {
+      const int64 n = offsets[r + 1] - offsets[r];
+      if (n == 0) {
+        continue;
+      }
+      const TValue scale = SparseCombinerScale<TValue>(combiner_, n);
+      const TValue* grad_row = grad_base + r * value_len;
+      for (int64 i = offsets[r]; i < offsets[r + 1]; ++i) {
+        TValue* value_row = values_base + slots[order[i]] * value_len;
+        for (int64 j = 0; j < value_len; ++j) {
+          value_row[j] += scale * grad_row[j];
+        }
+      }
+    }
+  }
+
+ private:
+  SparseCombiner combiner_;
+};
+
+#define REGISTER_SPARSE_COMBINE_GRAD_FULL(dev, ktype, vtype)           \
+  REGISTER_KERNEL_BUILDER(Name("KvResourceSparseSegmentCombineGrad")   \
+                              .Device(DEVICE_##dev)                    \
+                              .TypeConstraint<vtype>("dtype")          \
+                              .TypeConstraint<ktype>("Tkeys"),         \
+                          KvResourceSparseSegmentCombineGradOp<ktype, vtype>)
+
+#define REGISTER_SPARSE_COMBINE_GRAD_CPU(type)            \
+  REGISTER_SPARSE_COMBINE_GRAD_FULL(CPU, int32, type);    \
+  REGISTER_SPARSE_COMBINE_GRAD_FULL(CPU, int64, type)
+
+TF_CALL_float(REGISTER_SPARSE_COMBINE_GRAD_CPU);
+TF_CALL_double(REGISTER_SPARSE_COMBINE_GRAD_CPU);
+
+#undef REGISTER_SPARSE_COMBINE_GRAD_CPU
+#undef REGISTER_SPARSE_COMBINE_GRAD_FULL
+
+template <typename TKey, typename TValue>
+class KvResourcePrefetchOp : public OpKernel {
+ public:
+  explicit KvResourcePrefetchOp(OpKernelConstruction* c) : OpKernel(c) {}
+
+  void Compute(OpKernelContext* c) override {
+    EmbeddingVar<TKey, TValue>* ev = nullptr;
+    OP_REQUIRES_OK(c, LookupResource(c, HandleFromInput(c, 0), &ev));
+    core::ScopedUnref unref_me(ev);
+    const Tensor& indices = c->input(1);
+    Tensor* promoted_num = nullptr;
+    OP_REQUIRES_OK(c, c->allocate_output(0, TensorShape({}), &promoted_num));
+    promoted_num->scalar<int64>()() = ev->GetPrefetchMetrics().promoted_num;
+    if (ev->IsMultiLevel() && indices.NumElements() > 0) {
+      auto indices_flat = indices.flat<TKey>();
+      ev->Prefetch(indices_flat.data(), indices_flat.size());
+    }
+  }
+};
+
+#define REGISTER_PREFETCH_FULL(dev, ktype, vtype)                 \
+  REGISTER_KERNEL_BUILDER(Name("KvResourcePrefetch")              \
+                              .Device(DEVICE_##dev)               \
+                              .HostMemory("resource")             \
+                              .HostMemory("indices")              \
+                              .HostMemory("promoted_num")         \
+                              .TypeConstraint<vtype>("dtype")     \
+                              .TypeConstraint<ktype>("Tkeys"),    \
+                          KvResourcePrefetchOp<ktype, vtype>)
+
+#define REGISTER_PREFETCH_ALL_INDICES(dev, type) \
+  REGISTER_PREFETCH_FULL(dev, int32, type);      \
+  REGISTER_PREFETCH_FULL(dev, int64, type)
+
+#define REGISTER_PREFETCH_CPU(type) REGISTER_PREFETCH_ALL_INDICES(CPU, type)
+
+TF_CALL_float(REGISTER_PREFETCH_CPU);
+TF_CALL_double(REGISTER_PREFETCH_CPU);
+
+#undef REGISTER_PREFETCH_CPU
+#undef REGISTER_PREFETCH_ALL_INDICES
+#undef REGISTER_PREFETCH_FULL
 /*
 // Op that outputs tensors of all keys and all values.
 template <typename TKey, typename TValue>
@@ -586,6 +942,7 @@ class KvResourceImportV2Op: public OpKernel {
     OP_REQUIRES_OK(c, c->GetAttr("false_positive_probability", &false_positive_probability_));
     OP_REQUIRES_OK(c, c->GetAttr("l2_weight_threshold", &l2_weight_threshold_));
     OP_REQUIRES_OK(c, c->GetAttr("layout", &layout_));
+    OP_REQUIRES_OK(c, MaybeUseContiguousLayout(block_num_, &layout_));
     OP_REQUIRES_OK(c, c->GetAttr("max_freq", &max_freq_));
     OP_REQUIRES_OK(c, c->GetAttr("default_value_dim", &default_value_dim_));
 
@@ -597,6 +954,8 @@ class KvResourceImportV2Op: public OpKernel {
 
     OP_REQUIRES_OK(c, c->GetAttr("storage_path", &storage_path_));
     OP_REQUIRES_OK(c, c->GetAttr("storage_size", &storage_size_));
+    OP_REQUIRES_OK(c, c->GetAttr("storage_cache_strategy",
+                                 &storage_cache_strategy_));
   }
 
   void Compute(OpKernelContext* context) override {
@@ -628,7 +987,8 @@ class KvResourceImportV2Op: public OpKernel {
                   handle_self.name(), embedding::StorageConfig(storage_type_,
                                                                storage_path_,
                                                                storage_size_,
-                                                               layout_));
+                                                               layout_,
+                                                               storage_cache_strategy_));
               TF_CHECK_OK(storage_manager->Init());
               *ptr = new EmbeddingVar<TKey, TValue>(handle_self.name(),
                          storage_manager,
@@ -654,7 +1014,8 @@ class KvResourceImportV2Op: public OpKernel {
                  handle_primary.name(), embedding::StorageConfig(storage_type_,
                                                                  storage_path_,
                                                                  storage_size_,
-                                                                 layout_));
+                                                                 layout_,
+                                                                 storage_cache_strategy_));
              TF_CHECK_OK(storage_manager->Init());
              *ptr = new EmbeddingVar<TKey, TValue>(handle_primary.name(),
                         storage_manager,
@@ -691,7 +1052,8 @@ class KvResourceImportV2Op: public OpKernel {
     OP_REQUIRES_OK(context, reader.status());
 
     EVRestoreDynamically(ev, name_string, partition_id_, partition_num_, context, &reader,
-                         "-partition_offset", "-keys", "-values", "-versions", "-freqs");
+                         "-partition_offset", "-keys", "-values", "-versions", "-freqs",
+                         context->device()->tensorflow_cpu_worker_threads()->workers);
     ev->SetInitialized();
   }
 
@@ -719,6 +1081,7 @@ class KvResourceImportV2Op: public OpKernel {
   embedding::StorageType storage_type_;
   std::string storage_path_;
   std::vector<int64> storage_size_;
+  std::vector<int64> storage_cache_strategy_;
   int64 default_value_dim_;
 };
 
@@ -751,7 +1114,9 @@ class KvResourceIncrImportOp: public OpKernel {
     OP_REQUIRES(c, partition_num_ >= 1,
                  errors::InvalidArgument(
                     "partition_num must >= 1, ", std::to_string(partition_num_)));
-
+    // Incremental checkpoints are applied to EVs that may be serving.
+    throttle_ = EVRestoreThrottle::FromEnv();
+    throttle_.upsert = true;
   }
 
   void Compute(OpKernelContext* context) override {
@@ -772,13 +1137,16 @@ class KvResourceIncrImportOp: public OpKernel {
     LOG(INFO) << "incr import, evname:" << name_string << "partition_num:" <<partition_num_;
     EVRestoreDynamically(ev, name_string, partition_id_, partition_num_, context, &reader,
                          "-incr_partition_offset", "-sparse_incr_keys", "-sparse_incr_values",
-                         "-sparse_incr_versions", "-sparse_incr_freqs");
+                         "-sparse_incr_versions", "-sparse_incr_freqs",
+                         context->device()->tensorflow_cpu_worker_threads()->workers,
+                         throttle_);
     ev->SetInitialized();
   }
 
  private:
   int64 partition_id_;
   int64 partition_num_;
+  EVRestoreThrottle throttle_;
   DataType dtype_;
   TensorShape shape_;
   int64 steps_to_live_;
@@ -818,6 +1186,8 @@ class KvResourceExportOp : public OpKernel {
     std::vector<int64> tot_version_list;
     std::vector<int64> tot_freq_list;
     embedding::Iterator* it = nullptr;
+    // The ValuePtrs are not reused before the values are copied out.
+    embedding::EpochGuard guard(ev->epoch_manager());
     int64 total_size = ev->GetSnapshot(&tot_key_list, &tot_valueptr_list, &tot_version_list, &tot_freq_list, &it);
 
     // Create an output tensor
@@ -840,19 +1210,31 @@ class KvResourceExportOp : public OpKernel {
     auto versions_output = versions_output_tensor->template flat<int64>();
     auto freq_output = freq_output_tensor->template flat<int64>();
 
-    for(size_t i = 0; i < total_size; i++) {
-      keys_output(i) = tot_key_list[i];
-      TValue *value = tot_valueptr_list[i];
-      for(int64 m = 0; m < ev->ValueLen(); m++) {
-        val_matrix(i, m) = *(value + m);
-      }
-      if (tot_version_list.size() != 0) {
-        versions_output(i) = tot_version_list[i];
-      }
-      if (tot_freq_list.size() != 0) {
-        freq_output(i) = tot_freq_list[i];
-      }
+    if (total_size > 0) {
+      memcpy(keys_output.data(), tot_key_list.data(),
+             total_size * sizeof(TKey));
+    }
+    if (tot_version_list.size() != 0) {
+      memcpy(versions_output.data(), tot_version_list.data(),
+             tot_version_list.size() * sizeof(int64));
     }
+    if (tot_freq_list.size() != 0) {
+      memcpy(freq_output.data(), tot_freq_list.data(),
+             tot_freq_list.size() * sizeof(int64));
+    }
+
+    const int64 value_len = ev->ValueLen();
+    TValue* val_base = val_matrix.data();
+    auto copy_rows = [&tot_valueptr_list, val_base, value_len](int64 start,
+                                                               int64 limit) {
+      for (int64 i = start; i < limit; ++i) {
+        memcpy(val_base + i * value_len, tot_valueptr_list[i],
+               value_len * sizeof(TValue));
+      }
+    };
+    auto worker_threads = ctx->device()->tensorflow_cpu_worker_threads();
+    Shard(worker_threads->num_threads, worker_threads->workers, total_size,
+          value_len * sizeof(TValue), copy_rows);
   }
 };
 
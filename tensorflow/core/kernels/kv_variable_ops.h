@@ -25,6 +25,9 @@ limitations under the License.
 #include "tensorflow/core/framework/register_types.h"
 #include "tensorflow/core/framework/resource_mgr.h"
 #include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/core/notification.h"
+#include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow/core/platform/env.h"
 #include "tensorflow/core/platform/macros.h"
 #include "tensorflow/core/platform/mutex.h"
 #include "tensorflow/core/platform/types.h"
@@ -33,126 +36,118 @@ limitations under the License.
 #include "tensorflow/core/lib/random/random.h"
 #include "tensorflow/core/lib/random/random_distributions.h"
 #include "tensorflow/core/util/tensor_bundle/tensor_bundle.h"
+#include "tensorflow/core/util/env_var.h"
 
 namespace tensorflow {
 namespace {
   const int kSavedPartitionNum = 1000;
 }
 
+// Dumps a column that is already contiguous in memory.
 template<class T>
-class EVKeyDumpIterator: public  DumpIterator<T> {
+class EVListDumpIterator: public  DumpIterator<T> {
  public:
-  EVKeyDumpIterator(std::vector<T>& key_list):key_list_(key_list) {
+  EVListDumpIterator(std::vector<T>& list):list_(list) {
     keys_idx_ = 0;
   }
 
   bool HasNext() const {
-    return keys_idx_ < key_list_.size();
+    return keys_idx_ < list_.size();
   }
 
   T Next() {
-    return key_list_[keys_idx_++];
+    return list_[keys_idx_++];
+  }
+
+  int64 NextBatch(T* buffer, int64 max_num) {
+    int64 num = std::min(max_num, (int64)list_.size() - keys_idx_);
+    memcpy(buffer, list_.data() + keys_idx_, num * sizeof(T));
+    keys_idx_ += num;
+    return num;
   }
 
  private:
+  std::vector<T>& list_;
   int64 keys_idx_;
-  std::vector<T>& key_list_;
 };
 
+template<class T>
+using EVKeyDumpIterator = EVListDumpIterator<T>;
+template<class T>
+using EVVersionDumpIterator = EVListDumpIterator<T>;
+template<class T>
+using EVFreqDumpIterator = EVListDumpIterator<T>;
+template<class T>
+using EVOffsetDumpIterator = EVListDumpIterator<T>;
+
+// Dumps the embeddings row by row. Batches copy whole rows, split across
+// `thread_pool` when one is given.
 template<class K, class T>
 class EVValueDumpIterator: public  DumpIterator<T> {
  public:
-  EVValueDumpIterator(EmbeddingVar<K, T>*& ev, std::vector<T* >& valueptr_list):ev_(ev), valueptr_list_(valueptr_list) {
+  EVValueDumpIterator(EmbeddingVar<K, T>*& ev, std::vector<T* >& valueptr_list,
+                      thread::ThreadPool* thread_pool = nullptr)
+      : ev_(ev), valueptr_list_(valueptr_list), thread_pool_(thread_pool) {
     keys_idx_ = 0;
     col_idx_ = 0;
   }
 
   bool HasNext() const {
-    if (keys_idx_ < valueptr_list_.size()) {
-      if (keys_idx_ < valueptr_list_.size() - 1)
-        return true;
-      else
-        return col_idx_ < ev_->ValueLen();
-    } else
-      return false;
+    return keys_idx_ < valueptr_list_.size() && ev_->ValueLen() > 0;
   }
 
   T Next() {
+    T value = valueptr_list_[keys_idx_][col_idx_++];
     if (col_idx_ >= ev_->ValueLen()) {
       keys_idx_++;
       col_idx_ = 0;
     }
-    Eigen::array<Eigen::DenseIndex, 1> dims({ev_->ValueLen()});
-    typename TTypes<T>::Flat value_flat = typename TTypes<T>::Flat(valueptr_list_[keys_idx_], dims);
-    return value_flat(col_idx_++);
-  }
-
- private:
-  EmbeddingVar<K, T>* ev_;
-  std::vector<T* >& valueptr_list_;
-  int64 keys_idx_;
-  int64 col_idx_;
-};
-
-
-template<class T>
-class EVVersionDumpIterator: public  DumpIterator<T> {
- public:
-  EVVersionDumpIterator(std::vector<T >& version_list):version_list_(version_list) {
-    keys_idx_ = 0;
-  }
-
-  bool HasNext() const {
-    return keys_idx_ < version_list_.size();
+    return value;
   }
 
-  T Next() {
-    return version_list_[keys_idx_++];
-  }
-
- private:
-  std::vector<T>& version_list_;
-  int64 keys_idx_;
-};
-
-template<class T>
-class EVFreqDumpIterator: public  DumpIterator<T> {
- public:
-  EVFreqDumpIterator(std::vector<T>& freq_list):freq_list_(freq_list) {
-    keys_idx_ = 0;
-  }
-
-  bool HasNext() const {
-    return keys_idx_ < freq_list_.size();
-  }
-
-  T Next() {
-    return freq_list_[keys_idx_++];
+  int64 NextBatch(T* buffer, int64 max_num) {
+    const int64 value_len = ev_->ValueLen();
+    if (value_len <= 0) {
+      return 0;
+    }
+    int64 num = 0;
+    // Finishes the row the previous batch stopped in.
+    while (col_idx_ > 0 && num < max_num) {
+      buffer[num++] = Next();
+    }
+    int64 rows = std::min((max_num - num) / value_len,
+                          (int64)valueptr_list_.size() - keys_idx_);
+    CopyRows(buffer + num, keys_idx_, rows, value_len);
+    keys_idx_ += rows;
+    num += rows * value_len;
+    // Starts a row that does not fit in whole.
+    while (num < max_num && HasNext()) {
+      buffer[num++] = Next();
+    }
+    return num;
   }
 
  private:
-  std::vector<T>& freq_list_;
-  int64 keys_idx_;
-};
-
-template<class T>
-class EVOffsetDumpIterator: public  DumpIterator<T> {
- public:
-  EVOffsetDumpIterator(std::vector<T>& offset_list):offset_list_(offset_list) {
-    keys_idx_ = 0;
-  }
-
-  bool HasNext() const {
-    return keys_idx_ < offset_list_.size();
-  }
-
-  T Next() {
-    return offset_list_[keys_idx_++];
+  void CopyRows(T* buffer, int64 start, int64 rows, int64 value_len) {
+    auto copy = [this, buffer, start, value_len](int64 begin, int64 end) {
+      for (int64 i = begin; i < end; ++i) {
+        memcpy(buffer + i * value_len, valueptr_list_[start + i],
+               value_len * sizeof(T));
+      }
+    };
+    if (thread_pool_ != nullptr && rows >= kParallelRows) {
+      thread_pool_->ParallelFor(rows, value_len * sizeof(T), copy);
+    } else {
+      copy(0, rows);
+    }
   }
 
- private:
-  std::vector<T>& offset_list_;
+  static const int64 kParallelRows = 4096;
+  EmbeddingVar<K, T>* ev_;
+  std::vector<T* >& valueptr_list_;
+  thread::ThreadPool* thread_pool_;
   int64 keys_idx_;
+  int64 col_idx_;
 };
 
 template <class K, class V>
@@ -165,8 +160,20 @@ Status GetInputEmbeddingVar(OpKernelContext* ctx, int input,
   }
 }
 
+// Logs how fast the `mode` (full or incremental) checkpoint of an EV was
+// written.
+inline void LogSaveThroughput(const string& mode, const string& tensor_key,
+                              int64 key_num, int64 bytes, uint64 start_micros) {
+  uint64 micros = std::max<uint64>(Env::Default()->NowMicros() - start_micros, 1);
+  LOG(INFO) << "EV:" << tensor_key << ", " << mode << " save, keys:" << key_num
+            << ", bytes:" << bytes << ", MB/s:" << (double)bytes / micros;
+}
+
 template <class K, class V>
-Status DumpEmbeddingValues(EmbeddingVar<K, V>* ev, const string& tensor_key, BundleWriter* writer, Tensor* part_offset_tensor) {
+Status DumpEmbeddingValues(EmbeddingVar<K, V>* ev, const string& tensor_key,
+                           BundleWriter* writer, Tensor* part_offset_tensor,
+                           thread::ThreadPool* thread_pool = nullptr) {
+  uint64 start_micros = Env::Default()->NowMicros();
   std::vector<K> tot_key_list;
   std::vector<V* > tot_valueptr_list;
   std::vector<int64> tot_version_list;
@@ -176,6 +183,24 @@ Status DumpEmbeddingValues(EmbeddingVar<K, V>* ev, const string& tensor_key, Bun
   std::vector<int64> tot_version_filter_list;
   embedding::Iterator* it = nullptr;
   mutex_lock l(*ev->storage_manager()->get_mutex());
+  // The SSDHASH level is saved as an index snapshot next to the data files
+  // of the bundle as well, so that restoring it does not re-insert every key.
+  bool ssd_index_saved = false;
+  int64 ssd_mutation_num = -1;
+  if (ev->IsMultiLevel() &&
+      ev->storage_manager()->SSDIndexLevel() != nullptr) {
+    Status st = ev->storage_manager()->SaveSSDIndex(
+        SSDIndexDirname(writer->prefix()), &ssd_mutation_num);
+    if (st.ok()) {
+      ssd_index_saved = true;
+    } else {
+      LOG(WARNING) << "EV:" << tensor_key << ", failed to save SSDHASH index: "
+                   << st;
+    }
+  }
+  // The values of the snapshot are read until the dump ends, the guard keeps
+  // their ValuePtrs from being recycled by eviction or shrink meanwhile.
+  embedding::EpochGuard guard(ev->epoch_manager());
   int64 total_size = ev->GetSnapshot(&tot_key_list, &tot_valueptr_list, &tot_version_list, &tot_freq_list, &it);
   VLOG(1) << "EV:" << tensor_key << ", save size:" << total_size;
   int64 iterator_size = 0;
@@ -217,43 +242,33 @@ Status DumpEmbeddingValues(EmbeddingVar<K, V>* ev, const string& tensor_key, Bun
   // save the ev with kSavedPartitionNum piece of tensor so that we can dynamically load ev with changed partition number
   int64 filter_freq = ev->MinFreq();
   for (size_t i = 0; i < tot_key_list.size(); i++) {
-    for (int partid = 0; partid < kSavedPartitionNum; partid++) {
-      if (tot_key_list[i] % kSavedPartitionNum == partid) {
-        if (tot_valueptr_list[i] == reinterpret_cast<V*>(-1)) {
-            // only forward, no backward, bypass
-        } else if (filter_freq != 0 && tot_freq_list[i] < filter_freq) {
-          key_filter_list_parts[partid].push_back(tot_key_list[i]);
-        } else {
-          key_list_parts[partid].push_back(tot_key_list[i]);
-          valueptr_list_parts[partid].push_back(tot_valueptr_list[i]);
-        }
-        break;
-      }
+    // Keys with a negative remainder belong to no partition.
+    int partid = tot_key_list[i] % kSavedPartitionNum;
+    if (partid < 0) {
+      continue;
     }
-  }
-
-  for (size_t i = 0; i < tot_version_list.size(); i++) {
-    for (int partid = 0; partid < kSavedPartitionNum; partid++) {
-      if (tot_key_list[i] % kSavedPartitionNum == partid) {
-        if (filter_freq != 0 && tot_freq_list[i] < filter_freq) {
-          version_filter_list_parts[partid].push_back(tot_version_list[i]);
-        } else {
-          version_list_parts[partid].push_back(tot_version_list[i]);
-        }
-        break;
+    bool filtered = filter_freq != 0 && i < tot_freq_list.size() &&
+                    tot_freq_list[i] < filter_freq;
+    if (tot_valueptr_list[i] == reinterpret_cast<V*>(-1)) {
+        // only forward, no backward, bypass
+    } else if (filtered) {
+      key_filter_list_parts[partid].push_back(tot_key_list[i]);
+    } else {
+      key_list_parts[partid].push_back(tot_key_list[i]);
+      valueptr_list_parts[partid].push_back(tot_valueptr_list[i]);
+    }
+    if (i < tot_version_list.size()) {
+      if (filtered) {
+        version_filter_list_parts[partid].push_back(tot_version_list[i]);
+      } else {
+        version_list_parts[partid].push_back(tot_version_list[i]);
       }
     }
-  }
-  
-  for (size_t i = 0; i < tot_freq_list.size(); i++) {
-    for (int partid = 0; partid < kSavedPartitionNum; partid++) {
-      if (tot_key_list[i] % kSavedPartitionNum == partid) {
-        if (filter_freq != 0 && tot_freq_list[i] < filter_freq) {
-          freq_filter_list_parts[partid].push_back(tot_freq_list[i]);
-        } else {
-          freq_list_parts[partid].push_back(tot_freq_list[i]);
-        }
-        break;
+    if (i < tot_freq_list.size()) {
+      if (filtered) {
+        freq_filter_list_parts[partid].push_back(tot_freq_list[i]);
+      } else {
+        freq_list_parts[partid].push_back(tot_freq_list[i]);
       }
     }
   }
@@ -324,7 +339,8 @@ Status DumpEmbeddingValues(EmbeddingVar<K, V>* ev, const string& tensor_key, Bun
     return st;
   }
 
-  EVValueDumpIterator<K, V> ev_value_dump_iter(ev, partitioned_tot_valueptr_list);
+  EVValueDumpIterator<K, V> ev_value_dump_iter(ev, partitioned_tot_valueptr_list,
+                                                thread_pool);
   st = SaveTensorWithFixedBuffer(tensor_key + "-values", writer, dump_buffer,
                                  bytes_limit, &ev_value_dump_iter,
                                  TensorShape({partitioned_tot_key_list.size() + iterator_size, ev->ValueLen()}),
@@ -374,6 +390,26 @@ Status DumpEmbeddingValues(EmbeddingVar<K, V>* ev, const string& tensor_key, Bun
   }
 
   free(dump_buffer);
+  int64 key_num = partitioned_tot_key_list.size() + iterator_size;
+  int64 bytes = key_num * (sizeof(K) + ev->ValueLen() * sizeof(V)) +
+      partitioned_tot_key_filter_list.size() * sizeof(K) +
+      (partitioned_tot_version_list.size() + partitioned_tot_freq_list.size() +
+       partitioned_tot_version_filter_list.size() +
+       partitioned_tot_freq_filter_list.size()) * sizeof(int64);
+  LogSaveThroughput("full", tensor_key, key_num, bytes, start_micros);
+
+  // The snapshot matches the trailing iterator keys only if the level did
+  // not change while they were dumped.
+  if (ssd_index_saved &&
+      ev->storage_manager()->SSDIndexLevel()->MutationNum() ==
+          ssd_mutation_num) {
+    Tensor ssd_index_tensor(DT_INT64, TensorShape({}));
+    ssd_index_tensor.scalar<int64>()() = iterator_size;
+    st = writer->Add(tensor_key + "-ssd_index", ssd_index_tensor);
+    if (!st.ok()) {
+      return st;
+    }
+  }
 
   if (it != nullptr) {
     delete it;
@@ -381,13 +417,203 @@ Status DumpEmbeddingValues(EmbeddingVar<K, V>* ev, const string& tensor_key, Bun
   return Status::OK();
 }
 
+// Restores the SSDHASH level of `ev` from the index snapshot saved with
+// `tensor_name`. Returns the number of trailing keys of the checkpoint the
+// snapshot covers, or 0 if they have to be imported.
+template<typename K, typename V>
+int64 RestoreSSDIndex(EmbeddingVar<K, V>* ev, BundleReader* reader,
+                      const std::string& tensor_name) {
+  const std::string ssd_index_key = tensor_name + "-ssd_index";
+  if (!ev->IsMultiLevel() ||
+      ev->storage_manager()->SSDIndexLevel() == nullptr ||
+      !reader->Contains(ssd_index_key)) {
+    return 0;
+  }
+  Tensor ssd_index_tensor(DT_INT64, TensorShape({}));
+  Status st = reader->Lookup(ssd_index_key, &ssd_index_tensor);
+  if (st.ok()) {
+    st = ev->storage_manager()->RestoreSSDIndex(
+        SSDIndexDirname(reader->prefix()));
+  }
+  if (!st.ok()) {
+    LOG(WARNING) << "EV:" << tensor_name
+                 << ", importing SSDHASH keys, index not restored: " << st;
+    return 0;
+  }
+  return ssd_index_tensor.scalar<int64>()();
+}
+
+// Bounds how long a restore into a live EV imports without a break, so
+// lookups keep running while an incremental checkpoint is applied, and
+// whether the rows it carries replace the existing ones.
+struct EVRestoreThrottle {
+  // Keys imported at a time, 0 imports whole chunks.
+  int64 slice_key_num = 0;
+  // Pause after every slice.
+  int64 slice_interval_micros = 0;
+  // Overwrite the rows of keys the EV already has. A full restore keeps
+  // them, an incremental checkpoint carries newer rows of them.
+  bool upsert = false;
+
+  bool enabled() const {
+    return slice_key_num > 0;
+  }
+
+  static EVRestoreThrottle FromEnv() {
+    EVRestoreThrottle throttle;
+    TF_CHECK_OK(ReadInt64FromEnvVar("TF_EV_INCR_RESTORE_SLICE_SIZE", 0,
+                                    &throttle.slice_key_num));
+    TF_CHECK_OK(ReadInt64FromEnvVar("TF_EV_INCR_RESTORE_SLICE_INTERVAL_MICROS",
+                                    0, &throttle.slice_interval_micros));
+    return throttle;
+  }
+};
+
+// Imports the chunks of an EV checkpoint through two RestoreBuffers: the next
+// chunk is read from the bundle in the background while `thread_pool` imports
+// the rows of the current one. Each shard imports a contiguous range of rows,
+// checkpoint keys are unique so no two shards insert the same key.
+template<typename K, typename V>
+class EVRestorePipeline {
+ public:
+  // Reads the next chunk into the buffer and returns its number of keys, 0 at
+  // the end of the tensor.
+  typedef std::function<int64(RestoreBuffer*)> ReadFn;
+
+  EVRestorePipeline(EmbeddingVar<K, V>* ev, thread::ThreadPool* thread_pool,
+                    size_t buffer_size,
+                    const EVRestoreThrottle& throttle = EVRestoreThrottle())
+      : ev_(ev), thread_pool_(thread_pool), throttle_(throttle) {
+    for (auto& restore_buff : buffers_) {
+      restore_buff.key_buffer = new char[buffer_size];
+      restore_buff.value_buffer = new char[buffer_size];
+      restore_buff.version_buffer = new char[buffer_size];
+      restore_buff.freq_buffer = new char[buffer_size];
+    }
+  }
+
+  Status Run(const ReadFn& read_fn, int bucket_num, int64 partition_id,
+             int64 partition_num, bool is_filter) {
+    int cur = 0;
+    int64 key_num = Read(read_fn, &buffers_[cur]);
+    while (key_num > 0) {
+      RestoreBuffer* next = &buffers_[1 - cur];
+      int64 next_key_num = 0;
+      Status st;
+      if (thread_pool_ != nullptr) {
+        Notification read_done;
+        thread_pool_->Schedule(
+            [this, &read_fn, next, &next_key_num, &read_done]() {
+          next_key_num = Read(read_fn, next);
+          read_done.Notify();
+        });
+        st = Import(buffers_[cur], key_num, bucket_num, partition_id,
+                    partition_num, is_filter);
+        read_done.WaitForNotification();
+      } else {
+        st = Import(buffers_[cur], key_num, bucket_num, partition_id,
+                    partition_num, is_filter);
+        if (st.ok()) {
+          next_key_num = Read(read_fn, next);
+        }
+      }
+      if (!st.ok()) {
+        return st;
+      }
+      cur = 1 - cur;
+      key_num = next_key_num;
+    }
+    return Status::OK();
+  }
+
+ private:
+  int64 Read(const ReadFn& read_fn, RestoreBuffer* restore_buff) {
+    uint64 start = Env::Default()->NowMicros();
+    int64 key_num = read_fn(restore_buff);
+    ev_->RecordRestoreRead(Env::Default()->NowMicros() - start);
+    return key_num;
+  }
+
+  Status Import(RestoreBuffer& restore_buff, int64 key_num, int bucket_num,
+                int64 partition_id, int64 partition_num, bool is_filter) {
+    if (!throttle_.enabled()) {
+      return ImportSlice(restore_buff, 0, key_num, bucket_num, partition_id,
+                         partition_num, is_filter);
+    }
+    for (int64 begin = 0; begin < key_num;
+         begin += throttle_.slice_key_num) {
+      int64 end = std::min(key_num, begin + throttle_.slice_key_num);
+      TF_RETURN_IF_ERROR(ImportSlice(restore_buff, begin, end, bucket_num,
+                                     partition_id, partition_num, is_filter));
+      if (throttle_.slice_interval_micros > 0) {
+        Env::Default()->SleepForMicroseconds(throttle_.slice_interval_micros);
+      }
+    }
+    return Status::OK();
+  }
+
+  // Imports rows [first, last) of the chunk.
+  Status ImportSlice(RestoreBuffer& restore_buff, int64 first, int64 last,
+                     int bucket_num, int64 partition_id, int64 partition_num,
+                     bool is_filter) {
+    uint64 start = Env::Default()->NowMicros();
+    const int64 key_num = last - first;
+    const int64 value_len = ev_->ValueLen();
+    mutex mu;
+    Status st;
+    auto import_shard = [&](int64 begin, int64 end) {
+      begin += first;
+      end += first;
+      RestoreBuffer shard;
+      shard.key_buffer = restore_buff.key_buffer + begin * sizeof(K);
+      // Filtered keys carry no values.
+      shard.value_buffer = is_filter ? restore_buff.value_buffer :
+          restore_buff.value_buffer + begin * value_len * sizeof(V);
+      shard.version_buffer = restore_buff.version_buffer + begin * sizeof(int64);
+      shard.freq_buffer = restore_buff.freq_buffer + begin * sizeof(int64);
+      shard.upsert = throttle_.upsert;
+      Status s = ev_->Import(shard, end - begin, bucket_num, partition_id,
+                             partition_num, is_filter);
+      // The shard only views the buffers of the chunk.
+      shard.key_buffer = nullptr;
+      shard.value_buffer = nullptr;
+      shard.version_buffer = nullptr;
+      shard.freq_buffer = nullptr;
+      if (!s.ok()) {
+        mutex_lock l(mu);
+        st.Update(s);
+      }
+    };
+    if (thread_pool_ == nullptr || key_num < kParallelKeyNum) {
+      import_shard(0, key_num);
+    } else {
+      thread_pool_->ParallelFor(key_num, kImportCostPerKey + value_len * sizeof(V),
+                                import_shard);
+    }
+    ev_->RecordRestoreImport(key_num, Env::Default()->NowMicros() - start);
+    return st;
+  }
+
+  static const int64 kParallelKeyNum = 4096;
+  // Rough cycles of a hash insert and a ValuePtr allocation.
+  static const int64 kImportCostPerKey = 1000;
+  EmbeddingVar<K, V>* ev_;
+  thread::ThreadPool* thread_pool_;
+  EVRestoreThrottle throttle_;
+  RestoreBuffer buffers_[2];
+};
+
 template<typename K, typename V>
 Status DynamicRestoreValue(EmbeddingVar<K, V>* ev, BundleReader* reader, std::string name_string, int orig_partnum,
-       int64 partition_id = 0, int64 partition_num = 1) {
+       int64 partition_id = 0, int64 partition_num = 1,
+       thread::ThreadPool* thread_pool = nullptr,
+       const EVRestoreThrottle& throttle = EVRestoreThrottle()) {
   string part_str = "part_";
   string curr_partid_str = std::to_string(partition_id);
   bool filter_flag = true;
   bool restore_filter_flag = true;
+  size_t buffer_size = 8 << 20;
+  EVRestorePipeline<K, V> pipeline(ev, thread_pool, buffer_size, throttle);
   for (int i = 0; i < orig_partnum; i++) {
     string part_id = std::to_string(i);
     string pre_subname = name_string.substr(0, name_string.find("part_"));
@@ -443,45 +669,39 @@ Status DynamicRestoreValue(EmbeddingVar<K, V>* ev, BundleReader* reader, std::st
       }
     }
 
-    size_t buffer_size = 8 << 20;
-    RestoreBuffer restore_buff;
-    restore_buff.key_buffer = new char[buffer_size];
-    restore_buff.value_buffer = new char[buffer_size];
-    restore_buff.version_buffer = new char[buffer_size];
-    restore_buff.freq_buffer = new char[buffer_size];
-
     size_t key_bytes_read = 0, value_bytes_read = 0, version_bytes_read = 0, freq_bytes_read = 0;
     int64 tot_key_num = key_shape.dim_size(0);
     size_t value_unit_bytes = sizeof(V) *  value_shape.dim_size(1);
 
-    while(tot_key_num > 0) {
+    auto read_fn = [&](RestoreBuffer* restore_buff) -> int64 {
+      if (tot_key_num <= 0) {
+        return 0;
+      }
       size_t read_key_num = std::min(std::min(buffer_size / sizeof(K), buffer_size / value_unit_bytes), buffer_size / sizeof(int64));
       read_key_num = std::min((int64)read_key_num, tot_key_num);
-      reader->LookupSegment(tensor_key, read_key_num * sizeof(K), restore_buff.key_buffer, key_bytes_read);
-      reader->LookupSegment(tensor_value, read_key_num * value_unit_bytes, restore_buff.value_buffer, value_bytes_read);
-      reader->LookupSegment(tensor_version, read_key_num * sizeof(int64), restore_buff.version_buffer, version_bytes_read);
+      reader->LookupSegment(tensor_key, read_key_num * sizeof(K), restore_buff->key_buffer, key_bytes_read);
+      reader->LookupSegment(tensor_value, read_key_num * value_unit_bytes, restore_buff->value_buffer, value_bytes_read);
+      reader->LookupSegment(tensor_version, read_key_num * sizeof(int64), restore_buff->version_buffer, version_bytes_read);
       if (version_bytes_read == 0) {
-        memset(restore_buff.version_buffer, -1, sizeof(int64) * read_key_num);
+        memset(restore_buff->version_buffer, -1, sizeof(int64) * read_key_num);
       }
       if (filter_flag) {
-        reader->LookupSegment(tensor_freq, (read_key_num + 1)* sizeof(int64), restore_buff.freq_buffer, freq_bytes_read);
+        reader->LookupSegment(tensor_freq, (read_key_num + 1)* sizeof(int64), restore_buff->freq_buffer, freq_bytes_read);
       }else {
-        int64 *freq_tmp = (int64 *)restore_buff.freq_buffer;
+        int64 *freq_tmp = (int64 *)restore_buff->freq_buffer;
         freq_tmp[0] = 0;
         for (int64 i = 1; i < read_key_num + 1; i++) {
           freq_tmp[i] = ev->MinFreq();
         }
       }
-
-      if (key_bytes_read > 0) {
-        read_key_num = key_bytes_read / sizeof(K);
-        VLOG(2) << "repartition, read_key_num:" << read_key_num;
-        st = ev->Import(restore_buff, read_key_num, kSavedPartitionNum, partition_id, partition_num, false);
-        if (!st.ok()) {
-          return st;
-        }
-        tot_key_num -= read_key_num;
-      }
+      read_key_num = key_bytes_read / sizeof(K);
+      VLOG(2) << "repartition, read_key_num:" << read_key_num;
+      tot_key_num -= read_key_num;
+      return read_key_num;
+    };
+    st = pipeline.Run(read_fn, kSavedPartitionNum, partition_id, partition_num, false);
+    if (!st.ok()) {
+      return st;
     }
   }
   return Status::OK();
@@ -489,7 +709,9 @@ Status DynamicRestoreValue(EmbeddingVar<K, V>* ev, BundleReader* reader, std::st
 
 
 template<typename K, typename V>
-Status RestoreValue(EmbeddingVar<K, V>* ev, BundleReader* reader, std::string tensor_key, std::string tensor_value, std::string tensor_version, std::string tensor_freq) {
+Status RestoreValue(EmbeddingVar<K, V>* ev, BundleReader* reader, std::string tensor_key, std::string tensor_value, std::string tensor_version, std::string tensor_freq,
+                    int64 ssd_key_num = 0, thread::ThreadPool* thread_pool = nullptr,
+                    const EVRestoreThrottle& throttle = EVRestoreThrottle()) {
   TensorShape key_shape, value_shape, version_shape, freq_shape, key_filter_shape, version_filter_shape, freq_filter_shape;
   Status st;
   reader->LookupTensorShape(tensor_key, &key_shape);
@@ -566,81 +788,84 @@ Status RestoreValue(EmbeddingVar<K, V>* ev, BundleReader* reader, std::string te
   }
 
   size_t buffer_size = 8 << 20;
-  RestoreBuffer restore_buff;
-  restore_buff.key_buffer = new char[buffer_size];
-  restore_buff.value_buffer = new char[buffer_size];
-  restore_buff.version_buffer = new char[buffer_size];
-  restore_buff.freq_buffer = new char[buffer_size];
+  EVRestorePipeline<K, V> pipeline(ev, thread_pool, buffer_size, throttle);
 
   size_t key_bytes_read = 0, value_bytes_read = 0, version_bytes_read = 0, freq_bytes_read = 0;
   size_t key_filter_bytes_read = 0, version_filter_bytes_read = 0, freq_filter_bytes_read = 0;
 
-  int64 tot_key_num = key_shape.dim_size(0);
+  // Trailing keys covered by a restored SSDHASH index are not imported.
+  int64 tot_key_num = key_shape.dim_size(0) - ssd_key_num;
   size_t value_unit_bytes = sizeof(V) *  value_shape.dim_size(1);
-  std::string key_str = "|";
-  while(tot_key_num > 0) {
+  auto read_fn = [&](RestoreBuffer* restore_buff) -> int64 {
+    if (tot_key_num <= 0) {
+      return 0;
+    }
     size_t read_key_num = std::min(std::min(buffer_size / sizeof(K), buffer_size / value_unit_bytes), buffer_size / sizeof(int64));
     read_key_num = std::min((int64)read_key_num, tot_key_num);
-    reader->LookupSegment(tensor_key, read_key_num * sizeof(K), restore_buff.key_buffer, key_bytes_read);
-    reader->LookupSegment(tensor_value, read_key_num * value_unit_bytes, restore_buff.value_buffer, value_bytes_read);
-    reader->LookupSegment(tensor_version, read_key_num * sizeof(int64), restore_buff.version_buffer, version_bytes_read);
+    reader->LookupSegment(tensor_key, read_key_num * sizeof(K), restore_buff->key_buffer, key_bytes_read);
+    reader->LookupSegment(tensor_value, read_key_num * value_unit_bytes, restore_buff->value_buffer, value_bytes_read);
+    reader->LookupSegment(tensor_version, read_key_num * sizeof(int64), restore_buff->version_buffer, version_bytes_read);
     if (version_bytes_read == 0) {
-        memset(restore_buff.version_buffer, -1, sizeof(int64) * read_key_num);
+        memset(restore_buff->version_buffer, -1, sizeof(int64) * read_key_num);
     }
     if (filter_flag) {
-      reader->LookupSegment(tensor_freq, read_key_num * sizeof(int64), restore_buff.freq_buffer, freq_bytes_read);
+      reader->LookupSegment(tensor_freq, read_key_num * sizeof(int64), restore_buff->freq_buffer, freq_bytes_read);
     } else {
-      int64 *freq_tmp = (int64 *)restore_buff.freq_buffer;
+      int64 *freq_tmp = (int64 *)restore_buff->freq_buffer;
       freq_tmp[0] = 0;
       for (int64 i = 1; i < read_key_num + 1; i++) {
         freq_tmp[i] = ev->MinFreq();
       }
     }
-    if (key_bytes_read > 0) {
-      read_key_num = key_bytes_read / sizeof(K);
-      VLOG(2) << "restore, read_key_num:" << read_key_num;
+    read_key_num = key_bytes_read / sizeof(K);
+    VLOG(2) << "restore, read_key_num:" << read_key_num;
+    tot_key_num -= read_key_num;
+    return read_key_num;
+  };
+  st = pipeline.Run(read_fn, 1, 0, 1, false);
+  if (!st.ok())
+    return st;
 
-      st = ev->Import(restore_buff, read_key_num, 1, 0, 1, false);
-      if (!st.ok())
-        return st;
-      tot_key_num -= read_key_num;
-    }
-  }
-  
   if (restore_filter_flag) {
     int64 tot_key_filter_num = key_filter_shape.dim_size(0);
-    while (tot_key_filter_num > 0) {
+    auto read_filter_fn = [&](RestoreBuffer* restore_buff) -> int64 {
+      if (tot_key_filter_num <= 0) {
+        return 0;
+      }
       size_t read_key_num = std::min(buffer_size / sizeof(K), buffer_size / sizeof(int64));
       read_key_num = std::min((int64)read_key_num, tot_key_filter_num);
-      reader->LookupSegment(tensor_key + "_filtered", read_key_num * sizeof(K), restore_buff.key_buffer, key_filter_bytes_read);
-      reader->LookupSegment(tensor_version + "_filtered", read_key_num * sizeof(int64), restore_buff.version_buffer, version_filter_bytes_read);
-      reader->LookupSegment(tensor_freq + "_filtered", read_key_num * sizeof(int64), restore_buff.freq_buffer, freq_filter_bytes_read);
-      if (key_filter_bytes_read > 0) {
-        read_key_num = key_filter_bytes_read / sizeof(K);
-        VLOG(2) << "restore, read_key_num:" << read_key_num;
-
-        st = ev->Import(restore_buff, read_key_num, 1, 0, 1, true);
-        if (!st.ok())
-          return st;
-        tot_key_filter_num -= read_key_num;
-      }
-    }
+      reader->LookupSegment(tensor_key + "_filtered", read_key_num * sizeof(K), restore_buff->key_buffer, key_filter_bytes_read);
+      reader->LookupSegment(tensor_version + "_filtered", read_key_num * sizeof(int64), restore_buff->version_buffer, version_filter_bytes_read);
+      reader->LookupSegment(tensor_freq + "_filtered", read_key_num * sizeof(int64), restore_buff->freq_buffer, freq_filter_bytes_read);
+      read_key_num = key_filter_bytes_read / sizeof(K);
+      VLOG(2) << "restore, read_key_num:" << read_key_num;
+      tot_key_filter_num -= read_key_num;
+      return read_key_num;
+    };
+    st = pipeline.Run(read_filter_fn, 1, 0, 1, true);
+    if (!st.ok())
+      return st;
   }
-  
+
   return Status::OK();
 }
 
 template<typename K, typename V>
-Status EVRestoreDynamically(EmbeddingVar<K, V>* ev, std::string name_string, int partition_id, int partition_num,
+Status EVRestoreDynamicallyImpl(EmbeddingVar<K, V>* ev, std::string name_string, int partition_id, int partition_num,
           OpKernelContext* context, BundleReader* reader, std::string part_offset_tensor_suffix,
-          std::string key_suffix, std::string value_suffix, std::string version_suffix, std::string freq_suffix) {
+          std::string key_suffix, std::string value_suffix, std::string version_suffix, std::string freq_suffix,
+          thread::ThreadPool* thread_pool, const EVRestoreThrottle& throttle) {
 
     // first check whether there is partition
     string part_str = "part_";
 
+    // Only full checkpoints carry SSDHASH index snapshots.
+    bool restore_ssd_index = (key_suffix == "-keys");
+
     if (name_string.find(part_str) == std::string::npos) {
       // no partition
-      Status s = RestoreValue(ev, reader, name_string + key_suffix, name_string + value_suffix, name_string + version_suffix, name_string + freq_suffix);
+      int64 ssd_key_num = restore_ssd_index ? RestoreSSDIndex(ev, reader, name_string) : 0;
+      Status s = RestoreValue(ev, reader, name_string + key_suffix, name_string + value_suffix, name_string + version_suffix, name_string + freq_suffix, ssd_key_num, thread_pool, throttle);
       if (!s.ok()) {
         LOG(FATAL) <<  "EV restoring fail:" << s.ToString();
       }
@@ -684,7 +909,7 @@ Status EVRestoreDynamically(EmbeddingVar<K, V>* ev, std::string name_string, int
 
       VLOG(1) << "old form, EV name:" << name_string << ", partition_id:" << partition_id
               << ", old partition_num:" << orig_partnum << ", new partition num:" << partition_num;
-      Status s = DynamicRestoreValue(ev, reader, name_string, orig_partnum,  partition_id, partition_num);
+      Status s = DynamicRestoreValue(ev, reader, name_string, orig_partnum,  partition_id, partition_num, thread_pool, throttle);
       if (!s.ok()) {
         LOG(FATAL) <<  "EV restoring fail:" << s.ToString();
       }
@@ -704,13 +929,21 @@ Status EVRestoreDynamically(EmbeddingVar<K, V>* ev, std::string name_string, int
 
       VLOG(1) << "new form:" << name_string << ", partition_id:" << partition_id << ", partition_num:" << partition_num;
 
+      // The trailing iterator keys are not partitioned, with an unchanged
+      // partition number the SSDHASH index snapshot of this part restores them.
+      if (restore_ssd_index) {
+        string pre_subname = name_string.substr(0, name_string.find(part_str));
+        string post_subname = name_string.substr(name_string.find(part_str) + part_str.size() + curr_partid_str.size());
+        string next_tensor_key = pre_subname + part_str + std::to_string(partition_num) + post_subname + key_suffix;
+        string last_tensor_key = pre_subname + part_str + std::to_string(partition_num - 1) + post_subname + key_suffix;
+        if (!reader->Contains(next_tensor_key) && reader->Contains(last_tensor_key)) {
+          RestoreSSDIndex(ev, reader, name_string);
+        }
+      }
+
       int orig_partnum = 0;
       size_t buffer_size = 8 << 20;
-      RestoreBuffer restore_buff;
-      restore_buff.key_buffer = new char[buffer_size];
-      restore_buff.value_buffer = new char[buffer_size];
-      restore_buff.version_buffer = new char[buffer_size];
-      restore_buff.freq_buffer = new char[buffer_size];
+      EVRestorePipeline<K, V> pipeline(ev, thread_pool, buffer_size, throttle);
 
       for (;  ; orig_partnum++) {
         string part_id = std::to_string(orig_partnum);
@@ -859,38 +1092,40 @@ Status EVRestoreDynamically(EmbeddingVar<K, V>* ev, std::string name_string, int
 
           int64 tot_key_bytes_read(0), tot_value_bytes_read(0), tot_version_bytes_read(0), tot_freq_bytes_read(0);
           size_t key_bytes_read = 0, value_bytes_read = 0, version_bytes_read = 0, freq_bytes_read = 0;
-          while(tot_key_num > 0) {
+          auto read_fn = [&](RestoreBuffer* restore_buff) -> int64 {
+            if (tot_key_num <= 0) {
+              return 0;
+            }
             size_t read_key_num = std::min(std::min(buffer_size / sizeof(K), buffer_size / value_unit_bytes), buffer_size / sizeof(int64));
             read_key_num = std::min((int64)read_key_num, tot_key_num);
-            reader->LookupSegmentOffset(tensor_key, key_part_offset + tot_key_bytes_read, read_key_num * sizeof(K),  restore_buff.key_buffer, key_bytes_read);
+            reader->LookupSegmentOffset(tensor_key, key_part_offset + tot_key_bytes_read, read_key_num * sizeof(K),  restore_buff->key_buffer, key_bytes_read);
 
-            reader->LookupSegmentOffset(tensor_value, value_part_offset + tot_value_bytes_read, read_key_num * value_unit_bytes, restore_buff.value_buffer, value_bytes_read);
+            reader->LookupSegmentOffset(tensor_value, value_part_offset + tot_value_bytes_read, read_key_num * value_unit_bytes, restore_buff->value_buffer, value_bytes_read);
 
-            reader->LookupSegmentOffset(tensor_version, version_part_offset + tot_version_bytes_read, read_key_num * sizeof(int64) , restore_buff.version_buffer, version_bytes_read);
+            reader->LookupSegmentOffset(tensor_version, version_part_offset + tot_version_bytes_read, read_key_num * sizeof(int64) , restore_buff->version_buffer, version_bytes_read);
             if (version_bytes_read == 0) {
-               memset(restore_buff.version_buffer, -1, sizeof(int64) * read_key_num);
+               memset(restore_buff->version_buffer, -1, sizeof(int64) * read_key_num);
             }
             if (filter_flag) {
-              reader->LookupSegmentOffset(tensor_freq, freq_part_offset + tot_freq_bytes_read, read_key_num * sizeof(int64), restore_buff.freq_buffer, freq_bytes_read);
+              reader->LookupSegmentOffset(tensor_freq, freq_part_offset + tot_freq_bytes_read, read_key_num * sizeof(int64), restore_buff->freq_buffer, freq_bytes_read);
             } else {
-              int64 *freq_tmp = (int64 *)restore_buff.freq_buffer;
+              int64 *freq_tmp = (int64 *)restore_buff->freq_buffer;
               for (int64 i = 0; i < read_key_num; i++) {
                 freq_tmp[i] = ev->MinFreq();
               }
             }
-            if (key_bytes_read > 0) {
-              read_key_num = key_bytes_read / sizeof(K);
-              VLOG(2) << "restore, read_key_num:" << read_key_num;
-              st = ev->Import(restore_buff, read_key_num, kSavedPartitionNum, partition_id, partition_num, false);
-              if (!st.ok()) {
-                LOG(FATAL) <<  "EV restoring fail:" << st.ToString();
-              }
-            }
-            tot_key_num -= read_key_num;
             tot_key_bytes_read += key_bytes_read;
             tot_value_bytes_read += value_bytes_read;
             tot_version_bytes_read += version_bytes_read;
             tot_freq_bytes_read += freq_bytes_read;
+            read_key_num = key_bytes_read / sizeof(K);
+            VLOG(2) << "restore, read_key_num:" << read_key_num;
+            tot_key_num -= read_key_num;
+            return read_key_num;
+          };
+          st = pipeline.Run(read_fn, kSavedPartitionNum, partition_id, partition_num, false);
+          if (!st.ok()) {
+            LOG(FATAL) <<  "EV restoring fail:" << st.ToString();
           }
 
           if (restore_filter_flag) {
@@ -901,21 +1136,26 @@ Status EVRestoreDynamically(EmbeddingVar<K, V>* ev, std::string name_string, int
             int64 tot_key_filter_num = part_filter_offset_flat(subpart_id + 1) - subpart_filter_offset;
             int64 tot_key_filter_bytes_read(0), tot_version_filter_bytes_read(0), tot_freq_filter_bytes_read(0);
             size_t key_filter_bytes_read = 0, version_filter_bytes_read = 0, freq_filter_bytes_read = 0;
-            while (tot_key_filter_num > 0) {
+            auto read_filter_fn = [&](RestoreBuffer* restore_buff) -> int64 {
+              if (tot_key_filter_num <= 0) {
+                return 0;
+              }
               size_t read_key_num = std::min(buffer_size / sizeof(K), buffer_size / sizeof(int64));
               read_key_num = std::min((int64)read_key_num, tot_key_filter_num);
-              reader->LookupSegmentOffset(tensor_key + "_filtered", key_filter_part_offset + key_filter_bytes_read, read_key_num * sizeof(K), restore_buff.key_buffer, key_filter_bytes_read);
-              reader->LookupSegmentOffset(tensor_version + "_filtered", version_filter_part_offset + version_filter_bytes_read, read_key_num * sizeof(int64), restore_buff.version_buffer, version_filter_bytes_read);
-              reader->LookupSegmentOffset(tensor_freq + "_filtered", freq_filter_part_offset + freq_filter_bytes_read, read_key_num * sizeof(int64), restore_buff.freq_buffer, freq_filter_bytes_read);
-              if (key_filter_bytes_read > 0) {
-                read_key_num = key_filter_bytes_read / sizeof(K);
-                VLOG(2) << "restore, read_key_num:" << read_key_num;
-                st = ev->Import(restore_buff, read_key_num, kSavedPartitionNum, partition_id, partition_num, true);
-                if (!st.ok())
-                 return st;
-                tot_key_filter_num -= read_key_num;
-              }
-            }
+              reader->LookupSegmentOffset(tensor_key + "_filtered", key_filter_part_offset + tot_key_filter_bytes_read, read_key_num * sizeof(K), restore_buff->key_buffer, key_filter_bytes_read);
+              reader->LookupSegmentOffset(tensor_version + "_filtered", version_filter_part_offset + tot_version_filter_bytes_read, read_key_num * sizeof(int64), restore_buff->version_buffer, version_filter_bytes_read);
+              reader->LookupSegmentOffset(tensor_freq + "_filtered", freq_filter_part_offset + tot_freq_filter_bytes_read, read_key_num * sizeof(int64), restore_buff->freq_buffer, freq_filter_bytes_read);
+              tot_key_filter_bytes_read += key_filter_bytes_read;
+              tot_version_filter_bytes_read += version_filter_bytes_read;
+              tot_freq_filter_bytes_read += freq_filter_bytes_read;
+              read_key_num = key_filter_bytes_read / sizeof(K);
+              VLOG(2) << "restore, read_key_num:" << read_key_num;
+              tot_key_filter_num -= read_key_num;
+              return read_key_num;
+            };
+            st = pipeline.Run(read_filter_fn, kSavedPartitionNum, partition_id, partition_num, true);
+            if (!st.ok())
+             return st;
           }
         }
       }
@@ -923,6 +1163,25 @@ Status EVRestoreDynamically(EmbeddingVar<K, V>* ev, std::string name_string, int
     return Status::OK();
   }
 
+// Restores `ev` from the bundle, importing its rows on `thread_pool` when one
+// is given and pausing between slices of keys as `throttle` asks. The restore
+// progress and time land in ev->GetRestoreMetrics().
+template<typename K, typename V>
+Status EVRestoreDynamically(EmbeddingVar<K, V>* ev, std::string name_string, int partition_id, int partition_num,
+          OpKernelContext* context, BundleReader* reader, std::string part_offset_tensor_suffix,
+          std::string key_suffix, std::string value_suffix, std::string version_suffix, std::string freq_suffix,
+          thread::ThreadPool* thread_pool = nullptr,
+          const EVRestoreThrottle& throttle = EVRestoreThrottle()) {
+  uint64 start = Env::Default()->NowMicros();
+  Status s = EVRestoreDynamicallyImpl(ev, name_string, partition_id, partition_num,
+      context, reader, part_offset_tensor_suffix, key_suffix, value_suffix,
+      version_suffix, freq_suffix, thread_pool, throttle);
+  ev->RecordRestoreTotal(Env::Default()->NowMicros() - start);
+  LOG(INFO) << "EV:" << name_string << " restored, "
+            << ev->GetRestoreMetrics().DebugString();
+  return s;
+}
+
 }  // namespace tensorflow
 
 #endif  // TENSORFLOW_KERNELS_KV_VARIABLE_OPS_H_
@@ -111,6 +111,15 @@ class DumpIterator {
   virtual ~DumpIterator() {}
   virtual bool HasNext() const = 0;
   virtual T Next() = 0;
+  // Copies up to max_num next elements into buffer and returns how many were
+  // copied. Iterators over contiguous data override it with bulk copies.
+  virtual int64 NextBatch(T* buffer, int64 max_num) {
+    int64 num = 0;
+    while (num < max_num && HasNext()) {
+      buffer[num++] = Next();
+    }
+    return num;
+  }
 };
 
 template<typename T>
@@ -125,7 +134,8 @@ Status SaveTensorWithFixedBuffer(const string& tensor_name,
     bool use_shape = true) {
   bool dump_happened = false;
   size_t bytes_written = 0;
-  int buffer_idx = 0;
+  int64 buffer_idx = 0;
+  const int64 buffer_num = bytes_limit / sizeof(T);
   Status st;
   int64 total_bytes_written = 0;
   T* key_dump_buffer = (T*)dump_buffer;
@@ -134,58 +144,49 @@ Status SaveTensorWithFixedBuffer(const string& tensor_name,
   if (!st.ok())
     return st;
 
-  while (dump_iter->HasNext()) {
-    T key = dump_iter->Next();
-    if (bytes_written + sizeof(T) > bytes_limit) {
+  // Hands a full buffer to the writer before more data is copied into it.
+  auto flush_if_full = [&]() {
+    if (buffer_idx == buffer_num) {
       dump_happened = true;
       writer->AppendSegmentData(dump_buffer, bytes_written);
       bytes_written = 0;
       buffer_idx = 0;
     }
-    key_dump_buffer[buffer_idx] = key;
-    buffer_idx++;
-    bytes_written += sizeof(T);
-    total_bytes_written += sizeof(T);
+  };
+  auto advance = [&](int64 num) {
+    buffer_idx += num;
+    bytes_written += num * sizeof(T);
+    total_bytes_written += num * sizeof(T);
+  };
+
+  while (dump_iter->HasNext()) {
+    flush_if_full();
+    advance(dump_iter->NextBatch(key_dump_buffer + buffer_idx,
+                                 buffer_num - buffer_idx));
   }
   if (it != nullptr) {
-    int64 size = 0; 
-    if (value_offset == -1) {
-      size = sizeof(T);
-    } else {
-      size = sizeof(T) * dump_tensor_shape.dim_size(1);
-    }
-    char val[size] = {0};
+    int64 dim = (value_offset == -1) ? 1 : dump_tensor_shape.dim_size(1);
+    std::vector<T> row(dim);
     for (it->SeekToFirst(); it->Valid(); it->Next()) {
-      int64 dim = 0;
-      void* start = nullptr;
+      flush_if_full();
       if (value_offset == -1) {
-        it->Key(val, sizeof(T));
-        if (bytes_written + sizeof(T) > bytes_limit) {
-          dump_happened = true;
-          writer->AppendSegmentData(dump_buffer, bytes_written);
-          bytes_written = 0;
-          buffer_idx = 0;
-        }
-        key_dump_buffer[buffer_idx] = *((T*)val);
-        buffer_idx++;
-        bytes_written += sizeof(T);
-        total_bytes_written += sizeof(T);
-
+        it->Key((char*)(key_dump_buffer + buffer_idx), sizeof(T));
+        advance(1);
+      } else if (buffer_num - buffer_idx >= dim) {
+        it->Value((char*)(key_dump_buffer + buffer_idx), dim * sizeof(T),
+                  value_offset * sizeof(T));
+        advance(dim);
       } else {
-        dim = dump_tensor_shape.dim_size(1);
-        it->Value(val, dim * sizeof(T), value_offset * sizeof(T));
-
-        for (int j = 0; j < dim; ++j) {
-          if (bytes_written + sizeof(T) > bytes_limit) {
-            dump_happened = true;
-            writer->AppendSegmentData(dump_buffer, bytes_written);
-            bytes_written = 0;
-            buffer_idx = 0;
-          }
-          key_dump_buffer[buffer_idx] = *((T*)val + j);
-          buffer_idx++;
-          bytes_written += sizeof(T);
-          total_bytes_written += sizeof(T);
+        // The row straddles two buffers.
+        it->Value((char*)row.data(), dim * sizeof(T), value_offset * sizeof(T));
+        int64 copied = 0;
+        while (copied < dim) {
+          flush_if_full();
+          int64 num = std::min(dim - copied, buffer_num - buffer_idx);
+          memcpy(key_dump_buffer + buffer_idx, row.data() + copied,
+                 num * sizeof(T));
+          advance(num);
+          copied += num;
         }
       }
     }
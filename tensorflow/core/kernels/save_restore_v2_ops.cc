@@ -130,7 +130,9 @@ class SaveV2 : public OpKernel {
       OP_REQUIRES_OK(context, variable->Shrink());
     else
       OP_REQUIRES_OK(context, variable->Shrink(global_step_scalar));
-    OP_REQUIRES_OK(context, DumpEmbeddingValues(variable, tensor_name, &writer, &part_offset_tensor));
+    OP_REQUIRES_OK(context, DumpEmbeddingValues(variable, tensor_name, &writer,
+        &part_offset_tensor,
+        context->device()->tensorflow_cpu_worker_threads()->workers));
   }
 
   void Compute(OpKernelContext* context) override {
@@ -35,7 +35,10 @@ class TensorBufferOp : public OpKernel {
                               int64 capacity;
                               TF_RETURN_IF_ERROR(GetNodeAttr(
                                   ndef, "shared_capacity", &capacity));
-                              *pbuf = new TensorBuf(capacity);
+                              int64 max_capacity;
+                              TF_RETURN_IF_ERROR(GetNodeAttr(
+                                  ndef, "shared_max_capacity", &max_capacity));
+                              *pbuf = new TensorBuf(capacity, max_capacity);
                               return Status::OK();
                             }));
     core::ScopedUnref scope(buffer);
@@ -67,7 +70,12 @@ class TensorBufferAsyncOp : public AsyncOpKernel {
                                     int64 capacity;
                                     TF_RETURN_IF_ERROR(GetNodeAttr(
                                         ndef, "shared_capacity", &capacity));
-                                    *resource = new TensorBuf(capacity);
+                                    int64 max_capacity;
+                                    TF_RETURN_IF_ERROR(GetNodeAttr(
+                                        ndef, "shared_max_capacity",
+                                        &max_capacity));
+                                    *resource =
+                                        new TensorBuf(capacity, max_capacity);
                                     return Status::OK();
                                   }),
                          done);
@@ -103,7 +111,7 @@ class TensorBufferPutOp : public TensorBufferOp {
     for (int i = 0; i < ctx->num_inputs(); ++i) {
       record.push_back(ctx->input(i));
     }
-    ctx->SetStatus(buf->Put(record, timeout_millis_));
+    ctx->SetStatus(buf->Put(&record, timeout_millis_));
   }
 
  private:
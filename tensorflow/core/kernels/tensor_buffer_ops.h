@@ -34,68 +34,128 @@ limitations under the License.
 #include "third_party/eigen3/Eigen/Core"
 #include "third_party/eigen3/unsupported/Eigen/CXX11/Tensor"
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <cstddef>
-#include <deque>
+#include <memory>
 #include <vector>
 
 namespace tensorflow {
 
 #define TF_RESOURCE_DEBUG_STRING_CONST const
 
+// Bounded ring buffer of records shared by producers and consumers.
+//
+// Records are moved in and out of preallocated slots, whose sequence numbers
+// let producers and consumers claim slots without locks. mu_ is only taken
+// by threads that have to wait for space or records, and by the threads that
+// wake them up.
+//
+// If max_capacity is larger than the capacity, the capacity is doubled up to
+// it whenever consumers often found the buffer empty while producers were
+// blocked by a full buffer.
 class TensorBuf : public ResourceBase {
  public:
-  explicit TensorBuf(int64 capacity)
-      : capacity_(capacity), is_cancelled_(false), is_closed_(false) {}
+  TensorBuf(int64 capacity, int64 max_capacity)
+      : capacity_(capacity),
+        max_capacity_(std::max(capacity, max_capacity)),
+        is_cancelled_(false),
+        is_closed_(false),
+        enqueue_pos_(0),
+        dequeue_pos_(0),
+        num_put_waiters_(0),
+        num_take_waiters_(0),
+        num_takes_(0),
+        num_put_waits_(0),
+        put_wait_micros_(0),
+        num_take_waits_(0),
+        take_wait_micros_(0),
+        window_put_waits_(0),
+        window_take_waits_(0) {
+    int64 slot_num = 1;
+    while (slot_num < max_capacity_) {
+      slot_num <<= 1;
+    }
+    slot_mask_ = slot_num - 1;
+    slots_.reset(new Slot[slot_num]);
+    for (int64 i = 0; i < slot_num; ++i) {
+      slots_[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
 
   ~TensorBuf() { Cancel(); }
 
-  Status Put(const std::vector<Tensor>& record, int64 timeout_millis) {
-    std::unique_lock<std::mutex> lock(mu_);
-
-    bool should_retry = !put_cv_.wait_for(
-        lock, std::chrono::milliseconds(timeout_millis),
-        [this]() { return buffer_.size() < capacity_ || is_cancelled_; });
-    if (should_retry) {
-      lock.unlock();
-      LOG(WARNING) << "Prefetching was ignored since timeout.";
-      return Status::OK();
-    }
-
-    if (TF_PREDICT_FALSE(is_cancelled_)) {
-      lock.unlock();
+  // Moves `record` into the buffer.
+  Status Put(std::vector<Tensor>* record, int64 timeout_millis) {
+    if (TF_PREDICT_FALSE(is_cancelled_.load())) {
       return Status(errors::Cancelled("Session was closed."));
     }
 
-    buffer_.push_back(std::move(record));
-
-    lock.unlock();
-    take_cv_.notify_all();
+    if (!TryPush(record)) {
+      const uint64 start = Env::Default()->NowMicros();
+      bool is_pushed = false;
+      {
+        std::unique_lock<std::mutex> lock(mu_);
+        ++num_put_waiters_;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        put_cv_.wait_for(
+            lock, std::chrono::milliseconds(timeout_millis),
+            [this, record, &is_pushed]() {
+              is_pushed = !is_cancelled_.load() && TryPush(record);
+              return is_pushed || is_cancelled_.load();
+            });
+        --num_put_waiters_;
+      }
+      ++num_put_waits_;
+      ++window_put_waits_;
+      put_wait_micros_ += Env::Default()->NowMicros() - start;
+
+      if (TF_PREDICT_FALSE(!is_pushed)) {
+        if (is_cancelled_.load()) {
+          return Status(errors::Cancelled("Session was closed."));
+        }
+        LOG(WARNING) << "Prefetching was ignored since timeout.";
+        return Status::OK();
+      }
+    }
 
+    Notify(&num_take_waiters_, &take_cv_);
     return Status::OK();
   }
 
+  // Moves the oldest record out of the buffer into `record`.
   Status Take(std::vector<Tensor>* record) {
-    std::unique_lock<std::mutex> lock(mu_);
-
-    take_cv_.wait(lock, [this]() { return !buffer_.empty() || is_cancelled_; });
-
-    if (TF_PREDICT_FALSE(is_closed_ && buffer_.empty())) {
-      lock.unlock();
-      return Status(errors::OutOfRange("EOF reached."));
+    if (!TryPop(record)) {
+      const uint64 start = Env::Default()->NowMicros();
+      bool is_popped = false;
+      {
+        std::unique_lock<std::mutex> lock(mu_);
+        ++num_take_waiters_;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        take_cv_.wait(lock, [this, record, &is_popped]() {
+          is_popped = TryPop(record);
+          return is_popped || is_cancelled_.load();
+        });
+        --num_take_waiters_;
+      }
+      ++num_take_waits_;
+      ++window_take_waits_;
+      take_wait_micros_ += Env::Default()->NowMicros() - start;
+
+      if (TF_PREDICT_FALSE(!is_popped)) {
+        if (is_closed_.load()) {
+          return Status(errors::OutOfRange("EOF reached."));
+        }
+        return Status(errors::Cancelled("Session was closed."));
+      }
     }
 
-    if (TF_PREDICT_FALSE(is_cancelled_ && buffer_.empty())) {
-      lock.unlock();
-      return Status(errors::Cancelled("Session was closed."));
+    Notify(&num_put_waiters_, &put_cv_);
+    if (TF_PREDICT_FALSE((++num_takes_) % kTuneWindow == 0)) {
+      Tune();
     }
-
-    *record = std::move(buffer_.front());
-    buffer_.pop_front();
-
-    lock.unlock();
-    put_cv_.notify_all();
-
     return Status::OK();
   }
 
@@ -123,13 +183,21 @@ class TensorBuf : public ResourceBase {
   }
 
   Status GetSize(Tensor* size) {
-    std::unique_lock<std::mutex> lock(mu_);
-    size->scalar<int32>().setConstant(static_cast<int64>(buffer_.size()));
+    const uint64 dequeue_pos = dequeue_pos_.load();
+    const uint64 enqueue_pos = enqueue_pos_.load();
+    size->scalar<int32>().setConstant(
+        enqueue_pos > dequeue_pos ? static_cast<int32>(enqueue_pos - dequeue_pos)
+                                  : 0);
     return Status::OK();
   }
 
   string DebugString() TF_RESOURCE_DEBUG_STRING_CONST override {
-    return strings::StrCat("TensorBuf(capacity=", capacity_, ")");
+    return strings::StrCat(
+        "TensorBuf(capacity=", capacity_.load(), ", takes=", num_takes_.load(),
+        ", put_waits=", num_put_waits_.load(),
+        ", put_wait_micros=", put_wait_micros_.load(),
+        ", take_waits=", num_take_waits_.load(),
+        ", take_wait_micros=", take_wait_micros_.load(), ")");
   }
 
   void Schedule(const string& name, int64 num_threads,
@@ -151,13 +219,118 @@ class TensorBuf : public ResourceBase {
   }
 
  private:
-  std::deque<std::vector<Tensor> > buffer_;
-  std::size_t capacity_;
-  bool is_cancelled_;
-  bool is_closed_;
-  std::mutex mu_;
+  // Number of takes between two capacity tunings.
+  static const int64 kTuneWindow = 64;
+
+  // A slot is free for the enqueue at position p when seq == p, and holds the
+  // record for the dequeue at position p when seq == p + 1.
+  struct alignas(64) Slot {
+    std::atomic<uint64> seq;
+    std::vector<Tensor> record;
+  };
+
+  bool TryPush(std::vector<Tensor>* record) {
+    uint64 pos = enqueue_pos_.load(std::memory_order_relaxed);
+    Slot* slot;
+    while (true) {
+      if (static_cast<int64>(pos - dequeue_pos_.load()) >= capacity_.load()) {
+        return false;
+      }
+      slot = &slots_[pos & slot_mask_];
+      const int64 diff =
+          static_cast<int64>(slot->seq.load(std::memory_order_acquire) - pos);
+      if (diff == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    slot->record.swap(*record);
+    slot->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool TryPop(std::vector<Tensor>* record) {
+    uint64 pos = dequeue_pos_.load(std::memory_order_relaxed);
+    Slot* slot;
+    while (true) {
+      slot = &slots_[pos & slot_mask_];
+      const int64 diff = static_cast<int64>(
+          slot->seq.load(std::memory_order_acquire) - (pos + 1));
+      if (diff == 0) {
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    record->clear();
+    record->swap(slot->record);
+    slot->seq.store(pos + slot_mask_ + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Wakes a waiter, pairs with the fence taken by waiters before they check
+  // the buffer again.
+  void Notify(std::atomic<int64>* num_waiters, std::condition_variable* cv) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (num_waiters->load() > 0) {
+      { std::lock_guard<std::mutex> lock(mu_); }
+      cv->notify_one();
+    }
+  }
+
+  void Tune() {
+    const int64 take_waits = window_take_waits_.exchange(0);
+    const int64 put_waits = window_put_waits_.exchange(0);
+    const int64 capacity = capacity_.load();
+    // Consumers stalled while producers were held back by the capacity.
+    if (take_waits * 8 < kTuneWindow || put_waits == 0 ||
+        capacity >= max_capacity_) {
+      return;
+    }
+    const int64 new_capacity = std::min(capacity * 2, max_capacity_);
+    int64 expected = capacity;
+    if (capacity_.compare_exchange_strong(expected, new_capacity)) {
+      LOG(INFO) << "TensorBuf capacity increased from " << capacity << " to "
+                << new_capacity << " since " << take_waits << " of "
+                << kTuneWindow << " takes stalled.";
+      std::lock_guard<std::mutex> lock(mu_);
+      put_cv_.notify_all();
+    }
+  }
+
+  std::atomic<int64> capacity_;
+  int64 max_capacity_;
+  std::atomic<bool> is_cancelled_;
+  std::atomic<bool> is_closed_;
+
+  std::unique_ptr<Slot[]> slots_;
+  uint64 slot_mask_;
+  alignas(64) std::atomic<uint64> enqueue_pos_;
+  alignas(64) std::atomic<uint64> dequeue_pos_;
+
+  alignas(64) std::mutex mu_;
   std::condition_variable take_cv_;
   std::condition_variable put_cv_;
+  std::atomic<int64> num_put_waiters_;
+  std::atomic<int64> num_take_waiters_;
+
+  std::atomic<int64> num_takes_;
+  std::atomic<int64> num_put_waits_;
+  std::atomic<int64> put_wait_micros_;
+  std::atomic<int64> num_take_waits_;
+  std::atomic<int64> take_wait_micros_;
+  std::atomic<int64> window_put_waits_;
+  std::atomic<int64> window_take_waits_;
+
   std::shared_ptr<thread::ThreadPool> threads_;
 };
 }
@@ -20,6 +20,7 @@ limitations under the License.
 #include "tensorflow/core/lib/bfloat16/bfloat16.h"
 
 #include <algorithm>
+#include <memory>
 
 #include "tensorflow/core/framework/bounds_check.h"
 #include "tensorflow/core/framework/op_kernel.h"
@@ -126,12 +127,16 @@ class KvSparseApplyAdagradOp : public OpKernel {
 
         auto do_work = [this, ctx, &indices_vec, var, accum, &grad_flat,
             &gs, &lr_scalar] (int64 start_i, int64 limit_i) {
+          embedding::EpochGuard guard(var->epoch_manager());
+          std::vector<ValuePtr<T>*> value_ptrs(limit_i - start_i);
+          std::unique_ptr<bool[]> is_filters(new bool[limit_i - start_i]);
+          OP_REQUIRES_OK(ctx, var->BatchLookupOrCreateKey(
+              &indices_vec(start_i), limit_i - start_i, value_ptrs.data(),
+              is_filters.get(), gs));
           for (int64 i = start_i; i < limit_i; i++) {
             const TKey index = indices_vec(i);
-            ValuePtr<T>* value_ptr = nullptr;
-            bool is_filter = false;
-            OP_REQUIRES_OK(ctx, var->LookupOrCreateKey(index, &value_ptr, &is_filter,
-                  gs));
+            ValuePtr<T>* value_ptr = value_ptrs[i - start_i];
+            bool is_filter = is_filters[i - start_i];
             if (is_filter) {
               auto a = accum->flat(value_ptr);
               auto g = grad_flat.template chip<0>(i);
@@ -397,11 +402,16 @@ class KvSparseApplyFtrlOp : public OpKernel {
                        &l2_shrinkage_scalar, &lr_power_scalar]
                        (int64 start_i, int64 limit_i) {
 
+          embedding::EpochGuard guard(var_->epoch_manager());
+          std::vector<ValuePtr<T>*> value_ptrs(limit_i - start_i);
+          std::unique_ptr<bool[]> is_filters(new bool[limit_i - start_i]);
+          OP_REQUIRES_OK(ctx, var_->BatchLookupOrCreateKey(
+              &indices_vec(start_i), limit_i - start_i, value_ptrs.data(),
+              is_filters.get()));
           for (int64 i = start_i; i < limit_i; i++) {
             const TKey index = indices_vec(i);
-            ValuePtr<T>* value_ptr = nullptr;
-            bool is_filter = false;
-            OP_REQUIRES_OK(ctx, var_->LookupOrCreateKey(index, &value_ptr, &is_filter));
+            ValuePtr<T>* value_ptr = value_ptrs[i - start_i];
+            bool is_filter = is_filters[i - start_i];
             if (is_filter) {
               auto var = var_->flat(value_ptr);
               auto accum = accum_->flat(value_ptr);
@@ -1102,11 +1112,16 @@ class KvSparseApplyAdagradDecayOp : public OpKernel {
             &grad_flat, accum_decay_power_var, &decay_step_scalar,
             &decay_rate_scalar, &decay_baseline_scalar, &lr_scalar]
                 (int64 start_i, int64 limit_i) {
+          embedding::EpochGuard guard(var->epoch_manager());
+          std::vector<ValuePtr<T>*> value_ptrs(limit_i - start_i);
+          std::unique_ptr<bool[]> is_filters(new bool[limit_i - start_i]);
+          OP_REQUIRES_OK(ctx, var->BatchLookupOrCreateKey(
+              &indices_vec(start_i), limit_i - start_i, value_ptrs.data(),
+              is_filters.get(), gs));
           for (int64 i = start_i; i < limit_i; i++) {
             const Tindex index = indices_vec(i);
-            ValuePtr<T>* value_ptr = nullptr;
-            bool is_filter = false;
-            OP_REQUIRES_OK(ctx, var->LookupOrCreateKey(index, &value_ptr, &is_filter, gs));
+            ValuePtr<T>* value_ptr = value_ptrs[i - start_i];
+            bool is_filter = is_filters[i - start_i];
             if (is_filter) {
               auto a = accum->flat(value_ptr);
 
@@ -1265,11 +1280,16 @@ class KvSparseApplyAdamOp : public OpKernel {
 
           int64 gs = global_step.scalar<int64>()();
 
+          embedding::EpochGuard guard(var->epoch_manager());
+          std::vector<ValuePtr<T>*> value_ptrs(limit_i - start_i);
+          std::unique_ptr<bool[]> is_filters(new bool[limit_i - start_i]);
+          OP_REQUIRES_OK(ctx, var->BatchLookupOrCreateKey(
+              &indices_vec(start_i), limit_i - start_i, value_ptrs.data(),
+              is_filters.get(), gs));
           for (int64 i = start_i; i < limit_i; i++) {
             const Tindex index = indices_vec(i);
-            ValuePtr<T>* value_ptr = nullptr;
-            bool is_filter =false;
-            OP_REQUIRES_OK(ctx, var->LookupOrCreateKey(index, &value_ptr, &is_filter, gs));
+            ValuePtr<T>* value_ptr = value_ptrs[i - start_i];
+            bool is_filter = is_filters[i - start_i];
             if (is_filter) {
               auto var_i = var->flat(value_ptr);
               auto m_a = m->flat(value_ptr);
@@ -1828,11 +1848,16 @@ class KvSparseApplyAdamAsyncOp : public OpKernel {
             &beta2_scalar, &beta1_scalar, &epsilon_scalar, &lr_scalar, &global_step]
                 (int64 start_i, int64 limit_i) {
           Tstep gs = global_step.scalar<Tstep>()();
+          embedding::EpochGuard guard(var->epoch_manager());
+          std::vector<ValuePtr<T>*> value_ptrs(limit_i - start_i);
+          std::unique_ptr<bool[]> is_filters(new bool[limit_i - start_i]);
+          OP_REQUIRES_OK(ctx, var->BatchLookupOrCreateKey(
+              &indices_vec(start_i), limit_i - start_i, value_ptrs.data(),
+              is_filters.get(), gs));
           for (Tindex i = start_i; i < limit_i; i++) {
             const Tindex index = indices_vec(i);
-            ValuePtr<T>* value_ptr = nullptr;
-            bool is_filter = false;
-            OP_REQUIRES_OK(ctx, var->LookupOrCreateKey(index, &value_ptr, &is_filter, gs));
+            ValuePtr<T>* value_ptr = value_ptrs[i - start_i];
+            bool is_filter = is_filters[i - start_i];
             if (is_filter) {
               auto v_ = v->flat(value_ptr);
               auto m_ = m->flat(value_ptr);
@@ -1876,11 +1901,16 @@ class KvSparseApplyAdamAsyncOp : public OpKernel {
             auto indices_vec = indices.vec<Tindex>();
             Tstep gs = global_step.scalar<Tstep>()();
 
+            embedding::EpochGuard guard(var->epoch_manager());
+            std::vector<ValuePtr<T>*> value_ptrs(limit_i - start_i);
+            std::unique_ptr<bool[]> is_filters(new bool[limit_i - start_i]);
+            OP_REQUIRES_OK(ctx, var->BatchLookupOrCreateKey(
+                &indices_vec(start_i), limit_i - start_i, value_ptrs.data(),
+                is_filters.get(), gs));
             for (Tindex i = static_cast<Tindex>(start_i); i < static_cast<Tindex>(limit_i); i++) {
               const Tindex index = indices_vec(i);
-              ValuePtr<T>* value_ptr = nullptr;
-              bool is_filter = false;
-              OP_REQUIRES_OK(ctx, var->LookupOrCreateKey(index, &value_ptr, &is_filter, gs));
+              ValuePtr<T>* value_ptr = value_ptrs[i - start_i];
+              bool is_filter = is_filters[i - start_i];
               if (is_filter) {
                 auto m_a = m->flat(value_ptr);
                 auto v_a = v->flat(value_ptr);
@@ -1992,11 +2022,16 @@ class KvResourceSparseApplyGradientDescentOp : public OpKernel {
         auto grad_flat = grad.flat_outer_dims<T>();
         auto do_work = [this, ctx, &indices_vec, var, &grad_flat, &gs,
             &lr_scalar] (int64 start_i, int64 limit_i) {
+          embedding::EpochGuard guard(var->epoch_manager());
+          std::vector<ValuePtr<T>*> value_ptrs(limit_i - start_i);
+          std::unique_ptr<bool[]> is_filters(new bool[limit_i - start_i]);
+          OP_REQUIRES_OK(ctx, var->BatchLookupOrCreateKey(
+              &indices_vec(start_i), limit_i - start_i, value_ptrs.data(),
+              is_filters.get(), gs));
           for (int64 i = start_i; i < limit_i; i++) {
             const Tindex index = indices_vec(i);
-            ValuePtr<T>* value_ptr = nullptr;
-            bool is_filter = false;
-            OP_REQUIRES_OK(ctx, var->LookupOrCreateKey(index, &value_ptr, &is_filter, gs));
+            ValuePtr<T>* value_ptr = value_ptrs[i - start_i];
+            bool is_filter = is_filters[i - start_i];
             if (is_filter) {
               auto g = grad_flat.template chip<0>(i);
               auto v = var->flat(value_ptr);
@@ -13,11 +13,16 @@ See the License for the specific language governing permissions and
 limitations under the License.
 ==============================================================================*/
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <cstddef>
 #include <deque>
+#include <map>
 #include <mutex>
 #include <numeric>
+#include <unordered_map>
 #include <vector>
 
 #define EIGEN_USE_THREADS
@@ -67,95 +72,239 @@ namespace tensorflow {
 
 using shape_inference::InferenceContext;
 
+// Works are striped over segments by their sequence number, each segment
+// guarded by its own lock. Takers claim segments round-robin so concurrent
+// takes hit different locks, while a single taker still sees the works in the
+// order they were put. Puts, saves and restores lock all segments.
+//
+// Works ending with `?start=S&end=E` can also be taken as slices. A taken
+// slice is leased until its owner reports that all records in it were read,
+// and an idle taker splits off the unreserved half of the largest lease once
+// the queue is empty. Owners reserve the records they are going to read in
+// chunks, splits never take reserved records and leave at least
+// min_split_size records to the owner past its last reported position.
+// Remainders of leases past their reported positions are saved back as
+// works, so a restore reads exactly the records not reported as read.
 class WorkQueue : public ResourceBase {
  public:
-  WorkQueue(const string& name) : name_(name), is_closed_(false) {}
+  WorkQueue(const string& name)
+      : name_(name), is_closed_(false), size_(0), put_cursor_(0),
+        take_cursor_(0), num_waiters_(0), num_takes_(0), num_waits_(0),
+        wait_micros_(0), max_wait_micros_(0), is_drained_(false),
+        next_lease_id_(0), num_steals_(0) {}
 
   ~WorkQueue() { Close(); }
 
   string DebugString() const override {
-    return "WorkQueue";
+    return strings::StrCat(
+        "WorkQueue ", name_, ": ", size_.load(), " works, ",
+        num_takes_.load(), " takes, ", num_waits_.load(), " waits, ",
+        wait_micros_.load(), " us waited, ", max_wait_micros_.load(),
+        " us max wait, ", num_steals_.load(), " steals");
   }
 
   int64 MemoryUsed() const override {
-    return static_cast<int64>(queue_.size() * DataTypeSize(DT_STRING));
+    return size_.load() * static_cast<int64>(DataTypeSize(DT_STRING));
   }
 
   Status Put(const Tensor& inputs) {
     const int64 num_puts = inputs.shape().dim_size(0);
 
-    std::unique_lock<std::mutex> lock(mu_);
-    if (TF_PREDICT_FALSE(is_closed_)) {
-      lock.unlock();
-      take_cv_.notify_all();
+    if (TF_PREDICT_FALSE(is_closed_.load())) {
+      NotifyAll();
       LOG(WARNING) << "Work queue " << name_ << " reinitialized.";
 
       return Status::OK();
     }
 
-    for (int64 i = 0; i < num_puts; ++i) {
-      queue_.push_back(inputs.flat<string>()(i));
+    {
+      SegmentsLock lock(this);
+      for (int64 i = 0; i < num_puts; ++i) {
+        PushLocked(inputs.flat<string>()(i));
+      }
     }
 
-    lock.unlock();
-    take_cv_.notify_all();
+    std::unique_lock<std::mutex> lock(wait_mu_);
+    // Wake only as many takers as there are new works.
+    if (num_puts >= num_waiters_) {
+      take_cv_.notify_all();
+    } else {
+      for (int64 i = 0; i < num_puts; ++i) {
+        take_cv_.notify_one();
+      }
+    }
 
     return Status::OK();
   }
 
   Status Take(Tensor* output) {
-    std::unique_lock<std::mutex> lock(mu_);
+    string work;
+    TF_RETURN_IF_ERROR(
+        TakeOrWait([this](string* w) { return TryTake(w); }, &work));
+    output->scalar<string>().setConstant(std::move(work));
+    return Status::OK();
+  }
 
-    take_cv_.wait(lock, [this]() { return !queue_.empty() || is_closed_; });
+  // Takes a work and leases it if it is a slice, or splits a slice off the
+  // largest lease when the queue is empty. `lease` is -1 for works that are
+  // not slices.
+  Status TakeSlice(int64 min_split_size, string* work, int64* lease) {
+    bool stolen = false;
+    Status s = TakeOrWait(
+        [this, min_split_size, lease, &stolen](string* w) {
+          if (TryTake(w, lease)) {
+            return true;
+          }
+          stolen = TrySteal(min_split_size, w, lease);
+          return stolen;
+        },
+        work);
+    if (stolen) {
+      // The leases changed, waiting takers may split another one.
+      NotifyAll();
+    }
+    return s;
+  }
 
-    if (TF_PREDICT_FALSE(queue_.empty() && is_closed_)) {
-      return Status(errors::OutOfRange(
-          strings::StrCat("All works in work queue ", name_, " are taken.")));
+  // Reserves up to `num_records` records of the leased slice past the ones
+  // already reserved, and returns them as a slice in `work`, which is empty
+  // once the lease has no more records to reserve. `end` is the end of the
+  // reserved records, or -1 if the lease is unknown.
+  Status Reserve(int64 lease, int64 num_records, string* work, int64* end) {
+    std::lock_guard<std::mutex> lock(lease_mu_);
+    work->clear();
+    auto it = leases_.find(lease);
+    if (it == leases_.end()) {
+      *end = -1;
+      return Status::OK();
     }
+    Lease& l = it->second;
+    const int64 start = std::max(l.reserved, l.position);
+    *end = std::min(start + std::max(num_records, int64{1}), l.end);
+    if (start < *end) {
+      *work = SliceOf(l.url, start, *end);
+      l.reserved = *end;
+    } else {
+      *end = l.end;
+    }
+    return Status::OK();
+  }
 
-    output->scalar<string>().setConstant(std::move(queue_.front()));
-    queue_.pop_front();
+  // Records that records before `position` in the leased slice were read.
+  // Returns the end of the slice in `end`, which shrinks as the slice
+  // is split, or -1 if the lease is unknown. The lease is released once
+  // `position` reaches `end`.
+  Status ReportProgress(int64 lease, int64 position, int64* end) {
+    {
+      std::lock_guard<std::mutex> lock(lease_mu_);
+      auto it = leases_.find(lease);
+      if (it == leases_.end()) {
+        *end = -1;
+        return Status::OK();
+      }
+      Lease& l = it->second;
+      l.position = std::min(std::max(l.position, position), l.end);
+      *end = l.end;
+      if (l.position < l.end) {
+        return Status::OK();
+      }
+      leases_.erase(it);
+    }
+    // Wake the takers waiting on the released lease.
+    NotifyAll();
+    return Status::OK();
+  }
 
+  // Takes at least one and at most `num_works` works, waiting only for the
+  // first one.
+  Status TakeMany(int64 num_works, std::vector<string>* works) {
+    works->clear();
+    works->reserve(num_works);
+    string work;
+    TF_RETURN_IF_ERROR(
+        TakeOrWait([this](string* w) { return TryTake(w); }, &work));
+    works->push_back(std::move(work));
+    while (static_cast<int64>(works->size()) < num_works && TryTake(&work)) {
+      works->push_back(std::move(work));
+    }
     return Status::OK();
   }
 
   Status GetSize(Tensor* size) {
-    std::unique_lock<std::mutex> lock(mu_);
-    size->scalar<int64>().setConstant(static_cast<int64>(queue_.size()));
+    size->scalar<int64>().setConstant(size_.load());
     return Status::OK();
   }
 
   Status Restore(const Tensor& restorable) {
     const int64 num_works = restorable.shape().dim_size(0);
 
-    std::unique_lock<std::mutex> lock(mu_);
-
-    queue_.clear();
-    for (int64 i = 0; i < num_works; ++i) {
-      queue_.push_back(restorable.flat<string>()(i));
+    {
+      SegmentsLock lock(this);
+      for (int i = 0; i < kSegmentNum; ++i) {
+        segments_[i].works.clear();
+      }
+      size_ = 0;
+      put_cursor_ = 0;
+      take_cursor_ = 0;
+      std::lock_guard<std::mutex> lease_lock(lease_mu_);
+      leases_.clear();
+      for (int64 i = 0; i < num_works; ++i) {
+        PushLocked(restorable.flat<string>()(i));
+      }
     }
 
-    lock.unlock();
-    take_cv_.notify_all();
+    NotifyAll();
     return Status::OK();
   }
 
   Status Save(OpKernelContext* ctx, Tensor** saveable) {
-    std::unique_lock<std::mutex> lock(mu_);
+    SegmentsLock lock(this);
+
+    // Merges the segments back into the order the works were put.
+    std::vector<const std::pair<int64, string>*> works;
+    works.reserve(size_.load());
+    for (int i = 0; i < kSegmentNum; ++i) {
+      for (const auto& work : segments_[i].works) {
+        works.push_back(&work);
+      }
+    }
+    std::sort(works.begin(), works.end(),
+              [](const std::pair<int64, string>* a,
+                 const std::pair<int64, string>* b) {
+                return a->first < b->first;
+              });
+
+    // Unread remainders of leased slices follow the works in queue.
+    std::vector<string> remainders;
+    {
+      std::lock_guard<std::mutex> lease_lock(lease_mu_);
+      std::map<int64, const Lease*> leases;
+      for (const auto& it : leases_) {
+        leases.emplace(it.first, &it.second);
+      }
+      for (const auto& it : leases) {
+        remainders.push_back(SliceOf(it.second->url, it.second->position,
+                                     it.second->end));
+      }
+    }
 
     TF_RETURN_IF_ERROR(ctx->allocate_output(
-        0, TensorShape({static_cast<int64>(queue_.size())}), saveable));
-    for (size_t i = 0; i < queue_.size(); ++i) {
-      (*saveable)->flat<string>()(i) = queue_[i];
+        0, TensorShape({static_cast<int64>(works.size() + remainders.size())}),
+        saveable));
+    for (size_t i = 0; i < works.size(); ++i) {
+      (*saveable)->flat<string>()(i) = works[i]->second;
+    }
+    for (size_t i = 0; i < remainders.size(); ++i) {
+      (*saveable)->flat<string>()(works.size() + i) = remainders[i];
     }
 
     return Status::OK();
   }
 
   Status Close() {
-    std::unique_lock<std::mutex> lock(mu_);
+    std::unique_lock<std::mutex> lock(wait_mu_);
 
-    if (is_closed_) {
+    if (is_closed_.load()) {
       return Status::OK();
     }
 
@@ -167,7 +316,7 @@ class WorkQueue : public ResourceBase {
   }
 
   void Schedule(int64 num_threads, std::function<void()> fn) {
-    std::unique_lock<std::mutex> lock(mu_);
+    std::unique_lock<std::mutex> lock(wait_mu_);
     if (threads_) {
       lock.unlock();
       threads_->Schedule(fn);
@@ -184,13 +333,214 @@ class WorkQueue : public ResourceBase {
   }
 
  private:
-  // TODO(yuanman.ym): Use memory efficient data structure, e.g. HAT-trie,
-  // to implement the string queue. (See https://github.com/Tessil/hat-trie)
-  std::deque<string> queue_;
+  static const int kSegmentNum = 16;
+
+  struct alignas(64) Segment {
+    std::mutex mu;
+    // TODO(yuanman.ym): Use memory efficient data structure, e.g. HAT-trie,
+    // to implement the string queue. (See https://github.com/Tessil/hat-trie)
+    std::deque<std::pair<int64, string>> works;
+  };
+
+  // Locks all segments in index order.
+  class SegmentsLock {
+   public:
+    explicit SegmentsLock(WorkQueue* queue) : queue_(queue) {
+      for (int i = 0; i < kSegmentNum; ++i) {
+        queue_->segments_[i].mu.lock();
+      }
+    }
+
+    ~SegmentsLock() {
+      for (int i = kSegmentNum - 1; i >= 0; --i) {
+        queue_->segments_[i].mu.unlock();
+      }
+    }
+
+   private:
+    WorkQueue* queue_;
+  };
+
+  void PushLocked(const string& work) {
+    const int64 seq = put_cursor_++;
+    segments_[seq % kSegmentNum].works.emplace_back(seq, work);
+    ++size_;
+  }
+
+  struct Lease {
+    string url;
+    // Records before position were read, records before reserved were
+    // handed out to the owner.
+    int64 position;
+    int64 reserved;
+    int64 end;
+  };
+
+  static string SliceOf(const string& url, int64 start, int64 end) {
+    return strings::StrCat(url, "?start=", start, "&end=", end);
+  }
+
+  // Parses works formatted as `url?start=S&end=E`.
+  static bool ParseSlice(const string& work, Lease* slice) {
+    const size_t query = work.rfind("?start=");
+    if (query == string::npos) {
+      return false;
+    }
+    const size_t end_query = work.find("&end=", query);
+    if (end_query == string::npos) {
+      return false;
+    }
+    int64 start, end;
+    if (!strings::safe_strto64(work.substr(query + 7, end_query - query - 7),
+                               &start) ||
+        !strings::safe_strto64(work.substr(end_query + 5), &end) ||
+        start >= end) {
+      return false;
+    }
+    slice->url = work.substr(0, query);
+    slice->position = start;
+    slice->reserved = start;
+    slice->end = end;
+    return true;
+  }
+
+  // Leases the work if `lease` is not null. Called under the lock of the
+  // segment the work was taken from, so a save never misses it.
+  void LeaseLocked(const string& work, int64* lease) {
+    *lease = -1;
+    Lease slice;
+    if (!ParseSlice(work, &slice)) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(lease_mu_);
+    *lease = next_lease_id_++;
+    leases_.emplace(*lease, std::move(slice));
+  }
+
+  // First record of the lease a split may take.
+  static int64 SplittableStart(const Lease& l) {
+    return std::max(l.reserved, l.position);
+  }
+
+  bool TrySteal(int64 min_split_size, string* work, int64* lease) {
+    std::lock_guard<std::mutex> lock(lease_mu_);
+    Lease* victim = nullptr;
+    for (auto& it : leases_) {
+      if (victim == nullptr ||
+          it.second.end - SplittableStart(it.second) >
+              victim->end - SplittableStart(*victim)) {
+        victim = &it.second;
+      }
+    }
+    if (victim == nullptr ||
+        victim->end - SplittableStart(*victim) < 2 * min_split_size) {
+      return false;
+    }
+
+    const int64 start = SplittableStart(*victim);
+    const int64 split = start + (victim->end - start) / 2;
+    Lease stolen{victim->url, split, split, victim->end};
+    victim->end = split;
+    *work = SliceOf(stolen.url, stolen.position, stolen.end);
+    *lease = next_lease_id_++;
+    leases_.emplace(*lease, std::move(stolen));
+    ++num_steals_;
+    return true;
+  }
+
+  bool TryTake(string* work, int64* lease = nullptr) {
+    if (size_.load() <= 0) {
+      return false;
+    }
+    // The cursor only moves past works actually taken, so a failed take
+    // does not make the next one start at a later segment.
+    const uint64 cursor = take_cursor_.load();
+    for (int i = 0; i < kSegmentNum; ++i) {
+      Segment& segment = segments_[(cursor + i) % kSegmentNum];
+      std::lock_guard<std::mutex> lock(segment.mu);
+      if (!segment.works.empty()) {
+        const uint64 next = segment.works.front().first + 1;
+        uint64 expected = take_cursor_.load();
+        while (next > expected &&
+               !take_cursor_.compare_exchange_weak(expected, next)) {
+        }
+        *work = std::move(segment.works.front().second);
+        segment.works.pop_front();
+        if (lease != nullptr) {
+          LeaseLocked(*work, lease);
+        }
+        --size_;
+        ++num_takes_;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  Status TakeOrWait(const std::function<bool(string*)>& try_take,
+                    string* work) {
+    if (try_take(work)) {
+      return Status::OK();
+    }
+
+    const uint64 start = Env::Default()->NowMicros();
+    std::unique_lock<std::mutex> lock(wait_mu_);
+    ++num_waiters_;
+    Status s;
+    while (!try_take(work)) {
+      if (is_closed_.load() && size_.load() <= 0) {
+        s = errors::OutOfRange(
+            strings::StrCat("All works in work queue ", name_, " are taken."));
+        break;
+      }
+      take_cv_.wait(lock);
+    }
+    --num_waiters_;
+    lock.unlock();
+
+    const int64 waited = Env::Default()->NowMicros() - start;
+    ++num_waits_;
+    wait_micros_ += waited;
+    int64 max_waited = max_wait_micros_.load();
+    while (waited > max_waited &&
+           !max_wait_micros_.compare_exchange_weak(max_waited, waited)) {
+    }
+    if (!s.ok() && !is_drained_.exchange(true)) {
+      LOG(INFO) << DebugString();
+    }
+    return s;
+  }
+
+  void NotifyAll() {
+    { std::lock_guard<std::mutex> lock(wait_mu_); }
+    take_cv_.notify_all();
+  }
+
   string name_;
-  bool is_closed_;
-  std::mutex mu_;
+  std::atomic<bool> is_closed_;
+  Segment segments_[kSegmentNum];
+  std::atomic<int64> size_;
+  int64 put_cursor_;
+  std::atomic<uint64> take_cursor_;
+
+  // Takers that found the queue empty wait on take_cv_ under wait_mu_.
+  std::mutex wait_mu_;
   std::condition_variable take_cv_;
+  int64 num_waiters_;
+
+  // Metrics of takes, reported by DebugString and once the queue is drained.
+  std::atomic<int64> num_takes_;
+  std::atomic<int64> num_waits_;
+  std::atomic<int64> wait_micros_;
+  std::atomic<int64> max_wait_micros_;
+  std::atomic<bool> is_drained_;
+
+  // Leases of slices being read, locked after segments.
+  std::mutex lease_mu_;
+  std::unordered_map<int64, Lease> leases_;
+  int64 next_lease_id_;
+  std::atomic<int64> num_steals_;
+
   std::shared_ptr<thread::ThreadPool> threads_;
 };
 
@@ -329,6 +679,138 @@ class WorkQueueTakeOp : public AsyncOpKernel {
 REGISTER_KERNEL_BUILDER(Name("WorkQueueTake").Device(DEVICE_CPU),
                         WorkQueueTakeOp);
 
+class WorkQueueTakeManyOp : public AsyncOpKernel {
+ public:
+  explicit WorkQueueTakeManyOp(OpKernelConstruction* ctx)
+      : AsyncOpKernel(ctx) {
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("num_works", &num_works_));
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("num_clients", &num_clients_));
+  }
+
+  void ComputeAsync(OpKernelContext* ctx,
+                    AsyncOpKernel::DoneCallback done) override {
+    WorkQueue* work_queue;
+    OP_REQUIRES_OK_ASYNC(
+        ctx, LookupResource(ctx, HandleFromInput(ctx, 0), &work_queue), done);
+    core::ScopedUnref scoped_list(work_queue);
+    work_queue->Schedule(num_clients_, [this, ctx, done, work_queue]() {
+      std::vector<string> taken;
+      OP_REQUIRES_OK_ASYNC(ctx, work_queue->TakeMany(num_works_, &taken),
+                           done);
+      Tensor* works;
+      OP_REQUIRES_OK_ASYNC(
+          ctx,
+          ctx->allocate_output(
+              0, TensorShape({static_cast<int64>(taken.size())}), &works),
+          done);
+      for (size_t i = 0; i < taken.size(); ++i) {
+        works->flat<string>()(i) = std::move(taken[i]);
+      }
+      done();
+    });
+  }
+
+ private:
+  int64 num_works_;
+  int64 num_clients_;
+};
+
+REGISTER_KERNEL_BUILDER(Name("WorkQueueTakeMany").Device(DEVICE_CPU),
+                        WorkQueueTakeManyOp);
+
+class WorkQueueTakeSliceOp : public AsyncOpKernel {
+ public:
+  explicit WorkQueueTakeSliceOp(OpKernelConstruction* ctx)
+      : AsyncOpKernel(ctx) {
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("num_clients", &num_clients_));
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("min_split_size", &min_split_size_));
+  }
+
+  void ComputeAsync(OpKernelContext* ctx,
+                    AsyncOpKernel::DoneCallback done) override {
+    WorkQueue* work_queue;
+    OP_REQUIRES_OK_ASYNC(
+        ctx, LookupResource(ctx, HandleFromInput(ctx, 0), &work_queue), done);
+    core::ScopedUnref scoped_list(work_queue);
+    work_queue->Schedule(num_clients_, [this, ctx, done, work_queue]() {
+      Tensor* work;
+      OP_REQUIRES_OK_ASYNC(ctx, ctx->allocate_output(0, TensorShape({}), &work),
+                           done);
+      Tensor* lease;
+      OP_REQUIRES_OK_ASYNC(
+          ctx, ctx->allocate_output(1, TensorShape({}), &lease), done);
+      string taken;
+      OP_REQUIRES_OK_ASYNC(
+          ctx,
+          work_queue->TakeSlice(min_split_size_, &taken,
+                                &lease->scalar<int64>()()),
+          done);
+      work->scalar<string>()() = std::move(taken);
+      done();
+    });
+  }
+
+ private:
+  int64 num_clients_;
+  int64 min_split_size_;
+};
+
+REGISTER_KERNEL_BUILDER(Name("WorkQueueTakeSlice").Device(DEVICE_CPU),
+                        WorkQueueTakeSliceOp);
+
+class WorkQueueReportProgressOp : public OpKernel {
+ public:
+  explicit WorkQueueReportProgressOp(OpKernelConstruction* ctx)
+      : OpKernel(ctx) {}
+
+  void Compute(OpKernelContext* ctx) override {
+    WorkQueue* work_queue;
+    OP_REQUIRES_OK(ctx,
+                   LookupResource(ctx, HandleFromInput(ctx, 0), &work_queue));
+    core::ScopedUnref scoped_list(work_queue);
+    const Tensor* lease;
+    OP_REQUIRES_OK(ctx, ctx->input("lease", &lease));
+    const Tensor* position;
+    OP_REQUIRES_OK(ctx, ctx->input("position", &position));
+    Tensor* end;
+    OP_REQUIRES_OK(ctx, ctx->allocate_output(0, TensorShape({}), &end));
+    OP_REQUIRES_OK(ctx, work_queue->ReportProgress(
+                            lease->scalar<int64>()(),
+                            position->scalar<int64>()(),
+                            &end->scalar<int64>()()));
+  }
+};
+
+REGISTER_KERNEL_BUILDER(Name("WorkQueueReportProgress").Device(DEVICE_CPU),
+                        WorkQueueReportProgressOp);
+
+class WorkQueueReserveOp : public OpKernel {
+ public:
+  explicit WorkQueueReserveOp(OpKernelConstruction* ctx) : OpKernel(ctx) {}
+
+  void Compute(OpKernelContext* ctx) override {
+    WorkQueue* work_queue;
+    OP_REQUIRES_OK(ctx,
+                   LookupResource(ctx, HandleFromInput(ctx, 0), &work_queue));
+    core::ScopedUnref scoped_list(work_queue);
+    const Tensor* lease;
+    OP_REQUIRES_OK(ctx, ctx->input("lease", &lease));
+    const Tensor* num_records;
+    OP_REQUIRES_OK(ctx, ctx->input("num_records", &num_records));
+    Tensor* work;
+    OP_REQUIRES_OK(ctx, ctx->allocate_output(0, TensorShape({}), &work));
+    Tensor* end;
+    OP_REQUIRES_OK(ctx, ctx->allocate_output(1, TensorShape({}), &end));
+    OP_REQUIRES_OK(ctx, work_queue->Reserve(lease->scalar<int64>()(),
+                                            num_records->scalar<int64>()(),
+                                            &work->scalar<string>()(),
+                                            &end->scalar<int64>()()));
+  }
+};
+
+REGISTER_KERNEL_BUILDER(Name("WorkQueueReserve").Device(DEVICE_CPU),
+                        WorkQueueReserveOp);
+
 class SaveLocalWorkOp : public OpKernel {
  public:
   explicit SaveLocalWorkOp(OpKernelConstruction* ctx) : OpKernel(ctx) {
@@ -148,6 +148,7 @@ REGISTER_OP("InitializeKvVariableOp")
     .Attr("storage_type: int = 1")
     .Attr("storage_path: string = '.'")
     .Attr("storage_size: list(int) = []")
+    .Attr("storage_cache_strategy: list(int) = []")
     .Attr("default_value_dim: int = 4096")
     .SetShapeFn([](InferenceContext* c) { 
       return Status::OK();
@@ -316,6 +317,107 @@ Produces an output tensor with shape `indices.shape + params.shape[1:]` where:
 
 )doc");
 
+REGISTER_OP("KvResourceSparseSegmentCombine")
+    .Input("resource: resource")
+    .Input("indices: Tkeys")
+    .Input("sp_indices: int64")
+    .Input("dense_shape: int64")
+    .Input("default_value: dtype")
+    .Attr("combiner: {'sum', 'mean', 'sqrtn'} = 'mean'")
+    .Attr("is_use_default_value_tensor: bool = false")
+    .Output("output: dtype")
+    .Attr("dtype: {float, double}")
+    .Attr("Tkeys: {int64,int32}")
+    .SetShapeFn([](InferenceContext* c) {
+      ShapeAndType handle_shape_and_type;
+      TF_RETURN_IF_ERROR(
+          ValidateVariableResourceHandle(c, &handle_shape_and_type));
+      ShapeHandle unused;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &unused));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 2, &unused));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(3), 1, &unused));
+      ShapeHandle out;
+      TF_RETURN_IF_ERROR(c->Concatenate(
+          c->Vector(InferenceContext::kUnknownDim),
+          handle_shape_and_type.shape, &out));
+      c->set_output(0, out);
+      return Status::OK();
+    })
+    .Doc(R"doc(
+Looks up the embeddings of a SparseTensor of ids and combines them per row.
+
+Fuses `KvResourceGather` with `SparseSegmentSum/Mean/SqrtN`: the embeddings
+are accumulated into `output` where they are stored, without gathering them
+into an intermediate tensor first. Rows without ids are zero.
+
+resource: Should be from a `EmbeddingVariable` node.
+indices: The values of the SparseTensor, ids to look up.
+sp_indices: The indices of the SparseTensor, `sp_indices[i, 0]` is the
+  output row of `indices[i]`.
+dense_shape: The dense shape of the SparseTensor, `dense_shape[0]` is the
+  number of output rows.
+default_value: Default values of new ids when `is_use_default_value_tensor`.
+combiner: How the embeddings of a row are reduced.
+output: A `[dense_shape[0], embedding_dim]` tensor.
+)doc");
+
+REGISTER_OP("KvResourceSparseSegmentCombineGrad")
+    .Input("grad: dtype")
+    .Input("indices: Tkeys")
+    .Input("sp_indices: int64")
+    .Attr("combiner: {'sum', 'mean', 'sqrtn'} = 'mean'")
+    .Output("values: dtype")
+    .Output("unique_indices: Tkeys")
+    .Attr("dtype: {float, double}")
+    .Attr("Tkeys: {int64,int32}")
+    .SetShapeFn([](InferenceContext* c) {
+      ShapeHandle grad;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 2, &grad));
+      ShapeHandle unused;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &unused));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 2, &unused));
+      c->set_output(0, c->Matrix(InferenceContext::kUnknownDim,
+                                 c->Dim(grad, 1)));
+      c->set_output(1, c->Vector(InferenceContext::kUnknownDim));
+      return Status::OK();
+    })
+    .Doc(R"doc(
+Computes the gradient of `KvResourceSparseSegmentCombine` w.r.t. the
+embeddings it looked up, as IndexedSlices with unique indices.
+
+grad: Gradient of the output of `KvResourceSparseSegmentCombine`.
+indices: The `indices` input of `KvResourceSparseSegmentCombine`.
+sp_indices: The `sp_indices` input of `KvResourceSparseSegmentCombine`.
+combiner: The `combiner` attr of `KvResourceSparseSegmentCombine`.
+values: Gradient of the embedding of `unique_indices[i]`, the contributions
+  of duplicated ids are summed.
+unique_indices: Unique ids of `indices`, in order of first occurrence.
+)doc");
+
+REGISTER_OP("KvResourcePrefetch")
+    .Input("resource: resource")
+    .Input("indices: Tkeys")
+    .Output("promoted_num: int64")
+    .Attr("dtype: type")
+    .Attr("Tkeys: {int64,int32}")
+    .SetShapeFn([](InferenceContext* c) {
+      ShapeAndType handle_shape_and_type;
+      TF_RETURN_IF_ERROR(
+          ValidateVariableResourceHandle(c, &handle_shape_and_type));
+      c->set_output(0, c->Scalar());
+      return Status::OK();
+    })
+    .Doc(R"doc(
+Asynchronously promotes `indices` living in the lower storage levels of a
+multi-level EmbeddingVariable into DRAM, ahead of a gather of the same ids.
+It is a no-op for single-level EmbeddingVariables.
+
+resource: Should be from a `EmbeddingVariable` node.
+indices: Ids of the upcoming lookup.
+promoted_num: Number of ids promoted into DRAM by the prefetches of this
+  EmbeddingVariable so far, not including this one.
+)doc");
+
 REGISTER_OP("KvResourceScatterAdd")
     .Input("resource: resource")
     .Input("indices: Tkeys")
@@ -427,6 +529,7 @@ REGISTER_OP("KvResourceImportV2")
     .Attr("storage_type: int = 1")
     .Attr("storage_path: string = '.'")
     .Attr("storage_size: list(int) = []")
+    .Attr("storage_cache_strategy: list(int) = []")
     .Attr("default_value_dim: int = 4096")
     .SetShapeFn([](InferenceContext* c) {
           ShapeHandle handle;
@@ -31,6 +31,7 @@ REGISTER_OP("TensorBufferPut")
     .Attr("dtypes: list(type)")
     .Attr("shared_name: string = ''")
     .Attr("shared_capacity: int >= 1 = 1")
+    .Attr("shared_max_capacity: int >= 0 = 0")
     .Attr("timeout_millis: int >= 1 = 1000")
     .SetShapeFn(shape_inference::UnknownShape)
     .SetIsStateful();
@@ -41,6 +42,7 @@ REGISTER_OP("TensorBufferTake")
     .Attr("dtypes: list(type)")
     .Attr("shared_name: string = ''")
     .Attr("shared_capacity: int >= 1 = 1")
+    .Attr("shared_max_capacity: int >= 0 = 0")
     .Attr("shared_threads: int >= 1 = 1")
     .SetShapeFn(shape_inference::UnknownShape)
     .SetIsStateful();
@@ -50,6 +52,7 @@ REGISTER_OP("TensorBufferCancel")
     .Attr("is_cancelled: bool = true")
     .Attr("shared_name: string = ''")
     .Attr("shared_capacity: int >= 1 = 1")
+    .Attr("shared_max_capacity: int >= 0 = 0")
     .SetShapeFn(shape_inference::UnknownShape)
     .SetIsStateful();
 
@@ -57,6 +60,7 @@ REGISTER_OP("TensorBufferClose")
     .Attr("container: string = ''")
     .Attr("shared_name: string = ''")
     .Attr("shared_capacity: int >= 1 = 1")
+    .Attr("shared_max_capacity: int >= 0 = 0")
     .SetShapeFn(shape_inference::UnknownShape)
     .SetIsStateful();
 
@@ -65,6 +69,7 @@ REGISTER_OP("TensorBufferSize")
     .Attr("container: string = ''")
     .Attr("shared_name: string = ''")
     .Attr("shared_capacity: int >= 1 = 1")
+    .Attr("shared_max_capacity: int >= 0 = 0")
     .SetShapeFn(shape_inference::ScalarShape)
     .SetIsStateful();
 
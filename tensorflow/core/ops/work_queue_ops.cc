@@ -119,6 +119,101 @@ work: A tensor of taken work.
 num_clients:  Number of threads for taking works.
 )doc");
 
+REGISTER_OP("WorkQueueTakeMany")
+    .Input("handle: resource")
+    .Output("works: string")
+    .Attr("num_works: int >= 1")
+    .Attr("num_clients: int >= 1 = 1")
+    .SetShapeFn([](InferenceContext* c) {
+      c->set_output(0, c->Vector(InferenceContext::kUnknownDim));
+      return Status::OK();
+    })
+    .SetIsStateful()
+    .Doc(R"doc(
+Take up to `num_works` works from the work queue.
+
+Waits until at least one work is available, then takes the works left in the
+queue without waiting for more.
+
+handle: Handle of a work queue.
+works: A vector of taken works.
+num_works: Maximum number of works to take.
+num_clients:  Number of threads for taking works.
+)doc");
+
+REGISTER_OP("WorkQueueTakeSlice")
+    .Input("handle: resource")
+    .Output("work: string")
+    .Output("lease: int64")
+    .Attr("num_clients: int >= 1 = 1")
+    .Attr("min_split_size: int >= 1 = 1")
+    .SetShapeFn([](InferenceContext* c) {
+      c->set_output(0, c->Scalar());
+      c->set_output(1, c->Scalar());
+      return Status::OK();
+    })
+    .SetIsStateful()
+    .Doc(R"doc(
+Take a slice from the work queue.
+
+Works formatted as `url?start=S&end=E` are leased until their records are
+reported as read. Once the queue is empty, the unreserved half of the largest
+lease is split off and taken instead.
+
+handle: Handle of a work queue.
+work: A tensor of taken work.
+lease: Lease of the taken slice, -1 if the work is not a slice.
+num_clients:  Number of threads for taking works.
+min_split_size: Minimum number of records of a split slice.
+)doc");
+
+REGISTER_OP("WorkQueueReportProgress")
+    .Input("handle: resource")
+    .Input("lease: int64")
+    .Input("position: int64")
+    .Output("end: int64")
+    .SetShapeFn(shape_inference::ScalarShape)
+    .SetIsStateful()
+    .Doc(R"doc(
+Reports that records before `position` in a leased slice were read.
+
+A split never takes reserved records and leaves at least `min_split_size`
+records past `position` to the owner. Owners reading records they did not
+reserve should report at least every `min_split_size` records.
+
+handle: Handle of a work queue.
+lease: Lease of the slice.
+position: Records before this position were read.
+end: End of the slice, which shrinks when the slice is split, or -1 if
+  the lease is released.
+)doc");
+
+REGISTER_OP("WorkQueueReserve")
+    .Input("handle: resource")
+    .Input("lease: int64")
+    .Input("num_records: int64")
+    .Output("work: string")
+    .Output("end: int64")
+    .SetShapeFn([](InferenceContext* c) {
+      c->set_output(0, c->Scalar());
+      c->set_output(1, c->Scalar());
+      return Status::OK();
+    })
+    .SetIsStateful()
+    .Doc(R"doc(
+Reserves the next records of a leased slice for its owner.
+
+Reserved records are never split off, and are saved as unread until they
+are reported as read.
+
+handle: Handle of a work queue.
+lease: Lease of the slice.
+num_records: Maximum number of records to reserve.
+work: Slice of the reserved records, empty once all records of the lease
+  are reserved.
+end: End of the reserved records, or -1 if the lease is released.
+)doc");
+
 REGISTER_OP("SaveLocalWork")
     .Input("work: string")
     .Attr("job_name: string = ''")
@@ -143,5 +238,6 @@ restore_works_dir: a directory that restore works for WorkQueue when failover.
 )doc");
 
 WHITELIST_STATEFUL_OP_FOR_DATASET_FUNCTIONS("QueueDequeueV2");
+WHITELIST_STATEFUL_OP_FOR_DATASET_FUNCTIONS("QueueEnqueueV2");
 
 } // tensorflow
@@ -17,6 +17,7 @@ limitations under the License.
 #define TENSORFLOW_CORE_PUBLIC_SESSION_H_
 
 #include <atomic>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -268,6 +269,20 @@ class Session {
   }
 };
 
+// Policy SessionGroup uses to pick the session serving a request which
+// comes without a session hint.
+enum class SessionGroupPolicy {
+  // Sessions are picked in turn.
+  kRoundRobin = 0,
+  // Picks the session with the fewest requests in flight. Idle sessions are
+  // used in turn, ties between busy ones are broken by the lower latency.
+  kLeastOutstanding = 1,
+  // Picks the less loaded of two random sessions, where the load of a
+  // session is its in-flight requests weighted by its average latency.
+  // Ties are broken by the lower latency.
+  kPowerOfTwoChoices = 2
+};
+
 class SessionGroup {
  public:
   ~SessionGroup() {
@@ -286,6 +301,7 @@ class SessionGroup {
       return errors::AlreadyExists("Leader session is already existed.");
     }
     sessions_.emplace_back(leader_session);
+    session_stats_.emplace_back(new SessionStat);
     ++session_num_;
     return Status::OK();
   }
@@ -296,6 +312,7 @@ class SessionGroup {
           "Leader session is not created, please create it firstly.");
     }
     sessions_.emplace_back(follower_session);
+    session_stats_.emplace_back(new SessionStat);
     ++session_num_;
     return Status::OK();
   }
@@ -304,6 +321,26 @@ class SessionGroup {
     return sessions_[0];
   }
 
+  void SetSelectPolicy(SessionGroupPolicy policy) {
+    policy_ = policy;
+  }
+
+  SessionGroupPolicy GetSelectPolicy() const {
+    return policy_;
+  }
+
+  // Number of requests running in the session `id`.
+  int64_t GetOutstandingNum(int32_t id) const {
+    return session_stats_[id]->outstanding_num.load(
+        std::memory_order_relaxed);
+  }
+
+  // Moving average of the run latency of the session `id` in microseconds.
+  int64_t GetAverageLatency(int32_t id) const {
+    return session_stats_[id]->ewma_latency_us.load(
+        std::memory_order_relaxed);
+  }
+
   Status Create(const GraphDef& graph) {
     for (auto sess : sessions_) {
       Status s = sess->Create(graph);
@@ -319,6 +356,7 @@ class SessionGroup {
     int32_t id = 0;
     Status s = GetServingSessionId(&id, session_id);
     if (!s.ok()) return s;
+    ScopedRunStat stat(session_stats_[id].get());
     return sessions_[id]->Run(inputs, output_tensor_names,
                               target_node_names, outputs);
   }
@@ -332,17 +370,95 @@ class SessionGroup {
     int32_t id = 0;
     Status s = GetServingSessionId(&id, session_id);
     if (!s.ok()) return s;
+    ScopedRunStat stat(session_stats_[id].get());
     return sessions_[id]->Run(run_options, inputs, output_tensor_names,
                               target_node_names, outputs, run_metadata);
   }
 
  private:
+  // Load of a session, updated by every Run on it. Padded to a cache line,
+  // sessions are run from different threads.
+  struct SessionStat {
+    std::atomic<int64_t> outstanding_num{0};
+    std::atomic<int64_t> ewma_latency_us{0};
+    char padding[64 - 2 * sizeof(std::atomic<int64_t>)];
+  };
+
+  class ScopedRunStat {
+   public:
+    explicit ScopedRunStat(SessionStat* stat)
+        : stat_(stat), start_us_(Env::Default()->NowMicros()) {
+      stat_->outstanding_num.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    ~ScopedRunStat() {
+      int64_t latency = Env::Default()->NowMicros() - start_us_;
+      // ewma = ewma + (latency - ewma) / 8, concurrent updates may drop a
+      // sample which is fine for load estimation.
+      int64_t ewma = stat_->ewma_latency_us.load(std::memory_order_relaxed);
+      ewma = ewma == 0 ? latency : ewma + (latency - ewma) / 8;
+      stat_->ewma_latency_us.store(ewma, std::memory_order_relaxed);
+      stat_->outstanding_num.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+   private:
+    SessionStat* stat_;
+    int64_t start_us_;
+  };
+
   // sessions_[0] is leader session which own resource,
   // and others are follower sessions who
   // will reuse leader's resource.
   std::vector<Session*> sessions_;
+  std::vector<std::unique_ptr<SessionStat> > session_stats_;
   int32_t session_num_ = 0;
   std::atomic<int64_t> serving_index_{0};
+  SessionGroupPolicy policy_ = SessionGroupPolicy::kRoundRobin;
+
+  // Expected time until the session `id` drains its in-flight requests,
+  // a session which has never run is treated as the fastest one.
+  uint64_t SessionCost(int32_t id) const {
+    uint64_t outstanding = GetOutstandingNum(id);
+    uint64_t latency = GetAverageLatency(id);
+    return outstanding * (latency + 1);
+  }
+
+  int32_t LeastOutstandingSessionId() {
+    // Scans from a rotating start so that idle sessions are used in turn.
+    int32_t start = serving_index_.fetch_add(1) % session_num_;
+    int32_t best = start;
+    int64_t best_num = GetOutstandingNum(best);
+    int64_t best_latency = GetAverageLatency(best);
+    for (int32_t i = 1; i < session_num_ && best_num > 0; ++i) {
+      int32_t id = (start + i) % session_num_;
+      int64_t num = GetOutstandingNum(id);
+      int64_t latency = GetAverageLatency(id);
+      if (num < best_num || (num == best_num && latency < best_latency)) {
+        best = id;
+        best_num = num;
+        best_latency = latency;
+      }
+    }
+    return best;
+  }
+
+  int32_t PowerOfTwoChoicesSessionId() {
+    // splitmix64 of a shared counter, cheaper than a locked random engine.
+    uint64_t x = serving_index_.fetch_add(1) * 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    int32_t first = (x & 0xFFFFFFFF) % session_num_;
+    int32_t second = ((x >> 32) % (session_num_ - 1) + first + 1) %
+                     session_num_;
+    uint64_t first_cost = SessionCost(first);
+    uint64_t second_cost = SessionCost(second);
+    if (second_cost != first_cost) {
+      return second_cost < first_cost ? second : first;
+    }
+    return GetAverageLatency(second) < GetAverageLatency(first) ? second
+                                                                : first;
+  }
 
   Status GetServingSessionId(int32_t* serving_id, int32_t hint_id = -1) {
     if (session_num_ < 1) {
@@ -352,6 +468,10 @@ class SessionGroup {
     } else {
       if (hint_id >= 0) {
         *serving_id = hint_id % session_num_;
+      } else if (policy_ == SessionGroupPolicy::kLeastOutstanding) {
+        *serving_id = LeastOutstandingSessionId();
+      } else if (policy_ == SessionGroupPolicy::kPowerOfTwoChoices) {
+        *serving_id = PowerOfTwoChoicesSessionId();
       } else {
         *serving_id = serving_index_.fetch_add(1);
         *serving_id %= session_num_;
@@ -33,4 +33,9 @@ string DataFilename(StringPiece prefix, int32 shard_id, int32 num_shards) {
                          shard_id, num_shards);
 }
 
+string SSDIndexDirname(StringPiece prefix) {
+  return strings::Printf("%.*s.ssd_index", static_cast<int>(prefix.size()),
+                         prefix.data());
+}
+
 }  // namespace tensorflow
@@ -22,6 +22,8 @@ limitations under the License.
 //
 //   MetaFilename(prefix): pathname of the metadata file.
 //   DataFilename(prefix, shard_id, num_shards): pathname of a data file.
+//   SSDIndexDirname(prefix): directory of the SSDHASH index snapshots of the
+//     embedding variables, one sub-directory per storage.
 //
 // Typical usage includes forming a filepattern to match files on disk:
 //
@@ -41,6 +43,7 @@ namespace tensorflow {
 
 string MetaFilename(StringPiece prefix);
 string DataFilename(StringPiece prefix, int32 shard_id, int32 num_shards);
+string SSDIndexDirname(StringPiece prefix);
 
 }  // namespace tensorflow
 
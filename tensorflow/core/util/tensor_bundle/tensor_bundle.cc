@@ -857,6 +857,23 @@ Status MergeBundles(Env* env, gtl::ArraySlice<tstring> prefixes,
         DataFilename(merged_prefix, p.second, merge.shard_ids.size())));
   }
 
+  // Moves the SSDHASH index snapshots, each storage is saved by one shard.
+  for (const string& prefix : prefixes) {
+    const string dir = SSDIndexDirname(prefix);
+    if (prefix == merged_prefix || !env->FileExists(dir).ok()) {
+      continue;
+    }
+    const string merged_dir = SSDIndexDirname(merged_prefix);
+    TF_RETURN_IF_ERROR(env->RecursivelyCreateDir(merged_dir));
+    std::vector<string> children;
+    TF_RETURN_IF_ERROR(env->GetChildren(dir, &children));
+    for (const string& child : children) {
+      TF_RETURN_IF_ERROR(env->RenameFile(io::JoinPath(dir, child),
+                                         io::JoinPath(merged_dir, child)));
+    }
+    env->DeleteDir(dir).IgnoreError();
+  }
+
   // Writes the final metadata table under the merged prefix.
   std::unique_ptr<WritableFile> merged_metadata;
   TF_RETURN_IF_ERROR(
@@ -155,6 +155,8 @@ class BundleWriter {
 
   Status status() const { return status_; }
 
+  const string& prefix() const { return prefix_; }
+
  private:
   Env* const env_;  // Not owned.
   const Options options_;
@@ -199,6 +201,8 @@ class BundleReader {
   // the metadata).
   Status status() const { return status_; }
 
+  const string& prefix() const { return prefix_; }
+
   // Queries whether the bundle contains an entry keyed by "key".  Calls Seek()
   // internally, so this call invalidates the reader's current position.
   // REQUIRES: status().ok()
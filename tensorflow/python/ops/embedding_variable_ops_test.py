@@ -13,6 +13,7 @@ from __future__ import print_function
 
 import numpy as np
 import os
+import time
 os.environ["CUDA_VISIBLE_DEVICES"] = "-1"
 
 from six.moves import xrange  # pylint: disable=redefined-builtin
@@ -24,11 +25,13 @@ from tensorflow.python.ops.check_ops import assert_equal
 from tensorflow.python.platform import googletest
 from tensorflow.python.ops import array_ops
 from tensorflow.python.ops import embedding_ops
+from tensorflow.python.ops import fused_embedding_ops
 from tensorflow.python.ops import kv_variable_ops
 from tensorflow.python.ops import math_ops
 from tensorflow.python.ops import init_ops
 from tensorflow.python.ops import nn_ops
 from tensorflow.python.ops import partitioned_variables
+from tensorflow.python.ops import prefetch
 from tensorflow.python.ops import variable_scope
 from tensorflow.python.framework import dtypes
 from tensorflow.python.framework import meta_graph
@@ -48,6 +51,7 @@ from tensorflow.contrib.layers.python.layers import embedding_ops as emb_ops
 from tensorflow.contrib.layers.python.layers import feature_column_ops
 from tensorflow.contrib.layers.python.layers import feature_column
 from tensorflow.python.training import checkpoint_utils
+from tensorflow.python.training import coordinator
 from tensorflow.python.saved_model import builder as saved_model_builder
 from tensorflow.python.saved_model import loader
 
@@ -1967,5 +1971,195 @@ class EmbeddingVariableTest(test_util.TensorFlowTestCase):
         self.assertAlmostEqual(emb1.tolist()[i][j], emb2.tolist()[i][j])
 
 
+  def testEmbeddingVariableForDRAMSSDAndLevelDB(self):
+    print("testEmbeddingVariableForDRAMSSDAndLevelDB")
+    def runTestAdagrad(self, var, g):
+      emb = embedding_ops.embedding_lookup(var, math_ops.cast([1, 2, 3, 4, 5, 6, 7, 8, 9], dtypes.int64))
+      fun = math_ops.multiply(emb, 2.0, name='multiply')
+      loss = math_ops.reduce_sum(fun, name='reduce_sum')
+      gs = training_util.get_or_create_global_step()
+      opt = adagrad.AdagradOptimizer(0.1)
+      g_v = opt.compute_gradients(loss)
+      train_op = opt.apply_gradients(g_v)
+      init = variables.global_variables_initializer()
+      with self.test_session(graph=g) as sess:
+        sess.run(ops.get_collection(ops.GraphKeys.EV_INIT_VAR_OPS))
+        sess.run(ops.get_collection(ops.GraphKeys.EV_INIT_SLOT_OPS))
+        sess.run([init])
+        for i in xrange(60):
+          r, _, _ = sess.run([emb, train_op, loss])
+        return r
+
+    with ops.device('/cpu:0'), ops.Graph().as_default() as g:
+      emb_var = variable_scope.get_embedding_variable("var_1",
+            embedding_dim = 30,
+            initializer=init_ops.ones_initializer(dtypes.float32),
+            partitioner=partitioned_variables.fixed_size_partitioner(num_shards=1),
+            steps_to_live=5,
+            ev_option = variables.EmbeddingVariableOption(storage_option=variables.StorageOption(storage_type=config_pb2.StorageType.DRAM_SSDHASH_LEVELDB,
+                                                                                                 storage_path=self.get_temp_dir(),
+                                                                                                 storage_size=[512, 1024],
+                                                                                                 cache_strategy=[config_pb2.CacheStrategy.LRU,
+                                                                                                                 config_pb2.CacheStrategy.LFU])))
+      emb1 = runTestAdagrad(self, emb_var, g)
+
+    with ops.device('/cpu:0'), ops.Graph().as_default() as g:
+      var = variable_scope.get_variable("var_2", shape=[100, 30], initializer=init_ops.ones_initializer(dtypes.float32))
+      emb2 = runTestAdagrad(self, var, g)
+
+    for i in range(0, 9):
+      for j in range(0, 30):
+        self.assertAlmostEqual(emb1.tolist()[i][j], emb2.tolist()[i][j])
+
+  def testEmbeddingVariableForPrefetch(self):
+    print("testEmbeddingVariableForPrefetch")
+    with ops.device('/cpu:0'):
+      var = variable_scope.get_embedding_variable("var_1",
+            embedding_dim = 3,
+            initializer=init_ops.ones_initializer(dtypes.float32),
+            ev_option = variables.EmbeddingVariableOption(storage_option=variables.StorageOption(storage_type=config_pb2.StorageType.DRAM_SSDHASH,
+                                                                                                 storage_path=self.get_temp_dir(),
+                                                                                                 storage_size=[128])))
+      all_ids = math_ops.range(0, 256, dtype=dtypes.int64)
+      fill = embedding_ops.embedding_lookup(var, all_ids)
+      # The oldest ids, demoted to SSDHASH once all ids are looked up.
+      ids = math_ops.cast([0, 1, 2, 3, 4, 5, 6, 7], dtypes.int64)
+      staged_ids = prefetch.staged(ids, embedding_prefetches=[(var, ids)],
+                                   timeout_millis=1000)
+      promoted_num = var.prefetch(array_ops.zeros([0], dtype=dtypes.int64))
+      emb = embedding_ops.embedding_lookup(var, staged_ids)
+      init = variables.global_variables_initializer()
+    with self.test_session() as sess:
+      sess.run([init])
+      sess.run(fill)
+      time.sleep(0.5)
+      self.assertEqual(0, sess.run(promoted_num))
+      coord = coordinator.Coordinator()
+      prefetch.make_prefetch_hook().create_threads(sess, coord)
+      self.assertAllEqual(sess.run(staged_ids), list(range(8)))
+      # Samples in the buffer promoted their ids without any lookup.
+      for _ in xrange(100):
+        if sess.run(promoted_num) > 0:
+          break
+        time.sleep(0.01)
+      self.assertGreater(sess.run(promoted_num), 0)
+      for _ in xrange(5):
+        r = sess.run(emb)
+        self.assertAllEqual(r, [[1.0] * 3] * 8)
+      coord.request_stop()
+
+  def testEmbeddingVariableForSparseCombine(self):
+    print("testEmbeddingVariableForSparseCombine")
+    ids = [1, 3, 1, 2, 5, 3]
+    sp_ids = sparse_tensor.SparseTensor(
+        indices=[[0, 0], [0, 1], [2, 0], [2, 1], [2, 2], [3, 0]],
+        values=math_ops.cast(ids, dtypes.int64),
+        dense_shape=[5, 3])
+    for combiner in ["sum", "mean", "sqrtn"]:
+      with ops.device('/cpu:0'):
+        var_fused = variable_scope.get_embedding_variable("var_fused_" + combiner,
+              embedding_dim=4,
+              initializer=init_ops.random_normal_initializer(seed=1))
+        var = variable_scope.get_embedding_variable("var_" + combiner,
+              embedding_dim=4,
+              initializer=init_ops.random_normal_initializer(seed=1))
+        emb_fused = var_fused.sparse_combine(sp_ids.values, sp_ids.indices,
+                                             sp_ids.dense_shape,
+                                             combiner=combiner)
+        emb = embedding_ops.embedding_lookup_sparse(var, sp_ids, None,
+                                                    combiner=combiner)
+        emb = array_ops.pad(emb, [[0, 5 - array_ops.shape(emb)[0]], [0, 0]])
+        opt = gradient_descent.GradientDescentOptimizer(0.1)
+        train_op = opt.minimize(math_ops.reduce_sum(emb_fused * emb_fused) +
+                                math_ops.reduce_sum(emb * emb))
+        lookup = math_ops.cast([1, 2, 3, 5], dtypes.int64)
+        emb_ids_fused = embedding_ops.embedding_lookup(var_fused, lookup)
+        emb_ids = embedding_ops.embedding_lookup(var, lookup)
+        init = variables.global_variables_initializer()
+      with self.test_session() as sess:
+        sess.run([init])
+        r_fused, r = sess.run([emb_fused, emb])
+        self.assertAllClose(r_fused, r)
+        self.assertAllEqual(r_fused[1], [0.0] * 4)
+        self.assertAllEqual(r_fused[4], [0.0] * 4)
+        sess.run(train_op)
+        r_fused, r = sess.run([emb_ids_fused, emb_ids])
+        self.assertAllClose(r_fused, r)
+
+  def testEmbeddingVariableForFusedLookupWithEmptyRows(self):
+    print("testEmbeddingVariableForFusedLookupWithEmptyRows")
+    ids = [1, 3, 1, 2, 5, 3]
+    sp_ids = sparse_tensor.SparseTensor(
+        indices=[[0, 0], [0, 1], [2, 0], [2, 1], [2, 2], [3, 0]],
+        values=math_ops.cast(ids, dtypes.int64),
+        dense_shape=[5, 3])
+    for combiner in ["sum", "mean", "sqrtn"]:
+      with ops.device('/cpu:0'):
+        var_fused = variable_scope.get_embedding_variable(
+            "var_fused_" + combiner,
+            embedding_dim=4,
+            initializer=init_ops.random_normal_initializer(seed=1))
+        var = variable_scope.get_embedding_variable(
+            "var_" + combiner,
+            embedding_dim=4,
+            initializer=init_ops.random_normal_initializer(seed=1))
+        # Without a default id, the variable on CPU takes the fused path.
+        emb_fused = fused_embedding_ops.fused_embedding_lookup_sparse(
+            [var_fused], sp_ids, partition_strategy="div", combiner=combiner)
+        # A default id keeps the gather and post lookup path.
+        emb = fused_embedding_ops.fused_embedding_lookup_sparse(
+            [var], sp_ids, partition_strategy="div", combiner=combiner,
+            default_id=0)
+        init = variables.global_variables_initializer()
+      self.assertEqual("KvResourceSparseSegmentCombine", emb_fused.op.type)
+      self.assertNotEqual("KvResourceSparseSegmentCombine", emb.op.type)
+      with self.test_session() as sess:
+        sess.run([init])
+        r_fused, r = sess.run([emb_fused, emb])
+        self.assertAllClose(r_fused, r)
+        self.assertAllEqual(r_fused[1], [0.0] * 4)
+        self.assertAllEqual(r_fused[4], [0.0] * 4)
+
+    # A variable without a device may be placed on GPU, so it does not take
+    # the CPU only fused path.
+    var_unplaced = variable_scope.get_embedding_variable(
+        "var_unplaced",
+        embedding_dim=4,
+        initializer=init_ops.random_normal_initializer(seed=1))
+    emb_unplaced = fused_embedding_ops.fused_embedding_lookup_sparse(
+        [var_unplaced], sp_ids, partition_strategy="div", combiner="sum")
+    self.assertNotEqual("KvResourceSparseSegmentCombine",
+                        emb_unplaced.op.type)
+
+  def testEmbeddingVariableForDRAMSSDSaveRestore(self):
+    print("testEmbeddingVariableForDRAMSSDSaveRestore")
+    checkpoint_directory = self.get_temp_dir()
+    with ops.device('/cpu:0'):
+      var = variable_scope.get_embedding_variable("var_1",
+            embedding_dim = 3,
+            initializer=init_ops.ones_initializer(dtypes.float32),
+            ev_option = variables.EmbeddingVariableOption(storage_option=variables.StorageOption(storage_type=config_pb2.StorageType.DRAM_SSDHASH,
+                                                                                                 storage_path=self.get_temp_dir(),
+                                                                                                 storage_size=[128])))
+      ids = math_ops.cast([0, 1, 2, 3, 4, 5, 6, 7], dtypes.int64)
+      emb = embedding_ops.embedding_lookup(var, ids)
+      fun = math_ops.multiply(emb, 2.0, name='multiply')
+      loss = math_ops.reduce_sum(fun, name='reduce_sum')
+      opt = adagrad.AdagradOptimizer(0.1)
+      g_v = opt.compute_gradients(loss)
+      train_op = opt.apply_gradients(g_v)
+      saver = saver_module.Saver()
+      init = variables.global_variables_initializer()
+      model_path = os.path.join(checkpoint_directory, "model.ckpt")
+    with self.test_session() as sess:
+      sess.run([init])
+      for i in xrange(5):
+        sess.run(train_op)
+      r = sess.run(emb)
+      saver.save(sess, model_path)
+    with self.test_session() as sess:
+      saver.restore(sess, model_path)
+      self.assertAllEqual(r, sess.run(emb))
+
 if __name__ == "__main__":
   googletest.main()
@@ -4,6 +4,7 @@ from __future__ import print_function
 
 import tensorflow
 from tensorflow.python.framework.constant_op import constant
+from tensorflow.python.framework import device as pydev
 from tensorflow.python.framework import dtypes
 from tensorflow.python.framework import ops
 from tensorflow.python.ops import variables
@@ -52,6 +53,15 @@ def fused_embedding_lookup_sparse(params,
   else:
     partition_shapes = [w.shape for w in params]
 
+  # Gather and combine the embeddings of an EmbeddingVariable placed on CPU in
+  # one kernel. It outputs zeros for empty rows without looking up any default
+  # id, so it is only used when no default id is given.
+  combine_in_ev = (type(params[0]) is EmbeddingVariable and
+                   max_norm is None and
+                   default_id is None and
+                   pydev.DeviceSpec.from_string(
+                       params[0].device).device_type == "CPU")
+
   with ops.name_scope(name, "fused_embedding_lookup_sparse",
                       params + [sp_ids]) as name:
     partitioned_values, partitioned_indices, \
@@ -60,11 +70,17 @@ def fused_embedding_lookup_sparse(params,
           sp_values=sp_ids.values,
           sp_indices=sp_ids.indices,
           sp_dense_shape=sp_ids.dense_shape,
-          fill_empty_row=True,
+          fill_empty_row=not combine_in_ev,
           default_id=default_id,
           prune_invalid_id=bool(prune_invalid_ids)
       )
 
+    if combine_in_ev:
+      with ops.colocate_with(params[0]):
+        return params[0].sparse_combine(
+            partitioned_values[0], partitioned_indices[0],
+            sp_ids.dense_shape, combiner=combiner)
+
     # fixme(marvin): ple align the meaning between pre & post op.
     default_id = 0 if default_id is None else default_id
 
@@ -283,12 +283,15 @@ class EmbeddingVariable(resource_variable_ops.ResourceVariable):
     multi_level_list = [config_pb2.StorageType.LEVELDB, config_pb2.StorageType.SSDHASH,
                         config_pb2.StorageType.DRAM_PMEM, config_pb2.StorageType.DRAM_LEVELDB,
                         config_pb2.StorageType.DRAM_SSDHASH, config_pb2.StorageType.HBM_DRAM,
-                        config_pb2.StorageType.DRAM_PMEM_SSDHASH, config_pb2.StorageType.HBM_DRAM_SSDHASH]
+                        config_pb2.StorageType.DRAM_PMEM_SSDHASH, config_pb2.StorageType.HBM_DRAM_SSDHASH,
+                        config_pb2.StorageType.DRAM_SSDHASH_LEVELDB]
       
     self._l2_weight_threshold = evconfig.l2_weight_threshold
     self._storage_type = evconfig.storage_type
     self._storage_path = evconfig.storage_path
     self._storage_size = evconfig.storage_size
+    self._storage_cache_strategy = evconfig.storage_cache_strategy \
+        if evconfig.storage_cache_strategy is not None else []
     self._default_value_dim = evconfig.default_value_dim
     if (isinstance(evconfig.filter_strategy, variables.CounterFilter)  and self._filter_freq != 0) or \
        self._steps_to_live not in [0, None] or \
@@ -410,6 +413,7 @@ class EmbeddingVariable(resource_variable_ops.ResourceVariable):
                     storage_type = self._storage_type,
                     storage_path = self._storage_path,
                     storage_size = self._storage_size,
+                    storage_cache_strategy = self._storage_cache_strategy,
                     default_value_dim = self._default_value_dim,
                     name=n))
         self._graph_element = self._handle
@@ -511,6 +515,7 @@ class EmbeddingVariable(resource_variable_ops.ResourceVariable):
     self._storage_type = self._initializer_op.get_attr("storage_type")
     self._storage_path = self._initializer_op.get_attr("storage_path")
     self._storage_size = self._initializer_op.get_attr("storage_size")
+    self._storage_cache_strategy = self._initializer_op.get_attr("storage_cache_strategy")
     self._default_value_dim = self._initializer_op.get_attr("default_value_dim")
 
   # LINT.ThenChange(//tensorflow/python/eager/graph_callable.py)
@@ -742,6 +747,51 @@ class EmbeddingVariable(resource_variable_ops.ResourceVariable):
               name=name)
     return array_ops.identity(value)
 
+  def sparse_combine(self, indices, sp_indices, dense_shape, combiner="mean",
+                     name=None, ev_init_value=None):
+    """Looks up `indices` and combines the embeddings of every row.
+
+    Equivalent to `sparse_read` followed by `sparse_segment_{combiner}` with
+    `sp_indices[:, 0]` as the segment ids, but the embeddings are accumulated
+    into the `[dense_shape[0], dim]` result directly. Rows without ids are
+    zero. It runs on CPU only.
+    """
+    with ops.name_scope("SparseCombine" if name is None else name) as name:
+      if self._trainable:
+        tape.variable_accessed(self)
+      if ev_init_value is not None:
+        default_value = ev_init_value
+        is_use_default_value_tensor = True
+      else:
+        default_value = ops.convert_to_tensor(1.0, dtype=self._dtype)
+        is_use_default_value_tensor = False
+      return gen_kv_variable_ops.kv_resource_sparse_segment_combine(
+          self._handle,
+          indices,
+          sp_indices,
+          dense_shape,
+          default_value,
+          combiner=combiner,
+          is_use_default_value_tensor=is_use_default_value_tensor,
+          name=name)
+
+  def prefetch(self, indices, name=None):
+    """Promotes `indices` from the lower storage levels into DRAM.
+
+    The promotion runs in the background, run this op on the ids of an
+    upcoming batch (e.g. through `embedding_prefetches` of `tf.staged`) so
+    that the gather of that batch only hits DRAM. It is a no-op for
+    single-level EmbeddingVariables.
+
+    Returns:
+      A scalar int64 `Tensor`, the number of ids promoted by the prefetches
+      of this variable before this one.
+    """
+    return gen_kv_variable_ops.kv_resource_prefetch(self._handle,
+        indices,
+        dtype=self._dtype,
+        name="Prefetch" if name is None else name)
+
   def to_proto(self, export_scope=None):
     """Converts a `EmbeddingVariable` to a `VariableDef` protocol buffer.
 
@@ -936,6 +986,19 @@ def _GatherGrad(op, grad):
   indices = array_ops.reshape(indices, size)
   return [ops.IndexedSlices(values, indices, params_shape), None, None]
 
+@ops.RegisterGradient("KvResourceSparseSegmentCombine")
+def _SparseSegmentCombineGrad(op, grad):
+  """Gradient for sparse segment combine op."""
+  handle = op.inputs[0]
+  while handle.op.type != "KvVarHandleOp":
+    handle = handle.op.inputs[0]
+  params_shape = ops.convert_to_tensor(
+      tensor_shape.TensorShape(handle.op.get_attr("shape")))
+  values, indices = gen_kv_variable_ops.kv_resource_sparse_segment_combine_grad(
+      grad, op.inputs[1], op.inputs[2], combiner=op.get_attr("combiner"))
+  return [ops.IndexedSlices(values, indices, params_shape),
+          None, None, None, None]
+
 @ops.RegisterGradient("KvResourceGatherV1")
 def _GatherV1Grad(op, grad):
   """Gradient for gather op."""
@@ -24,6 +24,7 @@ from tensorflow.python.framework import sparse_tensor
 from tensorflow.python.framework import ops
 from tensorflow.python.ops import array_ops
 from tensorflow.python.ops import control_flow_ops
+from tensorflow.python.platform import tf_logging as logging
 from tensorflow.python.util import nest
 from tensorflow.python.util.tf_export import tf_export
 
@@ -62,6 +63,8 @@ def staged(
     timeout_millis=300000,
     closed_exception_types=None,
     ignored_exception_types=None,
+    embedding_prefetches=None,
+    max_capacity=None,
     name=None):
   """Prefetch samples.
 
@@ -83,6 +86,14 @@ def staged(
       `(tf.errors.OutOfRangeError, StopIteration)`.
     ignored_exception_types: (Optional.) Exception types indicating that the
       prefetching can continue. Defaults to `()`.
+    embedding_prefetches: (Optional.) List of `(embedding_variable, ids)`
+      pairs, `ids` is a `Tensor` or `SparseTensor` computed from the same
+      input as `features`. Each prefetched sample promotes its `ids` from the
+      lower storage levels of the multi-level `embedding_variable` into DRAM
+      while it waits in the buffer.
+    max_capacity: (Optional.) If larger than `capacity`, the buffer grows up
+      to it when the step often waits for samples while prefetching threads
+      wait for space.
     name: (Optional.) Name of prefetching operations.
 
   Returns:
@@ -118,25 +129,36 @@ def staged(
 
   with ops.name_scope(name):
     with ops.device(local_device):
-      fetch_tensors = gen_tensor_buffer_ops.tensor_buffer_put(
-          tensors,
-          timeout_millis=timeout_millis,
-          shared_name=name,
-          shared_capacity=capacity)
+      embedding_prefetch_ops = []
+      for var, ids in embedding_prefetches or []:
+        if hasattr(ids, 'dense_shape'):
+          ids = ids.values
+        embedding_prefetch_ops.append(var.prefetch(ids).op)
+      with ops.control_dependencies(embedding_prefetch_ops):
+        fetch_tensors = gen_tensor_buffer_ops.tensor_buffer_put(
+            tensors,
+            timeout_millis=timeout_millis,
+            shared_name=name,
+            shared_capacity=capacity,
+            shared_max_capacity=max_capacity or 0)
       cancel_fetching = gen_tensor_buffer_ops.tensor_buffer_cancel(
           shared_name=name,
-          shared_capacity=capacity)
+          shared_capacity=capacity,
+          shared_max_capacity=max_capacity or 0)
       resume_fetching = gen_tensor_buffer_ops.tensor_buffer_cancel(
           is_cancelled=False,
           shared_name=name,
-          shared_capacity=capacity)
+          shared_capacity=capacity,
+          shared_max_capacity=max_capacity or 0)
       close_fetching = gen_tensor_buffer_ops.tensor_buffer_close(
           shared_name=name,
-          shared_capacity=capacity)
+          shared_capacity=capacity,
+          shared_max_capacity=max_capacity or 0)
       next_tensors = gen_tensor_buffer_ops.tensor_buffer_take(
           dtypes=tensor_dtypes,
           shared_name=name,
           shared_capacity=capacity,
+          shared_max_capacity=max_capacity or 0,
           shared_threads=num_clients)
       if not isinstance(next_tensors, (tuple, list)):
         next_tensors = [next_tensors]
@@ -185,6 +207,7 @@ def prefetch_join(
     timeout_millis=300000,
     closed_exception_types=None,
     ignored_exception_types=None,
+    max_capacity=None,
     name=None):
   """Prefetch samples from thread_to_features list.
 
@@ -207,6 +230,9 @@ def prefetch_join(
       `(tf.errors.OutOfRangeError, StopIteration)`.
     ignored_exception_types: (Optional.) Exception types indicating that the
       prefetching can continue. Defaults to `()`.
+    max_capacity: (Optional.) If larger than `capacity`, the buffer grows up
+      to it when the step often waits for samples while prefetching threads
+      wait for space.
     name: (Optional.) Name of prefetching operations.
 
   Returns:
@@ -222,14 +248,17 @@ def prefetch_join(
     with ops.device(local_device):
       cancel_fetching = gen_tensor_buffer_ops.tensor_buffer_cancel(
           shared_name=name,
-          shared_capacity=capacity)
+          shared_capacity=capacity,
+          shared_max_capacity=max_capacity or 0)
       resume_fetching = gen_tensor_buffer_ops.tensor_buffer_cancel(
           is_cancelled=False,
           shared_name=name,
-          shared_capacity=capacity)
+          shared_capacity=capacity,
+          shared_max_capacity=max_capacity or 0)
       close_fetching = gen_tensor_buffer_ops.tensor_buffer_close(
           shared_name=name,
-          shared_capacity=capacity)
+          shared_capacity=capacity,
+          shared_max_capacity=max_capacity or 0)
 
   thread_to_tensor_dtypes = []
   thread_to_tensor_shapes = []
@@ -269,7 +298,8 @@ def prefetch_join(
             tensors,
             timeout_millis=timeout_millis,
             shared_name=name,
-            shared_capacity=capacity)
+            shared_capacity=capacity,
+            shared_max_capacity=max_capacity or 0)
     thread_to_fetch_tensors.append(fetch_tensors)
 
   with ops.name_scope(name):
@@ -278,6 +308,7 @@ def prefetch_join(
           dtypes=thread_to_tensor_dtypes[0],
           shared_name=name,
           shared_capacity=capacity,
+          shared_max_capacity=max_capacity or 0,
           shared_threads=num_clients)
       if not isinstance(next_tensors, (tuple, list)):
         next_tensors = [next_tensors]
@@ -316,3 +347,185 @@ def prefetch_join(
       ignored_exception_types=ignored_exception_types)
   ops.add_to_collection(PREFETCH, runner)
   return prefetched
+
+
+# Ops producing the samples of a step, whose outputs are staged by
+# `auto_staged`.
+_INPUT_OP_TYPES = (
+    'IteratorGetNext',
+    'IteratorGetNextSync',
+    'QueueDequeueV2',
+    'QueueDequeueManyV2',
+    'QueueDequeueUpToV2')
+
+# Ops holding model states. Ops after them run in the step and can not be
+# staged.
+_VARIABLE_OP_TYPES = (
+    'Variable',
+    'VariableV2',
+    'VarHandleOp',
+    'KvVarHandleOp')
+
+# Datasets passing elements of their input through, skipped to find whether
+# the input of an iterator is already prefetched.
+_PASS_THROUGH_DATASET_TYPES = (
+    'ModelDataset',
+    'OptimizeDataset',
+    'MaxIntraOpParallelismDataset',
+    'PrivateThreadPoolDataset',
+    'ExperimentalMaxIntraOpParallelismDataset',
+    'ExperimentalPrivateThreadPoolDataset')
+
+
+def _variable_dependent_ops(all_ops):
+  """Returns ops depending on variables."""
+  pending = [op for op in all_ops if op.type in _VARIABLE_OP_TYPES]
+  visited = set()
+  while pending:
+    current = pending.pop()
+    if current in visited:
+      continue
+    visited.add(current)
+    for output in current.outputs:
+      pending.extend(output.consumers())
+    pending.extend(current._control_outputs)  # pylint: disable=protected-access
+  return visited
+
+
+def _num_preprocessing_ops(op, variable_dependent_ops):
+  """Returns number of ops without variables after the input op."""
+  pending = [c for output in op.outputs for c in output.consumers()]
+  visited = set()
+  while pending:
+    current = pending.pop()
+    if current in visited or current in variable_dependent_ops:
+      continue
+    visited.add(current)
+    for output in current.outputs:
+      pending.extend(output.consumers())
+  return len(visited)
+
+
+def _is_prefetched(op):
+  """Whether the input op takes samples prefetched by other threads."""
+  if op.type.startswith('QueueDequeue'):
+    return True
+  if not op.inputs:
+    return False
+  for consumer in op.inputs[0].consumers():
+    if consumer.type != 'MakeIterator':
+      continue
+    dataset = consumer.inputs[0].op
+    while dataset.type in _PASS_THROUGH_DATASET_TYPES:
+      dataset = dataset.inputs[0].op
+    if dataset.type in ('PrefetchDataset', 'PrefetchDatasetV2'):
+      return True
+  return False
+
+
+@tf_export(v1=["auto_staged"])
+def auto_staged(
+    graph=None,
+    capacity=1,
+    max_capacity=None,
+    num_threads=1,
+    num_clients=1,
+    timeout_millis=300000,
+    closed_exception_types=None,
+    ignored_exception_types=None,
+    min_preprocessing_ops=1):
+  """Stages outputs of input ops in the graph automatically.
+
+  Outputs of dataset iterators and queue dequeues feeding the step are
+  prefetched as if `staged` was called on them. With
+  `do_smart_stage` enabled, the stages are then extended to the ops without
+  variables after them, e.g. parsing and hashing of features, so that input
+  and preprocessing overlap with computation without placing stages by hand.
+
+  Staging costs a copy of each sample and a prefetching thread, so inputs
+  already prefetched by other threads, i.e. queue dequeues and iterators of
+  datasets ending with `prefetch`, are only staged when at least
+  `min_preprocessing_ops` ops without variables follow them.
+
+  Args:
+    graph: (Optional.) Graph to stage, the default graph by default.
+    capacity: (Optional.) Max number of samples to keep in the buffer.
+    max_capacity: (Optional.) If larger than `capacity`, buffers grow up to
+      it when the step often waits for samples.
+    num_threads: (Optional.) Number of threads for prefetching. 1 by
+      default.
+    num_clients: (Optional.) Number of clients of prefetched sample. 1 by
+      default.
+    timeout_millis: (Optional.) Max milliseconds put op can take, 5 min by
+      default.
+    closed_exception_types: (Optional.) Exception types indicating that the
+      prefetching is normally finished. Defaults to
+      `(tf.errors.OutOfRangeError, StopIteration)`.
+    ignored_exception_types: (Optional.) Exception types indicating that the
+      prefetching can continue. Defaults to `()`.
+    min_preprocessing_ops: (Optional.) Min number of ops without variables
+      after an already prefetched input to stage it. 1 by default.
+
+  Returns:
+    List of staged input ops.
+  """
+  graph = graph or ops.get_default_graph()
+  all_ops = graph.get_operations()
+  if any(op.type == 'TensorBufferPut' for op in all_ops):
+    logging.info('Inputs are already staged.')
+    return []
+
+  def feeds_queue(op):
+    """Whether the op runs in a queue runner instead of the step."""
+    visited = set()
+    pending = [op]
+    while pending:
+      current = pending.pop()
+      if current in visited:
+        continue
+      visited.add(current)
+      if current.type.startswith('QueueEnqueue'):
+        return True
+      for output in current.outputs:
+        pending.extend(output.consumers())
+    return False
+
+  variable_dependent_ops = _variable_dependent_ops(all_ops)
+  input_ops = []
+  for op in all_ops:
+    if op.type not in _INPUT_OP_TYPES or not op.outputs or feeds_queue(op):
+      continue
+    if _is_prefetched(op):
+      num_ops = _num_preprocessing_ops(op, variable_dependent_ops)
+      if num_ops < min_preprocessing_ops:
+        logging.info(
+            'Skipped prefetched %s with %d preprocessing ops.',
+            op.name, num_ops)
+        continue
+    input_ops.append(op)
+  if not input_ops:
+    logging.warning('No input ops found to stage.')
+    return []
+
+  with graph.as_default():
+    for op in input_ops:
+      consumers = []
+      for index, output in enumerate(op.outputs):
+        for consumer in output.consumers():
+          for consumer_input, tensor in enumerate(consumer.inputs):
+            if tensor is output:
+              consumers.append((consumer, consumer_input, index))
+      prefetched = staged(
+          list(op.outputs),
+          capacity=capacity,
+          num_threads=num_threads,
+          num_clients=num_clients,
+          timeout_millis=timeout_millis,
+          closed_exception_types=closed_exception_types,
+          ignored_exception_types=ignored_exception_types,
+          max_capacity=max_capacity)
+      for consumer, consumer_input, index in consumers:
+        consumer._update_input(  # pylint: disable=protected-access
+            consumer_input, prefetched[index])
+      logging.info('Staged outputs of %s.', op.name)
+  return input_ops
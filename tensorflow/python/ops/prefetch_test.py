@@ -18,14 +18,23 @@ from __future__ import absolute_import
 from __future__ import division
 from __future__ import print_function
 
+import threading
+import time
+
 from six.moves import xrange # pylint: disable=redefined-builtin
 
+from tensorflow.python.client import session
+from tensorflow.python.data.ops import dataset_ops
 from tensorflow.python.framework import dtypes
 from tensorflow.python.framework import errors
 from tensorflow.python.framework import ops
 from tensorflow.python.framework import sparse_tensor
 from tensorflow.python.ops import array_ops
+from tensorflow.python.ops import data_flow_ops
+from tensorflow.python.ops import gen_tensor_buffer_ops
 from tensorflow.python.ops import parsing_ops
+from tensorflow.python.ops import script_ops
+from tensorflow.python.ops import variables
 from tensorflow.python.platform import test
 from tensorflow.python.training import coordinator
 from tensorflow.python.training import monitored_session
@@ -54,6 +63,48 @@ class PrefetchTest(test.TestCase):
         self.assertAllClose(value, sess.run(y), rtol=1e-6)
       coord.request_stop()
 
+  def test_autotuned_capacity(self):
+    capacity = 1
+    max_capacity = 8
+    burst = 4
+    with ops.Graph().as_default() as graph:
+      with ops.device('/cpu:0'):
+        x = array_ops.constant(42.0, dtype=dtypes.float32, shape=[])
+        put = gen_tensor_buffer_ops.tensor_buffer_put(
+            [x], timeout_millis=100, shared_name='buf',
+            shared_capacity=capacity, shared_max_capacity=max_capacity)
+        take = gen_tensor_buffer_ops.tensor_buffer_take(
+            dtypes=[dtypes.float32], shared_name='buf',
+            shared_capacity=capacity, shared_max_capacity=max_capacity)
+        size = gen_tensor_buffer_ops.tensor_buffer_size(
+            shared_name='buf', shared_capacity=capacity,
+            shared_max_capacity=max_capacity)
+    graph.finalize()
+
+    with self.test_session(graph=graph) as sess:
+      # The producer puts bursts of records with pauses in between, so the
+      # consumer waits on an empty buffer after each burst while the
+      # producer waits on a full one within it.
+      stop = threading.Event()
+      def produce():
+        while not stop.is_set():
+          for _ in xrange(burst):
+            sess.run(put)
+          time.sleep(0.02)
+      producer = threading.Thread(target=produce)
+      producer.start()
+      for _ in xrange(64 * 4):
+        sess.run(take)
+      stop.set()
+      producer.join()
+
+      # Once nobody takes, puts fill the buffer up to its capacity.
+      while sess.run(size) > 0:
+        sess.run(take)
+      for _ in xrange(max_capacity):
+        sess.run(put)
+      self.assertGreaterEqual(sess.run(size), burst)
+
   def test_string(self):
     capacity = 3
     value = "'The quick brown fox jumps over the lazy dog!'"
@@ -283,6 +334,54 @@ class PrefetchTest(test.TestCase):
         pass
       coord.request_stop()
 
+  def test_auto_staged(self):
+    with ops.Graph().as_default() as graph:
+      with ops.device('/cpu:0'):
+        dataset = dataset_ops.Dataset.range(10)
+        x = dataset_ops.make_one_shot_iterator(dataset).get_next()
+        y = x * 2
+      staged_ops = prefetch.auto_staged(capacity=2)
+      self.assertEqual([x.op], staged_ops)
+      self.assertEqual('TensorBufferTake', y.op.inputs[0].op.inputs[0].op.type)
+      self.assertEqual([], prefetch.auto_staged())
+
+    graph.finalize()
+
+    with self.test_session(graph=graph) as sess:
+      coord = coordinator.Coordinator()
+      prefetch.make_prefetch_hook().create_threads(sess, coord)
+      for i in xrange(10):
+        self.assertEqual(i * 2, sess.run(y))
+      with self.assertRaises(errors.OutOfRangeError):
+        sess.run(y)
+      coord.request_stop()
+
+  def test_auto_staged_skips_prefetched_inputs(self):
+    with ops.Graph().as_default() as graph:
+      with ops.device('/cpu:0'):
+        dataset = dataset_ops.Dataset.range(10).prefetch(1)
+        iterator = dataset_ops.make_initializable_iterator(dataset)
+        x = iterator.get_next()
+        v = variables.Variable(2, dtype=dtypes.int64)
+        y = x * v
+      self.assertEqual([], prefetch.auto_staged())
+      self.assertEqual(x.op, y.op.inputs[0].op)
+      self.assertEqual(
+          [x.op], prefetch.auto_staged(min_preprocessing_ops=0))
+      self.assertEqual(
+          'TensorBufferTake', y.op.inputs[0].op.inputs[0].op.type)
+
+  def test_auto_staged_skips_dequeues_without_preprocessing(self):
+    with ops.Graph().as_default():
+      with ops.device('/cpu:0'):
+        queue = data_flow_ops.FIFOQueue(4, [dtypes.float32], shapes=[[]])
+        queue.enqueue([array_ops.constant(1.0)])
+        x = queue.dequeue()
+        v = variables.Variable(2.0)
+        y = x * v
+      self.assertEqual([], prefetch.auto_staged())
+      self.assertEqual(x.op, y.op.inputs[0].op)
+
   def test_preemption_retry(self):
     server = server_lib.Server.create_local_server()
     capacity = 5
@@ -309,6 +408,47 @@ class PrefetchTest(test.TestCase):
       sess.run(y)
       sess.close()
 
+class PrefetchBenchmark(test.Benchmark):
+
+  def _run_steps(self, stage, num_steps=100, sleep_secs=0.005):
+    def slow_input(i):
+      time.sleep(sleep_secs)
+      return i
+    def slow_step(x):
+      time.sleep(sleep_secs)
+      return x
+
+    with ops.Graph().as_default() as graph:
+      with ops.device('/cpu:0'):
+        dataset = dataset_ops.Dataset.range(num_steps + 1).map(
+            lambda i: script_ops.py_func(slow_input, [i], dtypes.int64))
+        x = dataset_ops.make_one_shot_iterator(dataset).get_next()
+        v = variables.Variable(2, dtype=dtypes.int64)
+        y = script_ops.py_func(slow_step, [x * v], dtypes.int64)
+      if stage:
+        prefetch.auto_staged(capacity=2)
+    graph.finalize()
+
+    with session.Session(graph=graph) as sess:
+      sess.run(v.initializer)
+      coord = coordinator.Coordinator()
+      prefetch.make_prefetch_hook().create_threads(sess, coord)
+      sess.run(y)
+      start = time.time()
+      for _ in xrange(num_steps):
+        sess.run(y)
+      wall_time = (time.time() - start) / num_steps
+      coord.request_stop()
+    return wall_time
+
+  def benchmark_auto_staged(self):
+    for stage in (False, True):
+      wall_time = self._run_steps(stage)
+      self.report_benchmark(
+          iters=100,
+          wall_time=wall_time,
+          name='auto_staged_%s' % ('on' if stage else 'off'))
+
 # pylint: enable=missing-docstring
 
 if __name__ == '__main__':
@@ -2203,6 +2203,7 @@ def get_embedding_variable(name,
         storage_type = ev_option.storage_option.storage_type,
         storage_path = ev_option.storage_option.storage_path,
         storage_size = ev_option.storage_option.storage_size,
+        storage_cache_strategy = ev_option.storage_option.cache_strategy,
         default_value_dim=ev_option.init.default_value_dim),
       ht_partition_num=ev_option.ht_partition_num)
 
@@ -2262,7 +2263,8 @@ def get_embedding_variable_internal(name,
         filter_strategy=ev_option.filter_strategy,
         storage_type=ev_option.storage_option.storage_type,
         storage_path=ev_option.storage_option.storage_path,
-        storage_size=ev_option.storage_option.storage_size),
+        storage_size=ev_option.storage_option.storage_size,
+        storage_cache_strategy=ev_option.storage_option.cache_strategy),
       ht_partition_num=ev_option.ht_partition_num)
 
 
@@ -229,10 +229,18 @@ class StorageOption(object):
   def __init__(self,
                storage_type=None,
                storage_path=None,
-               storage_size=[1024*1024*1024]):
+               storage_size=[1024*1024*1024],
+               cache_strategy=None):
     self.storage_type = storage_type
     self.storage_path = storage_path
     self.storage_size = storage_size
+    # cache_strategy[i] is the config_pb2.CacheStrategy of level i, the last
+    # one applies to the remaining levels.
+    if cache_strategy is None:
+      cache_strategy = [config_pb2.CacheStrategy.LRU]
+    elif not isinstance(cache_strategy, list):
+      cache_strategy = [cache_strategy]
+    self.cache_strategy = cache_strategy
     if not isinstance(storage_size, list):
         raise ValueError("storage_size should be list type")
     if len(storage_size) < 4:
@@ -248,7 +256,9 @@ class StorageOption(object):
       if storage_type is not None and storage_type in [config_pb2.StorageType.LEVELDB,
                                                        config_pb2.StorageType.SSDHASH,
                                                        config_pb2.StorageType.DRAM_SSDHASH,
-                                                       config_pb2.StorageType.DRAM_LEVELDB]:
+                                                       config_pb2.StorageType.DRAM_LEVELDB,
+                                                       config_pb2.StorageType.DRAM_PMEM_SSDHASH,
+                                                       config_pb2.StorageType.DRAM_SSDHASH_LEVELDB]:
         raise ValueError("storage_path musnt'be None when storage_type is set")
 
 @tf_export(v1=["EmbeddingVariableOption"])
@@ -315,6 +325,7 @@ class EmbeddingVariableConfig(object):
                storage_type=config_pb2.StorageType.DRAM,
                storage_path=None,
                storage_size=None,
+               storage_cache_strategy=None,
                default_value_dim=4096):
     self.steps_to_live = steps_to_live
     self.steps_to_live_l2reg = steps_to_live_l2reg
@@ -336,6 +347,7 @@ class EmbeddingVariableConfig(object):
     self.storage_type = storage_type
     self.storage_path = storage_path
     self.storage_size = storage_size
+    self.storage_cache_strategy = storage_cache_strategy
     self.default_value_dim = default_value_dim
 
   def reveal(self):
@@ -54,6 +54,10 @@ ops.NotDifferentiable('WorkQueueRestore')
 ops.NotDifferentiable('WorkQueueIsInitialized')
 ops.NotDifferentiable('WorkQueuePut')
 ops.NotDifferentiable('WorkQueueTake')
+ops.NotDifferentiable('WorkQueueTakeMany')
+ops.NotDifferentiable('WorkQueueTakeSlice')
+ops.NotDifferentiable('WorkQueueReportProgress')
+ops.NotDifferentiable('WorkQueueReserve')
 ops.NotDifferentiable('WorkQueueSize')
 ops.NotDifferentiable('WorkQueueClose')
 ops.NotDifferentiable('SaveLocalWork')
@@ -398,43 +402,344 @@ class WorkQueue(saver.BaseSaverBuilder.SaveableObject):
       return local_work
     return string_ops.string_join([self._prefix, local_work])
 
-  def input_producer(self):
+  def take_many(self, num_works):
+    """Take up to `num_works` works from the work queue.
+
+    Waits only for the first work, so fewer works are returned when the work
+    queue is running out.
+
+    Args:
+      num_works: Maximum number of works to take.
+
+    Returns:
+      A vector of works.
+    """
+    if self._local_work_mgr:
+      # Works taken by inference jobs are saved one by one for failover.
+      return array_ops.reshape(self.take(), [1])
+
+    with ops.name_scope(self.name):
+      with ops.device(self._remote_device):
+        taken = gen_work_queue_ops.work_queue_take_many(
+            self._handle,
+            num_works=num_works,
+            num_clients=self.num_clients)
+      with ops.device(self._local_device):
+        local_works = array_ops.identity(taken)
+
+    if self._prefix is None:
+      return local_works
+    return string_ops.string_join([self._prefix, local_works])
+
+  def _take_slice(self, min_split_size):
+    """Take a splittable slice without the prefix."""
+    def remote_take():
+      """Take slice from remote worker."""
+      with ops.name_scope(self.name):
+        with ops.device(self._remote_device):
+          taken, lease = gen_work_queue_ops.work_queue_take_slice(
+              self._handle,
+              num_clients=self.num_clients,
+              min_split_size=min_split_size)
+
+          work_bak = control_flow_ops.no_op()
+          if self._local_work_mgr:
+            work_bak = gen_work_queue_ops.save_local_work(
+                taken,
+                job_name=self._local_work_mgr.job_name,
+                task_index=self._local_work_mgr.task_index,
+                restore_works_dir=self._local_work_mgr.restore_works_dir)
+      with ops.control_dependencies([work_bak]):
+        with ops.device(self._local_device):
+          return array_ops.identity(taken), array_ops.identity(lease)
+
+    def local_take():
+      """Take work restored on local worker, which is not leased."""
+      assert self._local_work_mgr, 'local_work_mgr should not be None.'
+      return (
+          array_ops.reshape(self._local_work_mgr.take(), []),
+          constant_op.constant(-1, dtype=dtypes.int64))
+
+    if self._local_work_mgr:
+      with ops.name_scope(self.name):
+        with ops.device(self._local_device):
+          with ops.device('/cpu:0'):
+            local_workqueue_empty = self._local_work_mgr.local_workqueue_empty()
+            return control_flow_ops.cond(
+                local_workqueue_empty, remote_take, local_take)
+    return remote_take()
+
+  def _reserve(self, lease, num_records):
+    """Reserve records of a leased slice without the prefix."""
+    with ops.name_scope(self.name):
+      with ops.device(self._remote_device):
+        work, end = gen_work_queue_ops.work_queue_reserve(
+            self._handle, lease, num_records)
+      with ops.device(self._local_device):
+        return array_ops.identity(work), array_ops.identity(end)
+
+  def take_slice(self, min_split_size=1):
+    """Take a splittable slice from the work queue.
+
+    Slices are works formatted as `url?start=S&end=E`, e.g. works created
+    with `num_slices`. A taken slice is leased until `report_progress` reports
+    all of its records read. Once the work queue is empty, idle workers split
+    off the unreserved half of the largest lease, so slow workers holding
+    large slices do not stretch out the tail of an epoch. Records of leased
+    slices past their last reported positions are saved in checkpoints and
+    restored as works, so records read after the last report are read again
+    after a restore.
+
+    Works restored by `local_work_mgr` are taken before the work queue and
+    are not leased.
+
+    Args:
+      min_split_size: (Optional.) Minimum number of records of a split slice.
+
+    Returns:
+      A tuple (work, lease). lease is -1 if the work is not a leased slice.
+    """
+    local_work, local_lease = self._take_slice(min_split_size)
+    if self._prefix is not None:
+      local_work = string_ops.string_join([self._prefix, local_work])
+    return local_work, local_lease
+
+  def reserve(self, lease, num_records):
+    """Reserves the next records of a leased slice for reading.
+
+    Reserved records are never split off to another worker. Owners reading
+    only reserved records never read records of other workers.
+
+    Args:
+      lease: Lease returned by `take_slice`.
+      num_records: Maximum number of records to reserve.
+
+    Returns:
+      A tuple (work, end). work is the slice of reserved records, which is
+      empty once all records of the lease are reserved, and end is the end of
+      the reserved records, or -1 once the lease is released.
+    """
+    work, end = self._reserve(lease, num_records)
+    if self._prefix is not None:
+      work = string_ops.string_join([self._prefix, work])
+    return work, end
+
+  def report_progress(self, lease, position):
+    """Reports records before `position` in a leased slice as read.
+
+    A split never takes reserved records and leaves at least `min_split_size`
+    records past the reported position to the owner. Owners reading records
+    they did not `reserve` should report at least every `min_split_size`
+    records.
+
+    Args:
+      lease: Lease returned by `take_slice`.
+      position: Records before this position were read.
+
+    Returns:
+      Current end of the slice. Reading should stop at the returned end, which
+      shrinks when another worker splits the slice, or -1 once the lease
+      is released.
+    """
+    with ops.name_scope(self.name):
+      with ops.device(self._remote_device):
+        end = gen_work_queue_ops.work_queue_report_progress(
+            self._handle, lease, position)
+      with ops.device(self._local_device):
+        return array_ops.identity(end)
+
+  def input_producer(self, num_prefetches=1):
     """Returns a FIFOQueue as input producer.
 
+    Args:
+      num_prefetches: (Optional.) Number of works prefetched into the local
+        queue. If larger than 1, works are taken in batches of
+        `num_prefetches` to reduce round trips to the work queue. Prefetched
+        works are already taken from the work queue and are not in its
+        checkpoints, so a failover loses up to `2 * num_prefetches` works
+        besides the one being read: those in the local queue and the batch
+        waiting to be enqueued.
+
     Returns:
       A local queue of work items.  A `QueueRunner` for the Queue
       is added to the current `Graph`'s `QUEUE_RUNNER` collection.
     """
-    work = self.take()
+    if num_prefetches < 1:
+      raise ValueError(
+          "num_prefetches must be > 0 not {}.".format(num_prefetches))
+    if num_prefetches > 1:
+      works = self.take_many(num_prefetches)
+    else:
+      works = array_ops.reshape(self.take(), (1,))
     with ops.name_scope(self.name):
       with ops.device(self._local_device):
         proxy = data_flow_ops.FIFOQueue(
-            capacity=1,
+            capacity=num_prefetches,
             dtypes=[dtypes.string],
             shapes=[tensor_shape.TensorShape([1])],
             name='proxy')
         with ops.control_dependencies(
-            [logging_ops.print_v2("Take work:", work)]):
-          work = array_ops.identity(work)
-        enqueue_proxy = proxy.enqueue(array_ops.reshape(work, (1,)))
+            [logging_ops.print_v2("Take work:", works)]):
+          works = array_ops.identity(works)
+        enqueue_proxy = proxy.enqueue_many(array_ops.reshape(works, (-1, 1)))
         cancel_proxy = proxy.close(cancel_pending_enqueues=True)
         proxy_runner = queue_runner.QueueRunner(
             proxy, [enqueue_proxy], cancel_op=cancel_proxy)
         queue_runner.add_queue_runner(proxy_runner)
         return proxy
 
-  def input_dataset(self):
+  def _slice_producer(self, num_prefetches, chunk_size, min_split_size):
+    """Returns a FIFOQueue of reserved chunks of slices.
+
+    Each element is a tuple (work, lease, end), where lease and end tell the
+    chunk read before this work, to be reported once this work is dequeued.
+    The last element has an empty work.
+    """
+    with ops.name_scope(self.name):
+      with ops.device(self._local_device):
+        proxy = data_flow_ops.FIFOQueue(
+            capacity=num_prefetches,
+            dtypes=[dtypes.string, dtypes.int64, dtypes.int64],
+            shapes=[tensor_shape.TensorShape([])] * 3,
+            name='proxy')
+        lease_var, prev_lease_var, prev_end_var = [
+            vs.variable(
+                constant_op.constant(-1, dtype=dtypes.int64),
+                name=name,
+                trainable=False,
+                collections=[ops.GraphKeys.LOCAL_VARIABLES])
+            for name in ['lease', 'prev_lease', 'prev_end']]
+
+    def reserve_chunk(lease):
+      return self._reserve(lease, chunk_size)
+
+    def no_chunk():
+      return (
+          constant_op.constant(b'', dtype=dtypes.string),
+          constant_op.constant(-1, dtype=dtypes.int64))
+
+    def take_chunk():
+      """Take a slice and reserve its first chunk."""
+      taken, taken_lease = self._take_slice(min_split_size)
+      chunk, chunk_end = control_flow_ops.cond(
+          math_ops.greater_equal(taken_lease, 0),
+          lambda: reserve_chunk(taken_lease),
+          lambda: (taken, constant_op.constant(-1, dtype=dtypes.int64)))
+      return chunk, taken_lease, chunk_end
+
+    with ops.device(self._local_device):
+      held_lease = array_ops.identity(lease_var)
+      held_work, held_end = control_flow_ops.cond(
+          math_ops.greater_equal(held_lease, 0),
+          lambda: reserve_chunk(held_lease),
+          no_chunk)
+      # Takes the next slice once the held one has no records to reserve.
+      work, lease, end = control_flow_ops.cond(
+          math_ops.equal(held_work, b''),
+          take_chunk,
+          lambda: (held_work, held_lease, held_end))
+      if self._prefix is not None:
+        work = string_ops.string_join([self._prefix, work])
+      with ops.control_dependencies(
+          [logging_ops.print_v2("Take work:", work)]):
+        work = array_ops.identity(work)
+      with ops.name_scope(self.name):
+        enqueue_proxy = proxy.enqueue(
+            [work,
+             array_ops.identity(prev_lease_var),
+             array_ops.identity(prev_end_var)])
+        with ops.control_dependencies([enqueue_proxy]):
+          enqueue_proxy = control_flow_ops.group(
+              lease_var.assign(lease),
+              prev_lease_var.assign(lease),
+              prev_end_var.assign(end))
+        # Tell the reader to report the last chunk before closing.
+        with ops.control_dependencies([proxy.enqueue(
+            [constant_op.constant(b'', dtype=dtypes.string),
+             array_ops.identity(prev_lease_var),
+             array_ops.identity(prev_end_var)])]):
+          close_proxy = proxy.close()
+        cancel_proxy = proxy.close(cancel_pending_enqueues=True)
+        proxy_runner = queue_runner.QueueRunner(
+            proxy, [enqueue_proxy],
+            close_op=close_proxy, cancel_op=cancel_proxy)
+        queue_runner.add_queue_runner(proxy_runner)
+        return proxy
+
+  def input_dataset(
+      self, num_prefetches=1, chunk_size=None, min_split_size=None):
     """Returns a dataset as input dataset
 
+    If `chunk_size` is specified, works formatted as `url?start=S&end=E` are
+    taken by `take_slice` and read in chunks of at most `chunk_size` records,
+    each reserved by `reserve` before reading, so idle workers can split off
+    the unreserved records of slow workers. A chunk is reported as read once
+    the next work is pulled from the dataset, so a checkpoint saves the
+    records of the chunk being read and the prefetched chunks as unread. Read
+    each work completely before pulling the next one, e.g. by `flat_map` on
+    this dataset, to read every record exactly once across restores.
+
+    Args:
+      num_prefetches: (Optional.) Number of works prefetched into the local
+        queue.
+      chunk_size: (Optional.) Maximum number of records of a work taken from
+        a slice.
+      min_split_size: (Optional.) Minimum number of records of a split slice,
+        `chunk_size` by default.
+
     Returns:
       A local dataset of work items.
     """
-    proxy = self.input_producer()
-    next_work = lambda _: array_ops.reshape(proxy.dequeue(), [])
+    if chunk_size is None:
+      proxy = self.input_producer(num_prefetches=num_prefetches)
+      next_work = lambda _: array_ops.reshape(proxy.dequeue(), [])
+      with ops.name_scope(self.name):
+        with ops.device(self._local_device):
+          dataset = dataset_ops.Dataset.from_tensors(0).repeat()
+          dataset = dataset.map(next_work)
+          return dataset
+
+    if num_prefetches < 1:
+      raise ValueError(
+          "num_prefetches must be > 0 not {}.".format(num_prefetches))
+    if chunk_size < 1:
+      raise ValueError("chunk_size must be > 0 not {}.".format(chunk_size))
+    proxy = self._slice_producer(
+        num_prefetches, chunk_size, min_split_size or chunk_size)
     with ops.name_scope(self.name):
       with ops.device(self._local_device):
+        # Reports run outside of the dataset, next to the work queue.
+        progress = data_flow_ops.FIFOQueue(
+            capacity=1,
+            dtypes=[dtypes.int64, dtypes.int64],
+            shapes=[tensor_shape.TensorShape([])] * 2,
+            name='progress')
+        acks = data_flow_ops.FIFOQueue(
+            capacity=1,
+            dtypes=[dtypes.int64],
+            shapes=[tensor_shape.TensorShape([])],
+            name='acks')
+        lease, position = progress.dequeue()
+      reported = self.report_progress(lease, position)
+      with ops.device(self._local_device):
+        report = acks.enqueue([reported])
+        cancel_report = control_flow_ops.group(
+            progress.close(cancel_pending_enqueues=True),
+            acks.close(cancel_pending_enqueues=True))
+        report_runner = queue_runner.QueueRunner(
+            progress, [report], cancel_op=cancel_report)
+        queue_runner.add_queue_runner(report_runner)
+
+        def next_work(_):
+          """Reports the chunk read before and pulls the next work."""
+          work, lease, end = proxy.dequeue()
+          with ops.control_dependencies([progress.enqueue([lease, end])]):
+            with ops.control_dependencies([acks.dequeue()]):
+              return array_ops.identity(work)
+
         dataset = dataset_ops.Dataset.from_tensors(0).repeat()
         dataset = dataset.map(next_work)
+        dataset = dataset.filter(lambda work: math_ops.not_equal(work, b''))
         return dataset
 
   def add_summary(self):
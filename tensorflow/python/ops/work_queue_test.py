@@ -25,6 +25,7 @@ from six import string_types
 import portpicker
 
 from tensorflow.core.protobuf import config_pb2
+from tensorflow.python.framework import dtypes
 from tensorflow.python.framework import errors_impl
 from tensorflow.python.framework import ops
 from tensorflow.python.framework import test_util
@@ -34,6 +35,7 @@ from tensorflow.python.ops import variables
 from tensorflow.python.ops import variable_scope as vs
 from tensorflow.python.platform import test as test_lib
 from tensorflow.python.platform import tf_logging as logging
+from tensorflow.python.training import coordinator
 from tensorflow.python.training import device_setter
 from tensorflow.python.training import monitored_session
 from tensorflow.python.training import queue_runner_impl
@@ -109,6 +111,193 @@ class WorkQueueTest(test_lib.TestCase):
       for thread in threads:
         thread.join()
 
+  def test_take_many(self):
+    with self.test_session():
+      works = [b"to", b"be", b"or", b"not", b"to", b"be"]
+      num_epochs = 2
+      work_queue = WorkQueue(works, num_epochs=num_epochs, shuffle=False)
+      take_many = work_queue.take_many(5)
+
+      resources.initialize_resources(resources.shared_resources()).run()
+      variables.global_variables_initializer().run()
+      variables.local_variables_initializer().run()
+
+      taken = []
+      taken.extend(take_many.eval().tolist())
+      taken.extend(take_many.eval().tolist())
+      # Fewer works than requested are left in the queue.
+      taken.extend(take_many.eval().tolist())
+      self.assertEqual(works * num_epochs, taken)
+
+      # Reached the limit.
+      with self.assertRaises(errors_impl.OutOfRangeError):
+        take_many.eval()
+
+  def test_prefetch(self):
+    with self.test_session():
+      works = [b"to", b"be", b"or", b"not", b"to", b"be"]
+      num_epochs = 3
+      work_queue = WorkQueue(works, num_epochs=num_epochs, shuffle=False)
+
+      local_queue = work_queue.input_producer(num_prefetches=4)
+      dequeue = local_queue.dequeue()
+      dequeue_many = local_queue.dequeue_many(len(works) * num_epochs)
+
+      resources.initialize_resources(resources.shared_resources()).run()
+      variables.global_variables_initializer().run()
+      variables.local_variables_initializer().run()
+      threads = queue_runner_impl.start_queue_runners()
+
+      local_works = dequeue_many.eval().tolist()
+      self.assertEqual(
+          works * num_epochs,
+          [item for work in local_works for item in work])
+
+      # Reached the limit.
+      with self.assertRaises(errors_impl.OutOfRangeError):
+        dequeue.eval()
+      for thread in threads:
+        thread.join()
+
+  def test_take_slice(self):
+    with self.test_session() as sess:
+      works = [b"path/to/file?start=0&end=100"]
+      work_queue = WorkQueue(works, shuffle=False)
+      take_slice = work_queue.take_slice()
+      lease = array_ops.placeholder(dtypes.int64, [])
+      position = array_ops.placeholder(dtypes.int64, [])
+      report = work_queue.report_progress(lease, position)
+      # pylint: disable=protected-access
+      save = work_queue._save
+      # pylint: enable=protected-access
+
+      resources.initialize_resources(resources.shared_resources()).run()
+      variables.global_variables_initializer().run()
+      variables.local_variables_initializer().run()
+
+      work, slow_lease = sess.run(take_slice)
+      self.assertEqual(works[0], work)
+      self.assertEqual(100, sess.run(report, {lease: slow_lease, position: 10}))
+
+      # An idle worker takes the unread half of the slow worker's slice.
+      work, idle_lease = sess.run(take_slice)
+      self.assertEqual(b"path/to/file?start=55&end=100", work)
+      self.assertEqual(55, sess.run(report, {lease: slow_lease, position: 20}))
+      self.assertEqual(
+          [b"path/to/file?start=20&end=55", b"path/to/file?start=55&end=100"],
+          save.eval().tolist())
+
+      self.assertEqual(55, sess.run(report, {lease: slow_lease, position: 55}))
+      self.assertEqual(-1, sess.run(report, {lease: slow_lease, position: 55}))
+      self.assertEqual(100, sess.run(report, {lease: idle_lease, position: 70}))
+      self.assertEqual([b"path/to/file?start=70&end=100"], save.eval().tolist())
+
+  def test_take_slice_shortens_tail(self):
+    with self.test_session() as sess:
+      num_records = 1000
+      min_split_size = 10
+      works = [b"a?start=0&end=1000", b"b?start=0&end=1000"]
+      work_queue = WorkQueue(works, shuffle=False)
+      take_slice = work_queue.take_slice(min_split_size=min_split_size)
+      lease = array_ops.placeholder(dtypes.int64, [])
+      position = array_ops.placeholder(dtypes.int64, [])
+      report = work_queue.report_progress(lease, position)
+
+      resources.initialize_resources(resources.shared_resources()).run()
+      variables.global_variables_initializer().run()
+      variables.local_variables_initializer().run()
+
+      def take(worker):
+        work, worker["lease"] = sess.run(take_slice)
+        url, query = work.split(b"?start=")
+        start, end = query.split(b"&end=")
+        worker["url"] = url
+        worker["position"] = int(start)
+        worker["end"] = int(end)
+
+      # Both workers read min_split_size records between reports, the fast
+      # one ten times as often.
+      slow = {"steps": 1}
+      fast = {"steps": 10}
+      take(slow)
+      take(fast)
+      read = {b"a": [], b"b": []}
+      ticks = 0
+      while slow["lease"] is not None or fast["lease"] is not None:
+        ticks += 1
+        for worker in [slow, fast]:
+          for _ in range(worker["steps"]):
+            if worker["lease"] is None:
+              # Idle, splits the slice of the other worker if it can.
+              other = fast if worker is slow else slow
+              if (other["lease"] is None or
+                  other["end"] - other["position"] < 2 * min_split_size):
+                break
+              take(worker)
+              self.assertEqual(other["url"], worker["url"])
+              other["end"] = worker["position"]
+            begin = worker["position"]
+            worker["position"] = min(begin + min_split_size, worker["end"])
+            read[worker["url"]].append((begin, worker["position"]))
+            worker["end"] = sess.run(
+                report,
+                {lease: worker["lease"], position: worker["position"]})
+            if worker["position"] >= worker["end"]:
+              worker["lease"] = None
+
+      # Every record is read once.
+      for ranges in read.values():
+        ranges.sort()
+        self.assertEqual(0, ranges[0][0])
+        self.assertEqual(num_records, ranges[-1][1])
+        for prev, cur in zip(ranges, ranges[1:]):
+          self.assertEqual(prev[1], cur[0])
+      # Without splitting the slow worker alone needs 100 ticks for its slice,
+      # the two workers together read 110 records a tick.
+      logging.info("Read %d records in %d ticks.", 2 * num_records, ticks)
+      self.assertLess(ticks, 30)
+
+  def test_reserve(self):
+    with self.test_session() as sess:
+      works = [b"path/to/file?start=0&end=100"]
+      work_queue = WorkQueue(works, shuffle=False)
+      take_slice = work_queue.take_slice()
+      lease = array_ops.placeholder(dtypes.int64, [])
+      position = array_ops.placeholder(dtypes.int64, [])
+      reserve = work_queue.reserve(lease, 40)
+      report = work_queue.report_progress(lease, position)
+      # pylint: disable=protected-access
+      save = work_queue._save
+      # pylint: enable=protected-access
+
+      resources.initialize_resources(resources.shared_resources()).run()
+      variables.global_variables_initializer().run()
+      variables.local_variables_initializer().run()
+
+      _, slow_lease = sess.run(take_slice)
+      self.assertEqual(
+          (b"path/to/file?start=0&end=40", 40),
+          sess.run(reserve, {lease: slow_lease}))
+
+      # An idle worker takes the unreserved half of the slow worker's slice.
+      work, _ = sess.run(take_slice)
+      self.assertEqual(b"path/to/file?start=70&end=100", work)
+      self.assertEqual(
+          (b"path/to/file?start=40&end=70", 70),
+          sess.run(reserve, {lease: slow_lease}))
+      self.assertEqual((b"", 70), sess.run(reserve, {lease: slow_lease}))
+
+      # Reserved records are saved until reported as read.
+      self.assertEqual(
+          [b"path/to/file?start=0&end=70", b"path/to/file?start=70&end=100"],
+          save.eval().tolist())
+      self.assertEqual(70, sess.run(report, {lease: slow_lease, position: 40}))
+      self.assertEqual(
+          [b"path/to/file?start=40&end=70", b"path/to/file?start=70&end=100"],
+          save.eval().tolist())
+      self.assertEqual(70, sess.run(report, {lease: slow_lease, position: 70}))
+      self.assertEqual((b"", -1), sess.run(reserve, {lease: slow_lease}))
+
   def test_slices(self):
     with self.test_session():
       works = [
@@ -294,6 +483,50 @@ class WorkQueueTest(test_lib.TestCase):
       for thread in threads:
         thread.join()
 
+  def test_slice_dataset(self):
+    with self.test_session() as sess:
+      works = [b"a?start=0&end=10", b"b?start=0&end=5"]
+      work_queue = WorkQueue(works, shuffle=False)
+      dataset = work_queue.input_dataset(chunk_size=4)
+      iterator = dataset.make_initializable_iterator()
+      data = iterator.get_next()
+      # pylint: disable=protected-access
+      save = work_queue._save
+      # pylint: enable=protected-access
+
+      sess.run(iterator.initializer)
+      resources.initialize_resources(resources.shared_resources()).run()
+      variables.global_variables_initializer().run()
+      variables.local_variables_initializer().run()
+
+      coord = coordinator.Coordinator()
+      threads = queue_runner_impl.start_queue_runners(sess=sess, coord=coord)
+
+      # Chunks being read or prefetched are saved as unread.
+      self.assertEqual(b"a?start=0&end=4", sess.run(data))
+      self.assertEqual(
+          [b"a?start=0&end=10", b"b?start=0&end=5"],
+          sorted(save.eval().tolist()))
+      # Pulling the next chunk reports the previous one as read.
+      self.assertEqual(b"a?start=4&end=8", sess.run(data))
+      self.assertEqual(
+          [b"a?start=4&end=10", b"b?start=0&end=5"],
+          sorted(save.eval().tolist()))
+
+      local_works = []
+      for _ in range(3):
+        local_works.append(sess.run(data))
+      self.assertEqual(
+          [b"a?start=8&end=10", b"b?start=0&end=4", b"b?start=4&end=5"],
+          local_works)
+
+      with self.assertRaises(errors_impl.OutOfRangeError):
+        sess.run(data)
+      self.assertEqual([], save.eval().tolist())
+
+      coord.request_stop()
+      coord.join(threads)
+
   def _get_workers(
       self, num_workers, workers,
       works, num_epochs=1, shuffle=True,
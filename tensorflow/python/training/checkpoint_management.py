@@ -462,6 +462,9 @@ def remove_checkpoint(checkpoint_prefix,
     # V2 has a metadata file and some data files.
     _delete_file_if_exists(checkpoint_prefix + ".index")
     _delete_file_if_exists(checkpoint_prefix + ".data-?????-of-?????")
+    # SSDHASH index snapshots of the embedding variables.
+    if file_io.file_exists(checkpoint_prefix + ".ssd_index"):
+      file_io.delete_recursively(checkpoint_prefix + ".ssd_index")
   else:
     # V1, Legacy.  Exact match on the data file.
     _delete_file_if_exists(checkpoint_prefix)
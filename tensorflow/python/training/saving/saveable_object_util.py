@@ -211,6 +211,7 @@ class EmbeddingVariableSaveable(saveable_object.SaveableObject):
             storage_type=self.var._storage_type,
             storage_path=self.var._storage_path,
             storage_size=self.var._storage_size,
+            storage_cache_strategy=self.var._storage_cache_strategy,
             partition_id=self.partition_id, partition_num=self.partition_num,
             default_value_dim=self.var._default_value_dim)
 